@@ -42,7 +42,7 @@ install_dependencies() {
         fi
         
         echo "  Installing via Homebrew..."
-        brew install xz openssl gcc make
+        brew install xz openssl zlib gcc make
         echo "  ✓ Dependencies installed"
         
     elif [[ "$OS" == "Linux" ]]; then
@@ -50,32 +50,32 @@ install_dependencies() {
         if command_exists apt-get; then
             echo "  Detected Debian/Ubuntu..."
             sudo apt-get update
-            sudo apt-get install -y liblzma-dev libssl-dev gcc make pkg-config
+            sudo apt-get install -y liblzma-dev libssl-dev zlib1g-dev gcc make pkg-config
             echo "  ✓ Dependencies installed"
             
         elif command_exists dnf; then
             echo "  Detected Fedora/RHEL..."
-            sudo dnf install -y xz-devel openssl-devel gcc make pkgconfig
+            sudo dnf install -y xz-devel openssl-devel zlib-devel gcc make pkgconfig
             echo "  ✓ Dependencies installed"
             
         elif command_exists yum; then
             echo "  Detected CentOS/older RHEL..."
-            sudo yum install -y xz-devel openssl-devel gcc make pkgconfig
+            sudo yum install -y xz-devel openssl-devel zlib-devel gcc make pkgconfig
             echo "  ✓ Dependencies installed"
             
         elif command_exists pacman; then
             echo "  Detected Arch Linux..."
-            sudo pacman -S --needed --noconfirm xz openssl gcc make pkgconf
+            sudo pacman -S --needed --noconfirm xz openssl zlib gcc make pkgconf
             echo "  ✓ Dependencies installed"
             
         elif command_exists apk; then
             echo "  Detected Alpine Linux..."
-            sudo apk add --no-cache xz-dev openssl-dev gcc make musl-dev pkgconfig
+            sudo apk add --no-cache xz-dev openssl-dev zlib-dev gcc make musl-dev pkgconfig
             echo "  ✓ Dependencies installed"
             
         else
             echo "❌ Unknown package manager!"
-            echo "Please manually install: liblzma-dev, libssl-dev, gcc, make"
+            echo "Please manually install: liblzma-dev, libssl-dev, zlib1g-dev, gcc, make"
             exit 1
         fi
         
@@ -112,6 +112,9 @@ check_dependencies() {
         if ! brew list openssl &>/dev/null; then
             MISSING_DEPS+=("openssl")
         fi
+        if ! brew list zlib &>/dev/null; then
+            MISSING_DEPS+=("zlib")
+        fi
     elif [[ "$OS" == "Linux" ]]; then
         if ! ldconfig -p | grep -q liblzma; then
             MISSING_DEPS+=("liblzma")
@@ -119,6 +122,9 @@ check_dependencies() {
         if ! ldconfig -p | grep -q libssl; then
             MISSING_DEPS+=("libssl")
         fi
+        if ! ldconfig -p | grep -q libz.so; then
+            MISSING_DEPS+=("zlib")
+        fi
     fi
     
     if [ ${#MISSING_DEPS[@]} -eq 0 ]; then
@@ -1,30 +1,249 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+#include <poll.h>
+#include <signal.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 #include <lzma.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <zlib.h>
 
 #define KUNDA_MAGIC "KUNDA\x00\x00\x00"
-#define KUNDA_VERSION 2
+#define KUNDA_VERSION 3
+#define KUNDA_VERSION_PLAIN 2   // written when an archive uses none of the version 3 features
 
 #define COMP_ZLIB 0
 #define COMP_BZ2 1
 #define COMP_LZMA 2
 #define COMP_LZMA_ULTRA 3
+#define COMP_LZMA_REF 4         // raw LZMA2 primed with a reference archive's payload
 
 #define FLAG_ENCRYPTED 0x01
 #define FLAG_CHECKSUMMED 0x02
 #define FLAG_PATH_COMPRESSED 0x04
+#define FLAG_LONG_RANGE 0x08
+#define FLAG_CONTENT_DIGEST 0x10
+#define FLAG_FILE_DIGESTS 0x20
+#define FLAG_BLOCKED 0x40
+#define FLAG_CHAINED 0x80
+#define FLAGS_PLAIN (FLAG_CHECKSUMMED | FLAG_PATH_COMPRESSED)   // all a version 2 reader knows
+
+// Per-file digest algorithms (digest table at the end of the payload)
+#define DIGEST_NONE 0
+#define DIGEST_FAST128 1
+#define DIGEST_SHA256 2
+
+// Output is handed to the checksum thread in windows of this size
+#define HASH_WINDOW ((size_t)1024 * 1024)
+// Compressed data is read and hashed in windows of this size on extract
+#define DECODE_WINDOW ((size_t)1024 * 1024)
 
 #define MAX_PATH_LEN 4096
+
+// Nanosecond file times are st_mtim/st_ctim on Linux and
+// st_mtimespec/st_ctimespec on Darwin
+#ifdef __APPLE__
+#define STAT_MTIME(st) ((st).st_mtimespec)
+#define STAT_CTIME(st) ((st).st_ctimespec)
+#else
+#define STAT_MTIME(st) ((st).st_mtim)
+#define STAT_CTIME(st) ((st).st_ctim)
+#endif
 #define MAX_FILES 100000
 #define MAX_PREFIXES 1000
 
+// Automatic dictionary sizing
+#define DICT_AUTO_MAX ((size_t)1536 * 1024 * 1024)
+#define DICT_AUTO_FLOOR ((size_t)1024 * 1024)
+#define DICT_MEM_FRACTION 0.75
+#define BLOCK_SIZE_MIN ((size_t)1024 * 1024)
+
+// Record-aligned verifiable blocks (--blocks)
+#define BLOCK_TARGET_DEFAULT ((size_t)8 * 1024 * 1024)
+#define BLOCK_DESC_SIZE 20
+#define MAX_BLOCKS 1000000
+
+// Rsyncable output (--rsyncable): independent streams cut at content-defined
+// boundaries of the payload
+#define RSYNC_DEFAULT_AVG ((size_t)1024 * 1024)
+#define RSYNC_MIN_AVG ((size_t)64 * 1024)
+#define RSYNC_BENCH_BLOCK 2048      // rsync block size used by bench rsync
+
+// Large encoder/decoder allocations (dictionary, match-finder hash chains)
+// are backed by 2 MB pages
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+#define HUGE_ALLOC_MIN ((size_t)4 * 1024 * 1024)
+#define HUGE_HEADER 64
+
+// NUMA placement for the parallel encoder
+#define NUMA_MAX_NODES 64
+
+typedef enum {
+    NUMA_OFF,                   // leave placement to the kernel
+    NUMA_LOCAL,                 // pin workers to nodes, encoder memory node-local
+    NUMA_INTERLEAVE             // encoder memory interleaved across all nodes
+} NumaMode;
+
+typedef enum {
+    HUGEPAGES_OFF,
+    HUGEPAGES_AUTO,             // MAP_HUGETLB if reserved pages exist, else THP
+    HUGEPAGES_THP,              // madvise(MADV_HUGEPAGE)
+    HUGEPAGES_HUGETLB           // MAP_HUGETLB, falling back to THP
+} HugePageMode;
+
+// Similarity clustering (MinHash sketches bucketed with LSH)
+#define MINHASH_K 64
+#define LSH_BANDS 16
+#define LSH_ROWS (MINHASH_K / LSH_BANDS)
+#define SHINGLE_LEN 8
+#define SKETCH_MAX_BYTES (16 * 1024 * 1024)
+#define SKETCH_WINDOWS 16
+#define CLUSTER_MIN_SIMILARITY 0.5
+#define CLUSTER_PROBE_BYTES (32 * 1024 * 1024)
+
+// Record markers stored in place of the content length
+#define RECORD_DUPLICATE 0xFFFFFFFF
+#define RECORD_DELTA 0xFFFFFFFE
+#define RECORD_CHUNKED 0xFFFFFFFD
+#define RECORD_BASE 0xFFFFFFFC      // unchanged member, content is in the base archive
+#define RECORD_REPO 0xFFFFFFFB      // member stored as chunk references into a chunk repository
+#define RECORD_PRECOMP 0xFFFFFFFA   // member with deflate streams stored inflated
+#define RECORD_JPEG 0xFFFFFFF9      // JPEG with re-coded coefficients
+#define RECORD_LOG 0xFFFFFFF8       // text split into template and field values
+#define RECORD_COLUMNAR 0xFFFFFFF7  // table stored column by column
+
+// File state sidecar (<archive>.state) for incremental archives
+#define STATE_MAGIC "KUNSTATE"
+#define STATE_VERSION 2             // 1 had no chain depth
+#define ARCHIVE_ID_LEN 16
+#define MAX_CHAIN_DEPTH 64          // base archives below the newest that extract will follow
+
+// Scan cache (--scan-cache=FILE): fixed-size entries sorted by path, then the
+// path strings. It is mapped and binary-searched in place, never parsed.
+#define SCAN_CACHE_MAGIC "KUNSCACH"
+#define SCAN_CACHE_VERSION 1
+#define SCAN_CACHE_HEADER 24
+#define SCAN_ENTRY_SIZE (108 + MINHASH_K * 4)
+#define SCAN_HAS_SKETCH 0x01
+
+// Appended segments (append/compact): xz streams after the main archive data,
+// listed by a trailing index that ends with a fixed-size footer
+#define INDEX_MAGIC "KUNDAIDX"
+#define INDEX_END_MAGIC "KUNDAEND"
+#define INDEX_VERSION 1
+#define INDEX_ENTRY_SIZE 53
+#define INDEX_FOOTER_SIZE 20
+#define INDEX_SCAN_WINDOW (1024 * 1024)  // backwards search for the last complete footer
+#define MAX_SEGMENTS 65536
+#define SEGMENTS_FULL -2
+
+// watch: batch changed files into appended segments
+#define WATCH_DEFAULT_INTERVAL 5            // seconds
+#define WATCH_DEFAULT_MAX_BATCH (64 * 1024 * 1024)
+#define WATCH_MAX_PENDING 65536
+
+// Content-defined chunking (FastCDC gear hash with normalized chunking)
+#define CDC_DEFAULT_AVG 8192
+#define CDC_MIN_AVG 256
+#define CDC_MAX_AVG (4 * 1024 * 1024)
+#define CHUNK_NEW 0xFFFFFFFF
+
+// Chunk repository (--repo=DIR)
+#define REPO_INDEX_MAGIC "KUNREPOI"
+#define REPO_BLOOM_MAGIC "KUNBLOOM"
+#define REPO_PACK_MAGIC "KUNDAPAK"
+#define REPO_VERSION 1
+#define REPO_INDEX_HEADER 24
+#define REPO_ENTRY_SIZE 48          // SHA-256, pack id, offset, length
+#define REPO_REF_SIZE 36            // SHA-256, length
+#define REPO_PACK_HEADER 28
+#define BLOOM_BITS_PER_CHUNK 16     // ~0.05% false positives with 8 hashes
+#define BLOOM_HASHES 8
+#define REPO_GC_REPACK 0.5          // repack when less than this fraction of a pack is live
+
+// Member filters (--precomp, --jpeg, --log-filter, --columnar) under --mem-limit
+#define FILTER_WORKER_MIN ((size_t)64 * 1024 * 1024)  // smallest per-worker allowance
+#define FILTER_BODIES_MIN ((size_t)1024 * 1024)       // smaller budgets keep no bodies at all
+
+// Deflate recompression (--precomp)
+#define PRECOMP_MIN_STREAM 64       // smaller streams are not worth the parameter search
+#define PRECOMP_MAX_INFLATED ((size_t)256 * 1024 * 1024)
+#define PRECOMP_LITERAL 0
+#define PRECOMP_RAW 1               // raw deflate (gzip member, zip entry)
+#define PRECOMP_PNG 2               // zlib stream split over PNG IDAT chunks
+
+// JPEG re-coding (--jpeg)
+#define JPEG_MAX_COMPONENTS 4
+#define JPEG_MAX_BLOCKS ((size_t)1 << 22)  // 512 MB of coefficients
+#define JPEG_BLOCK_BYTES (64 * sizeof(int16_t) + 1)   // coefficients and non-zero count
+#define JPEG_NZ_BUCKETS 9
+#define JPEG_MAG_BUCKETS 16
+#define JPEG_MAX_EXP 16
+#define JPEG_ADAPT_LIMIT 60          // slowest adaptation rate: 1/62
+#define JPEG_MIX_INPUTS 3
+#define JPEG_MIX_RATE 12            // weight learning rate, in 1/16384 steps
+#define JPEG_MAX_SCANS 64
+#define JPEG_MAX_CORR_BITS 1000     // libjpeg's refinement bit buffer
+
+// Text filters (--log-filter, --columnar)
+#define FILTER_PROBE_BYTES (1024 * 1024)  // prefix that decides whether a file is filtered
+#define LOG_MIN_SIZE 4096
+#define LOG_MIN_LINES 16
+#define LOG_MAX_LINE 2048           // longer average lines are not line-oriented text
+#define LOG_FIELD_BITS 12           // field slots for the delta predictions
+#define LOG_NUMBER 0x01             // template placeholders, see log_filter_encode
+#define LOG_PADDED 0x02
+#define LOG_DATETIME 0x03
+#define LOG_TIME 0x04
+#define LOG_ESCAPE 0x05
+#define COLUMNAR_MIN_SIZE 4096
+#define COLUMNAR_MIN_LINES 16
+#define COLUMNAR_SAMPLE_BYTES (64 * 1024)  // sample for detect_table_format
+#define COLUMNAR_MAX_COLUMNS 256    // later fields share the last column
+#define COLUMNAR_KEY_SLOTS 1024     // NDJSON keys, at most half of them used
+#define COLUMNAR_ESCAPE 0x00        // column and NDJSON template bytes, see columnar_encode
+#define COLUMNAR_VALUE 0x01
+#define COLUMNAR_RAW 0x02
+#define COLUMNAR_LF 0               // delimited row endings
+#define COLUMNAR_CRLF 1
+#define COLUMNAR_EOF 2
+
+// Long-range matching (rzip-style) ahead of LZMA
+#define LRM_MIN_BLOCK 4096
+#define LRM_MAX_TABLE (1 << 24)
+#define LRM_MIN_MATCH_BLOCKS 4
+#define LRM_MIN_DISTANCE (1024 * 1024)
+#define LRM_HASH_MUL 0x100000001b3ULL
+
+// Near-duplicate delta encoding
+#define DELTA_BLOCK 16
+#define DELTA_MIN_SIMILARITY 0.3
+#define DELTA_MAX_RATIO 0.5
+#define DELTA_OP_ADD 0
+#define DELTA_OP_COPY 1
+
 typedef enum {
     FILE_TYPE_EMPTY,
     FILE_TYPE_TEXT,
@@ -32,43 +251,598 @@ typedef enum {
     FILE_TYPE_COMPRESSED
 } FileType;
 
+typedef enum {
+    TABLE_NONE,
+    TABLE_DELIMITED,            // CSV, TSV and the like
+    TABLE_NDJSON                // one JSON object per line
+} TableFormat;
+
 typedef struct {
     char path[MAX_PATH_LEN];
+    char *source;               // file to read during the parallel load
     uint8_t *content;
     size_t size;
     FileType type;
     int is_duplicate;
     char duplicate_of[MAX_PATH_LEN];
+    int has_sketch;
+    uint32_t sketch[MINHASH_K];
+    int is_delta;
+    size_t delta_base;          // index of the full-content base file
+    uint8_t *patch;
+    size_t patch_size;
+    uint32_t *chunk_refs;       // chunk ids when stored as a chunk list
+    size_t chunk_count;
+    uint8_t digest[32];         // per-file digest, taken while loading
+    int64_t mtime_sec;          // stat at scan time, for the file state sidecar
+    uint32_t mtime_nsec;
+    uint64_t inode;
+    uint8_t state_hash[16];     // fast128 of the content
+    uint64_t dev;
+    int64_t ctime_sec;
+    uint32_t ctime_nsec;
+    int scan_cached;            // type and hashes were taken from the scan cache
+    int digest_cached;
+    uint8_t *repo_refs;         // chunk references when stored in a chunk repository
+    size_t repo_nrefs;
+    uint8_t *precomp;           // --precomp segments, NULL if no stream could be re-created
+    size_t precomp_size;
+    uint8_t *jpeg;              // --jpeg body, NULL if the file was not re-coded
+    size_t jpeg_size;
+    uint8_t *log_filter;        // --log-filter body, NULL if the file was not filtered
+    size_t log_filter_size;
+    uint8_t *columnar;          // --columnar body, NULL if the file is not stored by column
+    size_t columnar_size;
 } FileEntry;
 
+// One file of a state sidecar: what the file looked like when archived
+typedef struct {
+    char *path;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t inode;
+    uint8_t hash[16];
+} FileState;
+
+// A scan cache file mapped read-only
+typedef struct {
+    uint8_t *map;
+    size_t size;
+    uint32_t count;
+    int64_t written_at;         // entries modified at or after this second are not trusted
+} ScanCache;
+
+typedef struct {
+    uint8_t archive_id[ARCHIVE_ID_LEN];
+    uint32_t chain_depth;       // base archives below this one, 0 = full archive
+    FileState *entries;
+    size_t count;
+    size_t *slots;              // open-addressing path index
+    size_t slot_count;
+} FileStateTable;
+
 typedef struct {
     char prefix[MAX_PATH_LEN];
     int count;
 } PathPrefix;
 
+typedef struct {
+    const uint8_t *data;        // points into the owning file's content
+    uint32_t len;
+    uint64_t hash;
+} Chunk;
+
 typedef struct {
     FileEntry *files;
     size_t count;
     size_t capacity;
     PathPrefix *prefixes;
     size_t prefix_count;
+    Chunk *chunks;              // unique chunks, id = index
+    size_t chunk_count;
+    size_t chunk_capacity;
+    FileState *base_members;    // unchanged since the base archive, not read
+    size_t base_count;
 } Archive;
 
+typedef struct {
+    int cluster;                // --cluster: group near-duplicate files
+    int delta;                  // --delta: encode near-duplicates as patches
+    size_t cdc_avg;             // --cdc[=AVG]: chunk-level dedup, 0 = off
+    int lrm;                    // --lrm: long-range matching before LZMA
+    size_t mem_limit;           // --mem-limit=SIZE: whole-run budget, 0 = none
+    uint32_t fixed_dict;        // batch: one ultra dictionary for every archive, 0 = per archive
+    int content_digest;         // --content-digest: also store SHA-256 of the uncompressed payload
+    size_t block_target;        // --blocks[=SIZE]: record-aligned verifiable blocks, 0 = off
+    int file_state;             // --file-state: write <archive>.state for later incremental runs
+    const char *incremental_from; // --incremental-from=BASE: only store files changed since BASE
+    const char *scan_cache;     // --scan-cache=FILE: reuse type and hashes of unchanged files
+    const char *ref_archive;    // --ref-archive=REF: prime the encoder with REF's payload
+    const char *repo;           // --repo=DIR: store chunks in a shared chunk repository
+    size_t rsync_avg;           // --rsyncable[=AVG]: resynchronising output, 0 = off
+    int precomp;                // --precomp: store re-creatable deflate streams inflated
+    int jpeg;                   // --jpeg: re-code baseline JPEG coefficients
+    int log_filter;             // --log-filter: split log lines into templates and field values
+    int columnar;               // --columnar: store CSV/TSV and NDJSON column by column
+} CreateOptions;
+
+typedef struct {
+    double sketch_ms;
+    double sketch_mb;
+    size_t clusters;            // clusters with 2+ members
+    size_t clustered_files;
+    double similarity_before;   // mean Jaccard estimate of stream neighbours
+    double similarity_after;
+    double probe_ms;
+    double probe_ratio_before;  // fast LZMA probe over the content stream
+    double probe_ratio_after;
+} ClusterStats;
+
+typedef struct {
+    size_t files;
+    size_t total_chunks;
+    size_t unique_chunks;
+    size_t input_bytes;
+    size_t unique_bytes;
+    double chunk_ms;
+} ChunkStats;
+
+typedef struct {
+    size_t files;               // files with at least one re-created stream
+    size_t streams;             // deflate streams found
+    size_t recreated;           // streams zlib reproduces bit-exactly
+    size_t deflated_bytes;      // size of the re-created streams
+    size_t inflated_bytes;      // what they inflate to
+    size_t input_bytes;
+    double cpu_ms;
+    double wall_ms;
+} PrecompStats;
+
+typedef struct {
+    size_t candidates;          // files starting with a JPEG SOI marker
+    size_t recoded;
+    size_t original_bytes;      // size of the re-coded files
+    size_t coded_bytes;         // what their bodies take
+    double cpu_ms;
+    double wall_ms;
+} JpegStats;
+
+typedef struct {
+    size_t candidates;          // line-oriented text files
+    size_t candidate_bytes;
+    size_t filtered;
+    size_t original_bytes;      // size of the filtered files
+    size_t template_bytes;
+    size_t value_bytes;
+    size_t fields;
+    double cpu_ms;
+    double wall_ms;
+} LogFilterStats;
+
+typedef struct {
+    size_t candidates;          // delimited or NDJSON text files
+    size_t candidate_bytes;
+    size_t converted;
+    size_t original_bytes;      // size of the converted files
+    size_t columns;
+    double cpu_ms;
+    double wall_ms;
+} ColumnarStats;
+
+typedef struct {
+    size_t block;               // index granularity
+    size_t matches;
+    size_t matched_bytes;
+    size_t output_size;
+    double encode_ms;
+} LrmStats;
+
+typedef struct {
+    size_t mem_available;       // MemAvailable from /proc/meminfo
+    size_t cgroup_limit;        // 0 = no cgroup memory limit
+    size_t cgroup_usage;
+    size_t usable;              // what this process can still allocate
+} MemoryInfo;
+
+typedef struct {
+    uint32_t preset_level;
+    int ultra;                  // BT4 / depth 273 chain instead of the plain preset
+    uint32_t dict_size;
+    uint32_t threads;
+    size_t block_size;          // bytes per independently encoded block, 0 = one block
+    const uint8_t *preset_dict; // --ref-archive: one raw LZMA2 stream primed with these bytes
+    size_t preset_dict_size;
+    size_t rsync_avg;           // --rsyncable: cut streams at content-defined boundaries, 0 = off
+    size_t streams;             // set by compress_lzma_ultra: xz streams written
+} EncoderConfig;
+
+typedef struct {
+    size_t scan;                // file contents held after scanning
+    size_t payload;             // serialized binary format
+    size_t lrm;                 // long-range match output and index
+    size_t reference;           // --ref-archive: decoded reference payload
+    size_t filters;             // member filters: one file in flight per worker
+    size_t filter_worker;       // what one worker's file may take
+    int filter_workers;         // workers filtering at once
+    size_t filter_bodies;       // filter bodies kept for the payload
+    size_t dedup;               // --delta patches and LSH tables, --cdc chunk tables
+    size_t encoder;             // all encoder instances
+    size_t output;
+    size_t total;
+} MemoryPlan;
+
+typedef struct {
+    char *path;
+    const uint8_t *data;
+    size_t size;
+    uint8_t *owned;             // rebuilt content (delta members)
+    int ok;                     // content resolved
+    int digest_failed;          // content does not match its stored digest
+    int from_base;              // RECORD_BASE: content comes from the base archive
+    int shadowed;               // replaced by a member of a later appended segment
+    int from_repo;              // RECORD_REPO: content comes from the chunk repository
+    const uint8_t *repo_refs;   // points into the payload
+    uint32_t repo_nrefs;
+    const uint8_t *jpeg_body;   // RECORD_JPEG: rebuilt after all records are parsed
+    uint32_t jpeg_body_size;
+} ExtractEntry;
+
+// One entry of the FLAG_BLOCKED block table. The first five fields are
+// stored (BLOCK_DESC_SIZE bytes, big-endian); the rest is derived.
+typedef struct {
+    uint32_t raw_size;          // payload bytes in the block
+    uint32_t comp_size;         // xz stream bytes
+    uint32_t first_record;      // index of the first member record that starts in the block
+    uint32_t first_chunk;       // chunk id the block's first new chunk gets
+    uint32_t crc;               // CRC32 of the xz stream
+    size_t raw_offset;
+    size_t comp_offset;
+    uint8_t leaf[32];           // Merkle leaf: SHA-256 of descriptor and stream
+    int damaged;
+} ArchiveBlock;
+
+typedef struct {
+    uint8_t flags;
+    size_t compressed_size;
+    uint8_t *payload;           // decoded member records
+    size_t payload_size;
+    int checksum_verified;      // FLAG_CHECKSUMMED digest matched
+    int content_verified;       // FLAG_CONTENT_DIGEST digest matched
+    double decode_ms;
+    ArchiveBlock *blocks;       // FLAG_BLOCKED only; damaged blocks are zero-filled in payload
+    uint32_t nblocks;
+    uint32_t damaged_blocks;
+    uint32_t nrecords;          // record count from the block table header
+    int merkle_verified;
+    size_t end_offset;          // file offset just past the main compressed data
+} DecodedArchive;
+
+struct LoadedArchive;
+
+typedef struct {
+    ExtractEntry *entries;
+    uint32_t count;             // records parsed
+    uint32_t declared;          // records the payload announces
+    char **prefixes;
+    uint16_t num_prefixes;
+    size_t *path_index;
+    size_t index_size;
+    Chunk *chunks;
+    int digest_algo;            // DIGEST_NONE if the archive has no digest table
+    const uint8_t *digests;     // count * digest_length(digest_algo), in record order
+    int chained;                // FLAG_CHAINED trailer was read
+    uint8_t archive_id[ARCHIVE_ID_LEN];
+    uint8_t base_id[ARCHIVE_ID_LEN];
+    char *base_path;            // base archive as given at create time, NULL for a full archive
+    char *repo_path;            // chunk repository, NULL if the archive does not use one
+    struct LoadedArchive *base; // decoded base, owns the data of from_base members
+    struct LoadedArchive *segments; // appended segments, oldest first
+    uint32_t nsegments;
+} MemberTable;
+
+// A decoded payload (base archive or appended segment) and its members,
+// kept alive while the members are extracted
+struct LoadedArchive {
+    DecodedArchive decoded;
+    MemberTable table;
+};
+
+// One appended segment as listed by the trailing index
+typedef struct {
+    uint64_t offset;            // file offset of the xz stream
+    uint32_t comp_size;
+    uint32_t raw_size;
+    uint32_t records;
+    uint8_t flags;              // FLAG_FILE_DIGESTS
+    uint8_t sha[32];            // SHA-256 of the xz stream
+} SegmentInfo;
+
+typedef struct {
+    SegmentInfo *segments;
+    uint32_t count;
+    uint64_t index_offset;      // index position: end of the last segment
+    uint64_t end;               // end of the index footer; anything after it is left over
+} SegmentIndex;
+
+// A changed file waiting for the next watch batch
+typedef struct {
+    char *path;                 // relative to the watched directory
+    size_t size;
+    double event_ms;            // first event since the last batch
+} PendingFile;
+
+typedef struct {
+    int fd;                     // inotify instance
+    const char *root;
+    const char *archive_file;
+    const char *preset;
+    uint32_t fixed_dict;        // dictionary every batch is encoded with
+    char **dirs;                // watch descriptor -> directory relative to root
+    int dir_capacity;
+    dev_t archive_dev;          // the archive itself is never queued
+    ino_t archive_ino;
+    PendingFile *pending;
+    size_t npending;
+    size_t *slots;              // open-addressing path set over pending
+    size_t pending_bytes;
+    // Event-to-durable latency over all batches
+    size_t batches;
+    size_t files;
+    double latency_sum;
+    double latency_max;
+} WatchState;
+
+typedef struct {
+    size_t delta_files;
+    size_t target_bytes;        // size of files stored as patches
+    size_t patch_bytes;
+    double encode_ms;
+} DeltaStats;
+
+// An open chunk repository: mapped index and in-memory Bloom filter
+typedef struct {
+    char dir[MAX_PATH_LEN - 64];  // absolute, leaves room for the file names below it
+    uint8_t *index_map;
+    size_t index_size;
+    uint64_t count;
+    uint32_t next_pack;
+    uint64_t *bloom;
+    uint64_t bloom_bits;        // power of two
+    uint64_t index_probes;      // lookups the Bloom filter let through
+    uint64_t bloom_false_positives;
+} ChunkRepo;
+
+typedef struct {
+    size_t total_chunks;
+    size_t new_chunks;
+    size_t input_bytes;
+    size_t new_bytes;
+    size_t pack_bytes;
+    uint64_t index_probes;
+    uint64_t bloom_false_positives;
+    double chunk_ms;
+} RepoStats;
+
+typedef struct {
+    int online;                 // sysconf(_SC_NPROCESSORS_ONLN)
+    int affinity;               // CPUs in the sched_getaffinity mask (Linux), else online
+    double cgroup_quota;        // CPUs allowed by the cgroup quota, 0 = none
+    int effective;
+} CpuInfo;
+
+// A long-lived encoder. The lzma_stream is kept initialised between uses so
+// that re-initialising it with the same filter chain reuses the dictionary
+// and match-finder allocations instead of freeing and re-zeroing them.
+typedef struct {
+    lzma_stream strm;
+    EncoderConfig cfg;          // chain the stream was last initialised with
+    int ready;
+    size_t fresh_inits;         // initialisations that had to allocate
+    size_t reused_inits;        // initialisations that kept the allocation
+} EncoderContext;
+
+typedef struct {
+    EncoderContext *contexts;   // one per worker
+    int count;
+} EncoderContextPool;
+
+typedef struct {
+    atomic_size_t huge_allocs;      // allocations placed in 2 MB-aligned mappings
+    atomic_size_t huge_bytes;
+    atomic_size_t hugetlb_bytes;    // of which explicit MAP_HUGETLB pages
+    atomic_size_t small_allocs;     // left to malloc
+    long minor_faults;              // page faults during the last encode
+    size_t anon_huge_kb;            // AnonHugePages of the process after encode
+} HugePageStats;
+
+typedef struct {
+    int nodes;                          // nodes with usable CPUs
+    int node_ids[NUMA_MAX_NODES];
+#ifdef __linux__
+    cpu_set_t cpus[NUMA_MAX_NODES];     // usable CPUs of each node
+#endif
+} NumaTopology;
+
+// Region of output the checksum thread consumes in order. avail grows as
+// the encoder writes; done marks the region complete.
+typedef struct {
+    const uint8_t *ptr;
+    size_t avail;
+    int done;
+} HashSegment;
+
+// SHA-256 over a sequence of segments, computed on its own thread while
+// they are still being produced
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    EVP_MD_CTX *md;
+    HashSegment *segs;
+    size_t nsegs;
+    size_t next;                // segment being hashed
+    size_t consumed;            // bytes of segs[next] already hashed
+    int cancelled;
+    double hash_ms;             // time the thread spent hashing
+    size_t bytes;
+    uint8_t digest[32];
+} StreamHasher;
+
+typedef void (*WorkFn)(void *ctx, size_t index, int worker);
+
+typedef struct WorkerPool {
+    pthread_t *threads;
+    struct WorkerArg *args;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    WorkFn fn;
+    void *ctx;
+    size_t next;
+    size_t count;
+    size_t remaining;
+    int active;                 // workers allowed to take tasks this run
+    int shutdown;
+    int pinned;                 // workers are bound to NUMA nodes
+} WorkerPool;
+
 // Function prototypes
 FileType detect_file_type(const uint8_t *data, size_t size);
+TableFormat detect_table_format(const uint8_t *data, size_t size, uint8_t *delimiter);
 Archive* archive_create(void);
 void archive_free(Archive *archive);
 int archive_add_file(Archive *archive, const char *path, const uint8_t *content, size_t size);
+void get_cpu_info(CpuInfo *info);
+#ifdef __linux__
+int parse_cpulist(const char *text, cpu_set_t *set);
+#endif
+void numa_detect(NumaTopology *topo);
+void numa_place(void *addr, size_t len);
+WorkerPool* pool_create(int nthreads);
+void pool_run(WorkerPool *pool, size_t count, int max_parallel, WorkFn fn, void *ctx);
+void pool_destroy(WorkerPool *pool);
+WorkerPool* get_worker_pool(void);
+void print_parallelism(void);
 int scan_directory(const char *dir_path, const char *base_path, Archive *archive);
+void load_archive_files(Archive *archive);
 void compress_paths(Archive *archive);
-uint8_t* compress_lzma_ultra(const uint8_t *data, size_t size, size_t *compressed_size, const char *preset);
-int create_archive(const char *directory, const char *output_file, const char *preset, int checksum);
+double now_ms(void);
+void compute_sketch(FileEntry *entry);
+double sketch_similarity(const FileEntry *a, const FileEntry *b);
+void cluster_files(Archive *archive, ClusterStats *stats);
+size_t write_varint(uint8_t *buf, uint64_t val);
+size_t read_varint(const uint8_t *buf, size_t avail, uint64_t *val);
+uint8_t* delta_encode(const uint8_t *base, size_t base_size, const uint8_t *target, size_t target_size,
+                      size_t max_patch, size_t *patch_size);
+int delta_apply(const uint8_t *base, size_t base_size, const uint8_t *patch, size_t patch_size,
+                uint8_t *out, size_t out_size);
+void delta_encode_files(Archive *archive, DeltaStats *stats);
+uint64_t hash_bytes(const uint8_t *data, size_t size, uint64_t seed);
+void fast128(const uint8_t *data, size_t size, uint8_t out[16]);
+size_t digest_length(int algo);
+void compute_digest(int algo, const uint8_t *data, size_t size, uint8_t *out);
+uint32_t verify_member_digests(MemberTable *table);
+size_t cdc_next_boundary(const uint8_t *data, size_t size, size_t avg);
+void chunk_files(Archive *archive, size_t avg, ChunkStats *stats);
+void precomp_files(Archive *archive, PrecompStats *stats);
+int precomp_rebuild(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size);
+void jpeg_files(Archive *archive, JpegStats *stats);
+int jpeg_rebuild(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size);
+void log_filter_files(Archive *archive, LogFilterStats *stats);
+int log_filter_decode(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size);
+void columnar_files(Archive *archive, ColumnarStats *stats);
+int columnar_decode(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size);
+uint8_t* lrm_encode(const uint8_t *data, size_t size, size_t *out_size, LrmStats *stats);
+uint8_t* lrm_decode(const uint8_t *data, size_t size, size_t *out_size);
+int make_parent_dirs(const char *file_path);
+int member_path_safe(const char *path);
+int resolve_encoder_config(const char *preset, size_t input_size, uint32_t fixed_dict, EncoderConfig *cfg);
+void fit_encoder_threads(EncoderConfig *cfg, size_t streams, size_t stream_size);
+int build_encoder_filters(const EncoderConfig *cfg, lzma_options_lzma *opt, lzma_filter filters[2]);
+uint64_t encoder_memusage(const EncoderConfig *cfg);
+int plan_memory(size_t mem_limit, size_t input_files, size_t input_bytes, size_t largest_file,
+                size_t reference_bytes, const CreateOptions *opts, EncoderConfig *cfg, MemoryPlan *plan);
+void print_encoder_config(const EncoderConfig *cfg);
+void size_rsyncable_dict(EncoderConfig *cfg);
+void *huge_alloc(void *opaque, size_t nmemb, size_t size);
+void huge_free(void *opaque, void *ptr);
+size_t read_anon_huge_kb(void);
+void print_hugepage_stats(void);
+int encoder_contexts_reserve(int count);
+void encoder_contexts_free(void);
+void print_encoder_context_stats(void);
+int stream_hasher_start(StreamHasher *hasher, size_t nsegs);
+void stream_hasher_update(StreamHasher *hasher, size_t seg, const uint8_t *ptr, size_t avail, int done);
+int stream_hasher_finish(StreamHasher *hasher);
+void stream_hasher_cancel(StreamHasher *hasher);
+lzma_ret encoder_context_encode(EncoderContext *ctx, const EncoderConfig *cfg, const uint8_t *in, size_t in_size,
+                                uint8_t *out, size_t out_size, size_t *out_pos, StreamHasher *hasher, size_t seg);
+uint8_t* compress_lzma_ultra(const uint8_t *data, size_t size, size_t *compressed_size, EncoderConfig *cfg,
+                             StreamHasher *hasher);
+uint8_t* compress_archive_blocks(const uint8_t *data, ArchiveBlock *blocks, uint32_t nblocks,
+                                 size_t *compressed_size, EncoderConfig *cfg);
+void block_descriptor(const ArchiveBlock *block, uint8_t out[BLOCK_DESC_SIZE]);
+void block_leaf_hash(ArchiveBlock *block, const uint8_t *stream);
+void merkle_root(const ArchiveBlock *blocks, uint32_t nblocks, uint8_t root[32]);
+int batch_create(const char *list_file, const char *preset, const CreateOptions *opts);
+uint8_t* load_input_bytes(const char *path, size_t *size);
+int bench_numa(const char *input, const char *preset);
+int bench_rsync(const char *input, const char *preset, size_t avg);
+int bench_precomp(const char *input, const char *preset);
+int bench_log_filter(const char *input, const char *preset);
+int bench_columnar(const char *input, const char *preset);
+int create_archive(const char *directory, const char *output_file, const char *preset, int checksum,
+                   const CreateOptions *opts);
+int decode_archive(const char *archive_file, DecodedArchive *out);
+void decoded_archive_free(DecodedArchive *decoded);
+int load_file_state(const char *archive_file, FileStateTable *table);
+void file_state_free(FileStateTable *table);
+size_t split_unchanged_files(Archive *archive, const FileStateTable *state, size_t *unchanged_bytes);
+int write_file_state(const char *archive_file, const uint8_t id[ARCHIVE_ID_LEN], uint32_t chain_depth,
+                     const Archive *archive);
+void new_archive_id(uint8_t id[ARCHIVE_ID_LEN], const char *output_file);
+void scan_cache_open(const char *path, ScanCache *cache);
+void scan_cache_close(ScanCache *cache);
+size_t scan_cache_apply(Archive *archive, const ScanCache *cache, size_t *cached_bytes);
+int scan_cache_write(const char *path, const Archive *archive, int64_t scan_start);
+int resolve_base_members(const char *archive_file, MemberTable *table, int depth);
+int read_archive_extent(FILE *f, size_t *end);
+int read_segment_index(FILE *f, size_t main_end, SegmentIndex *index);
+int write_segment_index(FILE *f, const SegmentIndex *index, size_t *end);
+int load_appended_segments(const char *archive_file, const DecodedArchive *main, MemberTable *table);
+const ExtractEntry *find_member(const MemberTable *table, const char *path);
+uint8_t *serialize_plain_members(const Archive *archive, const uint8_t *archive_id, size_t *size, uint8_t *flags);
+int append_archive(const char *archive_file, int npaths, char **paths, const char *preset);
+int compact_archive(const char *archive_file, const char *output_file, const char *preset);
+int append_segment(const char *archive_file, const Archive *archive, const char *preset, uint32_t fixed_dict,
+                   double start);
+int watch_directory(const char *directory, const char *archive_file, const char *preset, double interval_ms,
+                    size_t max_batch);
+int parse_members(const DecodedArchive *decoded, MemberTable *table);
+int repo_lock(const char *dir, int exclusive);
+int repo_open(const char *dir, int create, ChunkRepo *repo);
+void repo_close(ChunkRepo *repo);
+int repo_store_files(ChunkRepo *repo, Archive *archive, size_t avg, const char *preset, RepoStats *stats);
+int repo_register(const ChunkRepo *repo, const uint8_t id[ARCHIVE_ID_LEN], const char *archive_file);
+int resolve_repo_members(MemberTable *table);
+int repo_gc(const char *dir, const char *preset);
+void member_table_free(MemberTable *table);
 int extract_archive(const char *archive_file, const char *output_directory);
+int test_archives(int count, char **archive_files);
 void write_uint16_be(uint8_t *buf, uint16_t val);
 void write_uint32_be(uint8_t *buf, uint32_t val);
+void write_uint64_be(uint8_t *buf, uint64_t val);
 uint16_t read_uint16_be(const uint8_t *buf);
 uint32_t read_uint32_be(const uint8_t *buf);
-size_t get_optimal_dict_size(void);
+uint64_t read_uint64_be(const uint8_t *buf);
+int read_cgroup_file(const char *v1_controller, const char *file, char *buf, size_t buf_len);
+void get_memory_info(MemoryInfo *info);
+uint64_t lzma_ultra_memusage(uint32_t dict_size);
+size_t parse_size(const char *text);
+int estimate_input(const char *path, size_t *files, size_t *bytes, size_t *largest);
+size_t get_optimal_dict_size(size_t input_size);
 void print_usage(void);
 
 // Detect file type
@@ -125,6 +899,11 @@ Archive* archive_create(void) {
     archive->count = 0;
     archive->prefixes = malloc(sizeof(PathPrefix) * MAX_PREFIXES);
     archive->prefix_count = 0;
+    archive->chunks = NULL;
+    archive->chunk_count = 0;
+    archive->chunk_capacity = 0;
+    archive->base_members = NULL;
+    archive->base_count = 0;
     
     if (!archive->files || !archive->prefixes) {
         free(archive->files);
@@ -144,8 +923,21 @@ void archive_free(Archive *archive) {
         if (!archive->files[i].is_duplicate) {
             free(archive->files[i].content);
         }
+        free(archive->files[i].patch);
+        free(archive->files[i].chunk_refs);
+        free(archive->files[i].repo_refs);
+        free(archive->files[i].precomp);
+        free(archive->files[i].jpeg);
+        free(archive->files[i].log_filter);
+        free(archive->files[i].columnar);
+        free(archive->files[i].source);
     }
     
+    for (size_t i = 0; i < archive->base_count; i++) {
+        free(archive->base_members[i].path);
+    }
+    free(archive->base_members);
+    free(archive->chunks);
     free(archive->files);
     free(archive->prefixes);
     free(archive);
@@ -161,19 +953,318 @@ int archive_add_file(Archive *archive, const char *path, const uint8_t *content,
         archive->capacity = new_capacity;
     }
     
+    // Zeroed first: the array comes from realloc, and later passes trust
+    // flags such as scan_cached and digest_cached
     FileEntry *entry = &archive->files[archive->count];
+    memset(entry, 0, sizeof(*entry));
     strncpy(entry->path, path, MAX_PATH_LEN - 1);
-    entry->path[MAX_PATH_LEN - 1] = '\0';
     entry->content = (uint8_t*)content;
     entry->size = size;
-    entry->type = detect_file_type(content, size);
-    entry->is_duplicate = 0;
+    entry->type = content ? detect_file_type(content, size) : FILE_TYPE_EMPTY;
     
     archive->count++;
     return 0;
 }
 
-// Scan directory recursively
+// CPUs this process may actually use: online CPUs, narrowed by the
+// affinity mask and by the cgroup CPU quota (v2 cpu.max, v1 cfs quota)
+void get_cpu_info(CpuInfo *info) {
+    memset(info, 0, sizeof(*info));
+    info->online = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (info->online < 1) info->online = 1;
+    info->affinity = info->online;
+    
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        info->affinity = CPU_COUNT(&set);
+    }
+#endif
+    
+    char buf[128];
+    if (read_cgroup_file(NULL, "cpu.max", buf, sizeof(buf)) == 0) {
+        char quota[32];
+        unsigned long long period = 0;
+        if (sscanf(buf, "%31s %llu", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0) {
+            info->cgroup_quota = (double)strtoull(quota, NULL, 10) / period;
+        }
+    } else if (read_cgroup_file("cpu", "cpu.cfs_quota_us", buf, sizeof(buf)) == 0) {
+        long long quota = strtoll(buf, NULL, 10);
+        if (quota > 0 && read_cgroup_file("cpu", "cpu.cfs_period_us", buf, sizeof(buf)) == 0) {
+            unsigned long long period = strtoull(buf, NULL, 10);
+            if (period > 0) info->cgroup_quota = (double)quota / period;
+        }
+    }
+    
+    info->effective = info->affinity;
+    if (info->cgroup_quota > 0) {
+        int quota_cpus = (int)(info->cgroup_quota + 0.999);
+        if (quota_cpus < info->effective) info->effective = quota_cpus;
+    }
+    if (info->effective < 1) info->effective = 1;
+}
+
+// NUMA placement needs the Linux affinity and mempolicy calls; elsewhere
+// the topology stays empty and --numa is ignored with a warning
+#ifdef __linux__
+// Parse a sysfs CPU list such as "0-3,8-11" into a set
+int parse_cpulist(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = text;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) return -1;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, set);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+#endif
+
+static NumaMode numa_mode = NUMA_OFF;     // --numa[=local|interleave]
+static NumaTopology numa_topology;
+#ifdef __linux__
+static int numa_cpu_node[CPU_SETSIZE];   // CPU -> index into numa_topology
+#endif
+
+static void set_numa_mode(NumaMode mode) {
+#ifdef __linux__
+    numa_mode = mode;
+#else
+    (void)mode;
+    fprintf(stderr, "Warning: --numa is not supported on this platform; ignoring it\n");
+#endif
+}
+
+// Nodes from /sys/devices/system/node that have CPUs inside our affinity
+// mask. A machine without that directory is treated as a single node.
+void numa_detect(NumaTopology *topo) {
+    memset(topo, 0, sizeof(*topo));
+#ifdef __linux__
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) numa_cpu_node[cpu] = 0;
+    
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && topo->nodes < NUMA_MAX_NODES) {
+        int id;
+        char tail;
+        if (sscanf(entry->d_name, "node%d%c", &id, &tail) != 1) continue;
+        
+        char path[128], buf[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        int ok = fgets(buf, sizeof(buf), f) != NULL;
+        fclose(f);
+        
+        cpu_set_t node_cpus;
+        if (!ok || parse_cpulist(buf, &node_cpus) != 0) continue;
+        CPU_AND(&node_cpus, &node_cpus, &allowed);
+        if (CPU_COUNT(&node_cpus) == 0) continue;
+        
+        topo->node_ids[topo->nodes] = id;
+        topo->cpus[topo->nodes] = node_cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_cpus)) numa_cpu_node[cpu] = topo->nodes;
+        }
+        topo->nodes++;
+    }
+    closedir(dir);
+#endif
+}
+
+// Apply the NUMA policy to a fresh mapping before it is touched: preferred on
+// the calling worker's node (NUMA_LOCAL) or interleaved over all nodes
+void numa_place(void *addr, size_t len) {
+#if defined(__linux__) && defined(SYS_mbind)
+    if (numa_mode == NUMA_OFF || numa_topology.nodes < 2) return;
+    
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    int policy;
+    if (numa_mode == NUMA_LOCAL) {
+        int cpu = sched_getcpu();
+        if (cpu < 0 || cpu >= CPU_SETSIZE) return;
+        int id = numa_topology.node_ids[numa_cpu_node[cpu]];
+        mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+        policy = MPOL_PREFERRED;
+    } else {
+        for (int n = 0; n < numa_topology.nodes; n++) {
+            int id = numa_topology.node_ids[n];
+            mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+        }
+        policy = MPOL_INTERLEAVE;
+    }
+    syscall(SYS_mbind, addr, len, policy, mask, (unsigned long)(sizeof(mask) * 8), 0);
+#else
+    (void)addr;
+    (void)len;
+#endif
+}
+
+typedef struct WorkerArg {
+    WorkerPool *pool;
+    int id;
+} WorkerArg;
+
+static void *pool_worker(void *arg) {
+    WorkerPool *pool = ((WorkerArg*)arg)->pool;
+    int id = ((WorkerArg*)arg)->id;
+    
+    // Workers are dealt round-robin over the nodes, so consecutive blocks
+    // land on different sockets
+#ifdef __linux__
+    if (pool->pinned) {
+        int node = id % numa_topology.nodes;
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_topology.cpus[node]);
+    }
+#endif
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && (pool->next >= pool->count || id >= pool->active)) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        
+        size_t index = pool->next++;
+        WorkFn fn = pool->fn;
+        void *ctx = pool->ctx;
+        pthread_mutex_unlock(&pool->lock);
+        
+        fn(ctx, index, id);
+        
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->remaining == 0) {
+            pthread_cond_broadcast(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+WorkerPool* pool_create(int nthreads) {
+    WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+    if (!pool) return NULL;
+    pool->nthreads = nthreads < 1 ? 1 : nthreads;
+    numa_detect(&numa_topology);
+    
+    // A single worker runs tasks inline on the calling thread
+    if (pool->nthreads == 1) return pool;
+    pool->pinned = numa_mode == NUMA_LOCAL && numa_topology.nodes > 1;
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->threads = malloc(sizeof(pthread_t) * pool->nthreads);
+    pool->args = malloc(sizeof(WorkerArg) * pool->nthreads);
+    if (!pool->threads || !pool->args) {
+        free(pool->threads);
+        free(pool->args);
+        pool->threads = NULL;
+        pool->args = NULL;
+        pool->nthreads = 1;
+        return pool;
+    }
+    
+    for (int i = 0; i < pool->nthreads; i++) {
+        pool->args[i].pool = pool;
+        pool->args[i].id = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, &pool->args[i]) != 0) {
+            pool->nthreads = i;
+            break;
+        }
+    }
+    if (pool->nthreads < 1) pool->nthreads = 1;
+    return pool;
+}
+
+// Run fn(ctx, index, worker) for index in [0, count) on at most max_parallel
+// workers (0 = all) and wait for every task to finish
+void pool_run(WorkerPool *pool, size_t count, int max_parallel, WorkFn fn, void *ctx) {
+    if (count == 0) return;
+    if (!pool || !pool->threads || max_parallel == 1) {
+        for (size_t i = 0; i < count; i++) fn(ctx, i, 0);
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->next = 0;
+    pool->count = count;
+    pool->remaining = count;
+    pool->active = (max_parallel > 0 && max_parallel < pool->nthreads) ? max_parallel : pool->nthreads;
+    pthread_cond_broadcast(&pool->work_ready);
+    while (pool->remaining > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pool->count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(WorkerPool *pool) {
+    if (!pool) return;
+    if (pool->threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&pool->work_ready);
+        pthread_mutex_unlock(&pool->lock);
+        for (int i = 0; i < pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->work_ready);
+        pthread_cond_destroy(&pool->work_done);
+    }
+    free(pool->threads);
+    free(pool->args);
+    free(pool);
+}
+
+static WorkerPool *shared_pool = NULL;
+static int requested_threads = 0;   // --threads=N, 0 = detect
+static int parallel_streams = 0;    // --parallel-streams: encode large payloads as concurrent xz streams
+static CpuInfo shared_cpu_info;
+
+// Process-wide pool shared by scan, hash, encode and write stages
+WorkerPool* get_worker_pool(void) {
+    if (!shared_pool) {
+        get_cpu_info(&shared_cpu_info);
+        shared_pool = pool_create(requested_threads > 0 ? requested_threads : shared_cpu_info.effective);
+    }
+    return shared_pool;
+}
+
+void print_parallelism(void) {
+    WorkerPool *pool = get_worker_pool();
+    printf("  Parallelism:        %d worker%s (%d online, %d in affinity mask",
+           pool->nthreads, pool->nthreads == 1 ? "" : "s", shared_cpu_info.online, shared_cpu_info.affinity);
+    if (shared_cpu_info.cgroup_quota > 0) {
+        printf(", cgroup quota %.2f CPUs", shared_cpu_info.cgroup_quota);
+    }
+    printf("%s)\n", requested_threads > 0 ? ", --threads" : "");
+    if (numa_mode != NUMA_OFF) {
+        printf("  NUMA placement:     %s over %d node%s%s\n",
+               numa_mode == NUMA_LOCAL ? "local" : "interleaved", numa_topology.nodes,
+               numa_topology.nodes == 1 ? "" : "s",
+               numa_topology.nodes < 2 ? " (no effect on a single node)" : pool->pinned ? ", workers pinned" : "");
+    }
+}
+
+// Scan directory recursively. Files are only recorded here; their contents
+// are read afterwards by load_archive_files() on the worker pool.
 int scan_directory(const char *dir_path, const char *base_path, Archive *archive) {
     DIR *dir = opendir(dir_path);
     if (!dir) {
@@ -198,36 +1289,20 @@ int scan_directory(const char *dir_path, const char *base_path, Archive *archive
         if (S_ISDIR(st.st_mode)) {
             scan_directory(full_path, base_path, archive);
         } else if (S_ISREG(st.st_mode)) {
-            // Read file
-            FILE *f = fopen(full_path, "rb");
-            if (!f) continue;
-            
-            fseek(f, 0, SEEK_END);
-            long file_size = ftell(f);
-            fseek(f, 0, SEEK_SET);
-            
-            uint8_t *content = malloc(file_size);
-            if (!content) {
-                fclose(f);
-                continue;
-            }
-            
-            fread(content, 1, file_size, f);
-            fclose(f);
-            
             // Get relative path
             const char *rel_path = full_path + strlen(base_path);
             while (*rel_path == '/') rel_path++;
             
-            archive_add_file(archive, rel_path, content, file_size);
-            
-            double size_mb = file_size / (1024.0 * 1024.0);
-            const char *type_str = "binary";
-            FileType type = detect_file_type(content, file_size);
-            if (type == FILE_TYPE_TEXT) type_str = "text";
-            else if (type == FILE_TYPE_COMPRESSED) type_str = "compressed";
-            
-            printf("  %s (%.2f MB, %s)\n", rel_path, size_mb, type_str);
+            if (archive_add_file(archive, rel_path, NULL, st.st_size) == 0) {
+                FileEntry *file = &archive->files[archive->count - 1];
+                file->source = strdup(full_path);
+                file->mtime_sec = STAT_MTIME(st).tv_sec;
+                file->mtime_nsec = STAT_MTIME(st).tv_nsec;
+                file->inode = st.st_ino;
+                file->dev = st.st_dev;
+                file->ctime_sec = STAT_CTIME(st).tv_sec;
+                file->ctime_nsec = STAT_CTIME(st).tv_nsec;
+            }
         }
     }
     
@@ -235,6 +1310,77 @@ int scan_directory(const char *dir_path, const char *base_path, Archive *archive
     return 0;
 }
 
+static int file_digest_algo = DIGEST_NONE;   // --file-digests[=fast|sha256]
+static int file_state_hashing = 0;          // fill state_hash while loading (--file-state)
+
+static void file_state_hash(FileEntry *file) {
+    if (!file_state_hashing) return;
+    if (file_digest_algo == DIGEST_FAST128) {
+        memcpy(file->state_hash, file->digest, 16);
+    } else {
+        fast128(file->content, file->size, file->state_hash);
+    }
+}
+
+static void load_file_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    FileEntry *file = &((Archive*)ctx)->files[index];
+    if (file->content || !file->source) return;
+    
+    FILE *f = fopen(file->source, "rb");
+    if (!f) return;
+    
+    uint8_t *content = malloc(file->size ? file->size : 1);
+    if (!content) {
+        fclose(f);
+        return;
+    }
+    
+    // The file may have shrunk since it was stat'ed
+    size_t expected = file->size;
+    file->size = fread(content, 1, file->size, f);
+    fclose(f);
+    file->content = content;
+    if (file->size != expected) {
+        file->scan_cached = 0;
+        file->has_sketch = 0;
+    }
+    if (file->scan_cached) {
+        if (!file->digest_cached) compute_digest(file_digest_algo, content, file->size, file->digest);
+        return;
+    }
+    file->type = detect_file_type(content, file->size);
+    
+    // Digest while the bytes are still in cache
+    compute_digest(file_digest_algo, content, file->size, file->digest);
+    file_state_hash(file);
+}
+
+// Read every scanned file in parallel, drop the ones that could not be read
+// and print the listing in scan order
+void load_archive_files(Archive *archive) {
+    pool_run(get_worker_pool(), archive->count, 0, load_file_task, archive);
+    
+    size_t kept = 0;
+    for (size_t i = 0; i < archive->count; i++) {
+        FileEntry *file = &archive->files[i];
+        if (!file->content) {
+            fprintf(stderr, "  Skipped unreadable file: %s\n", file->path);
+            free(file->source);
+            continue;
+        }
+        
+        const char *type_str = "binary";
+        if (file->type == FILE_TYPE_TEXT) type_str = "text";
+        else if (file->type == FILE_TYPE_COMPRESSED) type_str = "compressed";
+        printf("  %s (%.2f MB, %s)\n", file->path, file->size / (1024.0 * 1024.0), type_str);
+        
+        if (kept != i) archive->files[kept] = *file;
+        kept++;
+    }
+    archive->count = kept;
+}
+
 // Path compression
 void compress_paths(Archive *archive) {
     if (archive->count <= 1) return;
@@ -298,572 +1444,9411 @@ void compress_paths(Archive *archive) {
     printf("  Path compression: %zu common prefixes\n", archive->prefix_count);
 }
 
-// Get optimal dictionary size
-size_t get_optimal_dict_size(void) {
-    // Conservative default: 256 MB
-    size_t dict_size = 256 * 1024 * 1024;
+// Monotonic wall clock in milliseconds (for sub-second phase timings)
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+#define FAST_P1 0x9E3779B185EBCA87ULL
+#define FAST_P2 0xC2B2AE3D27D4EB4FULL
+#define FAST_P3 0x165667B19E3779F9ULL
+#define FAST_P4 0x85EBCA77C2B2AE63ULL
+#define FAST_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fast128_round(uint64_t acc, uint64_t v) {
+    return rotl64(acc + v * FAST_P2, 31) * FAST_P1;
+}
+
+// 128-bit non-cryptographic digest: four independent XXH64-style lanes over
+// 32-byte stripes, so the loop runs at memory speed; the lanes are folded
+// into two halves that each see the whole state and the tail
+void fast128(const uint8_t *data, size_t size, uint8_t out[16]) {
+    uint64_t v[4] = { FAST_P1 + FAST_P2, FAST_P2, 0, 0 - FAST_P1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t w;
+            memcpy(&w, data + i + lane * 8, 8);
+            v[lane] = fast128_round(v[lane], w);
+        }
+    }
     
-    // Round to power of 2
-    size_t rounded = 1;
-    while (rounded < dict_size) {
-        rounded <<= 1;
+    uint64_t lo = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+    uint64_t hi = rotl64(v[0], 29) + rotl64(v[1], 37) + rotl64(v[2], 43) + rotl64(v[3], 53);
+    lo ^= (uint64_t)size * FAST_P5;
+    hi += (uint64_t)size * FAST_P4;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        lo = rotl64(lo ^ fast128_round(0, w), 27) * FAST_P1 + FAST_P4;
+        hi = rotl64(hi + w * FAST_P3, 31) * FAST_P2;
     }
-    if (rounded > dict_size) {
-        rounded >>= 1;
+    for (; i < size; i++) {
+        lo = rotl64(lo ^ data[i] * FAST_P5, 11) * FAST_P1;
+        hi = rotl64(hi + data[i] * FAST_P1, 23) * FAST_P3;
     }
-    dict_size = rounded;
     
-    // Clamp between 64 MB and 1536 MB
-    if (dict_size < 64 * 1024 * 1024) {
-        dict_size = 64 * 1024 * 1024;
+    uint64_t a = mix64(lo ^ rotl64(hi, 32));
+    uint64_t b = mix64(hi + a * FAST_P3);
+    for (int k = 0; k < 8; k++) {
+        out[k] = (uint8_t)(a >> (56 - 8 * k));
+        out[8 + k] = (uint8_t)(b >> (56 - 8 * k));
     }
-    if (dict_size > 1536 * 1024 * 1024) {
-        dict_size = 1536 * 1024 * 1024;
+}
+
+size_t digest_length(int algo) {
+    switch (algo) {
+        case DIGEST_FAST128: return 16;
+        case DIGEST_SHA256: return 32;
+        default: return 0;
     }
-    
-    return dict_size;
 }
 
-// LZMA Ultra compression
-uint8_t* compress_lzma_ultra(const uint8_t *data, size_t size, size_t *compressed_size, const char *preset) {
-    lzma_stream strm = LZMA_STREAM_INIT;
-    lzma_options_lzma opt;
-    lzma_filter filters[2];
-    
-    uint32_t preset_level = 9;
-    uint32_t dict_size = 256 * 1024 * 1024; // 256 MB default
-    
-    if (strcmp(preset, "ultra") == 0) {
-        dict_size = get_optimal_dict_size();
-        printf("  Using LZMA with maximum settings...\n");
-        printf("  - Dictionary: %u MB (auto-detected)\n", dict_size / (1024 * 1024));
-    } else if (strncmp(preset, "ultra-", 6) == 0) {
-        dict_size = atoi(preset + 6) * 1024 * 1024;
-        printf("  Using LZMA with custom settings...\n");
-        printf("  - Dictionary: %u MB\n", dict_size / (1024 * 1024));
-    } else if (strcmp(preset, "max") == 0) {
-        dict_size = 256 * 1024 * 1024;
-    } else if (strcmp(preset, "balanced") == 0) {
-        preset_level = 6;
-        dict_size = 128 * 1024 * 1024;
-    } else { // fast
-        preset_level = 3;
-        dict_size = 64 * 1024 * 1024;
-    }
-    
-    printf("  - Match finder: BT4 (best)\n");
-    printf("  - Depth: 273 (maximum)\n");
-    
-    // Initialize LZMA options
-    if (lzma_lzma_preset(&opt, preset_level | LZMA_PRESET_EXTREME)) {
-        return NULL;
+void compute_digest(int algo, const uint8_t *data, size_t size, uint8_t *out) {
+    if (algo == DIGEST_FAST128) {
+        fast128(data, size, out);
+    } else if (algo == DIGEST_SHA256) {
+        EVP_Digest(data, size, out, NULL, EVP_sha256(), NULL);
     }
+}
+
+// One-permutation MinHash over 8-byte shingles. The top bits of each shingle
+// hash select a bin and the bin keeps its minimum, so the cost is one hash per
+// byte regardless of MINHASH_K. Files over SKETCH_MAX_BYTES are sampled in
+// evenly spaced windows.
+void compute_sketch(FileEntry *entry) {
+    entry->has_sketch = 0;
+    if (entry->is_duplicate || entry->size < SHINGLE_LEN) return;
     
-    // Set custom parameters for ultra mode
-    opt.dict_size = dict_size;
-    opt.lc = 3;
-    opt.lp = 0;
-    opt.pb = 2;
-    opt.depth = 273;
-    opt.mf = LZMA_MF_BT4;
-    
-    filters[0].id = LZMA_FILTER_LZMA2;
-    filters[0].options = &opt;
-    filters[1].id = LZMA_VLI_UNKNOWN;
+    uint32_t mins[MINHASH_K];
+    uint8_t filled[MINHASH_K] = {0};
+    for (int k = 0; k < MINHASH_K; k++) mins[k] = UINT32_MAX;
     
-    lzma_ret ret;
-    if (strncmp(preset, "ultra", 5) == 0) {
-        ret = lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC64);
-    } else {
-        ret = lzma_easy_encoder(&strm, preset_level | LZMA_PRESET_EXTREME, LZMA_CHECK_CRC64);
+    size_t windows = 1;
+    size_t window_len = entry->size;
+    size_t stride = 0;
+    if (entry->size > SKETCH_MAX_BYTES) {
+        windows = SKETCH_WINDOWS;
+        window_len = SKETCH_MAX_BYTES / SKETCH_WINDOWS;
+        stride = (entry->size - window_len) / (windows - 1);
     }
     
-    if (ret != LZMA_OK) {
-        fprintf(stderr, "LZMA encoder initialization failed: %d\n", ret);
-        return NULL;
+    for (size_t w = 0; w < windows; w++) {
+        const uint8_t *p = entry->content + w * stride;
+        for (size_t i = 0; i + SHINGLE_LEN <= window_len; i++) {
+            uint64_t v;
+            memcpy(&v, p + i, sizeof(v));
+            uint64_t h = mix64(v);
+            int bin = h >> 58;
+            uint32_t val = (uint32_t)h;
+            if (val < mins[bin]) mins[bin] = val;
+            filled[bin] = 1;
+        }
     }
     
-    // Allocate output buffer
-    size_t out_size = size + 65536;
-    uint8_t *out_buf = malloc(out_size);
-    if (!out_buf) {
-        lzma_end(&strm);
-        return NULL;
+    // Densify empty bins by borrowing from the next filled bin
+    for (int k = 0; k < MINHASH_K; k++) {
+        if (filled[k]) continue;
+        for (int step = 1; step < MINHASH_K; step++) {
+            int j = (k + step) % MINHASH_K;
+            if (filled[j]) {
+                mins[k] = mins[j] + step * 0x9e3779b9u;
+                break;
+            }
+        }
     }
     
-    strm.next_in = data;
-    strm.avail_in = size;
-    strm.next_out = out_buf;
-    strm.avail_out = out_size;
-    
-    ret = lzma_code(&strm, LZMA_FINISH);
-    
-    if (ret != LZMA_STREAM_END) {
-        fprintf(stderr, "LZMA compression failed: %d\n", ret);
-        free(out_buf);
-        lzma_end(&strm);
-        return NULL;
+    memcpy(entry->sketch, mins, sizeof(mins));
+    entry->has_sketch = 1;
+}
+
+// Estimated Jaccard similarity of two sketched files
+double sketch_similarity(const FileEntry *a, const FileEntry *b) {
+    if (!a->has_sketch || !b->has_sketch) return 0.0;
+    int same = 0;
+    for (int k = 0; k < MINHASH_K; k++) {
+        if (a->sketch[k] == b->sketch[k]) same++;
     }
-    
-    *compressed_size = strm.total_out;
-    lzma_end(&strm);
-    
-    return out_buf;
+    return (double)same / MINHASH_K;
 }
 
-// Write big-endian integers
-void write_uint16_be(uint8_t *buf, uint16_t val) {
-    buf[0] = (val >> 8) & 0xFF;
-    buf[1] = val & 0xFF;
+static void sketch_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    FileEntry *file = &((Archive*)ctx)->files[index];
+    if (!file->has_sketch) compute_sketch(file);
 }
 
-void write_uint32_be(uint8_t *buf, uint32_t val) {
-    buf[0] = (val >> 24) & 0xFF;
-    buf[1] = (val >> 16) & 0xFF;
-    buf[2] = (val >> 8) & 0xFF;
-    buf[3] = val & 0xFF;
+static uint64_t lsh_band_key(const FileEntry *file, int band) {
+    uint64_t key = band;
+    for (int r = 0; r < LSH_ROWS; r++) {
+        key = mix64(key ^ file->sketch[band * LSH_ROWS + r]);
+    }
+    return key;
 }
 
-uint16_t read_uint16_be(const uint8_t *buf) {
-    return ((uint16_t)buf[0] << 8) | buf[1];
+static size_t uf_find(size_t *parent, size_t i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
 }
 
-uint32_t read_uint32_be(const uint8_t *buf) {
-    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
-           ((uint32_t)buf[2] << 8) | buf[3];
+static double neighbour_similarity(const Archive *archive, const size_t *order) {
+    size_t pairs = 0;
+    double total = 0.0;
+    for (size_t k = 1; k < archive->count; k++) {
+        const FileEntry *a = &archive->files[order[k - 1]];
+        const FileEntry *b = &archive->files[order[k]];
+        if (!a->has_sketch || !b->has_sketch) continue;
+        total += sketch_similarity(a, b);
+        pairs++;
+    }
+    return pairs ? total / pairs : 0.0;
 }
 
-// Create archive
-int create_archive(const char *input_path, const char *output_file, const char *preset, int checksum) {
-    printf("Phase 1: Scanning and analyzing files...\n");
-    time_t start_time = time(NULL);
+// Compress the first CLUSTER_PROBE_BYTES of the content stream in the given
+// order with a small-dictionary preset and return the ratio in percent.
+static double probe_order_ratio(const Archive *archive, const size_t *order) {
+    size_t probe_size = 0;
+    for (size_t k = 0; k < archive->count && probe_size < CLUSTER_PROBE_BYTES; k++) {
+        probe_size += archive->files[order[k]].size;
+    }
+    if (probe_size > CLUSTER_PROBE_BYTES) probe_size = CLUSTER_PROBE_BYTES;
+    if (probe_size == 0) return 100.0;
     
-    Archive *archive = archive_create();
-    if (!archive) {
-        fprintf(stderr, "Failed to create archive structure\n");
-        return -1;
+    uint8_t *buf = malloc(probe_size);
+    size_t out_cap = lzma_stream_buffer_bound(probe_size);
+    uint8_t *out = malloc(out_cap);
+    if (!buf || !out) {
+        free(buf);
+        free(out);
+        return 100.0;
     }
     
-    // Check if input is a file or directory
-    struct stat input_st;
-    if (stat(input_path, &input_st) != 0) {
-        fprintf(stderr, "Cannot access: %s\n", input_path);
-        archive_free(archive);
-        return -1;
+    size_t filled = 0;
+    for (size_t k = 0; k < archive->count && filled < probe_size; k++) {
+        const FileEntry *file = &archive->files[order[k]];
+        size_t n = file->size;
+        if (n > probe_size - filled) n = probe_size - filled;
+        if (!file->is_duplicate && n > 0) memcpy(buf + filled, file->content, n);
+        filled += n;
     }
     
-    if (S_ISREG(input_st.st_mode)) {
-        // Single file
-        printf("Compressing single file: %s\n", input_path);
+    size_t out_pos = 0;
+    double ratio = 100.0;
+    if (lzma_easy_buffer_encode(1, LZMA_CHECK_NONE, NULL, buf, filled,
+                                out, &out_pos, out_cap) == LZMA_OK) {
+        ratio = (double)out_pos / filled * 100.0;
+    }
+    free(buf);
+    free(out);
+    return ratio;
+}
+
+// Reorder archive->files so that near-duplicate files sit next to each other
+// in the solid stream. Candidate pairs come from LSH buckets (LSH_BANDS bands
+// of LSH_ROWS sketch values) and are confirmed against the full sketch.
+// Clusters are emitted at the position of their first member.
+void cluster_files(Archive *archive, ClusterStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t n = archive->count;
+    if (n < 2) return;
+    
+    double start = now_ms();
+    pool_run(get_worker_pool(), n, 0, sketch_task, archive);
+    for (size_t i = 0; i < n; i++) {
+        size_t sketched = archive->files[i].size;
+        if (sketched > SKETCH_MAX_BYTES) sketched = SKETCH_MAX_BYTES;
+        stats->sketch_mb += sketched / (1024.0 * 1024.0);
+    }
+    stats->sketch_ms = now_ms() - start;
+    
+    size_t table_size = 1;
+    while (table_size < n * 2) table_size <<= 1;
+    
+    size_t *parent = malloc(sizeof(size_t) * n);
+    size_t *order = malloc(sizeof(size_t) * n);
+    size_t *next = malloc(sizeof(size_t) * n);
+    size_t *head = malloc(sizeof(size_t) * n);
+    size_t *slots = malloc(sizeof(size_t) * table_size);
+    uint64_t *keys = malloc(sizeof(uint64_t) * table_size);
+    if (!parent || !order || !next || !head || !slots || !keys) {
+        free(parent); free(order); free(next); free(head); free(slots); free(keys);
+        return;
+    }
+    
+    for (size_t i = 0; i < n; i++) parent[i] = i;
+    
+    for (int band = 0; band < LSH_BANDS; band++) {
+        for (size_t s = 0; s < table_size; s++) slots[s] = SIZE_MAX;
         
-        FILE *f = fopen(input_path, "rb");
-        if (!f) {
-            fprintf(stderr, "Cannot open file: %s\n", input_path);
-            archive_free(archive);
-            return -1;
+        for (size_t i = 0; i < n; i++) {
+            const FileEntry *file = &archive->files[i];
+            if (!file->has_sketch) continue;
+            
+            uint64_t key = lsh_band_key(file, band);
+            size_t slot = key & (table_size - 1);
+            while (slots[slot] != SIZE_MAX && keys[slot] != key) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            if (slots[slot] == SIZE_MAX) {
+                slots[slot] = i;
+                keys[slot] = key;
+                continue;
+            }
+            
+            size_t a = uf_find(parent, i);
+            size_t b = uf_find(parent, slots[slot]);
+            if (a != b && sketch_similarity(file, &archive->files[slots[slot]]) >= CLUSTER_MIN_SIMILARITY) {
+                // Keep the earliest file as root so clusters stay in scan order
+                if (a < b) parent[b] = a; else parent[a] = b;
+            }
         }
-        
-        fseek(f, 0, SEEK_END);
-        long file_size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        
-        uint8_t *content = malloc(file_size);
-        if (!content) {
-            fclose(f);
-            archive_free(archive);
-            return -1;
+    }
+    
+    // Chain cluster members in scan order, then emit each chain at its root
+    for (size_t i = 0; i < n; i++) head[i] = SIZE_MAX;
+    size_t *cluster_size = slots; // reuse: table_size >= n
+    for (size_t i = 0; i < n; i++) cluster_size[i] = 0;
+    for (size_t i = n; i-- > 0;) {
+        size_t r = uf_find(parent, i);
+        next[i] = head[r];
+        head[r] = i;
+        cluster_size[r]++;
+    }
+    
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t r = uf_find(parent, i);
+        if (head[r] == SIZE_MAX) continue;
+        if (cluster_size[r] > 1) {
+            stats->clusters++;
+            stats->clustered_files += cluster_size[r];
         }
-        
-        fread(content, 1, file_size, f);
-        fclose(f);
-        
-        // Get just the filename (no path)
-        const char *filename = strrchr(input_path, '/');
-        if (filename) {
-            filename++; // Skip the '/'
-        } else {
-            filename = input_path;
+        for (size_t j = head[r]; j != SIZE_MAX; j = next[j]) {
+            order[k++] = j;
         }
+        head[r] = SIZE_MAX;
+    }
+    
+    for (size_t i = 0; i < n; i++) next[i] = i; // identity order
+    stats->similarity_before = neighbour_similarity(archive, next);
+    stats->similarity_after = neighbour_similarity(archive, order);
+    
+    if (stats->clusters > 0) {
+        double probe_start = now_ms();
+        stats->probe_ratio_before = probe_order_ratio(archive, next);
+        stats->probe_ratio_after = probe_order_ratio(archive, order);
+        stats->probe_ms = now_ms() - probe_start;
         
-        archive_add_file(archive, filename, content, file_size);
-        
-        double size_mb = file_size / (1024.0 * 1024.0);
-        FileType type = detect_file_type(content, file_size);
-        const char *type_str = "binary";
-        if (type == FILE_TYPE_TEXT) type_str = "text";
-        else if (type == FILE_TYPE_COMPRESSED) type_str = "compressed";
-        
-        printf("  %s (%.2f MB, %s)\n", filename, size_mb, type_str);
-        
-    } else if (S_ISDIR(input_st.st_mode)) {
-        // Directory
-        if (scan_directory(input_path, input_path, archive) != 0) {
-            archive_free(archive);
-            return -1;
+        // Apply the permutation in place, one cycle at a time
+        FileEntry *temp = malloc(sizeof(FileEntry));
+        uint8_t *placed = calloc(n, 1);
+        if (temp && placed) {
+            for (size_t start_pos = 0; start_pos < n; start_pos++) {
+                if (placed[start_pos] || order[start_pos] == start_pos) continue;
+                *temp = archive->files[start_pos];
+                size_t j = start_pos;
+                while (order[j] != start_pos) {
+                    archive->files[j] = archive->files[order[j]];
+                    placed[j] = 1;
+                    j = order[j];
+                }
+                archive->files[j] = *temp;
+                placed[j] = 1;
+            }
         }
-    } else {
-        fprintf(stderr, "Input must be a regular file or directory: %s\n", input_path);
-        archive_free(archive);
-        return -1;
+        free(temp);
+        free(placed);
     }
     
-    time_t scan_time = time(NULL) - start_time;
-    
-    // Calculate statistics
-    size_t total_size = 0;
-    int text_files = 0, binary_files = 0, compressed_files = 0;
+    printf("  Sketched %.2f MB in %.0f ms (%.0f MB/s)\n", stats->sketch_mb, stats->sketch_ms,
+           stats->sketch_ms > 0 ? stats->sketch_mb / (stats->sketch_ms / 1000.0) : 0.0);
+    printf("  Clusters: %zu (%zu files)\n", stats->clusters, stats->clustered_files);
+    printf("  Neighbour similarity: %.1f%% -> %.1f%%\n",
+           stats->similarity_before * 100.0, stats->similarity_after * 100.0);
     
-    for (size_t i = 0; i < archive->count; i++) {
-        total_size += archive->files[i].size;
-        switch (archive->files[i].type) {
-            case FILE_TYPE_TEXT: text_files++; break;
-            case FILE_TYPE_BINARY: binary_files++; break;
-            case FILE_TYPE_COMPRESSED: compressed_files++; break;
-            default: break;
+    free(parent); free(order); free(next); free(head); free(slots); free(keys);
+}
+
+// LEB128-style variable-length integers used by the patch format
+size_t write_varint(uint8_t *buf, uint64_t val) {
+    size_t n = 0;
+    while (val >= 0x80) {
+        buf[n++] = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+    buf[n++] = (uint8_t)val;
+    return n;
+}
+
+size_t read_varint(const uint8_t *buf, size_t avail, uint64_t *val) {
+    uint64_t result = 0;
+    for (size_t n = 0; n < avail && n < 10; n++) {
+        result |= (uint64_t)(buf[n] & 0x7F) << (7 * n);
+        if (!(buf[n] & 0x80)) {
+            *val = result;
+            return n + 1;
         }
     }
+    return 0;
+}
+
+static uint64_t delta_block_hash(const uint8_t *p) {
+    uint64_t a, b;
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    return mix64(a ^ mix64(b));
+}
+
+static size_t delta_emit_add(uint8_t *out, const uint8_t *lit, size_t len) {
+    size_t n = 0;
+    out[n++] = DELTA_OP_ADD;
+    n += write_varint(out + n, len);
+    memcpy(out + n, lit, len);
+    return n + len;
+}
+
+// Encode target as a sequence of COPY(base offset, length) and ADD(bytes)
+// operations, xdelta-style. The base is indexed every DELTA_BLOCK bytes and
+// matches are extended in both directions. Returns NULL if the patch would
+// exceed max_patch bytes.
+uint8_t* delta_encode(const uint8_t *base, size_t base_size, const uint8_t *target, size_t target_size,
+                      size_t max_patch, size_t *patch_size) {
+    if (base_size < DELTA_BLOCK || target_size < DELTA_BLOCK || base_size > UINT32_MAX) return NULL;
     
-    printf("\n✓ Analysis complete (%lds)\n", scan_time);
-    printf("  Files: %zu (%d text, %d binary, %d pre-compressed)\n",
-           archive->count, text_files, binary_files, compressed_files);
-    printf("  Total size: %.2f MB\n", total_size / (1024.0 * 1024.0));
-    
-    // Compress paths
-    printf("\nPhase 2: Path compression...\n");
-    compress_paths(archive);
+    size_t blocks = base_size / DELTA_BLOCK;
+    size_t table_size = 1;
+    while (table_size < blocks * 2) table_size <<= 1;
     
-    // Create binary format
-    printf("\nPhase 3: Creating binary format...\n");
+    uint32_t *table = malloc(sizeof(uint32_t) * table_size);
+    // Worst case for a run that stays under max_patch: one literal op header
+    uint8_t *out = malloc(max_patch + 32);
+    if (!table || !out) {
+        free(table);
+        free(out);
+        return NULL;
+    }
+    for (size_t i = 0; i < table_size; i++) table[i] = UINT32_MAX;
     
-    size_t binary_capacity = total_size + archive->count * 1024;
-    uint8_t *binary_data = malloc(binary_capacity);
-    if (!binary_data) {
-        archive_free(archive);
-        return -1;
+    for (size_t b = 0; b < blocks; b++) {
+        size_t slot = delta_block_hash(base + b * DELTA_BLOCK) & (table_size - 1);
+        if (table[slot] == UINT32_MAX) table[slot] = b * DELTA_BLOCK;
     }
     
-    size_t offset = 0;
+    size_t out_pos = 0;
+    size_t lit_start = 0;
+    size_t i = 0;
     
-    // Write prefixes
-    write_uint16_be(binary_data + offset, archive->prefix_count);
-    offset += 2;
+    while (i + DELTA_BLOCK <= target_size) {
+        uint32_t cand = table[delta_block_hash(target + i) & (table_size - 1)];
+        if (cand == UINT32_MAX || memcmp(base + cand, target + i, DELTA_BLOCK) != 0) {
+            i++;
+            continue;
+        }
+        
+        size_t match_base = cand;
+        size_t match_start = i;
+        while (match_start > lit_start && match_base > 0 &&
+               base[match_base - 1] == target[match_start - 1]) {
+            match_base--;
+            match_start--;
+        }
+        size_t match_len = i - match_start + DELTA_BLOCK;
+        while (match_base + match_len < base_size && match_start + match_len < target_size &&
+               base[match_base + match_len] == target[match_start + match_len]) {
+            match_len++;
+        }
+        
+        size_t lit_len = match_start - lit_start;
+        if (out_pos + lit_len + 32 > max_patch) {
+            free(table);
+            free(out);
+            return NULL;
+        }
+        if (lit_len > 0) {
+            out_pos += delta_emit_add(out + out_pos, target + lit_start, lit_len);
+        }
+        out[out_pos++] = DELTA_OP_COPY;
+        out_pos += write_varint(out + out_pos, match_base);
+        out_pos += write_varint(out + out_pos, match_len);
+        
+        i = match_start + match_len;
+        lit_start = i;
+    }
     
-    for (size_t i = 0; i < archive->prefix_count; i++) {
-        size_t prefix_len = strlen(archive->prefixes[i].prefix);
-        write_uint16_be(binary_data + offset, prefix_len);
-        offset += 2;
-        memcpy(binary_data + offset, archive->prefixes[i].prefix, prefix_len);
-        offset += prefix_len;
+    size_t lit_len = target_size - lit_start;
+    if (out_pos + lit_len + 16 > max_patch) {
+        free(table);
+        free(out);
+        return NULL;
+    }
+    if (lit_len > 0) {
+        out_pos += delta_emit_add(out + out_pos, target + lit_start, lit_len);
     }
     
-    // Write files
-    write_uint32_be(binary_data + offset, archive->count);
-    offset += 4;
+    free(table);
+    *patch_size = out_pos;
+    return out;
+}
+
+// Rebuild a delta-encoded file. Returns 0 on success, -1 on a malformed patch.
+int delta_apply(const uint8_t *base, size_t base_size, const uint8_t *patch, size_t patch_size,
+                uint8_t *out, size_t out_size) {
+    size_t pos = 0;
+    size_t out_pos = 0;
     
-    for (size_t i = 0; i < archive->count; i++) {
-        FileEntry *file = &archive->files[i];
-        
-        size_t path_len = strlen(file->path);
-        write_uint16_be(binary_data + offset, path_len);
-        offset += 2;
-        memcpy(binary_data + offset, file->path, path_len);
-        offset += path_len;
+    while (pos < patch_size) {
+        uint8_t op = patch[pos++];
+        uint64_t a, b;
+        size_t n = read_varint(patch + pos, patch_size - pos, &a);
+        if (n == 0) return -1;
+        pos += n;
         
-        if (file->is_duplicate) {
-            write_uint32_be(binary_data + offset, 0xFFFFFFFF);
-            offset += 4;
-            size_t dup_len = strlen(file->duplicate_of);
-            write_uint16_be(binary_data + offset, dup_len);
-            offset += 2;
-            memcpy(binary_data + offset, file->duplicate_of, dup_len);
-            offset += dup_len;
+        if (op == DELTA_OP_ADD) {
+            if (a > patch_size - pos || a > out_size - out_pos) return -1;
+            memcpy(out + out_pos, patch + pos, a);
+            pos += a;
+            out_pos += a;
+        } else if (op == DELTA_OP_COPY) {
+            n = read_varint(patch + pos, patch_size - pos, &b);
+            if (n == 0) return -1;
+            pos += n;
+            if (a > base_size || b > base_size - a || b > out_size - out_pos) return -1;
+            memcpy(out + out_pos, base + a, b);
+            out_pos += b;
         } else {
-            write_uint32_be(binary_data + offset, file->size);
-            offset += 4;
-            memcpy(binary_data + offset, file->content, file->size);
-            offset += file->size;
+            return -1;
         }
     }
     
-    size_t original_size = offset;
-    printf("✓ Binary format: %.2f MB\n", original_size / (1024.0 * 1024.0));
+    return out_pos == out_size ? 0 : -1;
+}
+
+// Choose a base for each file among earlier full-content files that share an
+// LSH bucket with it, and keep the patch when it is at most DELTA_MAX_RATIO
+// of the file. Bases are always full-content records so the extractor can
+// rebuild every delta in a single pass.
+void delta_encode_files(Archive *archive, DeltaStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t n = archive->count;
+    if (n < 2) return;
     
-    // Compress
-    printf("\nPhase 4: Ultra compression (preset: %s)...\n", preset);
-    time_t compress_start = time(NULL);
+    double start = now_ms();
+    pool_run(get_worker_pool(), n, 0, sketch_task, archive);
     
-    size_t compressed_size;
-    uint8_t *compressed_data = compress_lzma_ultra(binary_data, original_size, &compressed_size, preset);
+    size_t table_size = 1;
+    while (table_size < n * 2) table_size <<= 1;
+    size_t *slots = malloc(sizeof(size_t) * table_size * LSH_BANDS);
+    uint64_t *keys = malloc(sizeof(uint64_t) * table_size * LSH_BANDS);
+    if (!slots || !keys) {
+        free(slots);
+        free(keys);
+        return;
+    }
+    for (size_t s = 0; s < table_size * LSH_BANDS; s++) slots[s] = SIZE_MAX;
     
-    if (!compressed_data) {
-        free(binary_data);
-        archive_free(archive);
-        return -1;
+    for (size_t i = 0; i < n; i++) {
+        FileEntry *file = &archive->files[i];
+        if (!file->has_sketch) continue;
+        
+        uint64_t band_keys[LSH_BANDS];
+        size_t best = SIZE_MAX;
+        double best_sim = DELTA_MIN_SIMILARITY;
+        
+        for (int band = 0; band < LSH_BANDS; band++) {
+            band_keys[band] = lsh_band_key(file, band);
+            size_t *band_slots = slots + band * table_size;
+            uint64_t *band_key_tab = keys + band * table_size;
+            size_t slot = band_keys[band] & (table_size - 1);
+            while (band_slots[slot] != SIZE_MAX) {
+                if (band_key_tab[slot] == band_keys[band]) {
+                    double sim = sketch_similarity(file, &archive->files[band_slots[slot]]);
+                    if (sim >= best_sim) {
+                        best_sim = sim;
+                        best = band_slots[slot];
+                    }
+                    break;
+                }
+                slot = (slot + 1) & (table_size - 1);
+            }
+        }
+        
+        if (best != SIZE_MAX) {
+            FileEntry *base = &archive->files[best];
+            size_t patch_size;
+            uint8_t *patch = delta_encode(base->content, base->size, file->content, file->size,
+                                          (size_t)(file->size * DELTA_MAX_RATIO), &patch_size);
+            if (patch) {
+                file->is_delta = 1;
+                file->delta_base = best;
+                file->patch = patch;
+                file->patch_size = patch_size;
+                stats->delta_files++;
+                stats->target_bytes += file->size;
+                stats->patch_bytes += patch_size;
+                continue;
+            }
+        }
+        
+        // Still a full-content file: make it (the latest) candidate in its buckets
+        for (int band = 0; band < LSH_BANDS; band++) {
+            size_t *band_slots = slots + band * table_size;
+            uint64_t *band_key_tab = keys + band * table_size;
+            size_t slot = band_keys[band] & (table_size - 1);
+            while (band_slots[slot] != SIZE_MAX && band_key_tab[slot] != band_keys[band]) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            band_slots[slot] = i;
+            band_key_tab[slot] = band_keys[band];
+        }
     }
     
-    time_t compress_time = time(NULL) - compress_start;
-    double compression_ratio = (double)compressed_size / original_size * 100.0;
+    free(slots);
+    free(keys);
+    stats->encode_ms = now_ms() - start;
     
-    printf("✓ Compressed in %lds\n", compress_time);
-    printf("  Size: %.2f MB (%.1f%%)\n", compressed_size / (1024.0 * 1024.0), compression_ratio);
+    printf("  Delta members: %zu (%.2f MB -> %.2f MB of patches, %.0f ms)\n",
+           stats->delta_files, stats->target_bytes / (1024.0 * 1024.0),
+           stats->patch_bytes / (1024.0 * 1024.0), stats->encode_ms);
+}
+
+// Fast 64-bit content hash (8 bytes per step); equal hashes are always
+// confirmed with memcmp before two chunks are treated as identical
+uint64_t hash_bytes(const uint8_t *data, size_t size, uint64_t seed) {
+    uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        h = (h ^ mix64(v)) * 0x9fb21c651e98df25ULL;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    return mix64(h ^ tail);
+}
+
+static uint64_t gear_table[256];
+
+static void gear_table_init(void) {
+    if (gear_table[0] != 0) return;
+    for (int i = 0; i < 256; i++) {
+        gear_table[i] = mix64(0x6a09e667f3bcc909ULL + i);
+    }
+}
+
+// FastCDC: gear rolling hash, no cut before avg/4, a stricter mask until the
+// average size and a looser one after it, forced cut at avg*8
+size_t cdc_next_boundary(const uint8_t *data, size_t size, size_t avg) {
+    size_t min_size = avg / 4;
+    size_t max_size = avg * 8;
+    if (size <= min_size) return size;
+    if (size > max_size) size = max_size;
     
-    // Calculate checksum
-    uint8_t flags = FLAG_PATH_COMPRESSED;
-    uint8_t sha256_hash[32] = {0};
+    int bits = 0;
+    while (((size_t)1 << (bits + 1)) <= avg) bits++;
+    uint64_t mask_s = ~(UINT64_MAX >> (bits + 2));
+    uint64_t mask_l = ~(UINT64_MAX >> (bits - 2));
     
-    if (checksum) {
-        printf("\nPhase 5: Calculating checksum...\n");
-        SHA256(compressed_data, compressed_size, sha256_hash);
-        flags |= FLAG_CHECKSUMMED;
+    size_t normal = avg < size ? avg : size;
+    uint64_t h = 0;
+    size_t i = min_size;
+    for (; i < normal; i++) {
+        h = (h << 1) + gear_table[data[i]];
+        if (!(h & mask_s)) return i + 1;
+    }
+    for (; i < size; i++) {
+        h = (h << 1) + gear_table[data[i]];
+        if (!(h & mask_l)) return i + 1;
+    }
+    return size;
+}
+
+static int chunk_store_add(Archive *archive, const uint8_t *data, uint32_t len, uint64_t hash) {
+    if (archive->chunk_count >= archive->chunk_capacity) {
+        size_t new_capacity = archive->chunk_capacity ? archive->chunk_capacity * 2 : 4096;
+        Chunk *new_chunks = realloc(archive->chunks, sizeof(Chunk) * new_capacity);
+        if (!new_chunks) return -1;
+        archive->chunks = new_chunks;
+        archive->chunk_capacity = new_capacity;
     }
+    archive->chunks[archive->chunk_count].data = data;
+    archive->chunks[archive->chunk_count].len = len;
+    archive->chunks[archive->chunk_count].hash = hash;
+    archive->chunk_count++;
+    return 0;
+}
+
+typedef struct {
+    uint32_t *lens;
+    uint64_t *hashes;
+    size_t count;
+} ChunkCuts;
+
+typedef struct {
+    Archive *archive;
+    ChunkCuts *cuts;
+    size_t avg;
+} ChunkCutJob;
+
+// Cut one file and hash its chunks; runs on the worker pool
+static void chunk_cut_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    ChunkCutJob *job = ctx;
+    FileEntry *file = &job->archive->files[index];
+    ChunkCuts *cuts = &job->cuts[index];
+    if (file->is_duplicate || file->is_delta || file->size == 0) return;
     
-    // Build archive
-    printf("\nPhase 6: Writing archive...\n");
+    size_t capacity = file->size / (job->avg / 4) + 2;
+    cuts->lens = malloc(sizeof(uint32_t) * capacity);
+    cuts->hashes = malloc(sizeof(uint64_t) * capacity);
+    if (!cuts->lens || !cuts->hashes) {
+        free(cuts->lens);
+        free(cuts->hashes);
+        cuts->lens = NULL;
+        cuts->hashes = NULL;
+        return;
+    }
     
-    FILE *out = fopen(output_file, "wb");
-    if (!out) {
-        fprintf(stderr, "Cannot create output file: %s\n", output_file);
-        free(compressed_data);
+    size_t pos = 0;
+    while (pos < file->size) {
+        size_t len = cdc_next_boundary(file->content + pos, file->size - pos, job->avg);
+        cuts->lens[cuts->count] = len;
+        cuts->hashes[cuts->count] = hash_bytes(file->content + pos, len, 0);
+        cuts->count++;
+        pos += len;
+    }
+}
+
+// Split every full-content file into content-defined chunks and represent it
+// as a list of chunk ids. Cutting and hashing run per file on the worker
+// pool; the dedup table is then filled in stream order. Each unique chunk is
+// stored once, inline at its first occurrence, so the solid stream keeps the
+// original byte order. Writing relies on chunk ids being handed out in that
+// order, so if a file cannot be chunked the store is rolled back to where the
+// file started and the remaining files are left whole.
+void chunk_files(Archive *archive, size_t avg, ChunkStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    gear_table_init();
+    
+    size_t table_size = 1 << 16;
+    uint32_t *table = malloc(sizeof(uint32_t) * table_size);
+    ChunkCuts *all_cuts = calloc(archive->count ? archive->count : 1, sizeof(ChunkCuts));
+    if (!table || !all_cuts) {
+        free(table);
+        free(all_cuts);
+        return;
+    }
+    for (size_t i = 0; i < table_size; i++) table[i] = CHUNK_NEW;
+    
+    double start = now_ms();
+    
+    ChunkCutJob job = { archive, all_cuts, avg };
+    pool_run(get_worker_pool(), archive->count, 0, chunk_cut_task, &job);
+    
+    for (size_t f = 0; f < archive->count; f++) {
+        FileEntry *file = &archive->files[f];
+        ChunkCuts *cuts = &all_cuts[f];
+        if (!cuts->lens) continue;
+        
+        uint32_t *refs = malloc(sizeof(uint32_t) * cuts->count);
+        if (!refs) continue;
+        
+        size_t first_chunk = archive->chunk_count, unique_bytes = 0;
+        size_t pos = 0;
+        size_t c;
+        for (c = 0; c < cuts->count; c++) {
+            size_t len = cuts->lens[c];
+            const uint8_t *data = file->content + pos;
+            uint64_t h = cuts->hashes[c];
+            
+            size_t slot = h & (table_size - 1);
+            uint32_t id = CHUNK_NEW;
+            while (table[slot] != CHUNK_NEW) {
+                Chunk *existing = &archive->chunks[table[slot]];
+                if (existing->hash == h && existing->len == len && memcmp(existing->data, data, len) == 0) {
+                    id = table[slot];
+                    break;
+                }
+                slot = (slot + 1) & (table_size - 1);
+            }
+            
+            if (id == CHUNK_NEW) {
+                id = archive->chunk_count;
+                if (chunk_store_add(archive, data, len, h) != 0) break;
+                table[slot] = id;
+                unique_bytes += len;
+                
+                // Keep the table at most half full; a table that cannot grow
+                // would eventually fill up, so that ends chunking too
+                if (archive->chunk_count * 2 > table_size) {
+                    size_t new_size = table_size * 2;
+                    uint32_t *new_table = malloc(sizeof(uint32_t) * new_size);
+                    if (!new_table) break;
+                    for (size_t i = 0; i < new_size; i++) new_table[i] = CHUNK_NEW;
+                    for (uint32_t k = 0; k < archive->chunk_count; k++) {
+                        size_t s2 = archive->chunks[k].hash & (new_size - 1);
+                        while (new_table[s2] != CHUNK_NEW) s2 = (s2 + 1) & (new_size - 1);
+                        new_table[s2] = k;
+                    }
+                    free(table);
+                    table = new_table;
+                    table_size = new_size;
+                }
+            }
+            
+            refs[c] = id;
+            pos += len;
+        }
+        
+        if (c < cuts->count) {
+            // The table may still name the dropped chunks, so stop here
+            archive->chunk_count = first_chunk;
+            free(refs);
+            fprintf(stderr, "Out of memory while chunking %s; it and the remaining files are stored whole\n",
+                    file->path);
+            break;
+        }
+        file->chunk_refs = refs;
+        file->chunk_count = cuts->count;
+        stats->files++;
+        stats->input_bytes += file->size;
+        stats->total_chunks += cuts->count;
+        stats->unique_bytes += unique_bytes;
+    }
+    
+    for (size_t f = 0; f < archive->count; f++) {
+        free(all_cuts[f].lens);
+        free(all_cuts[f].hashes);
+    }
+    free(all_cuts);
+    free(table);
+    stats->chunk_ms = now_ms() - start;
+    stats->unique_chunks = archive->chunk_count;
+    
+    double input_mb = stats->input_bytes / (1024.0 * 1024.0);
+    printf("  Chunked %.2f MB in %.0f ms (%.0f MB/s, avg chunk %zu bytes)\n", input_mb, stats->chunk_ms,
+           stats->chunk_ms > 0 ? input_mb / (stats->chunk_ms / 1000.0) : 0.0, avg);
+    printf("  Chunks: %zu total, %zu unique (dedup ratio %.2fx)\n", stats->total_chunks,
+           stats->unique_chunks, stats->unique_bytes ? (double)stats->input_bytes / stats->unique_bytes : 1.0);
+}
+
+// Memory the member filters may use, set by create from its --mem-limit
+// plan (no limit otherwise). At most filter_workers files are filtered at
+// once (0 = every worker), each with buffers of at most filter_worker_bytes,
+// and the bodies kept for the payload take at most filter_body_budget in
+// all. A file that does not fit is stored as it is and counted in
+// filter_over_limit.
+static size_t filter_worker_bytes = SIZE_MAX;
+static int filter_workers = 0;
+static size_t filter_body_budget = SIZE_MAX;
+static atomic_size_t filter_body_held;
+static atomic_size_t filter_over_limit;
+
+static void set_filter_limits(size_t worker_bytes, int workers, size_t body_budget) {
+    filter_worker_bytes = worker_bytes;
+    filter_workers = workers;
+    filter_body_budget = body_budget;
+    atomic_store(&filter_body_held, 0);
+    atomic_store(&filter_over_limit, 0);
+}
+
+// Claim room for a kept body of size bytes; 0 if the budget is used up
+static int filter_keep_body(size_t size) {
+    size_t held = atomic_load(&filter_body_held);
+    do {
+        if (size > filter_body_budget - held) {
+            atomic_fetch_add(&filter_over_limit, 1);
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&filter_body_held, &held, held + size));
+    return 1;
+}
+
+// Deflate recompression (--precomp). A file becomes a list of segments:
+// literal bytes, or a deflate stream stored inflated together with the zlib
+// parameters that re-create it bit-exactly.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+    size_t limit;               // capacity body_put may grow to, 0 = no limit
+} PrecompBody;
+
+typedef struct {
+    Archive *archive;
+    atomic_size_t streams;
+    atomic_size_t recreated;
+    atomic_size_t deflated_bytes;
+    atomic_size_t inflated_bytes;
+} PrecompJob;
+
+static void body_put(PrecompBody *body, const void *data, size_t len) {
+    if (body->failed) return;
+    if (body->size + len > body->capacity) {
+        size_t capacity = body->capacity ? body->capacity : 4096;
+        while (capacity < body->size + len) capacity *= 2;
+        uint8_t *grown = !body->limit || capacity <= body->limit ? realloc(body->data, capacity) : NULL;
+        if (!grown) {
+            body->failed = 1;
+            return;
+        }
+        body->data = grown;
+        body->capacity = capacity;
+    }
+    memcpy(body->data + body->size, data, len);
+    body->size += len;
+}
+
+static void body_put_u32(PrecompBody *body, uint32_t val) {
+    uint8_t buf[4];
+    write_uint32_be(buf, val);
+    body_put(body, buf, 4);
+}
+
+static void body_put_literal(PrecompBody *body, const uint8_t *data, size_t len) {
+    if (len == 0) return;
+    uint8_t kind = PRECOMP_LITERAL;
+    body_put(body, &kind, 1);
+    body_put_u32(body, len);
+    body_put(body, data, len);
+}
+
+// Inflate the stream at in, giving up past max_out bytes; *consumed is the
+// deflate stream's own length
+static uint8_t *precomp_inflate(const uint8_t *in, size_t in_size, int wbits, size_t max_out, size_t *out_size,
+                                size_t *consumed) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (in_size > UINT32_MAX || inflateInit2(&zs, wbits) != Z_OK) return NULL;
+    // in_size is all that follows the stream's start, often far more than the stream
+    size_t capacity = in_size < 256 * 1024 ? in_size * 4 + 4096 : 1024 * 1024;
+    if (capacity > max_out) capacity = max_out;
+    uint8_t *out = malloc(capacity);
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = in_size;
+    int ret = Z_OK;
+    while (out && ret == Z_OK) {
+        if (zs.total_out == capacity) {
+            capacity *= 2;
+            uint8_t *grown = capacity <= max_out ? realloc(out, capacity) : NULL;
+            if (!grown) break;
+            out = grown;
+        }
+        zs.next_out = out + zs.total_out;
+        zs.avail_out = capacity - zs.total_out;
+        ret = inflate(&zs, Z_NO_FLUSH);
+    }
+    *out_size = zs.total_out;
+    *consumed = zs.total_in;
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Does deflate with these parameters reproduce stream exactly? The output
+// is compared as it is produced, so a wrong guess usually stops within the
+// first few KB.
+static int deflate_matches(const uint8_t *raw, size_t raw_size, const uint8_t *stream, size_t stream_size,
+                           int level, int wbits, int mem_level, int strategy) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, wbits, mem_level, strategy) != Z_OK) return 0;
+    uint8_t out[16384];
+    size_t produced = 0;
+    int ok = 1, ret;
+    zs.next_in = (Bytef *)raw;
+    zs.avail_in = raw_size;
+    do {
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        ret = deflate(&zs, Z_FINISH);
+        size_t n = sizeof(out) - zs.avail_out;
+        if (produced + n > stream_size || memcmp(out, stream + produced, n) != 0) {
+            ok = 0;
+            break;
+        }
+        produced += n;
+    } while (ret == Z_OK);
+    deflateEnd(&zs);
+    return ok && ret == Z_STREAM_END && produced == stream_size;
+}
+
+// Try to re-create one deflate stream (raw, or zlib-wrapped for PNG) and on
+// success append its segment. chunks/nchunks describe how a PNG stream is
+// split over IDAT chunks.
+static int precomp_stream(PrecompJob *job, PrecompBody *body, int kind, const uint8_t *stream, size_t avail,
+                          const uint32_t *chunks, uint32_t nchunks, size_t *consumed) {
+    int wbits = 15;
+    if (kind == PRECOMP_PNG) {
+        if (avail < 2 || (stream[0] & 0x0F) != Z_DEFLATED || (stream[0] >> 4) > 7) return 0;
+        wbits = (stream[0] >> 4) + 8;
+    }
+    // Under a body limit, more inflated bytes than the body may take are no use
+    size_t max_raw = body->limit && body->limit < PRECOMP_MAX_INFLATED ? body->limit : PRECOMP_MAX_INFLATED;
+    size_t raw_size;
+    uint8_t *raw = precomp_inflate(stream, avail, kind == PRECOMP_PNG ? wbits : -wbits, max_raw, &raw_size, consumed);
+    if (!raw) return 0;
+    if (*consumed < PRECOMP_MIN_STREAM || (kind == PRECOMP_PNG && *consumed != avail)) {
+        free(raw);
+        return 0;
+    }
+    atomic_fetch_add(&job->streams, 1);
+    
+    // zlib's own level order of likelihood; libpng favours Z_FILTERED
+    static const int levels[] = { 6, 9, 1, 5, 4, 3, 2, 7, 8 };
+    static const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED };
+    int found = 0;
+    uint8_t params[4];
+    for (int s = 0; s < 2 && !found; s++) {
+        for (int m = 8; m <= 9 && !found; m++) {
+            for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]) && !found; l++) {
+                if (deflate_matches(raw, raw_size, stream, *consumed, levels[l],
+                                    kind == PRECOMP_PNG ? wbits : -wbits, m, strategies[s])) {
+                    params[0] = levels[l];
+                    params[1] = m;
+                    params[2] = strategies[s];
+                    params[3] = wbits;
+                    found = 1;
+                }
+            }
+        }
+    }
+    if (found) {
+        uint8_t k = kind;
+        body_put(body, &k, 1);
+        body_put(body, params, 4);
+        body_put_u32(body, *consumed);
+        body_put_u32(body, raw_size);
+        body_put(body, raw, raw_size);
+        if (kind == PRECOMP_PNG) {
+            body_put_u32(body, nchunks);
+            for (uint32_t c = 0; c < nchunks; c++) body_put_u32(body, chunks[c]);
+        }
+        atomic_fetch_add(&job->recreated, 1);
+        atomic_fetch_add(&job->deflated_bytes, *consumed);
+        atomic_fetch_add(&job->inflated_bytes, raw_size);
+    }
+    free(raw);
+    return found;
+}
+
+static uint16_t read_uint16_le(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+// Length of the gzip member header at p, 0 if there is none
+static size_t gzip_header_size(const uint8_t *p, size_t n) {
+    if (n < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != Z_DEFLATED) return 0;
+    uint8_t flags = p[3];
+    size_t pos = 10;
+    if (flags & 0x04) pos += 2 + read_uint16_le(p + pos);
+    for (int field = 0x08; field <= 0x10; field <<= 1) {
+        if (!(flags & field)) continue;
+        while (pos < n && p[pos]) pos++;
+        pos++;
+    }
+    if (flags & 0x02) pos += 2;
+    return pos < n ? pos : 0;
+}
+
+static void precomp_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    PrecompJob *job = ctx;
+    FileEntry *file = &job->archive->files[index];
+    const uint8_t *data = file->content;
+    size_t n = file->size;
+    if (!data || n < PRECOMP_MIN_STREAM || file->jpeg) return;
+    
+    PrecompBody body = { NULL, 0, 0, 0, 0 };
+    size_t literal_from = 0, consumed;
+    int recreated = 0;
+    if (filter_worker_bytes != SIZE_MAX) {
+        // The verify copy and a PNG's joined stream take up to 2n; the rest
+        // of the allowance is split between the body and one inflated stream
+        int candidate = gzip_header_size(data, n) || (n >= 30 && memcmp(data, "PK\x03\x04", 4) == 0) ||
+                        (n >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0);
+        if (candidate && filter_worker_bytes / 2 <= n + PRECOMP_MIN_STREAM) {
+            atomic_fetch_add(&filter_over_limit, 1);
+            return;
+        }
+        body.limit = (filter_worker_bytes - 2 * n) / 2;
+    }
+    
+    if (gzip_header_size(data, n)) {
+        // gzip: one or more members, each header + raw deflate + 8-byte trailer
+        size_t pos = 0, header;
+        while ((header = gzip_header_size(data + pos, n - pos)) != 0) {
+            size_t at = pos + header;
+            size_t mark = body.size;
+            body_put_literal(&body, data + literal_from, at - literal_from);
+            if (!precomp_stream(job, &body, PRECOMP_RAW, data + at, n - at, NULL, 0, &consumed)) {
+                body.size = mark;
+                break;
+            }
+            recreated++;
+            literal_from = at + consumed;
+            pos = literal_from + 8;
+            if (pos > n) break;
+        }
+    } else if (n >= 30 && memcmp(data, "PK\x03\x04", 4) == 0) {
+        // zip/jar/wheel: every deflated local file entry
+        size_t pos = 0;
+        const uint8_t *hit;
+        while (pos + 30 <= n && (hit = memmem(data + pos, n - pos, "PK\x03\x04", 4)) != NULL) {
+            size_t at = hit - data;
+            if (at + 30 > n || read_uint16_le(hit + 8) != Z_DEFLATED) {
+                pos = at + 4;
+                continue;
+            }
+            size_t start = at + 30 + read_uint16_le(hit + 26) + read_uint16_le(hit + 28);
+            size_t mark = body.size;
+            body_put_literal(&body, data + literal_from, start < n ? start - literal_from : 0);
+            if (start < n && precomp_stream(job, &body, PRECOMP_RAW, data + start, n - start, NULL, 0, &consumed)) {
+                recreated++;
+                literal_from = start + consumed;
+                pos = literal_from;
+            } else {
+                body.size = mark;
+                pos = at + 4;
+            }
+        }
+    } else if (n >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        // PNG: the IDAT chunks together hold one zlib stream
+        size_t pos = 8, first = 0, end = 0, stream_size = 0;
+        uint32_t nchunks = 0;
+        while (pos + 12 <= n) {
+            uint32_t len = read_uint32_be(data + pos);
+            if (len > n - pos - 12) break;
+            int idat = memcmp(data + pos + 4, "IDAT", 4) == 0;
+            if (idat && (nchunks == 0 || end == pos)) {
+                if (nchunks == 0) first = pos;
+                nchunks++;
+                stream_size += len;
+                end = pos + 12 + len;
+            } else if (nchunks) {
+                break;
+            }
+            pos += 12 + len;
+        }
+        uint8_t *stream = nchunks ? malloc(stream_size ? stream_size : 1) : NULL;
+        uint32_t *chunks = nchunks ? malloc(sizeof(uint32_t) * nchunks) : NULL;
+        if (stream && chunks) {
+            size_t filled = 0;
+            pos = first;
+            for (uint32_t c = 0; c < nchunks; c++) {
+                chunks[c] = read_uint32_be(data + pos);
+                memcpy(stream + filled, data + pos + 8, chunks[c]);
+                filled += chunks[c];
+                pos += 12 + chunks[c];
+            }
+            body_put_literal(&body, data, first);
+            if (precomp_stream(job, &body, PRECOMP_PNG, stream, stream_size, chunks, nchunks, &consumed)) {
+                recreated++;
+                literal_from = end;
+            }
+        }
+        free(stream);
+        free(chunks);
+    }
+    
+    if (recreated) body_put_literal(&body, data + literal_from, n - literal_from);
+    
+    // Keep the result only if the whole file comes back exactly
+    if (recreated && body.failed && body.limit) atomic_fetch_add(&filter_over_limit, 1);
+    uint8_t *check = recreated && !body.failed ? malloc(n) : NULL;
+    if (check && precomp_rebuild(body.data, body.size, check, n) == 0 && memcmp(check, data, n) == 0 &&
+        filter_keep_body(body.capacity)) {
+        file->precomp = body.data;
+        file->precomp_size = body.size;
+    } else {
+        free(body.data);
+    }
+    free(check);
+}
+
+// Rebuild a file from its --precomp segments into out (out_size bytes)
+int precomp_rebuild(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size) {
+    size_t pos = 0, filled = 0;
+    while (pos < body_size) {
+        uint8_t kind = body[pos++];
+        if (kind == PRECOMP_LITERAL) {
+            if (pos + 4 > body_size) return -1;
+            uint32_t len = read_uint32_be(body + pos);
+            pos += 4;
+            if (len > body_size - pos || len > out_size - filled) return -1;
+            memcpy(out + filled, body + pos, len);
+            pos += len;
+            filled += len;
+            continue;
+        }
+        if ((kind != PRECOMP_RAW && kind != PRECOMP_PNG) || pos + 12 > body_size) return -1;
+        const uint8_t *params = body + pos;
+        uint32_t deflated = read_uint32_be(body + pos + 4);
+        uint32_t inflated = read_uint32_be(body + pos + 8);
+        pos += 12;
+        if (inflated > body_size - pos) return -1;
+        const uint8_t *raw = body + pos;
+        pos += inflated;
+        
+        uint32_t nchunks = 0;
+        const uint8_t *chunks = NULL;
+        size_t need = deflated;
+        if (kind == PRECOMP_PNG) {
+            if (pos + 4 > body_size) return -1;
+            nchunks = read_uint32_be(body + pos);
+            pos += 4;
+            if (nchunks > (body_size - pos) / 4) return -1;
+            chunks = body + pos;
+            pos += (size_t)nchunks * 4;
+            need += (size_t)nchunks * 12;
+        }
+        if (need > out_size - filled) return -1;
+        
+        // PNG streams are deflated aside and then framed into chunks
+        uint8_t *stream = kind == PRECOMP_PNG ? malloc(deflated ? deflated : 1) : out + filled;
+        if (!stream) return -1;
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        int wbits = kind == PRECOMP_PNG ? params[3] : -params[3];
+        int ok = deflateInit2(&zs, params[0], Z_DEFLATED, wbits, params[1], params[2]) == Z_OK;
+        if (ok) {
+            zs.next_in = (Bytef *)raw;
+            zs.avail_in = inflated;
+            zs.next_out = stream;
+            zs.avail_out = deflated;
+            int ret = deflate(&zs, Z_FINISH);
+            if (ret == Z_OK && zs.avail_out == 0) {
+                // An exact fit can leave deflate unsure it is done; any
+                // further output means the parameters were wrong
+                uint8_t spare[64];
+                zs.next_out = spare;
+                zs.avail_out = sizeof(spare);
+                ret = deflate(&zs, Z_FINISH);
+                if (zs.avail_out != sizeof(spare)) ret = Z_DATA_ERROR;
+            }
+            ok = ret == Z_STREAM_END && zs.total_out == deflated;
+            deflateEnd(&zs);
+        }
+        if (ok && kind == PRECOMP_PNG) {
+            size_t from = 0;
+            for (uint32_t c = 0; c < nchunks && ok; c++) {
+                uint32_t len = read_uint32_be(chunks + c * 4);
+                if (len > deflated - from) {
+                    ok = 0;
+                    break;
+                }
+                uLong crc = crc32(crc32(0, (const Bytef *)"IDAT", 4), stream + from, len);
+                write_uint32_be(out + filled, len);
+                memcpy(out + filled + 4, "IDAT", 4);
+                memcpy(out + filled + 8, stream + from, len);
+                write_uint32_be(out + filled + 8 + len, crc);
+                filled += 12 + len;
+                from += len;
+            }
+            ok &= from == deflated;
+            free(stream);
+        } else if (ok) {
+            filled += deflated;
+        } else if (kind == PRECOMP_PNG) {
+            free(stream);
+        }
+        if (!ok) return -1;
+    }
+    return filled == out_size ? 0 : -1;
+}
+
+// Look for gzip members, deflated zip entries and PNG image data in every
+// file, in parallel, and keep the streams zlib re-creates bit-exactly
+void precomp_files(Archive *archive, PrecompStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    double start = now_ms();
+    
+    PrecompJob job;
+    memset(&job, 0, sizeof(job));
+    job.archive = archive;
+    pool_run(get_worker_pool(), archive->count, filter_workers, precomp_task, &job);
+    
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    stats->streams = job.streams;
+    stats->recreated = job.recreated;
+    stats->deflated_bytes = job.deflated_bytes;
+    stats->inflated_bytes = job.inflated_bytes;
+    for (size_t i = 0; i < archive->count; i++) {
+        stats->input_bytes += archive->files[i].size;
+        stats->files += archive->files[i].precomp != NULL;
+    }
+    stats->cpu_ms = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000.0 + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e6;
+    stats->wall_ms = now_ms() - start;
+    
+    double input_mb = stats->input_bytes / (1024.0 * 1024.0);
+    printf("  %zu of %zu deflate streams re-created in %zu files: %.2f MB -> %.2f MB inflated\n",
+           stats->recreated, stats->streams, stats->files, stats->deflated_bytes / (1024.0 * 1024.0),
+           stats->inflated_bytes / (1024.0 * 1024.0));
+    printf("  %.0f ms (%.0f ms CPU, %.1f ms CPU per input MB)\n", stats->wall_ms, stats->cpu_ms,
+           input_mb > 0 ? stats->cpu_ms / input_mb : 0.0);
+}
+
+// JPEG re-coding (--jpeg). Huffman-coded JPEGs, sequential or progressive,
+// are decoded to their quantized DCT coefficients, which are then coded with
+// a context model and a binary range coder instead of the file's Huffman
+// codes. Marker segments and everything after the last scan are kept
+// verbatim; on extract every scan is Huffman-coded again with the tables in
+// force at that point. A file is only re-coded if the rebuilt bytes match.
+//
+// Body: u32 scan count, then per scan u32 length and the bytes from the end
+// of the previous scan (SOI for the first) up to and including its SOS
+// segment, u32 trailer length, trailer (EOI and anything after), then the
+// range-coded coefficients.
+typedef struct {
+    uint8_t counts[17];         // codes per length, 1-16
+    uint8_t symbols[256];
+    int32_t maxcode[17];
+    int32_t mincode[17];
+    int32_t valptr[17];
+    uint16_t code[256];         // encoding: code and length per symbol, length 0 = none
+    uint8_t length[256];
+    int defined;
+} JpegHuffman;
+
+typedef struct {
+    int id;
+    int h, v;                   // sampling factors
+    int dc_table, ac_table;
+    int bw, bh;                 // blocks per row and column, including MCU padding
+    int ew, eh;                 // blocks covered by a non-interleaved scan
+    int16_t *coef;              // bw * bh blocks of 64 coefficients in zigzag order
+    uint8_t *nonzero;           // non-zero AC coefficients per block
+} JpegComponent;
+
+typedef struct {
+    int have_frame;
+    int progressive;
+    int width, height;
+    int ncomp;
+    int restart;                // restart interval in MCUs, 0 = none
+    int hmax, vmax;
+    int mcux, mcuy;
+    JpegComponent comp[JPEG_MAX_COMPONENTS];
+    JpegHuffman dc[4], ac[4];
+} JpegImage;
+
+typedef struct {
+    int ncomp;
+    int comp[JPEG_MAX_COMPONENTS]; // frame component indices in scan order
+    int ss, se;                 // spectral selection
+    int ah, al;                 // successive approximation
+} JpegScan;
+
+typedef struct {
+    uint16_t p;                 // probability of a 0 bit, scaled to 16 bits
+    uint16_t n;                 // observations so far, caps the adaptation rate
+} JpegBit;
+
+// Contexts: class (luma, chroma), zigzag position, then the bucketed
+// neighbour information. The zero flags and exponents have three contexts
+// each, mixed with one weight set per class and position.
+typedef struct {
+    struct {
+        JpegBit nonzero[2][JPEG_NZ_BUCKETS][64];
+        JpegBit zero0[2][64][JPEG_NZ_BUCKETS][JPEG_MAG_BUCKETS];
+        JpegBit zero1[2][64][JPEG_MAG_BUCKETS][JPEG_MAG_BUCKETS];
+        JpegBit zero2[2][64][JPEG_NZ_BUCKETS][JPEG_MAG_BUCKETS];
+        JpegBit exponent0[2][64][JPEG_MAG_BUCKETS][JPEG_MAX_EXP];
+        JpegBit exponent1[2][64][JPEG_MAG_BUCKETS][JPEG_MAX_EXP];
+        JpegBit exponent2[2][JPEG_NZ_BUCKETS][JPEG_MAG_BUCKETS][JPEG_MAX_EXP];
+        JpegBit sign[2][64][5];
+        JpegBit mantissa[2][64][JPEG_MAX_EXP + 1][JPEG_MAX_EXP];
+        JpegBit dc_zero[JPEG_MIX_INPUTS][2][JPEG_MAG_BUCKETS];
+        JpegBit dc_exponent[JPEG_MIX_INPUTS][2][JPEG_MAG_BUCKETS][JPEG_MAX_EXP];
+        JpegBit dc_sign[2];
+        JpegBit dc_mantissa[2][JPEG_MAX_EXP + 1][JPEG_MAX_EXP];
+    } bits;
+    struct {
+        int32_t zero_weights[2][64][JPEG_MIX_INPUTS + 1];
+        int32_t exponent_weights[2][64][JPEG_MAX_EXP][JPEG_MIX_INPUTS + 1];
+        int32_t dc_zero_weights[2][JPEG_MIX_INPUTS + 1];
+        int32_t dc_exponent_weights[2][JPEG_MAX_EXP][JPEG_MIX_INPUTS + 1];
+    } weights;
+    int16_t stretch[4096];      // inverse of jpeg_squash
+} JpegModel;
+
+// LZMA-style range coder, shared by both directions so the model code is
+// written once
+typedef struct {
+    int decoding;
+    uint32_t range;
+    PrecompBody *out;
+    uint64_t low;
+    uint64_t pending;
+    uint8_t cache;
+    const uint8_t *in;
+    size_t in_size;
+    size_t in_pos;
+    uint32_t code;
+} JpegCoder;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint32_t acc;
+    int nbits;
+    int failed;                 // ran into a marker or the end of the data
+} JpegBitReader;
+
+typedef struct {
+    uint8_t *out;
+    size_t size;
+    size_t pos;
+    uint32_t acc;
+    int nbits;
+    int overflow;
+} JpegBitWriter;
+
+// Encoder state of one scan. Progressive AC scans follow libjpeg: runs of
+// empty blocks are merged into one EOBRUN, and refinement bits that belong
+// to it are held back until it is written.
+typedef struct {
+    JpegBitWriter bw;
+    int pred[JPEG_MAX_COMPONENTS];
+    unsigned eobrun;
+    const JpegHuffman *ac;
+    size_t held;
+    uint8_t held_bits[JPEG_MAX_CORR_BITS + 64];
+} JpegScanWriter;
+
+typedef struct {
+    Archive *archive;
+    atomic_size_t candidates;
+    atomic_size_t recoded;
+    atomic_size_t original_bytes;
+    atomic_size_t coded_bytes;
+} JpegJob;
+
+static const uint8_t jpeg_natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static int bit_length(uint32_t v) {
+    int n = 0;
+    while (v) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+static int jpeg_build_huffman(JpegHuffman *table, const uint8_t *counts, const uint8_t *symbols, int total) {
+    memset(table, 0, sizeof(*table));
+    memcpy(table->counts + 1, counts, 16);
+    memcpy(table->symbols, symbols, total);
+    int32_t code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        table->valptr[len] = k;
+        table->mincode[len] = code;
+        for (int i = 0; i < table->counts[len]; i++, k++, code++) {
+            if (!table->length[symbols[k]]) {
+                table->code[symbols[k]] = code;
+                table->length[symbols[k]] = len;
+            }
+        }
+        table->maxcode[len] = table->counts[len] ? code - 1 : -1;
+        if (code > (1 << len)) return -1;
+        code <<= 1;
+    }
+    table->defined = 1;
+    return 0;
+}
+
+static int jpeg_parse_frame(const uint8_t *seg, size_t seg_len, JpegImage *img) {
+    if (img->have_frame || seg_len < 6 || seg[0] != 8) return -1;
+    img->height = read_uint16_be(seg + 1);
+    img->width = read_uint16_be(seg + 3);
+    img->ncomp = seg[5];
+    if (img->width == 0 || img->height == 0 || img->ncomp < 1 || img->ncomp > JPEG_MAX_COMPONENTS ||
+        seg_len < 6 + 3 * (size_t)img->ncomp) return -1;
+    for (int c = 0; c < img->ncomp; c++) {
+        JpegComponent *comp = &img->comp[c];
+        comp->id = seg[6 + 3 * c];
+        comp->h = seg[7 + 3 * c] >> 4;
+        comp->v = seg[7 + 3 * c] & 15;
+        if (comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4) return -1;
+        if (comp->h > img->hmax) img->hmax = comp->h;
+        if (comp->v > img->vmax) img->vmax = comp->v;
+    }
+
+    img->mcux = (img->width + 8 * img->hmax - 1) / (8 * img->hmax);
+    img->mcuy = (img->height + 8 * img->vmax - 1) / (8 * img->vmax);
+    size_t blocks = 0;
+    for (int c = 0; c < img->ncomp; c++) {
+        JpegComponent *comp = &img->comp[c];
+        comp->ew = ((img->width * comp->h + img->hmax - 1) / img->hmax + 7) / 8;
+        comp->eh = ((img->height * comp->v + img->vmax - 1) / img->vmax + 7) / 8;
+        comp->bw = img->ncomp == 1 ? comp->ew : img->mcux * comp->h;
+        comp->bh = img->ncomp == 1 ? comp->eh : img->mcuy * comp->v;
+        blocks += (size_t)comp->bw * comp->bh;
+    }
+    img->have_frame = 1;
+    return blocks <= JPEG_MAX_BLOCKS ? 0 : -1;
+}
+
+static int jpeg_parse_scan(const uint8_t *seg, size_t seg_len, JpegImage *img, JpegScan *scan) {
+    memset(scan, 0, sizeof(*scan));
+    if (!img->have_frame || seg_len < 1) return -1;
+    scan->ncomp = seg[0];
+    if (scan->ncomp < 1 || scan->ncomp > img->ncomp || seg_len < 4 + 2 * (size_t)scan->ncomp) return -1;
+    const uint8_t *spectral = seg + 1 + 2 * scan->ncomp;
+    scan->ss = spectral[0];
+    scan->se = spectral[1];
+    scan->ah = spectral[2] >> 4;
+    scan->al = spectral[2] & 15;
+    if (!img->progressive) {
+        if (scan->ss != 0 || scan->se != 63 || spectral[2] != 0) return -1;
+    } else if (scan->se > 63 || scan->ss > scan->se || (scan->ss == 0) != (scan->se == 0) ||
+               (scan->ss > 0 && scan->ncomp != 1) || scan->al > 13) {
+        return -1;
+    }
+
+    for (int i = 0; i < scan->ncomp; i++) {
+        int c = 0;
+        while (c < img->ncomp && img->comp[c].id != seg[1 + 2 * i]) c++;
+        if (c == img->ncomp) return -1;
+        for (int j = 0; j < i; j++) {
+            if (scan->comp[j] == c) return -1;
+        }
+        scan->comp[i] = c;
+        JpegComponent *comp = &img->comp[c];
+        comp->dc_table = seg[2 + 2 * i] >> 4;
+        comp->ac_table = seg[2 + 2 * i] & 15;
+        // Progressive refinement scans and AC scans never use the DC table
+        int needs_dc = scan->ss == 0 && scan->ah == 0;
+        int needs_ac = scan->se > 0;
+        if ((needs_dc && (comp->dc_table > 3 || !img->dc[comp->dc_table].defined)) ||
+            (needs_ac && (comp->ac_table > 3 || !img->ac[comp->ac_table].defined))) return -1;
+    }
+    return 0;
+}
+
+// Read marker segments from pos up to and including the next SOS. Returns
+// the offset just past the SOS segment, 0 on anything this codec does not
+// handle (arithmetic coding, lossless, hierarchical, 12-bit, DNL ...).
+static size_t jpeg_parse_markers(const uint8_t *data, size_t size, size_t pos, JpegImage *img, JpegScan *scan) {
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return 0;
+        uint8_t marker = data[pos + 1];
+        size_t len = read_uint16_be(data + pos + 2);
+        if (len < 2 || pos + 2 + len > size) return 0;
+        const uint8_t *seg = data + pos + 4;
+        size_t seg_len = len - 2;
+
+        if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+            img->progressive = marker == 0xC2;
+            if (jpeg_parse_frame(seg, seg_len, img) != 0) return 0;
+        } else if (marker == 0xC4) {
+            while (seg_len >= 17) {
+                int cls = seg[0] >> 4, id = seg[0] & 15;
+                int total = 0;
+                for (int i = 1; i <= 16; i++) total += seg[i];
+                if (cls > 1 || id > 3 || total > 256 || seg_len < 17 + (size_t)total) return 0;
+                if (jpeg_build_huffman(cls ? &img->ac[id] : &img->dc[id], seg + 1, seg + 17, total) != 0) return 0;
+                seg += 17 + total;
+                seg_len -= 17 + total;
+            }
+            if (seg_len != 0) return 0;
+        } else if (marker == 0xDD) {
+            if (seg_len < 2) return 0;
+            img->restart = read_uint16_be(seg);
+        } else if (marker == 0xDA) {
+            return jpeg_parse_scan(seg, seg_len, img, scan) == 0 ? pos + 2 + len : 0;
+        } else if (marker != 0xDB && marker != 0xFE && (marker < 0xE0 || marker > 0xEF)) {
+            return 0;
+        }
+        pos += 2 + len;
+    }
+    return 0;
+}
+
+static int jpeg_alloc_coefficients(JpegImage *img) {
+    for (int c = 0; c < img->ncomp; c++) {
+        size_t blocks = (size_t)img->comp[c].bw * img->comp[c].bh;
+        img->comp[c].coef = calloc(blocks * 64, sizeof(int16_t));
+        img->comp[c].nonzero = calloc(blocks, 1);
+        if (!img->comp[c].coef || !img->comp[c].nonzero) return -1;
+    }
+    return 0;
+}
+
+static size_t jpeg_image_blocks(const JpegImage *img) {
+    size_t blocks = 0;
+    for (int c = 0; c < img->ncomp; c++) blocks += (size_t)img->comp[c].bw * img->comp[c].bh;
+    return blocks;
+}
+
+static void jpeg_free_coefficients(JpegImage *img) {
+    for (int c = 0; c < img->ncomp; c++) {
+        free(img->comp[c].coef);
+        free(img->comp[c].nonzero);
+    }
+}
+
+static size_t jpeg_scan_mcus(const JpegImage *img, const JpegScan *scan) {
+    if (scan->ncomp == 1) {
+        const JpegComponent *comp = &img->comp[scan->comp[0]];
+        return (size_t)comp->ew * comp->eh;
+    }
+    return (size_t)img->mcux * img->mcuy;
+}
+
+// Blocks of MCU m in coding order, as component and block index pairs.
+// Returns the count.
+static int jpeg_mcu_blocks(const JpegImage *img, const JpegScan *scan, size_t m, int *comps, size_t *blocks) {
+    if (scan->ncomp == 1) {
+        const JpegComponent *comp = &img->comp[scan->comp[0]];
+        comps[0] = scan->comp[0];
+        blocks[0] = (m / comp->ew) * comp->bw + m % comp->ew;
+        return 1;
+    }
+    int n = 0;
+    size_t mx = m % img->mcux, my = m / img->mcux;
+    for (int i = 0; i < scan->ncomp; i++) {
+        const JpegComponent *comp = &img->comp[scan->comp[i]];
+        for (int v = 0; v < comp->v; v++) {
+            for (int h = 0; h < comp->h; h++) {
+                comps[n] = scan->comp[i];
+                blocks[n++] = (my * comp->v + v) * comp->bw + mx * comp->h + h;
+            }
+        }
+    }
+    return n;
+}
+
+static int jpeg_read_bit(JpegBitReader *br) {
+    if (br->nbits == 0) {
+        uint8_t byte = 0;
+        if (br->pos < br->size && br->data[br->pos] != 0xFF) {
+            byte = br->data[br->pos++];
+        } else if (br->pos + 1 < br->size && br->data[br->pos] == 0xFF && br->data[br->pos + 1] == 0) {
+            byte = 0xFF;
+            br->pos += 2;
+        } else {
+            br->failed = 1;
+        }
+        br->acc = byte;
+        br->nbits = 8;
+    }
+    br->nbits--;
+    return (br->acc >> br->nbits) & 1;
+}
+
+static unsigned jpeg_read_bits(JpegBitReader *br, int n) {
+    unsigned v = 0;
+    for (int i = 0; i < n; i++) v = (v << 1) | jpeg_read_bit(br);
+    return v;
+}
+
+static int jpeg_read_huffman(JpegBitReader *br, const JpegHuffman *table) {
+    int32_t code = 0;
+    for (int len = 1; len <= 16; len++) {
+        code = (code << 1) | jpeg_read_bit(br);
+        if (code <= table->maxcode[len]) return table->symbols[table->valptr[len] + code - table->mincode[len]];
+    }
+    br->failed = 1;
+    return 0;
+}
+
+// Magnitude category s followed by s bits, negative values one's complemented
+static int jpeg_read_value(JpegBitReader *br, int s) {
+    int v = jpeg_read_bits(br, s);
+    return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+// Apply a refinement bit to an already non-zero coefficient
+static void jpeg_refine(JpegBitReader *br, int16_t *coef, int bit) {
+    if (jpeg_read_bit(br) && (*coef & bit) == 0) *coef += *coef >= 0 ? bit : -bit;
+}
+
+static int jpeg_decode_block(JpegBitReader *br, const JpegImage *img, const JpegScan *scan,
+                             const JpegComponent *comp, int16_t *blk, int *pred, unsigned *eobrun) {
+    if (scan->ss == 0 && scan->ah == 0) {
+        int s = jpeg_read_huffman(br, &img->dc[comp->dc_table]);
+        if (s > 11) return -1;
+        *pred += s ? jpeg_read_value(br, s) : 0;
+        if (abs(*pred) > (INT16_MAX >> scan->al)) return -1;
+        blk[0] = *pred * (1 << scan->al);
+    } else if (scan->ss == 0) {
+        if (jpeg_read_bit(br)) blk[0] |= 1 << scan->al;
+    }
+    if (scan->se == 0) return br->failed ? -1 : 0;
+
+    const JpegHuffman *ac = &img->ac[comp->ac_table];
+    int k = scan->ss ? scan->ss : 1;
+    if (!img->progressive || scan->ah == 0) {
+        // Sequential, or the first pass over a progressive band
+        if (*eobrun > 0) {
+            (*eobrun)--;
+            return 0;
+        }
+        for (; k <= scan->se; k++) {
+            int rs = jpeg_read_huffman(br, ac);
+            int run = rs >> 4, s = rs & 15;
+            if (s == 0) {
+                if (run == 15) {
+                    k += 15;
+                    continue;
+                }
+                if (run > 0 && !img->progressive) return -1;
+                *eobrun = (1u << run) - 1 + jpeg_read_bits(br, run);
+                break;
+            }
+            k += run;
+            if (k > scan->se || s > 10) return -1;
+            int v = jpeg_read_value(br, s);
+            if (abs(v) > (INT16_MAX >> scan->al)) return -1;
+            blk[k] = v * (1 << scan->al);
+        }
+        return br->failed ? -1 : 0;
+    }
+
+    // Refinement pass: newly non-zero coefficients are +-1 at this bit, and
+    // every coefficient that already was non-zero gets a correction bit
+    int bit = 1 << scan->al;
+    if (*eobrun == 0) {
+        for (; k <= scan->se; k++) {
+            int rs = jpeg_read_huffman(br, ac);
+            int run = rs >> 4, s = rs & 15;
+            int value = 0;
+            if (s) {
+                if (s != 1) return -1;
+                value = jpeg_read_bit(br) ? bit : -bit;
+            } else if (run != 15) {
+                *eobrun = (1u << run) + jpeg_read_bits(br, run);
+                break;
+            }
+            for (; k <= scan->se; k++) {
+                if (blk[k] != 0) {
+                    jpeg_refine(br, &blk[k], bit);
+                } else if (--run < 0) {
+                    break;
+                }
+            }
+            if (value) {
+                if (k > scan->se) return -1;
+                blk[k] = value;
+            }
+        }
+    }
+    if (*eobrun > 0) {
+        for (; k <= scan->se; k++) {
+            if (blk[k] != 0) jpeg_refine(br, &blk[k], bit);
+        }
+        (*eobrun)--;
+    }
+    return br->failed ? -1 : 0;
+}
+
+// Decode the entropy-coded segment that starts at pos. Returns the offset
+// of the first byte after it, 0 on failure.
+static size_t jpeg_decode_scan(const uint8_t *data, size_t size, size_t pos, JpegImage *img, const JpegScan *scan) {
+    JpegBitReader br = { data, size, pos, 0, 0, 0 };
+    int pred[JPEG_MAX_COMPONENTS] = {0};
+    unsigned eobrun = 0;
+    int comps[JPEG_MAX_COMPONENTS * 16];
+    size_t blocks[JPEG_MAX_COMPONENTS * 16];
+    size_t mcus = jpeg_scan_mcus(img, scan);
+    for (size_t m = 0; m < mcus; m++) {
+        if (img->restart && m > 0 && m % img->restart == 0) {
+            size_t marker = (m / img->restart - 1) & 7;
+            br.nbits = 0;
+            if (br.pos + 2 > size || data[br.pos] != 0xFF || data[br.pos + 1] != 0xD0 + marker) return 0;
+            br.pos += 2;
+            memset(pred, 0, sizeof(pred));
+            eobrun = 0;
+        }
+        int n = jpeg_mcu_blocks(img, scan, m, comps, blocks);
+        for (int i = 0; i < n; i++) {
+            JpegComponent *comp = &img->comp[comps[i]];
+            if (jpeg_decode_block(&br, img, scan, comp, comp->coef + blocks[i] * 64, &pred[comps[i]], &eobrun) != 0) {
+                return 0;
+            }
+        }
+    }
+    return br.failed || eobrun ? 0 : br.pos;
+}
+
+static void jpeg_put_byte(JpegBitWriter *bw, uint8_t byte) {
+    if (bw->pos < bw->size) {
+        bw->out[bw->pos++] = byte;
+    } else {
+        bw->overflow = 1;
+    }
+}
+
+static void jpeg_put_bits(JpegBitWriter *bw, uint32_t bits, int len) {
+    bw->acc = (bw->acc << len) | (bits & ((1u << len) - 1));
+    bw->nbits += len;
+    while (bw->nbits >= 8) {
+        uint8_t byte = (bw->acc >> (bw->nbits - 8)) & 0xFF;
+        jpeg_put_byte(bw, byte);
+        if (byte == 0xFF) jpeg_put_byte(bw, 0);
+        bw->nbits -= 8;
+    }
+    bw->acc &= (1u << bw->nbits) - 1;
+}
+
+// Pad the last byte with 1 bits, as libjpeg does before a marker
+static void jpeg_flush_bits(JpegBitWriter *bw) {
+    if (bw->nbits > 0) jpeg_put_bits(bw, 0x7F, 8 - bw->nbits);
+}
+
+static int jpeg_put_symbol(JpegBitWriter *bw, const JpegHuffman *table, int symbol) {
+    if (!table->length[symbol]) return -1;
+    jpeg_put_bits(bw, table->code[symbol], table->length[symbol]);
+    return 0;
+}
+
+static int jpeg_put_value(JpegBitWriter *bw, const JpegHuffman *table, int run, int v, int max_bits) {
+    int s = bit_length(abs(v));
+    if (s > max_bits || jpeg_put_symbol(bw, table, (run << 4) | s) != 0) return -1;
+    if (s) jpeg_put_bits(bw, v < 0 ? v - 1 : v, s);
+    return 0;
+}
+
+// Write the pending EOBRUN and the refinement bits held back for it
+static int jpeg_put_eobrun(JpegScanWriter *sw) {
+    if (sw->eobrun == 0) return 0;
+    int nbits = bit_length(sw->eobrun) - 1;
+    if (jpeg_put_symbol(&sw->bw, sw->ac, nbits << 4) != 0) return -1;
+    if (nbits) jpeg_put_bits(&sw->bw, sw->eobrun, nbits);
+    for (size_t i = 0; i < sw->held; i++) jpeg_put_bits(&sw->bw, sw->held_bits[i], 1);
+    sw->eobrun = 0;
+    sw->held = 0;
+    return 0;
+}
+
+static int jpeg_floor_shift(int v, int n) {
+    return v >= 0 ? v >> n : ~(~v >> n);
+}
+
+static int jpeg_encode_block(JpegScanWriter *sw, const JpegImage *img, const JpegScan *scan,
+                             const JpegComponent *comp, const int16_t *blk, int *pred) {
+    if (scan->ss == 0 && scan->ah == 0) {
+        int dc = jpeg_floor_shift(blk[0], scan->al);
+        if (jpeg_put_value(&sw->bw, &img->dc[comp->dc_table], 0, dc - *pred, 11) != 0) return -1;
+        *pred = dc;
+    } else if (scan->ss == 0) {
+        jpeg_put_bits(&sw->bw, jpeg_floor_shift(blk[0], scan->al) & 1, 1);
+    }
+    if (scan->se == 0) return 0;
+
+    const JpegHuffman *ac = &img->ac[comp->ac_table];
+    sw->ac = ac;
+    int first = scan->ss ? scan->ss : 1;
+    int run = 0;
+    if (!img->progressive || scan->ah == 0) {
+        for (int k = first; k <= scan->se; k++) {
+            int mag = abs(blk[k]) >> scan->al;
+            if (mag == 0) {
+                run++;
+                continue;
+            }
+            if (jpeg_put_eobrun(sw) != 0) return -1;
+            for (; run > 15; run -= 16) {
+                if (jpeg_put_symbol(&sw->bw, ac, 0xF0) != 0) return -1;
+            }
+            if (jpeg_put_value(&sw->bw, ac, run, blk[k] < 0 ? -mag : mag, 10) != 0) return -1;
+            run = 0;
+        }
+        if (run > 0) {
+            // Sequential scans end every block with its own EOB
+            sw->eobrun++;
+            if ((!img->progressive || sw->eobrun == 0x7FFF) && jpeg_put_eobrun(sw) != 0) return -1;
+        }
+        return 0;
+    }
+
+    // Refinement pass, the same way libjpeg's encode_mcu_AC_refine does it
+    int mags[64];
+    int eob = 0;
+    for (int k = first; k <= scan->se; k++) {
+        mags[k] = abs(blk[k]) >> scan->al;
+        if (mags[k] == 1) eob = k;
+    }
+    uint8_t bits[64];
+    int nbits = 0;
+    for (int k = first; k <= scan->se; k++) {
+        if (mags[k] == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15 && k <= eob) {
+            if (jpeg_put_eobrun(sw) != 0 || jpeg_put_symbol(&sw->bw, ac, 0xF0) != 0) return -1;
+            run -= 16;
+            for (int i = 0; i < nbits; i++) jpeg_put_bits(&sw->bw, bits[i], 1);
+            nbits = 0;
+        }
+        if (mags[k] > 1) {
+            bits[nbits++] = mags[k] & 1;
+            continue;
+        }
+        if (jpeg_put_eobrun(sw) != 0 || jpeg_put_symbol(&sw->bw, ac, (run << 4) | 1) != 0) return -1;
+        jpeg_put_bits(&sw->bw, blk[k] >= 0, 1);
+        for (int i = 0; i < nbits; i++) jpeg_put_bits(&sw->bw, bits[i], 1);
+        nbits = 0;
+        run = 0;
+    }
+    if (run > 0 || nbits > 0) {
+        sw->eobrun++;
+        memcpy(sw->held_bits + sw->held, bits, nbits);
+        sw->held += nbits;
+        if ((sw->eobrun == 0x7FFF || sw->held > JPEG_MAX_CORR_BITS - 64 + 1) && jpeg_put_eobrun(sw) != 0) return -1;
+    }
+    return 0;
+}
+
+// Huffman-code one scan with the tables in force. Returns the number of
+// bytes written, 0 on failure.
+static size_t jpeg_encode_scan(const JpegImage *img, const JpegScan *scan, uint8_t *out, size_t out_size) {
+    JpegScanWriter *sw = calloc(1, sizeof(JpegScanWriter));
+    if (!sw) return 0;
+    sw->bw.out = out;
+    sw->bw.size = out_size;
+    sw->ac = &img->ac[img->comp[scan->comp[0]].ac_table];
+    int comps[JPEG_MAX_COMPONENTS * 16];
+    size_t blocks[JPEG_MAX_COMPONENTS * 16];
+    size_t mcus = jpeg_scan_mcus(img, scan);
+    int failed = 0;
+    for (size_t m = 0; m < mcus && !failed; m++) {
+        if (img->restart && m > 0 && m % img->restart == 0) {
+            failed |= jpeg_put_eobrun(sw);
+            jpeg_flush_bits(&sw->bw);
+            jpeg_put_byte(&sw->bw, 0xFF);
+            jpeg_put_byte(&sw->bw, 0xD0 + ((m / img->restart - 1) & 7));
+            memset(sw->pred, 0, sizeof(sw->pred));
+        }
+        int n = jpeg_mcu_blocks(img, scan, m, comps, blocks);
+        for (int i = 0; i < n && !failed; i++) {
+            const JpegComponent *comp = &img->comp[comps[i]];
+            failed |= jpeg_encode_block(sw, img, scan, comp, comp->coef + blocks[i] * 64, &sw->pred[comps[i]]);
+        }
+        failed |= sw->bw.overflow;
+    }
+    failed |= jpeg_put_eobrun(sw);
+    jpeg_flush_bits(&sw->bw);
+    size_t written = failed || sw->bw.overflow ? 0 : sw->bw.pos;
+    free(sw);
+    return written;
+}
+
+static void jpeg_shift_low(JpegCoder *coder) {
+    if ((uint32_t)coder->low < 0xFF000000u || (coder->low >> 32) != 0) {
+        uint8_t carry = coder->low >> 32;
+        uint8_t byte = coder->cache;
+        do {
+            uint8_t out = byte + carry;
+            body_put(coder->out, &out, 1);
+            byte = 0xFF;
+        } while (--coder->pending != 0);
+        coder->cache = (coder->low >> 24) & 0xFF;
+    }
+    coder->pending++;
+    coder->low = (coder->low & 0x00FFFFFF) << 8;
+}
+
+// Code a bit with probability p (of a 0 bit, 16-bit scale)
+static int jpeg_code_raw(JpegCoder *coder, uint32_t p, int bit) {
+    uint32_t bound = (coder->range >> 16) * p;
+    if (coder->decoding) bit = coder->code >= bound;
+    if (!bit) {
+        coder->range = bound;
+    } else {
+        if (coder->decoding) {
+            coder->code -= bound;
+        } else {
+            coder->low += bound;
+        }
+        coder->range -= bound;
+    }
+    while (coder->range < (1u << 24)) {
+        coder->range <<= 8;
+        if (coder->decoding) {
+            coder->code = (coder->code << 8) | (coder->in_pos < coder->in_size ? coder->in[coder->in_pos++] : 0);
+        } else {
+            jpeg_shift_low(coder);
+        }
+    }
+    return bit;
+}
+
+// Count-based adaptation until JPEG_ADAPT_LIMIT observations, then a fixed
+// rate
+static void jpeg_adapt(JpegBit *ctx, int bit) {
+    int target = bit ? 0 : 65535;
+    int p = ctx->p + (target - ctx->p) / (ctx->n + 2);
+    ctx->p = p < 64 ? 64 : p > 65535 - 64 ? 65535 - 64 : p;
+    if (ctx->n < JPEG_ADAPT_LIMIT) ctx->n++;
+}
+
+static int jpeg_code_bit(JpegCoder *coder, JpegBit *ctx, int bit) {
+    bit = jpeg_code_raw(coder, ctx->p, bit);
+    jpeg_adapt(ctx, bit);
+    return bit;
+}
+
+// Logistic function on a 8.8 fixed-point input, 12-bit output
+static int jpeg_squash(int d) {
+    static const int16_t table[33] = {
+           1,    2,    3,    6,   10,   16,   27,   45,   73,  120,  194,  310,  488,  747, 1101, 1546, 2047,
+        2549, 2994, 3348, 3607, 3785, 3901, 3975, 4024, 4050, 4068, 4079, 4085, 4089, 4092, 4093, 4094
+    };
+    if (d > 2047) return 4095;
+    if (d < -2047) return 1;
+    d += 2048;
+    int w = d & 127;
+    return (table[d >> 7] * (128 - w) + table[(d >> 7) + 1] * w + 64) >> 7;
+}
+
+// Code a bit from JPEG_MIX_INPUTS contexts: their predictions are combined
+// in the logistic domain with weights that are trained as the data goes
+static int jpeg_code_mixed(JpegCoder *coder, const JpegModel *model, JpegBit **ctx, int32_t *weights, int bit) {
+    int st[JPEG_MIX_INPUTS + 1];
+    int64_t dot = 0;
+    for (int i = 0; i < JPEG_MIX_INPUTS; i++) {
+        st[i] = model->stretch[(65535 - ctx[i]->p) >> 4];
+        dot += (int64_t)weights[i] * st[i];
+    }
+    st[JPEG_MIX_INPUTS] = 256;
+    dot += (int64_t)weights[JPEG_MIX_INPUTS] * 256;
+    int p1 = jpeg_squash((int)(dot >> 16));
+    bit = jpeg_code_raw(coder, (uint32_t)(4096 - p1) << 4, bit);
+    int err = ((bit << 12) - p1) * JPEG_MIX_RATE;
+    for (int i = 0; i <= JPEG_MIX_INPUTS; i++) weights[i] += (st[i] * err) >> 14;
+    for (int i = 0; i < JPEG_MIX_INPUTS; i++) jpeg_adapt(ctx[i], bit);
+    return bit;
+}
+
+// Contexts of one value: the zero flag (NULL when the value is known to be
+// non-zero) and the exponent are mixed, sign and mantissa use one context
+typedef struct {
+    JpegBit *zero[JPEG_MIX_INPUTS];
+    int32_t *zero_weights;
+    JpegBit *exponent[JPEG_MIX_INPUTS];     // JPEG_MAX_EXP contexts each
+    int32_t (*exponent_weights)[JPEG_MIX_INPUTS + 1];
+    JpegBit *sign;
+    JpegBit (*mantissa)[JPEG_MAX_EXP];
+} JpegValueContext;
+
+// Zero flag, exponent in unary, sign, then the bits below the leading one
+static int jpeg_code_value(JpegCoder *coder, const JpegModel *model, const JpegValueContext *vc, int value) {
+    int mag = abs(value);
+    if (vc->zero[0] && !jpeg_code_mixed(coder, model, (JpegBit **)vc->zero, vc->zero_weights, mag != 0)) return 0;
+    int e = bit_length(mag);
+    int coded = 1;
+    while (coded < JPEG_MAX_EXP) {
+        JpegBit *ctx[JPEG_MIX_INPUTS];
+        for (int i = 0; i < JPEG_MIX_INPUTS; i++) ctx[i] = &vc->exponent[i][coded];
+        if (!jpeg_code_mixed(coder, model, ctx, vc->exponent_weights[coded], e > coded)) break;
+        coded++;
+    }
+    int negative = jpeg_code_bit(coder, vc->sign, value < 0);
+    int result = 1;
+    for (int j = coded - 2; j >= 0; j--) {
+        result = (result << 1) | jpeg_code_bit(coder, &vc->mantissa[coded][j], (mag >> j) & 1);
+    }
+    return negative ? -result : result;
+}
+
+static int jpeg_nz_bucket(int n) {
+    return n <= 4 ? n : 2 + bit_length(n);
+}
+
+// Logarithmic with half steps: 0, 1, 2, 3, 4-5, 6-7, 8-11, 12-15 ...
+static int jpeg_mag_bucket(int m) {
+    if (m < 4) return m;
+    int b = bit_length(m);
+    int bucket = 2 * b - 2 + ((m >> (b - 2)) & 1);
+    return bucket < JPEG_MAG_BUCKETS ? bucket : JPEG_MAG_BUCKETS - 1;
+}
+
+static int jpeg_sign(int v) {
+    return (v > 0) - (v < 0);
+}
+
+// Code every block of every component in raster order. Neighbours above and
+// to the left are already known to the decoder: they pick the contexts for
+// the non-zero count and for each coefficient's magnitude and sign, and
+// predict DC (median edge detector over above, left and above-left).
+// Within a block, the coefficients above and to the left of the current one
+// in the 8x8 layout come earlier in zigzag order and refine the context.
+static int jpeg_code_coefficients(JpegImage *img, JpegCoder *coder, JpegModel *model) {
+    uint8_t zigzag[64];
+    for (int k = 0; k < 64; k++) zigzag[jpeg_natural_order[k]] = k;
+    
+    for (int c = 0; c < img->ncomp; c++) {
+        JpegComponent *comp = &img->comp[c];
+        int cls = c ? 1 : 0;
+        for (int by = 0; by < comp->bh; by++) {
+            for (int bx = 0; bx < comp->bw; bx++) {
+                size_t b = (size_t)by * comp->bw + bx;
+                int16_t *blk = comp->coef + b * 64;
+                const int16_t *above = by ? blk - (size_t)comp->bw * 64 : NULL;
+                const int16_t *left = bx ? blk - 64 : NULL;
+                const int16_t *corner = above && left ? above - 64 : NULL;
+                
+                int pred = 0, grad = 0;
+                if (corner) {
+                    int a = above[0], l = left[0], al = corner[0];
+                    int lo = a < l ? a : l, hi = a < l ? l : a;
+                    pred = al >= hi ? lo : al <= lo ? hi : a + l - al;
+                    grad = abs(a - al) + abs(l - al);
+                } else if (above || left) {
+                    pred = above ? above[0] : left[0];
+                }
+                int residual = blk[0] - pred;
+                if (!coder->decoding && abs(residual) >= (1 << JPEG_MAX_EXP)) return -1;
+                int predicted = above && left ? (comp->nonzero[b - comp->bw] + comp->nonzero[b - 1] + 1) / 2 :
+                                above ? comp->nonzero[b - comp->bw] : left ? comp->nonzero[b - 1] : 0;
+                int dc_ctx[JPEG_MIX_INPUTS] = {
+                    jpeg_mag_bucket(grad),
+                    jpeg_nz_bucket(predicted),
+                    jpeg_mag_bucket((above ? abs(above[1]) + abs(above[2]) : 0) + (left ? abs(left[1]) + abs(left[2]) : 0))
+                };
+                JpegValueContext vc;
+                for (int i = 0; i < JPEG_MIX_INPUTS; i++) {
+                    vc.zero[i] = &model->bits.dc_zero[i][cls][dc_ctx[i]];
+                    vc.exponent[i] = model->bits.dc_exponent[i][cls][dc_ctx[i]];
+                }
+                vc.zero_weights = model->weights.dc_zero_weights[cls];
+                vc.exponent_weights = model->weights.dc_exponent_weights[cls];
+                vc.sign = &model->bits.dc_sign[cls];
+                vc.mantissa = model->bits.dc_mantissa[cls];
+                residual = jpeg_code_value(coder, model, &vc, residual);
+                if (pred + residual < INT16_MIN || pred + residual > INT16_MAX) return -1;
+                blk[0] = pred + residual;
+                
+                JpegBit *nz_ctx = model->bits.nonzero[cls][jpeg_nz_bucket(predicted)];
+                int node = 1;
+                for (int bit = 5; bit >= 0; bit--) {
+                    node = (node << 1) | jpeg_code_bit(coder, &nz_ctx[node], (comp->nonzero[b] >> bit) & 1);
+                }
+                int remaining = node - 64;
+                comp->nonzero[b] = remaining;
+                
+                for (int k = 1; k < 64 && remaining > 0; k++) {
+                    int a = above ? abs(above[k]) : 0, l = left ? abs(left[k]) : 0;
+                    int mag = corner ? (13 * (a + l) + 6 * abs(corner[k])) / 16 : 2 * (a + l);
+                    int mb = jpeg_mag_bucket(mag);
+                    int n = jpeg_natural_order[k];
+                    int inner = (n >= 8 ? abs(blk[zigzag[n - 8]]) : 0) + (n % 8 ? abs(blk[zigzag[n - 1]]) : 0);
+                    int ib = jpeg_mag_bucket(inner);
+                    int rb = jpeg_nz_bucket(remaining);
+                    int sign_ctx = 2 + (above ? jpeg_sign(above[k]) : 0) + (left ? jpeg_sign(left[k]) : 0);
+                    
+                    vc.zero[0] = remaining == 64 - k ? NULL : &model->bits.zero0[cls][k][rb][mb];
+                    vc.zero[1] = &model->bits.zero1[cls][k][mb][ib];
+                    vc.zero[2] = &model->bits.zero2[cls][k][rb][ib];
+                    vc.zero_weights = model->weights.zero_weights[cls][k];
+                    vc.exponent[0] = model->bits.exponent0[cls][k][mb];
+                    vc.exponent[1] = model->bits.exponent1[cls][k][ib];
+                    vc.exponent[2] = model->bits.exponent2[cls][rb][mb];
+                    vc.exponent_weights = model->weights.exponent_weights[cls][k];
+                    vc.sign = &model->bits.sign[cls][k][sign_ctx];
+                    vc.mantissa = model->bits.mantissa[cls][k];
+                    blk[k] = jpeg_code_value(coder, model, &vc, blk[k]);
+                    if (blk[k]) remaining--;
+                }
+                if (remaining > 0) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static JpegModel *jpeg_model_create(void) {
+    JpegModel *model = malloc(sizeof(JpegModel));
+    if (!model) return NULL;
+    JpegBit *bits = (JpegBit *)&model->bits;
+    for (size_t i = 0; i < sizeof(model->bits) / sizeof(JpegBit); i++) {
+        bits[i].p = 32768;
+        bits[i].n = 0;
+    }
+    // Every weight set starts as an even blend of its inputs, no bias
+    int32_t *weights = (int32_t *)&model->weights;
+    for (size_t i = 0; i < sizeof(model->weights) / sizeof(int32_t); i++) {
+        weights[i] = i % (JPEG_MIX_INPUTS + 1) == JPEG_MIX_INPUTS ? 0 : 65536 / JPEG_MIX_INPUTS;
+    }
+    // Inverse of jpeg_squash
+    int p = 0;
+    for (int x = -2047; x <= 2047; x++) {
+        int v = jpeg_squash(x);
+        for (; p <= v; p++) model->stretch[p] = x;
+    }
+    for (; p < 4096; p++) model->stretch[p] = 2047;
+    return model;
+}
+
+static void jpeg_count_nonzero(JpegImage *img) {
+    for (int c = 0; c < img->ncomp; c++) {
+        JpegComponent *comp = &img->comp[c];
+        size_t blocks = (size_t)comp->bw * comp->bh;
+        for (size_t b = 0; b < blocks; b++) {
+            int count = 0;
+            for (int k = 1; k < 64; k++) count += comp->coef[b * 64 + k] != 0;
+            comp->nonzero[b] = count;
+        }
+    }
+}
+
+// Re-code a JPEG into body. Returns -1 if the file is not a JPEG this codec
+// handles, -2 if it has more than max_blocks blocks.
+static int jpeg_encode(const uint8_t *data, size_t size, size_t max_blocks, PrecompBody *body) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return -1;
+    JpegImage img;
+    memset(&img, 0, sizeof(img));
+    JpegModel *model = jpeg_model_create();
+    size_t bounds[JPEG_MAX_SCANS + 1];  // scan i's markers are bounds[i] up to its data
+    size_t starts[JPEG_MAX_SCANS];
+    int nscans = 0;
+    size_t pos = 2;
+    int result = model ? 0 : -1;
+    bounds[0] = 0;
+    while (result == 0) {
+        JpegScan scan;
+        size_t start = nscans < JPEG_MAX_SCANS ? jpeg_parse_markers(data, size, pos, &img, &scan) : 0;
+        if (start && nscans == 0 && jpeg_image_blocks(&img) > max_blocks) {
+            result = -2;
+            break;
+        }
+        if (!start || (nscans == 0 && jpeg_alloc_coefficients(&img) != 0)) {
+            result = -1;
+            break;
+        }
+        starts[nscans] = start;
+        pos = jpeg_decode_scan(data, size, start, &img, &scan);
+        bounds[++nscans] = pos;
+        if (!pos) {
+            result = -1;
+        } else if (pos + 2 <= size && data[pos] == 0xFF && data[pos + 1] == 0xD9) {
+            break;
+        }
+    }
+    if (result == 0) {
+        body_put_u32(body, nscans);
+        for (int i = 0; i < nscans; i++) {
+            body_put_u32(body, starts[i] - bounds[i]);
+            body_put(body, data + bounds[i], starts[i] - bounds[i]);
+        }
+        body_put_u32(body, size - pos);
+        body_put(body, data + pos, size - pos);
+
+        JpegCoder coder;
+        memset(&coder, 0, sizeof(coder));
+        coder.out = body;
+        coder.range = 0xFFFFFFFF;
+        coder.pending = 1;
+        jpeg_count_nonzero(&img);
+        result = jpeg_code_coefficients(&img, &coder, model);
+        for (int i = 0; i < 5; i++) jpeg_shift_low(&coder);
+        if (body->failed) result = -1;
+    }
+    jpeg_free_coefficients(&img);
+    free(model);
+    return result;
+}
+
+// Rebuild the original JPEG from a --jpeg body. out_size must be the
+// original size.
+int jpeg_rebuild(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size) {
+    if (body_size < 4) return -1;
+    uint32_t nscans = read_uint32_be(body);
+    if (nscans == 0 || nscans > JPEG_MAX_SCANS) return -1;
+    // Marker bytes of every scan, then the trailer
+    const uint8_t *markers[JPEG_MAX_SCANS + 1];
+    size_t lengths[JPEG_MAX_SCANS + 1];
+    size_t pos = 4;
+    for (uint32_t i = 0; i <= nscans; i++) {
+        if (body_size - pos < 4) return -1;
+        lengths[i] = read_uint32_be(body + pos);
+        pos += 4;
+        if (lengths[i] > body_size - pos) return -1;
+        markers[i] = body + pos;
+        pos += lengths[i];
+    }
+    const uint8_t *trailer = markers[nscans];
+    size_t trailer_size = lengths[nscans];
+    if (lengths[0] < 2 || markers[0][0] != 0xFF || markers[0][1] != 0xD8) return -1;
+
+    JpegImage img;
+    memset(&img, 0, sizeof(img));
+    JpegScan scan;
+    if (jpeg_parse_markers(markers[0], lengths[0], 2, &img, &scan) != lengths[0]) return -1;
+    JpegModel *model = jpeg_model_create();
+    int result = -1;
+    if (model && jpeg_alloc_coefficients(&img) == 0) {
+        JpegCoder coder;
+        memset(&coder, 0, sizeof(coder));
+        coder.decoding = 1;
+        coder.range = 0xFFFFFFFF;
+        coder.in = body + pos;
+        coder.in_size = body_size - pos;
+        coder.in_pos = 1;               // the encoder's first byte is always 0
+        for (int i = 0; i < 4; i++) {
+            coder.code = (coder.code << 8) | (coder.in_pos < coder.in_size ? coder.in[coder.in_pos++] : 0);
+        }
+        result = jpeg_code_coefficients(&img, &coder, model);
+    }
+
+    // Every scan again, with the tables and restart interval of its markers
+    size_t filled = 0;
+    for (uint32_t i = 0; i < nscans && result == 0; i++) {
+        if (i > 0 && jpeg_parse_markers(markers[i], lengths[i], 0, &img, &scan) != lengths[i]) result = -1;
+        if (result != 0 || lengths[i] > out_size - filled) {
+            result = -1;
+            break;
+        }
+        memcpy(out + filled, markers[i], lengths[i]);
+        filled += lengths[i];
+        size_t written = jpeg_encode_scan(&img, &scan, out + filled, out_size - filled);
+        if (!written) result = -1;
+        filled += written;
+    }
+    if (result == 0 && out_size - filled == trailer_size) {
+        memcpy(out + filled, trailer, trailer_size);
+    } else {
+        result = -1;
+    }
+    jpeg_free_coefficients(&img);
+    free(model);
+    return result;
+}
+
+static void jpeg_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    JpegJob *job = ctx;
+    FileEntry *file = &job->archive->files[index];
+    if (!file->content || file->size < 4 || file->content[0] != 0xFF || file->content[1] != 0xD8 ||
+        file->size > UINT32_MAX) return;
+    atomic_fetch_add(&job->candidates, 1);
+    
+    // Besides the coefficients a worker holds the model, the coded body
+    // (kept only while smaller than the file) and the verify copy
+    size_t fixed = sizeof(JpegModel) + 2 * file->size;
+    size_t max_blocks = filter_worker_bytes > fixed ? (filter_worker_bytes - fixed) / JPEG_BLOCK_BYTES : 0;
+    if (max_blocks > JPEG_MAX_BLOCKS) max_blocks = JPEG_MAX_BLOCKS;
+    
+    PrecompBody body = {0};
+    uint8_t *check = max_blocks ? malloc(file->size) : NULL;
+    int encoded = check ? jpeg_encode(file->content, file->size, max_blocks, &body) : max_blocks ? -1 : -2;
+    if (encoded == -2) atomic_fetch_add(&filter_over_limit, 1);
+    if (encoded == 0 && body.size < file->size &&
+        jpeg_rebuild(body.data, body.size, check, file->size) == 0 && memcmp(check, file->content, file->size) == 0 &&
+        filter_keep_body(body.capacity)) {
+        file->jpeg = body.data;
+        file->jpeg_size = body.size;
+        atomic_fetch_add(&job->recoded, 1);
+        atomic_fetch_add(&job->original_bytes, file->size);
+        atomic_fetch_add(&job->coded_bytes, body.size);
+    } else {
+        free(body.data);
+    }
+    free(check);
+}
+
+// Re-code every JPEG member in parallel. Each one is rebuilt from its body
+// and compared with the original before the body is used. A JPEG whose
+// buffers would not fit filter_worker_bytes is left as it is.
+void jpeg_files(Archive *archive, JpegStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    double start = now_ms();
+    
+    JpegJob job;
+    memset(&job, 0, sizeof(job));
+    job.archive = archive;
+    pool_run(get_worker_pool(), archive->count, filter_workers, jpeg_task, &job);
+    
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    stats->candidates = job.candidates;
+    stats->recoded = job.recoded;
+    stats->original_bytes = job.original_bytes;
+    stats->coded_bytes = job.coded_bytes;
+    stats->cpu_ms = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000.0 + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e6;
+    stats->wall_ms = now_ms() - start;
+    
+    double original_mb = stats->original_bytes / (1024.0 * 1024.0);
+    printf("  %zu of %zu JPEG files re-coded: %.2f MB -> %.2f MB (%.1f%% smaller)\n",
+           stats->recoded, stats->candidates, original_mb, stats->coded_bytes / (1024.0 * 1024.0),
+           stats->original_bytes ? 100.0 - stats->coded_bytes * 100.0 / stats->original_bytes : 0.0);
+    printf("  %.0f ms (%.0f ms CPU, %.1f ms CPU per re-coded MB)\n", stats->wall_ms, stats->cpu_ms,
+           original_mb > 0 ? stats->cpu_ms / original_mb : 0.0);
+}
+
+// Last '\n' in the first size bytes of data, or NULL. memrchr does the same
+// but is a GNU extension.
+static const uint8_t *last_newline(const uint8_t *data, size_t size) {
+    while (size > 0) {
+        if (data[--size] == '\n') return data + size;
+    }
+    return NULL;
+}
+
+// Log filter (--log-filter). Line-oriented text becomes a template stream,
+// the text with every number and timestamp replaced by a placeholder, and a
+// stream with their values as varints. Each value is coded either as it is
+// or as the difference to the previous value of the same field, whichever
+// has been cheaper for that field so far; the decoder makes the same
+// choice from what it has already decoded. A field is identified by its
+// position in the line and the four template bytes before it.
+//
+// Placeholders: LOG_NUMBER; LOG_PADDED, digits; LOG_DATETIME, date/time
+// separator, fraction separator (0 for none), fraction digits; LOG_TIME,
+// fraction separator, fraction digits. Template bytes that collide with a
+// placeholder are preceded by LOG_ESCAPE. Everything else, including lines
+// with no field at all, is kept verbatim in the template.
+//
+// Body: u32 template length, template, values.
+typedef struct {
+    uint64_t prev;
+    uint32_t raw_cost;          // running averages of the varint sizes
+    uint32_t delta_cost;
+} LogField;
+
+typedef struct {
+    LogField fields[1 << LOG_FIELD_BITS];
+    uint32_t tail;              // last four template bytes
+    int index;                  // field number within the line
+} LogState;
+
+typedef struct {
+    Archive *archive;
+    atomic_size_t candidates;
+    atomic_size_t candidate_bytes;
+    atomic_size_t filtered;
+    atomic_size_t original_bytes;
+    atomic_size_t template_bytes;
+    atomic_size_t value_bytes;
+    atomic_size_t fields;
+} LogJob;
+
+static const uint64_t log_pow10[19] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL
+};
+
+static size_t log_varint_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static LogField *log_field(LogState *state) {
+    uint64_t key = ((uint64_t)state->tail << 8 | (state->index < 255 ? state->index : 255)) * FAST_P1;
+    return &state->fields[key >> (64 - LOG_FIELD_BITS)];
+}
+
+static uint64_t log_zigzag(uint64_t delta) {
+    return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static void log_field_update(LogField *field, uint64_t value) {
+    field->raw_cost += (uint32_t)log_varint_size(value) * 256 - (field->raw_cost >> 3);
+    field->delta_cost += (uint32_t)log_varint_size(log_zigzag(value - field->prev)) * 256 - (field->delta_cost >> 3);
+    field->prev = value;
+}
+
+static void log_put_template(LogState *state, PrecompBody *tmpl, uint8_t byte) {
+    body_put(tmpl, &byte, 1);
+    state->tail = state->tail << 8 | byte;
+}
+
+static void log_put_value(LogState *state, PrecompBody *values, uint64_t value) {
+    LogField *field = log_field(state);
+    uint8_t buf[10];
+    uint64_t coded = field->delta_cost < field->raw_cost ? log_zigzag(value - field->prev) : value;
+    body_put(values, buf, write_varint(buf, coded));
+    log_field_update(field, value);
+    state->index++;
+}
+
+static int log_digits(const uint8_t *p, size_t avail, size_t n, int *out) {
+    if (avail < n) return 0;
+    int v = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9') return 0;
+        v = v * 10 + (p[i] - '0');
+    }
+    *out = v;
+    return 1;
+}
+
+static int log_word_byte(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+}
+
+static size_t log_digit_run(const uint8_t *p, size_t avail) {
+    size_t n = 0;
+    while (n < avail && p[n] >= '0' && p[n] <= '9') n++;
+    return n;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date, and back
+static int64_t log_days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = y / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static void log_civil_from_days(int64_t z, int *y, int *m, int *d) {
+    z += 719468;
+    int64_t era = z / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = (int)(yoe + era * 400 + (*m <= 2));
+}
+
+// HH:MM:SS with an optional fraction of up to 9 digits at p. Returns the
+// length, 0 if there is no valid time of day.
+static size_t log_parse_time(const uint8_t *p, size_t avail, uint64_t *seconds, uint8_t *frac_sep,
+                             int *frac_digits, uint64_t *frac) {
+    int h, mi, s;
+    if (avail < 8 || p[2] != ':' || p[5] != ':' || !log_digits(p, avail, 2, &h) || !log_digits(p + 3, avail - 3, 2, &mi) ||
+        !log_digits(p + 6, avail - 6, 2, &s) || h > 23 || mi > 59 || s > 59) return 0;
+    *seconds = (uint64_t)h * 3600 + mi * 60 + s;
+    *frac_sep = 0;
+    *frac_digits = 0;
+    *frac = 0;
+    size_t n = 8;
+    if (n < avail && (p[n] == '.' || p[n] == ',')) {
+        size_t digits = log_digit_run(p + n + 1, avail - n - 1);
+        if (digits >= 1 && digits <= 9) {
+            *frac_sep = p[n];
+            *frac_digits = (int)digits;
+            for (size_t i = 0; i < digits; i++) *frac = *frac * 10 + (p[n + 1 + i] - '0');
+            n += 1 + digits;
+        }
+    }
+    return n;
+}
+
+// Split text into template and values. Returns the number of fields found.
+static size_t log_filter_encode(const uint8_t *data, size_t size, PrecompBody *tmpl, PrecompBody *values) {
+    LogState *state = calloc(1, sizeof(LogState));
+    if (!state) {
+        tmpl->failed = 1;
+        return 0;
+    }
+    size_t fields = 0, i = 0;
+    while (i < size && !tmpl->failed) {
+        uint8_t c = data[i];
+        if (c < '0' || c > '9') {
+            if (c >= LOG_NUMBER && c <= LOG_ESCAPE) log_put_template(state, tmpl, LOG_ESCAPE);
+            log_put_template(state, tmpl, c);
+            if (c == '\n') state->index = 0;
+            i++;
+            continue;
+        }
+        
+        // Timestamps first: YYYY-MM-DD[T ]HH:MM:SS[.frac], then HH:MM:SS[.frac]
+        const uint8_t *p = data + i;
+        size_t avail = size - i;
+        uint64_t seconds, frac;
+        uint8_t frac_sep;
+        int frac_digits, y, mo, d;
+        size_t n;
+        if (avail >= 19 && p[4] == '-' && p[7] == '-' && (p[10] == 'T' || p[10] == ' ') &&
+            log_digits(p, avail, 4, &y) && log_digits(p + 5, avail - 5, 2, &mo) && log_digits(p + 8, avail - 8, 2, &d) &&
+            y >= 1970 && y < 2200 && mo >= 1 && mo <= 12 && d >= 1 &&
+            log_days_from_civil(y, mo, d) < log_days_from_civil(mo == 12 ? y + 1 : y, mo == 12 ? 1 : mo + 1, 1) &&
+            (n = log_parse_time(p + 11, avail - 11, &seconds, &frac_sep, &frac_digits, &frac)) != 0) {
+            seconds += (uint64_t)log_days_from_civil(y, mo, d) * 86400;
+            log_put_value(state, values, seconds * log_pow10[frac_digits] + frac);
+            log_put_template(state, tmpl, LOG_DATETIME);
+            log_put_template(state, tmpl, p[10]);
+            log_put_template(state, tmpl, frac_sep);
+            log_put_template(state, tmpl, (uint8_t)frac_digits);
+            fields++;
+            i += 11 + n;
+            continue;
+        }
+        if ((n = log_parse_time(p, avail, &seconds, &frac_sep, &frac_digits, &frac)) != 0) {
+            log_put_value(state, values, seconds * log_pow10[frac_digits] + frac);
+            log_put_template(state, tmpl, LOG_TIME);
+            log_put_template(state, tmpl, frac_sep);
+            log_put_template(state, tmpl, (uint8_t)frac_digits);
+            fields++;
+            i += n;
+            continue;
+        }
+        
+        // Plain digit runs. Digits inside a word (amd64, x86_64, hex), dotted
+        // versions, addresses and decimals, and runs longer than a uint64_t
+        // holds stay text: LZMA matches those better as they are.
+        n = log_digit_run(p, avail);
+        if (n > 18 || (i > 0 && log_word_byte(data[i - 1])) || (n < avail && log_word_byte(p[n]))) {
+            for (size_t k = 0; k < n; k++) log_put_template(state, tmpl, p[k]);
+            i += n;
+            continue;
+        }
+        uint64_t value = 0;
+        for (size_t k = 0; k < n; k++) value = value * 10 + (p[k] - '0');
+        log_put_value(state, values, value);
+        if (p[0] == '0' && n > 1) {
+            log_put_template(state, tmpl, LOG_PADDED);
+            log_put_template(state, tmpl, (uint8_t)n);
+        } else {
+            log_put_template(state, tmpl, LOG_NUMBER);
+        }
+        fields++;
+        i += n;
+    }
+    free(state);
+    return fields;
+}
+
+// Re-create a filtered file from its body into out (out_size bytes)
+int log_filter_decode(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size) {
+    if (body_size < 4 || read_uint32_be(body) > body_size - 4) return -1;
+    const uint8_t *tmpl = body + 4;
+    size_t tmpl_size = read_uint32_be(body);
+    const uint8_t *values = tmpl + tmpl_size;
+    size_t values_size = body_size - 4 - tmpl_size;
+    LogState *state = calloc(1, sizeof(LogState));
+    if (!state) return -1;
+    
+    size_t t = 0, v = 0, filled = 0;
+    int result = 0;
+    while (t < tmpl_size && result == 0) {
+        uint8_t c = tmpl[t++];
+        if (c < LOG_NUMBER || c > LOG_ESCAPE) {
+            state->tail = state->tail << 8 | c;
+            if (filled == out_size) {
+                result = -1;
+                break;
+            }
+            out[filled++] = c;
+            if (c == '\n') state->index = 0;
+            continue;
+        }
+        size_t params = c == LOG_DATETIME ? 3 : c == LOG_TIME ? 2 : c == LOG_NUMBER ? 0 : 1;
+        if (t + params > tmpl_size) {
+            result = -1;
+            break;
+        }
+        const uint8_t *param = tmpl + t;
+        if (c == LOG_ESCAPE) {
+            state->tail = (state->tail << 8 | c) << 8 | param[0];
+            if (filled == out_size) result = -1;
+            else out[filled++] = param[0];
+            t++;
+            continue;
+        }
+        
+        LogField *field = log_field(state);
+        uint64_t coded;
+        size_t n = read_varint(values + v, values_size - v, &coded);
+        if (!n) {
+            result = -1;
+            break;
+        }
+        v += n;
+        uint64_t value = field->delta_cost < field->raw_cost ?
+                         field->prev + ((coded >> 1) ^ (0 - (coded & 1))) : coded;
+        log_field_update(field, value);
+        state->index++;
+        state->tail = state->tail << 8 | c;
+        for (size_t k = 0; k < params; k++) state->tail = state->tail << 8 | param[k];
+        t += params;
+        
+        char text[48];
+        int len;
+        if (c == LOG_NUMBER) {
+            len = snprintf(text, sizeof(text), "%llu", (unsigned long long)value);
+        } else if (c == LOG_PADDED) {
+            len = param[0] <= 18 ? snprintf(text, sizeof(text), "%0*llu", param[0], (unsigned long long)value) : -1;
+        } else {
+            int digits = param[params - 1];
+            if (digits > 9) {
+                result = -1;
+                break;
+            }
+            uint64_t seconds = value / log_pow10[digits], frac = value % log_pow10[digits];
+            len = 0;
+            if (c == LOG_DATETIME) {
+                int y, mo, d;
+                log_civil_from_days((int64_t)(seconds / 86400), &y, &mo, &d);
+                len = snprintf(text, sizeof(text), "%04d-%02d-%02d%c", y, mo, d, param[0]);
+                seconds %= 86400;
+            }
+            len += snprintf(text + len, sizeof(text) - len, "%02u:%02u:%02u", (unsigned)(seconds / 3600),
+                            (unsigned)(seconds / 60 % 60), (unsigned)(seconds % 60));
+            if (param[params - 2]) {
+                len += snprintf(text + len, sizeof(text) - len, "%c%0*llu", param[params - 2], digits,
+                                (unsigned long long)frac);
+            }
+        }
+        if (len < 0 || (size_t)len >= sizeof(text) || (size_t)len > out_size - filled) {
+            result = -1;
+            break;
+        }
+        memcpy(out + filled, text, len);
+        filled += len;
+    }
+    free(state);
+    return result == 0 && filled == out_size && v == values_size ? 0 : -1;
+}
+
+// Template and values of data as a body. Returns the number of fields.
+static size_t log_filter_body(const uint8_t *data, size_t size, PrecompBody *body, size_t *template_bytes,
+                              size_t *value_bytes) {
+    PrecompBody tmpl = { NULL, 0, 0, 0, 0 }, values = { NULL, 0, 0, 0, 0 };
+    size_t fields = log_filter_encode(data, size, &tmpl, &values);
+    body_put_u32(body, tmpl.size);
+    body_put(body, tmpl.data, tmpl.size);
+    body_put(body, values.data, values.size);
+    if (tmpl.failed || values.failed) body->failed = 1;
+    *template_bytes = tmpl.size;
+    *value_bytes = values.size;
+    free(tmpl.data);
+    free(values.data);
+    return fields;
+}
+
+// Compressed size of data with a fast preset, SIZE_MAX on failure
+static size_t filter_probe_size(const uint8_t *data, size_t size) {
+    size_t out_cap = lzma_stream_buffer_bound(size);
+    uint8_t *out = malloc(out_cap);
+    size_t out_pos = 0;
+    if (!out || lzma_easy_buffer_encode(1, LZMA_CHECK_NONE, NULL, data, size, out, &out_pos, out_cap) != LZMA_OK) {
+        out_pos = SIZE_MAX;
+    }
+    free(out);
+    return out_pos;
+}
+
+// What a text filter holds for a file of size bytes besides its body: the
+// verify copy, its own working buffers (the file again, grown by doubling)
+// and the compressibility probe
+static size_t text_filter_fixed(size_t size) {
+    return 3 * size + 2 * FILTER_PROBE_BYTES + (size_t)lzma_easy_encoder_memusage(1);
+}
+
+// Body limit for a text filter under --mem-limit (0 = no limit); -1 if the
+// file does not fit the worker's allowance at all
+static int text_filter_body_limit(size_t size, size_t *limit) {
+    *limit = 0;
+    if (filter_worker_bytes == SIZE_MAX) return 0;
+    size_t fixed = text_filter_fixed(size);
+    if (filter_worker_bytes <= fixed) {
+        atomic_fetch_add(&filter_over_limit, 1);
+        return -1;
+    }
+    *limit = filter_worker_bytes - fixed;
+    return 0;
+}
+
+static void log_filter_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    LogJob *job = ctx;
+    FileEntry *file = &job->archive->files[index];
+    if (!file->content || file->type != FILE_TYPE_TEXT || file->size < LOG_MIN_SIZE || file->size > UINT32_MAX ||
+        file->precomp || file->jpeg || file->columnar) return;
+    size_t lines = 0;
+    for (const uint8_t *p = file->content; (p = memchr(p, '\n', file->content + file->size - p)) != NULL; p++) lines++;
+    if (lines < LOG_MIN_LINES || file->size / lines > LOG_MAX_LINE) return;
+    atomic_fetch_add(&job->candidates, 1);
+    atomic_fetch_add(&job->candidate_bytes, file->size);
+    
+    // Decide on the first FILTER_PROBE_BYTES (whole lines): most lines must
+    // carry a field, and the filtered text must compress better than the
+    // original. Repetitive logs that LZMA already matches line by line often
+    // do not gain.
+    size_t probe = file->size;
+    if (probe > FILTER_PROBE_BYTES) {
+        const uint8_t *cut = last_newline(file->content, FILTER_PROBE_BYTES);
+        probe = cut ? (size_t)(cut - file->content) + 1 : FILTER_PROBE_BYTES;
+    }
+    size_t probe_lines = 0;
+    for (const uint8_t *p = file->content; (p = memchr(p, '\n', file->content + probe - p)) != NULL; p++) probe_lines++;
+    PrecompBody body = { NULL, 0, 0, 0, 0 };
+    if (text_filter_body_limit(file->size, &body.limit) != 0) return;
+    size_t template_bytes, value_bytes;
+    size_t fields = log_filter_body(file->content, probe, &body, &template_bytes, &value_bytes);
+    int use = !body.failed && fields >= probe_lines &&
+              filter_probe_size(body.data, body.size) < filter_probe_size(file->content, probe);
+    if (use && probe < file->size) {
+        body.size = 0;
+        fields = log_filter_body(file->content, file->size, &body, &template_bytes, &value_bytes);
+        use = !body.failed;
+        if (body.failed && body.limit) atomic_fetch_add(&filter_over_limit, 1);
+    }
+    
+    uint8_t *check = use ? malloc(file->size) : NULL;
+    if (check && log_filter_decode(body.data, body.size, check, file->size) == 0 &&
+        memcmp(check, file->content, file->size) == 0 && filter_keep_body(body.capacity)) {
+        file->log_filter = body.data;
+        file->log_filter_size = body.size;
+        atomic_fetch_add(&job->filtered, 1);
+        atomic_fetch_add(&job->original_bytes, file->size);
+        atomic_fetch_add(&job->template_bytes, template_bytes);
+        atomic_fetch_add(&job->value_bytes, value_bytes);
+        atomic_fetch_add(&job->fields, fields);
+    } else {
+        free(body.data);
+    }
+    free(check);
+}
+
+// Filter every line-oriented text member in parallel. Each one is decoded
+// again and compared with the original before the body is used.
+void log_filter_files(Archive *archive, LogFilterStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    double start = now_ms();
+    
+    LogJob job;
+    memset(&job, 0, sizeof(job));
+    job.archive = archive;
+    pool_run(get_worker_pool(), archive->count, filter_workers, log_filter_task, &job);
+    
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    stats->candidates = job.candidates;
+    stats->candidate_bytes = job.candidate_bytes;
+    stats->filtered = job.filtered;
+    stats->original_bytes = job.original_bytes;
+    stats->template_bytes = job.template_bytes;
+    stats->value_bytes = job.value_bytes;
+    stats->fields = job.fields;
+    stats->cpu_ms = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000.0 + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e6;
+    stats->wall_ms = now_ms() - start;
+    
+    double original_mb = stats->original_bytes / (1024.0 * 1024.0);
+    printf("  %zu of %zu log files filtered: %.2f MB -> %.2f MB template + %.2f MB values (%zu fields)\n",
+           stats->filtered, stats->candidates, original_mb, stats->template_bytes / (1024.0 * 1024.0),
+           stats->value_bytes / (1024.0 * 1024.0), stats->fields);
+    printf("  %.0f ms (%.0f ms CPU, %.0f MB/s per core over the candidates)\n", stats->wall_ms, stats->cpu_ms,
+           stats->cpu_ms > 0 ? stats->candidate_bytes / (1024.0 * 1024.0) / (stats->cpu_ms / 1000.0) : 0.0);
+}
+
+// Columnar tables (--columnar). Delimited text (CSV, TSV, ...) and NDJSON
+// are stored column by column, so LZMA sees each column's values next to
+// each other instead of interleaved with the rest of the row.
+//
+// Delimited: the rows stream has per row the field count (varint) and the
+// line ending (COLUMNAR_LF, COLUMNAR_CRLF, or COLUMNAR_EOF for a last row
+// without one). Field i goes to column i; fields past the last column share
+// it. NDJSON: the rows stream holds each line with its top-level values
+// replaced by COLUMNAR_VALUE, and each value goes to the column of its key
+// (the key string as written, numbered in order of first use). Lines that
+// are not a plain object, or hold control bytes, are kept whole after
+// COLUMNAR_RAW.
+//
+// In a column every value ends with a newline; newlines and COLUMNAR_ESCAPE
+// inside a value are preceded by COLUMNAR_ESCAPE.
+//
+// Body: format, delimiter (0 for NDJSON), u32 column count, u32 rows length,
+// rows, then per column u32 length and the values.
+typedef struct {
+    const uint8_t *data;
+    uint32_t size;
+    int column;
+} ColumnarKey;
+
+typedef struct {
+    PrecompBody rows;
+    PrecompBody columns[COLUMNAR_MAX_COLUMNS];
+    int ncolumns;
+    ColumnarKey keys[COLUMNAR_KEY_SLOTS];
+    int nkeys;
+} ColumnarTable;
+
+typedef struct {
+    Archive *archive;
+    atomic_size_t candidates;
+    atomic_size_t candidate_bytes;
+    atomic_size_t converted;
+    atomic_size_t original_bytes;
+    atomic_size_t columns;
+} ColumnarJob;
+
+// Column of an NDJSON key, numbered in order of first use. The decoder
+// sees the keys in the same order and numbers them the same way.
+static int columnar_key_column(ColumnarTable *table, const uint8_t *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+    size_t slot = h & (COLUMNAR_KEY_SLOTS - 1);
+    while (table->keys[slot].data) {
+        if (table->keys[slot].size == len && memcmp(table->keys[slot].data, key, len) == 0) {
+            return table->keys[slot].column;
+        }
+        slot = (slot + 1) & (COLUMNAR_KEY_SLOTS - 1);
+    }
+    int column = table->nkeys < COLUMNAR_MAX_COLUMNS ? table->nkeys : COLUMNAR_MAX_COLUMNS - 1;
+    if (table->nkeys < COLUMNAR_KEY_SLOTS / 2) {
+        table->keys[slot].data = key;
+        table->keys[slot].size = (uint32_t)len;
+        table->keys[slot].column = column;
+        table->nkeys++;
+    }
+    return column;
+}
+
+static void columnar_put_value(ColumnarTable *table, int column, const uint8_t *data, size_t len) {
+    PrecompBody *out = &table->columns[column];
+    size_t from = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n' && data[i] != COLUMNAR_ESCAPE) continue;
+        uint8_t escape = COLUMNAR_ESCAPE;
+        body_put(out, data + from, i - from);
+        body_put(out, &escape, 1);
+        from = i;
+    }
+    body_put(out, data + from, len - from);
+    body_put(out, "\n", 1);
+    if (column >= table->ncolumns) table->ncolumns = column + 1;
+}
+
+// Copy the next value of a column to out. Returns the bytes written, or
+// SIZE_MAX if the column is exhausted or out is too small.
+static size_t columnar_get_value(const uint8_t *column, size_t size, size_t *pos, uint8_t *out, size_t avail) {
+    size_t n = 0;
+    while (*pos < size) {
+        uint8_t c = column[(*pos)++];
+        if (c == '\n') return n;
+        if (c == COLUMNAR_ESCAPE) {
+            if (*pos == size) break;
+            c = column[(*pos)++];
+        }
+        if (n == avail) break;
+        out[n++] = c;
+    }
+    return SIZE_MAX;
+}
+
+// Field of a delimited row starting at pos: its bytes are [pos, *end), and
+// *last is set when the row ends after it. Returns where the next field
+// starts. A field that opens with a quote runs to the closing quote ("" is
+// an escaped quote), so delimiters and newlines inside quotes are data.
+static size_t columnar_field(const uint8_t *data, size_t size, size_t pos, uint8_t delimiter, size_t *end, int *last) {
+    if (pos < size && data[pos] == '"') {
+        pos++;
+        while (pos < size) {
+            if (data[pos++] != '"') continue;
+            if (pos < size && data[pos] == '"') {
+                pos++;
+            } else {
+                break;
+            }
+        }
+    }
+    while (pos < size && data[pos] != delimiter && data[pos] != '\n') pos++;
+    *end = pos;
+    *last = pos >= size || data[pos] == '\n';
+    return pos + 1;
+}
+
+static void columnar_split_delimited(ColumnarTable *table, const uint8_t *data, size_t size, uint8_t delimiter) {
+    size_t pos = 0;
+    while (pos < size && !table->rows.failed) {
+        uint32_t fields = 0;
+        uint8_t ending = COLUMNAR_EOF;
+        int last = 0;
+        while (!last) {
+            size_t start = pos, end;
+            pos = columnar_field(data, size, pos, delimiter, &end, &last);
+            if (last && end < size) {
+                ending = end > start && data[end - 1] == '\r' ? COLUMNAR_CRLF : COLUMNAR_LF;
+                if (ending == COLUMNAR_CRLF) end--;
+            }
+            columnar_put_value(table, fields < COLUMNAR_MAX_COLUMNS ? (int)fields : COLUMNAR_MAX_COLUMNS - 1,
+                               data + start, end - start);
+            fields++;
+        }
+        uint8_t buf[11];
+        size_t n = write_varint(buf, fields);
+        buf[n++] = ending;
+        body_put(&table->rows, buf, n);
+    }
+}
+
+static int columnar_space(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// End of the JSON string that opens at pos, 0 if it is not closed
+static size_t columnar_string_end(const uint8_t *line, size_t len, size_t pos) {
+    for (pos++; pos < len; pos++) {
+        if (line[pos] == '\\') {
+            pos++;
+        } else if (line[pos] == '"') {
+            return pos + 1;
+        }
+    }
+    return 0;
+}
+
+// End of the JSON value at pos: a string, a nested object or array, or a
+// scalar. 0 if there is none.
+static size_t columnar_value_end(const uint8_t *line, size_t len, size_t pos) {
+    if (pos >= len) return 0;
+    if (line[pos] == '"') return columnar_string_end(line, len, pos);
+    if (line[pos] == '{' || line[pos] == '[') {
+        int depth = 0;
+        while (pos < len) {
+            uint8_t c = line[pos];
+            if (c == '"') {
+                pos = columnar_string_end(line, len, pos);
+                if (!pos) return 0;
+                continue;
+            }
+            if (c == '{' || c == '[') depth++;
+            if (c == '}' || c == ']') depth--;
+            pos++;
+            if (depth == 0) return pos;
+        }
+        return 0;
+    }
+    size_t start = pos;
+    while (pos < len && line[pos] != ',' && line[pos] != '}' && line[pos] != ']' && !columnar_space(line[pos])) pos++;
+    return pos > start ? pos : 0;
+}
+
+// Split one NDJSON line (without its newline) into template and values.
+// Returns 0 if the line is not a plain object; nothing is written then.
+static int columnar_split_object(ColumnarTable *table, const uint8_t *line, size_t len) {
+    size_t spans[COLUMNAR_MAX_COLUMNS][4];  // key start/end, value start/end
+    int n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (line[i] < 0x20 && !columnar_space(line[i])) return 0;
+    }
+    size_t pos = 0;
+    while (pos < len && columnar_space(line[pos])) pos++;
+    if (pos == len || line[pos++] != '{') return 0;
+    while (pos < len && columnar_space(line[pos])) pos++;
+    if (pos < len && line[pos] == '}') {
+        pos++;
+    } else {
+        for (;;) {
+            if (n == COLUMNAR_MAX_COLUMNS || pos >= len || line[pos] != '"') return 0;
+            spans[n][0] = pos;
+            spans[n][1] = pos = columnar_string_end(line, len, pos);
+            if (!pos) return 0;
+            while (pos < len && columnar_space(line[pos])) pos++;
+            if (pos >= len || line[pos++] != ':') return 0;
+            while (pos < len && columnar_space(line[pos])) pos++;
+            spans[n][2] = pos;
+            spans[n][3] = pos = columnar_value_end(line, len, pos);
+            if (!pos) return 0;
+            n++;
+            while (pos < len && columnar_space(line[pos])) pos++;
+            if (pos >= len) return 0;
+            if (line[pos] == '}') {
+                pos++;
+                break;
+            }
+            if (line[pos++] != ',') return 0;
+            while (pos < len && columnar_space(line[pos])) pos++;
+        }
+    }
+    while (pos < len && columnar_space(line[pos])) pos++;
+    if (pos != len) return 0;
+    
+    size_t from = 0;
+    for (int k = 0; k < n; k++) {
+        int column = columnar_key_column(table, line + spans[k][0], spans[k][1] - spans[k][0]);
+        uint8_t placeholder = COLUMNAR_VALUE;
+        body_put(&table->rows, line + from, spans[k][2] - from);
+        body_put(&table->rows, &placeholder, 1);
+        columnar_put_value(table, column, line + spans[k][2], spans[k][3] - spans[k][2]);
+        from = spans[k][3];
+    }
+    body_put(&table->rows, line + from, len - from);
+    return 1;
+}
+
+static void columnar_split_ndjson(ColumnarTable *table, const uint8_t *data, size_t size) {
+    size_t pos = 0;
+    while (pos < size && !table->rows.failed) {
+        const uint8_t *eol = memchr(data + pos, '\n', size - pos);
+        size_t len = eol ? (size_t)(eol - data) - pos : size - pos;
+        if (!columnar_split_object(table, data + pos, len)) {
+            uint8_t raw = COLUMNAR_RAW;
+            body_put(&table->rows, &raw, 1);
+            body_put(&table->rows, data + pos, len);
+        }
+        if (eol) body_put(&table->rows, "\n", 1);
+        pos += len + 1;
+    }
+}
+
+// Split data into rows and columns and lay them out as a body
+static int columnar_encode(const uint8_t *data, size_t size, TableFormat format, uint8_t delimiter,
+                           PrecompBody *body, int *ncolumns) {
+    ColumnarTable *table = calloc(1, sizeof(ColumnarTable));
+    if (!table) return -1;
+    if (format == TABLE_DELIMITED) {
+        columnar_split_delimited(table, data, size, delimiter);
+    } else {
+        columnar_split_ndjson(table, data, size);
+    }
+    uint8_t header[2] = { (uint8_t)format, format == TABLE_DELIMITED ? delimiter : 0 };
+    body_put(body, header, 2);
+    body_put_u32(body, table->ncolumns);
+    body_put_u32(body, table->rows.size);
+    body_put(body, table->rows.data, table->rows.size);
+    int failed = table->rows.failed;
+    *ncolumns = table->ncolumns;
+    for (int c = 0; c < table->ncolumns; c++) {
+        body_put_u32(body, table->columns[c].size);
+        body_put(body, table->columns[c].data, table->columns[c].size);
+        failed |= table->columns[c].failed;
+    }
+    free(table->rows.data);
+    for (int c = 0; c < COLUMNAR_MAX_COLUMNS; c++) free(table->columns[c].data);
+    free(table);
+    return failed || body->failed ? -1 : 0;
+}
+
+// Re-create a columnar file from its body into out (out_size bytes)
+int columnar_decode(const uint8_t *body, size_t body_size, uint8_t *out, size_t out_size) {
+    if (body_size < 10) return -1;
+    TableFormat format = (TableFormat)body[0];
+    uint8_t delimiter = body[1];
+    uint32_t ncolumns = read_uint32_be(body + 2);
+    size_t rows_size = read_uint32_be(body + 6);
+    if ((format != TABLE_DELIMITED && format != TABLE_NDJSON) || ncolumns > COLUMNAR_MAX_COLUMNS ||
+        rows_size > body_size - 10) return -1;
+    const uint8_t *rows = body + 10;
+    const uint8_t *columns[COLUMNAR_MAX_COLUMNS];
+    size_t sizes[COLUMNAR_MAX_COLUMNS], cursors[COLUMNAR_MAX_COLUMNS];
+    size_t pos = 10 + rows_size;
+    for (uint32_t c = 0; c < ncolumns; c++) {
+        if (body_size - pos < 4 || read_uint32_be(body + pos) > body_size - pos - 4) return -1;
+        sizes[c] = read_uint32_be(body + pos);
+        columns[c] = body + pos + 4;
+        cursors[c] = 0;
+        pos += 4 + sizes[c];
+    }
+    if (pos != body_size) return -1;
+    
+    ColumnarTable *table = format == TABLE_NDJSON ? calloc(1, sizeof(ColumnarTable)) : NULL;
+    if (format == TABLE_NDJSON && !table) return -1;
+    size_t r = 0, filled = 0, n;
+    int result = 0;
+    const uint8_t *key = NULL;
+    size_t key_size = 0;
+    while (r < rows_size && result == 0) {
+        if (format == TABLE_DELIMITED) {
+            uint64_t fields;
+            size_t used = read_varint(rows + r, rows_size - r, &fields);
+            if (!used || r + used >= rows_size || fields == 0 || fields > out_size - filled + 1) {
+                result = -1;
+                break;
+            }
+            uint8_t ending = rows[r + used];
+            r += used + 1;
+            for (uint64_t f = 0; f < fields && result == 0; f++) {
+                uint32_t c = f < COLUMNAR_MAX_COLUMNS ? (uint32_t)f : COLUMNAR_MAX_COLUMNS - 1;
+                if (f > 0) {
+                    if (filled == out_size) result = -1;
+                    else out[filled++] = delimiter;
+                }
+                if (result != 0 || c >= ncolumns ||
+                    (n = columnar_get_value(columns[c], sizes[c], &cursors[c], out + filled, out_size - filled)) == SIZE_MAX) {
+                    result = -1;
+                    break;
+                }
+                filled += n;
+            }
+            const char *eol = ending == COLUMNAR_LF ? "\n" : ending == COLUMNAR_CRLF ? "\r\n" : "";
+            if (ending > COLUMNAR_EOF || strlen(eol) > out_size - filled) {
+                result = -1;
+            } else {
+                memcpy(out + filled, eol, strlen(eol));
+                filled += strlen(eol);
+            }
+            continue;
+        }
+        
+        // NDJSON: copy the template, filling in values by their key
+        uint8_t c = rows[r];
+        if (c == COLUMNAR_RAW && (r == 0 || rows[r - 1] == '\n')) {
+            const uint8_t *eol = memchr(rows + r + 1, '\n', rows_size - r - 1);
+            n = eol ? (size_t)(eol - rows) + 1 - (r + 1) : rows_size - r - 1;
+            if (n > out_size - filled) {
+                result = -1;
+            } else {
+                memcpy(out + filled, rows + r + 1, n);
+                filled += n;
+                r += 1 + n;
+            }
+            continue;
+        }
+        if (c == COLUMNAR_VALUE) {
+            int column = key ? columnar_key_column(table, key, key_size) : -1;
+            if (column < 0 || (uint32_t)column >= ncolumns ||
+                (n = columnar_get_value(columns[column], sizes[column], &cursors[column], out + filled,
+                                        out_size - filled)) == SIZE_MAX) {
+                result = -1;
+            } else {
+                filled += n;
+                r++;
+            }
+            continue;
+        }
+        n = 1;
+        if (c == '"') {
+            n = columnar_string_end(rows, rows_size, r);
+            n = n ? n - r : 0;
+            key = rows + r;
+            key_size = n;
+        }
+        if (n == 0 || n > out_size - filled) {
+            result = -1;
+        } else {
+            memcpy(out + filled, rows + r, n);
+            filled += n;
+            r += n;
+        }
+    }
+    free(table);
+    for (uint32_t c = 0; c < ncolumns && result == 0; c++) {
+        if (cursors[c] != sizes[c]) result = -1;
+    }
+    return result == 0 && filled == out_size ? 0 : -1;
+}
+
+// Delimited text or NDJSON, judged on the whole lines in the first
+// COLUMNAR_SAMPLE_BYTES: NDJSON if nearly every line is an object,
+// delimited if nearly every row has as many fields as the first one, at
+// least two, for one of the common delimiters
+TableFormat detect_table_format(const uint8_t *data, size_t size, uint8_t *delimiter) {
+    size_t sample = size;
+    if (sample > COLUMNAR_SAMPLE_BYTES) {
+        const uint8_t *cut = last_newline(data, COLUMNAR_SAMPLE_BYTES);
+        if (!cut) return TABLE_NONE;
+        sample = (size_t)(cut - data) + 1;
+    }
+    size_t lines = 0, objects = 0;
+    for (size_t pos = 0; pos < sample;) {
+        const uint8_t *eol = memchr(data + pos, '\n', sample - pos);
+        size_t end = eol ? (size_t)(eol - data) : sample;
+        size_t a = pos, b = end;
+        while (a < b && columnar_space(data[a])) a++;
+        while (b > a && columnar_space(data[b - 1])) b--;
+        if (b > a) {
+            lines++;
+            objects += data[a] == '{' && data[b - 1] == '}';
+        }
+        pos = end + 1;
+    }
+    if (lines < COLUMNAR_MIN_LINES) return TABLE_NONE;
+    if (objects * 10 >= lines * 9) return TABLE_NDJSON;
+    
+    static const uint8_t candidates[] = { ',', '\t', ';', '|' };
+    TableFormat format = TABLE_NONE;
+    size_t best = 1;
+    for (size_t i = 0; i < sizeof(candidates); i++) {
+        size_t rows = 0, matching = 0, expected = 0, pos = 0;
+        while (pos < sample) {
+            size_t fields = 0, end;
+            int last = 0;
+            while (!last) {
+                pos = columnar_field(data, sample, pos, candidates[i], &end, &last);
+                fields++;
+            }
+            if (rows == 0) expected = fields;
+            rows++;
+            matching += fields == expected;
+        }
+        if (expected > best && rows >= COLUMNAR_MIN_LINES && matching * 10 >= rows * 9) {
+            best = expected;
+            *delimiter = candidates[i];
+            format = TABLE_DELIMITED;
+        }
+    }
+    return format;
+}
+
+static void columnar_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    ColumnarJob *job = ctx;
+    FileEntry *file = &job->archive->files[index];
+    if (!file->content || file->type != FILE_TYPE_TEXT || file->size < COLUMNAR_MIN_SIZE ||
+        file->size > UINT32_MAX || file->precomp || file->jpeg) return;
+    uint8_t delimiter = 0;
+    TableFormat format = detect_table_format(file->content, file->size, &delimiter);
+    if (format == TABLE_NONE) return;
+    atomic_fetch_add(&job->candidates, 1);
+    atomic_fetch_add(&job->candidate_bytes, file->size);
+    
+    // Like the log filter, decide on a prefix of whole lines
+    size_t probe = file->size;
+    if (probe > FILTER_PROBE_BYTES) {
+        const uint8_t *cut = last_newline(file->content, FILTER_PROBE_BYTES);
+        probe = cut ? (size_t)(cut - file->content) + 1 : FILTER_PROBE_BYTES;
+    }
+    PrecompBody body = { NULL, 0, 0, 0, 0 };
+    if (text_filter_body_limit(file->size, &body.limit) != 0) return;
+    int ncolumns;
+    int use = columnar_encode(file->content, probe, format, delimiter, &body, &ncolumns) == 0 &&
+              filter_probe_size(body.data, body.size) < filter_probe_size(file->content, probe);
+    if (use && probe < file->size) {
+        body.size = 0;
+        use = columnar_encode(file->content, file->size, format, delimiter, &body, &ncolumns) == 0;
+        if (body.failed && body.limit) atomic_fetch_add(&filter_over_limit, 1);
+    }
+    
+    uint8_t *check = use ? malloc(file->size) : NULL;
+    if (check && columnar_decode(body.data, body.size, check, file->size) == 0 &&
+        memcmp(check, file->content, file->size) == 0 && filter_keep_body(body.capacity)) {
+        file->columnar = body.data;
+        file->columnar_size = body.size;
+        atomic_fetch_add(&job->converted, 1);
+        atomic_fetch_add(&job->original_bytes, file->size);
+        atomic_fetch_add(&job->columns, ncolumns);
+    } else {
+        free(body.data);
+    }
+    free(check);
+}
+
+// Store every delimited or NDJSON member column by column, in parallel.
+// Each one is re-interleaved and compared with the original before the
+// body is used.
+void columnar_files(Archive *archive, ColumnarStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    double start = now_ms();
+    
+    ColumnarJob job;
+    memset(&job, 0, sizeof(job));
+    job.archive = archive;
+    pool_run(get_worker_pool(), archive->count, filter_workers, columnar_task, &job);
+    
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    stats->candidates = job.candidates;
+    stats->candidate_bytes = job.candidate_bytes;
+    stats->converted = job.converted;
+    stats->original_bytes = job.original_bytes;
+    stats->columns = job.columns;
+    stats->cpu_ms = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000.0 + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e6;
+    stats->wall_ms = now_ms() - start;
+    
+    printf("  %zu of %zu table files stored by column: %.2f MB in %zu columns\n", stats->converted,
+           stats->candidates, stats->original_bytes / (1024.0 * 1024.0), stats->columns);
+    printf("  %.0f ms (%.0f ms CPU, %.0f MB/s per core over the candidates)\n", stats->wall_ms, stats->cpu_ms,
+           stats->cpu_ms > 0 ? stats->candidate_bytes / (1024.0 * 1024.0) / (stats->cpu_ms / 1000.0) : 0.0);
+}
+
+static size_t lrm_emit(uint8_t *out, const uint8_t *lit, size_t lit_len, size_t match_len, size_t distance) {
+    size_t n = write_varint(out, lit_len);
+    memcpy(out + n, lit, lit_len);
+    n += lit_len;
+    n += write_varint(out + n, match_len);
+    if (match_len > 0) n += write_varint(out + n, distance);
+    return n;
+}
+
+// rzip-style long-distance matching over the whole serialized stream. Blocks
+// at multiples of the index granularity are hashed into a direct-mapped table
+// and a rolling hash of the same width finds them again anywhere later in the
+// input. Verified matches of LRM_MIN_MATCH_BLOCKS blocks or more that lie at
+// least LRM_MIN_DISTANCE back become (length, distance) references; closer
+// repeats are left to the LZMA dictionary.
+//
+// Stream: varint original size, then repeated
+//   varint literal length, literal bytes, varint match length [, varint distance]
+uint8_t* lrm_encode(const uint8_t *data, size_t size, size_t *out_size, LrmStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    double start = now_ms();
+    
+    // Scale the index granularity so the table stays bounded on huge inputs
+    size_t block = LRM_MIN_BLOCK;
+    while (size / block > LRM_MAX_TABLE) block <<= 1;
+    size_t table_size = 1;
+    while (table_size < size / block && table_size < LRM_MAX_TABLE) table_size <<= 1;
+    stats->block = block;
+    
+    uint8_t *out = malloc(size + 64);
+    uint64_t *table = calloc(table_size, sizeof(uint64_t)); // position + 1, 0 = empty
+    if (!out || !table) {
+        free(out);
+        free(table);
+        return NULL;
+    }
+    
+    size_t out_pos = write_varint(out, size);
+    
+    uint64_t mul_pow = 1; // LRM_HASH_MUL^(block-1), weight of the outgoing byte
+    for (size_t k = 1; k < block; k++) mul_pow *= LRM_HASH_MUL;
+    
+    size_t lit_start = 0;
+    size_t i = 0;
+    uint64_t h = 0;
+    int hash_valid = 0;
+    size_t min_match = block * LRM_MIN_MATCH_BLOCKS;
+    
+    while (i + block <= size) {
+        if (!hash_valid) {
+            h = 0;
+            for (size_t k = 0; k < block; k++) h = h * LRM_HASH_MUL + data[i + k];
+            hash_valid = 1;
+        }
+        
+        size_t slot = mix64(h) & (table_size - 1);
+        uint64_t cand = table[slot];
+        if (cand != 0) {
+            size_t p = cand - 1;
+            if (i - p >= LRM_MIN_DISTANCE && memcmp(data + p, data + i, block) == 0) {
+                size_t match_start = i;
+                size_t match_pos = p;
+                while (match_start > lit_start && match_pos > 0 &&
+                       data[match_pos - 1] == data[match_start - 1]) {
+                    match_start--;
+                    match_pos--;
+                }
+                size_t match_len = i - match_start + block;
+                while (match_start + match_len < size && data[match_pos + match_len] == data[match_start + match_len]) {
+                    match_len++;
+                }
+                
+                if (match_len >= min_match) {
+                    out_pos += lrm_emit(out + out_pos, data + lit_start, match_start - lit_start,
+                                        match_len, match_start - match_pos);
+                    stats->matches++;
+                    stats->matched_bytes += match_len;
+                    i = match_start + match_len;
+                    lit_start = i;
+                    hash_valid = 0;
+                    continue;
+                }
+            }
+        }
+        
+        if (i % block == 0) table[slot] = i + 1;
+        
+        if (i + block < size) {
+            h = (h - data[i] * mul_pow) * LRM_HASH_MUL + data[i + block];
+        }
+        i++;
+    }
+    
+    out_pos += lrm_emit(out + out_pos, data + lit_start, size - lit_start, 0, 0);
+    
+    free(table);
+    stats->output_size = out_pos;
+    stats->encode_ms = now_ms() - start;
+    *out_size = out_pos;
+    return out;
+}
+
+uint8_t* lrm_decode(const uint8_t *data, size_t size, size_t *out_size) {
+    uint64_t total;
+    size_t pos = read_varint(data, size, &total);
+    if (pos == 0) return NULL;
+    
+    uint8_t *out = malloc(total ? total : 1);
+    if (!out) return NULL;
+    size_t out_pos = 0;
+    
+    while (out_pos < total) {
+        uint64_t lit_len, match_len, distance;
+        size_t n = read_varint(data + pos, size - pos, &lit_len);
+        if (n == 0 || lit_len > size - pos - n || lit_len > total - out_pos) break;
+        pos += n;
+        memcpy(out + out_pos, data + pos, lit_len);
+        pos += lit_len;
+        out_pos += lit_len;
+        
+        n = read_varint(data + pos, size - pos, &match_len);
+        if (n == 0) break;
+        pos += n;
+        if (match_len == 0) continue;
+        
+        n = read_varint(data + pos, size - pos, &distance);
+        if (n == 0 || distance == 0 || distance > out_pos || match_len > total - out_pos) break;
+        pos += n;
+        
+        // Source may overlap the destination
+        const uint8_t *src = out + out_pos - distance;
+        if (distance >= match_len) {
+            memcpy(out + out_pos, src, match_len);
+        } else {
+            for (size_t k = 0; k < match_len; k++) out[out_pos + k] = src[k];
+        }
+        out_pos += match_len;
+    }
+    
+    if (out_pos != total) {
+        free(out);
+        return NULL;
+    }
+    *out_size = total;
+    return out;
+}
+
+// Read a cgroup control file for this process. v1 hierarchies are found by
+// controller name, the v2 unified hierarchy through the "0::" entry. Inside
+// a cgroup namespace the process path may not exist under the mount, so the
+// mount root is tried as well.
+int read_cgroup_file(const char *v1_controller, const char *file, char *buf, size_t buf_len) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return -1;
+    
+    char line[MAX_PATH_LEN];
+    char candidates[2][MAX_PATH_LEN];
+    int ncandidates = 0;
+    
+    while (ncandidates == 0 && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *controllers = strchr(line, ':');
+        if (!controllers) continue;
+        controllers++;
+        char *path = strchr(controllers, ':');
+        if (!path) continue;
+        *path++ = '\0';
+        
+        const char *mount = NULL;
+        if (v1_controller == NULL && controllers[0] == '\0') {
+            mount = "/sys/fs/cgroup";
+        } else if (v1_controller != NULL) {
+            for (char *tok = strtok(controllers, ","); tok; tok = strtok(NULL, ",")) {
+                if (strcmp(tok, v1_controller) == 0) {
+                    mount = "/sys/fs/cgroup";
+                    break;
+                }
+            }
+        }
+        if (!mount) continue;
+        
+        if (v1_controller) {
+            snprintf(candidates[0], MAX_PATH_LEN, "%s/%s%s/%s", mount, v1_controller, path, file);
+            snprintf(candidates[1], MAX_PATH_LEN, "%s/%s/%s", mount, v1_controller, file);
+        } else {
+            snprintf(candidates[0], MAX_PATH_LEN, "%s%s/%s", mount, path, file);
+            snprintf(candidates[1], MAX_PATH_LEN, "%s/%s", mount, file);
+        }
+        ncandidates = 2;
+    }
+    fclose(f);
+    
+    for (int i = 0; i < ncandidates; i++) {
+        FILE *cf = fopen(candidates[i], "r");
+        if (!cf) continue;
+        size_t n = fread(buf, 1, buf_len - 1, cf);
+        fclose(cf);
+        buf[n] = '\0';
+        buf[strcspn(buf, "\n")] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+// Available RAM from /proc/meminfo and the cgroup (v2, then v1) memory limit
+void get_memory_info(MemoryInfo *info) {
+    memset(info, 0, sizeof(*info));
+    
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[256];
+        unsigned long long kb;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+                info->mem_available = (size_t)kb * 1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    
+    char buf[64];
+    unsigned long long limit = 0, usage = 0;
+    if (read_cgroup_file(NULL, "memory.max", buf, sizeof(buf)) == 0) {
+        if (strcmp(buf, "max") != 0) limit = strtoull(buf, NULL, 10);
+        if (read_cgroup_file(NULL, "memory.current", buf, sizeof(buf)) == 0) usage = strtoull(buf, NULL, 10);
+    } else if (read_cgroup_file("memory", "memory.limit_in_bytes", buf, sizeof(buf)) == 0) {
+        limit = strtoull(buf, NULL, 10);
+        // v1 reports "unlimited" as a huge page-aligned number
+        if (limit >= (1ULL << 62)) limit = 0;
+        if (read_cgroup_file("memory", "memory.usage_in_bytes", buf, sizeof(buf)) == 0) usage = strtoull(buf, NULL, 10);
+    }
+    info->cgroup_limit = limit;
+    info->cgroup_usage = usage;
+    
+    info->usable = info->mem_available;
+    if (limit > 0) {
+        size_t headroom = limit > usage ? limit - usage : 0;
+        if (info->usable == 0 || headroom < info->usable) info->usable = headroom;
+    }
+}
+
+// Encoder memory for the ultra filter chain at a given dictionary size
+uint64_t lzma_ultra_memusage(uint32_t dict_size) {
+    EncoderConfig cfg = {0};
+    cfg.preset_level = 9;
+    cfg.ultra = 1;
+    cfg.dict_size = dict_size;
+    cfg.threads = 1;
+    return encoder_memusage(&cfg);
+}
+
+// Parse a byte count with an optional K/M/G/T suffix (binary units)
+size_t parse_size(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return 0;
+    switch (*end) {
+        case 'k': case 'K': value *= 1024.0; break;
+        case 'm': case 'M': value *= 1024.0 * 1024.0; break;
+        case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+        case 't': case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; break;
+        default: break;
+    }
+    return (size_t)value;
+}
+
+// Stat-only pass over the input to size the run before reading anything;
+// *largest is raised to the biggest file seen
+int estimate_input(const char *path, size_t *files, size_t *bytes, size_t *largest) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    
+    if (S_ISREG(st.st_mode)) {
+        (*files)++;
+        *bytes += st.st_size;
+        if ((size_t)st.st_size > *largest) *largest = st.st_size;
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) return 0;
+    
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[MAX_PATH_LEN];
+        snprintf(child, MAX_PATH_LEN, "%s/%s", path, entry->d_name);
+        estimate_input(child, files, bytes, largest);
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Get optimal dictionary size: the largest power of two (up to 1536 MB)
+// whose encoder fits DICT_MEM_FRACTION of the memory this process may use,
+// never larger than the input itself
+size_t get_optimal_dict_size(size_t input_size) {
+    MemoryInfo mem;
+    get_memory_info(&mem);
+    
+    // The output buffer (input size + 64 KB) is allocated next to the encoder
+    size_t budget = 0;
+    if (mem.usable > input_size + 65536) {
+        budget = (size_t)((mem.usable - input_size - 65536) * DICT_MEM_FRACTION);
+    }
+    
+    size_t input_cap = LZMA_DICT_SIZE_MIN;
+    while (input_cap < input_size && input_cap < DICT_AUTO_MAX) input_cap <<= 1;
+    
+    size_t dict_size = DICT_AUTO_MAX;
+    int capped_by_input = 0;
+    if (input_cap < dict_size) {
+        dict_size = input_cap;
+        capped_by_input = 1;
+    }
+    while (dict_size > DICT_AUTO_FLOOR && lzma_ultra_memusage(dict_size) > budget) {
+        dict_size = dict_size == DICT_AUTO_MAX ? (size_t)1024 * 1024 * 1024 : dict_size >> 1;
+        capped_by_input = 0;
+    }
+    
+    printf("  - Memory: %zu MB usable (MemAvailable %zu MB, cgroup ",
+           mem.usable / (1024 * 1024), mem.mem_available / (1024 * 1024));
+    if (mem.cgroup_limit) {
+        printf("limit %zu MB, using %zu MB)\n", mem.cgroup_limit / (1024 * 1024), mem.cgroup_usage / (1024 * 1024));
+    } else {
+        printf("unlimited)\n");
+    }
+    
+    uint64_t memusage = lzma_ultra_memusage(dict_size);
+    if (capped_by_input) {
+        printf("  - Reason: capped by input size (%.2f MB)\n", input_size / (1024.0 * 1024.0));
+    } else if (memusage <= budget) {
+        printf("  - Reason: largest dictionary whose encoder (%llu MB) fits the budget (%zu MB)\n",
+               (unsigned long long)(memusage / (1024 * 1024)), budget / (1024 * 1024));
+    } else {
+        printf("  - Reason: minimum dictionary; encoder needs %llu MB, budget is only %zu MB\n",
+               (unsigned long long)(memusage / (1024 * 1024)), budget / (1024 * 1024));
+    }
+    
+    return dict_size;
+}
+
+// Resolve a preset name into an encoder configuration
+// fixed_dict overrides the automatic ultra dictionary (0 = size it here)
+int resolve_encoder_config(const char *preset, size_t input_size, uint32_t fixed_dict, EncoderConfig *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->preset_level = 9;
+    cfg->threads = 1;
+    
+    if (strncmp(preset, "ultra", 5) == 0 && fixed_dict) {
+        // The caller sized and announced the dictionary once for a whole run
+        cfg->ultra = 1;
+        cfg->dict_size = fixed_dict;
+    } else if (strcmp(preset, "ultra") == 0) {
+        cfg->ultra = 1;
+        printf("  Using LZMA with maximum settings...\n");
+        cfg->dict_size = get_optimal_dict_size(input_size);
+    } else if (strncmp(preset, "ultra-", 6) == 0) {
+        cfg->ultra = 1;
+        cfg->dict_size = atoi(preset + 6) * 1024 * 1024;
+        if (cfg->dict_size < LZMA_DICT_SIZE_MIN) {
+            fprintf(stderr, "Invalid dictionary size in preset: %s\n", preset);
+            return -1;
+        }
+        printf("  Using LZMA with custom settings...\n");
+    } else {
+        lzma_options_lzma opt;
+        if (strcmp(preset, "balanced") == 0) {
+            cfg->preset_level = 6;
+        } else if (strcmp(preset, "max") != 0) { // fast
+            cfg->preset_level = 3;
+        }
+        if (lzma_lzma_preset(&opt, cfg->preset_level | LZMA_PRESET_EXTREME)) return -1;
+        cfg->dict_size = opt.dict_size;
+    }
+    
+    // Block-parallel encoding (--parallel-streams): each block gets three
+    // dictionaries' worth of input so splitting costs little ratio; small
+    // inputs, and every input by default, stay one stream
+    cfg->block_size = (size_t)cfg->dict_size * 3;
+    if (cfg->block_size < BLOCK_SIZE_MIN) cfg->block_size = BLOCK_SIZE_MIN;
+    size_t nblocks = input_size / cfg->block_size + (input_size % cfg->block_size ? 1 : 0);
+    fit_encoder_threads(cfg, parallel_streams ? nblocks : 1, cfg->block_size);
+    if (cfg->threads <= 1) cfg->block_size = 0;
+    return 0;
+}
+
+// One encoder per stream, up to the worker count, as many as fit in memory
+// next to their stream_size input buffers
+void fit_encoder_threads(EncoderConfig *cfg, size_t streams, size_t stream_size) {
+    int workers = get_worker_pool()->nthreads;
+    cfg->threads = streams < (size_t)workers ? (uint32_t)streams : (uint32_t)workers;
+    if (cfg->threads > 1) {
+        // Each concurrent block holds its own encoder; keep them within memory
+        MemoryInfo mem;
+        get_memory_info(&mem);
+        uint64_t per_thread = encoder_memusage(cfg) + stream_size;
+        size_t budget = (size_t)(mem.usable * DICT_MEM_FRACTION);
+        while (cfg->threads > 1 && per_thread * cfg->threads > budget) cfg->threads--;
+    }
+    if (cfg->threads < 1) cfg->threads = 1;
+}
+
+// Filter chain for a configuration: the extreme preset of the configured
+// level, with the ultra settings (BT4, depth 273, lc3/lp0/pb2) on top
+int build_encoder_filters(const EncoderConfig *cfg, lzma_options_lzma *opt, lzma_filter filters[2]) {
+    if (lzma_lzma_preset(opt, cfg->preset_level | LZMA_PRESET_EXTREME)) {
+        return -1;
+    }
+    
+    opt->dict_size = cfg->dict_size;
+    if (cfg->ultra) {
+        opt->lc = 3;
+        opt->lp = 0;
+        opt->pb = 2;
+        opt->depth = 273;
+        opt->mf = LZMA_MF_BT4;
+    }
+    
+    if (cfg->preset_dict) {
+        opt->preset_dict = cfg->preset_dict;
+        opt->preset_dict_size = cfg->preset_dict_size;
+    }
+    
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = opt;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    return 0;
+}
+
+// Memory one encoder instance needs for this configuration
+uint64_t encoder_memusage(const EncoderConfig *cfg) {
+    lzma_options_lzma opt;
+    lzma_filter filters[2];
+    if (build_encoder_filters(cfg, &opt, filters) != 0) return UINT64_MAX;
+    return lzma_raw_encoder_memusage(filters);
+}
+
+// Estimate what a create run will hold at its peak and degrade until it fits
+// the limit: first a smaller member filter allowance per worker, then fewer
+// filter workers, then a smaller budget for kept filter bodies, then fewer
+// encoder threads, then smaller blocks, then a smaller dictionary. Returns
+// -1 if even the smallest settings do not fit, which leaves only the fixed
+// costs (file contents, payload, output, reference, dedup tables) and one
+// encoder thread.
+int plan_memory(size_t mem_limit, size_t input_files, size_t input_bytes, size_t largest_file,
+                size_t reference_bytes, const CreateOptions *opts, EncoderConfig *cfg, MemoryPlan *plan) {
+    memset(plan, 0, sizeof(*plan));
+    plan->scan = input_bytes + input_files * sizeof(FileEntry);
+    plan->reference = reference_bytes;
+    
+    // --delta: the patches (each buffer sized for DELTA_MAX_RATIO of its
+    // file), the LSH tables and one base index. --cdc: per possible chunk the
+    // cut length and hash, the file's reference to it, the chunk store and
+    // the dedup table, the last two grown by doubling.
+    if (opts->delta) {
+        plan->dedup += (size_t)(input_bytes * DELTA_MAX_RATIO) + input_files * 32 +
+                       input_files * 4 * LSH_BANDS * (sizeof(size_t) + sizeof(uint64_t)) +
+                       largest_file / DELTA_BLOCK * 4 * sizeof(uint32_t);
+    }
+    if (opts->cdc_avg) {
+        size_t chunks = input_bytes / (opts->cdc_avg / 4) + 2 * input_files;
+        plan->dedup += chunks * (2 * sizeof(uint32_t) + sizeof(uint64_t) + 2 * sizeof(Chunk) + 6 * sizeof(uint32_t));
+    }
+    
+    // Member filters: every worker may hold one file's buffers (JPEG
+    // coefficients, an inflated deflate stream, a text filter's working
+    // buffers) and files that need more are stored as they are. Kept bodies
+    // are counted by capacity and replace their files in the payload, which
+    // can grow by as much. The allowance is not halved below what the text
+    // filters need for the largest file; fewer workers come first.
+    size_t worker = 0, worker_min = FILTER_WORKER_MIN;
+    if (opts->jpeg) worker = JPEG_MAX_BLOCKS * JPEG_BLOCK_BYTES;
+    if (opts->precomp && 2 * largest_file + 2 * PRECOMP_MAX_INFLATED > worker) {
+        worker = 2 * largest_file + 2 * PRECOMP_MAX_INFLATED;
+    }
+    if (opts->log_filter || opts->columnar) {
+        size_t text = text_filter_fixed(largest_file) + 2 * largest_file;
+        if (text > worker) worker = text;
+        if (text > worker_min) worker_min = text;
+    }
+    plan->filter_worker = worker;
+    plan->filter_workers = worker ? get_worker_pool()->nthreads : 0;
+    plan->filter_bodies = worker ? (opts->precomp ? 4 : 2) * input_bytes : 0;
+    
+    for (;;) {
+        plan->payload = input_bytes + input_files * 64 + 6 + plan->filter_bodies;
+        plan->lrm = opts->lrm ? plan->payload + 64 + sizeof(uint64_t) * LRM_MAX_TABLE : 0;
+        plan->output = plan->payload + 65536;
+        size_t fixed = plan->scan + plan->payload + plan->lrm + plan->output + plan->reference + plan->dedup;
+        
+        uint64_t per_thread = encoder_memusage(cfg);
+        if (cfg->block_size > 0) per_thread += cfg->block_size + 65536;
+        plan->encoder = per_thread == UINT64_MAX ? SIZE_MAX : (size_t)(per_thread * cfg->threads);
+        plan->filters = plan->filter_workers * plan->filter_worker;
+        plan->total = fixed + plan->filters + plan->filter_bodies + plan->encoder;
+        if (plan->total <= mem_limit) return 0;
+        
+        if (plan->filter_worker / 2 >= worker_min) {
+            plan->filter_worker /= 2;
+        } else if (plan->filter_workers > 1) {
+            plan->filter_workers--;
+        } else if (plan->filter_bodies) {
+            // Without room for bodies nothing would be kept, so filter nothing
+            plan->filter_bodies = plan->filter_bodies / 2 >= FILTER_BODIES_MIN ? plan->filter_bodies / 2 : 0;
+            if (!plan->filter_bodies) plan->filter_worker = 0;
+        } else if (cfg->threads > 1) {
+            cfg->threads--;
+        } else if (cfg->block_size > BLOCK_SIZE_MIN) {
+            cfg->block_size /= 2;
+        } else if (cfg->dict_size / 2 >= DICT_AUTO_FLOOR) {
+            cfg->dict_size /= 2;
+        } else {
+            return -1;
+        }
+    }
+}
+
+void print_encoder_config(const EncoderConfig *cfg) {
+    if (cfg->dict_size >= 1024 * 1024) {
+        printf("  - Dictionary: %u MB%s\n", cfg->dict_size / (1024 * 1024), cfg->ultra ? "" : " (preset)");
+    } else {
+        printf("  - Dictionary: %u KB\n", cfg->dict_size / 1024);
+    }
+    if (cfg->ultra) {
+        printf("  - Match finder: BT4 (best)\n");
+        printf("  - Depth: 273 (maximum)\n");
+    }
+    if (cfg->threads > 1) {
+        printf("  - Threads: %u\n", cfg->threads);
+    }
+    if (cfg->preset_dict) {
+        printf("  - Reference: %.2f MB preset dictionary\n", cfg->preset_dict_size / (1024.0 * 1024.0));
+    }
+    if (cfg->rsync_avg) {
+        printf("  - Rsyncable: streams cut every ~%zu KB of payload\n", cfg->rsync_avg / 1024);
+    }
+}
+
+// An rsyncable stream never spans more than the largest cut, so a larger
+// dictionary would only cost memory
+void size_rsyncable_dict(EncoderConfig *cfg) {
+    uint32_t dict = DICT_AUTO_FLOOR;
+    while (dict < cfg->rsync_avg * 8 && dict < cfg->dict_size) dict *= 2;
+    if (dict < cfg->dict_size) cfg->dict_size = dict;
+}
+
+// With a reference, matches reach back over the whole reference, so the
+// dictionary is grown to hold it and the input, as far as an encoder of at
+// most budget bytes allows
+static void size_reference_dict(EncoderConfig *cfg, size_t input_size, size_t budget) {
+    uint64_t want = (uint64_t)cfg->preset_dict_size + input_size;
+    if (want > DICT_AUTO_MAX) want = DICT_AUTO_MAX;
+    if (cfg->dict_size >= want) return;
+    
+    EncoderConfig grown = *cfg;
+    grown.dict_size = (uint32_t)((want + 0xFFFFF) & ~(uint64_t)0xFFFFF);
+    while (grown.dict_size > cfg->dict_size && encoder_memusage(&grown) > budget) {
+        grown.dict_size /= 2;
+    }
+    grown.dict_size &= ~(uint32_t)0xFFFFF;
+    if (grown.dict_size > cfg->dict_size) {
+        printf("  Dictionary raised: %u MB -> %u MB to cover the reference\n", cfg->dict_size / (1024 * 1024),
+               grown.dict_size / (1024 * 1024));
+        cfg->dict_size = grown.dict_size;
+    }
+}
+
+static HugePageMode hugepage_mode = HUGEPAGES_AUTO;   // --hugepages=MODE
+static HugePageStats hugepage_stats;
+static const lzma_allocator huge_allocator = { huge_alloc, huge_free, NULL };
+
+// lzma_allocator that puts large blocks in their own 2 MB-aligned anonymous
+// mapping, so the dictionary and hash chains can be covered by huge pages
+// instead of thousands of 4 KB TLB entries. Every block carries a header
+// recording how it was allocated so huge_free() can undo it.
+void *huge_alloc(void *opaque, size_t nmemb, size_t size) {
+    (void)opaque;
+    if (size != 0 && nmemb > (SIZE_MAX - HUGE_PAGE_SIZE * 2) / size) return NULL;
+    size_t bytes = nmemb * size;
+    
+    if (hugepage_mode == HUGEPAGES_OFF || bytes < HUGE_ALLOC_MIN) {
+        uint8_t *block = malloc(bytes + HUGE_HEADER);
+        if (!block) return NULL;
+        ((size_t*)block)[0] = 0;
+        atomic_fetch_add(&hugepage_stats.small_allocs, 1);
+        return block + HUGE_HEADER;
+    }
+    
+    size_t map_size = (bytes + HUGE_HEADER + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    uint8_t *base = MAP_FAILED;
+    int hugetlb = 0;
+    
+#ifdef MAP_HUGETLB
+    if (hugepage_mode == HUGEPAGES_HUGETLB || hugepage_mode == HUGEPAGES_AUTO) {
+        base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        hugetlb = base != MAP_FAILED;
+    }
+#endif
+    
+    if (base == MAP_FAILED) {
+        // Over-map by one huge page and trim so the block starts 2 MB-aligned
+        uint8_t *raw = mmap(NULL, map_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return NULL;
+        base = (uint8_t*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (base > raw) munmap(raw, base - raw);
+        size_t tail = (raw + map_size + HUGE_PAGE_SIZE) - (base + map_size);
+        if (tail > 0) munmap(base + map_size, tail);
+#ifdef MADV_HUGEPAGE
+        madvise(base, map_size, MADV_HUGEPAGE);
+#endif
+    }
+    numa_place(base, map_size);
+    
+    ((size_t*)base)[0] = map_size;
+    atomic_fetch_add(&hugepage_stats.huge_allocs, 1);
+    atomic_fetch_add(&hugepage_stats.huge_bytes, map_size);
+    if (hugetlb) atomic_fetch_add(&hugepage_stats.hugetlb_bytes, map_size);
+    return base + HUGE_HEADER;
+}
+
+void huge_free(void *opaque, void *ptr) {
+    (void)opaque;
+    if (!ptr) return;
+    uint8_t *block = (uint8_t*)ptr - HUGE_HEADER;
+    size_t map_size = ((size_t*)block)[0];
+    if (map_size == 0) {
+        free(block);
+    } else {
+        munmap(block, map_size);
+    }
+}
+
+// AnonHugePages of this process (THP actually granted), in KB
+size_t read_anon_huge_kb(void) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0;
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+void print_hugepage_stats(void) {
+    static const char *mode_names[] = { "off", "auto", "thp", "hugetlb" };
+    size_t huge_mb = atomic_load(&hugepage_stats.huge_bytes) / (1024 * 1024);
+    printf("  Huge pages:         %s, %zu large allocation%s (%zu MB, %zu MB hugetlb), %zu MB in THP\n",
+           mode_names[hugepage_mode], atomic_load(&hugepage_stats.huge_allocs),
+           atomic_load(&hugepage_stats.huge_allocs) == 1 ? "" : "s", huge_mb,
+           atomic_load(&hugepage_stats.hugetlb_bytes) / (1024 * 1024), hugepage_stats.anon_huge_kb / 1024);
+    printf("  Page faults:        %ld during compression\n", hugepage_stats.minor_faults);
+}
+
+static EncoderContextPool encoder_pool;
+
+// Make sure there is an encoder context for each of count workers. Existing
+// contexts (and their allocations) are kept.
+int encoder_contexts_reserve(int count) {
+    if (count <= encoder_pool.count) return 0;
+    EncoderContext *contexts = realloc(encoder_pool.contexts, sizeof(EncoderContext) * count);
+    if (!contexts) return -1;
+    for (int i = encoder_pool.count; i < count; i++) {
+        lzma_stream init = LZMA_STREAM_INIT;
+        memset(&contexts[i], 0, sizeof(EncoderContext));
+        contexts[i].strm = init;
+        contexts[i].strm.allocator = &huge_allocator;
+    }
+    encoder_pool.contexts = contexts;
+    encoder_pool.count = count;
+    return 0;
+}
+
+// Release the encoder allocations but keep the contexts and their counters
+static void encoder_contexts_release(void) {
+    for (int i = 0; i < encoder_pool.count; i++) {
+        lzma_end(&encoder_pool.contexts[i].strm);
+        encoder_pool.contexts[i].ready = 0;
+    }
+}
+
+void encoder_contexts_free(void) {
+    encoder_contexts_release();
+    free(encoder_pool.contexts);
+    memset(&encoder_pool, 0, sizeof(encoder_pool));
+}
+
+void print_encoder_context_stats(void) {
+    size_t fresh = 0, reused = 0;
+    for (int i = 0; i < encoder_pool.count; i++) {
+        fresh += encoder_pool.contexts[i].fresh_inits;
+        reused += encoder_pool.contexts[i].reused_inits;
+    }
+    printf("  Encoder contexts:   %d (%zu fresh allocation%s, %zu reuse%s of a live encoder)\n",
+           encoder_pool.count, fresh, fresh == 1 ? "" : "s", reused, reused == 1 ? "" : "s");
+}
+
+static void *stream_hasher_thread(void *arg) {
+    StreamHasher *hasher = arg;
+    
+    pthread_mutex_lock(&hasher->lock);
+    while (!hasher->cancelled && hasher->next < hasher->nsegs) {
+        HashSegment *seg = &hasher->segs[hasher->next];
+        if (seg->avail > hasher->consumed) {
+            const uint8_t *ptr = seg->ptr + hasher->consumed;
+            size_t len = seg->avail - hasher->consumed;
+            pthread_mutex_unlock(&hasher->lock);
+            
+            double start = now_ms();
+            EVP_DigestUpdate(hasher->md, ptr, len);
+            
+            pthread_mutex_lock(&hasher->lock);
+            hasher->hash_ms += now_ms() - start;
+            hasher->consumed += len;
+            hasher->bytes += len;
+        } else if (seg->done) {
+            hasher->next++;
+            hasher->consumed = 0;
+        } else {
+            pthread_cond_wait(&hasher->progress, &hasher->lock);
+        }
+    }
+    pthread_mutex_unlock(&hasher->lock);
+    return NULL;
+}
+
+// Start hashing nsegs segments that will be filled in by
+// stream_hasher_update(), in segment order
+int stream_hasher_start(StreamHasher *hasher, size_t nsegs) {
+    memset(hasher, 0, sizeof(*hasher));
+    hasher->segs = calloc(nsegs ? nsegs : 1, sizeof(HashSegment));
+    hasher->md = EVP_MD_CTX_new();
+    hasher->nsegs = nsegs;
+    if (!hasher->segs || !hasher->md || EVP_DigestInit_ex(hasher->md, EVP_sha256(), NULL) != 1) {
+        free(hasher->segs);
+        EVP_MD_CTX_free(hasher->md);
+        return -1;
+    }
+    pthread_mutex_init(&hasher->lock, NULL);
+    pthread_cond_init(&hasher->progress, NULL);
+    if (pthread_create(&hasher->thread, NULL, stream_hasher_thread, hasher) != 0) {
+        pthread_mutex_destroy(&hasher->lock);
+        pthread_cond_destroy(&hasher->progress);
+        free(hasher->segs);
+        EVP_MD_CTX_free(hasher->md);
+        return -1;
+    }
+    return 0;
+}
+
+// Publish that the first avail bytes at ptr of segment seg are final
+void stream_hasher_update(StreamHasher *hasher, size_t seg, const uint8_t *ptr, size_t avail, int done) {
+    if (!hasher) return;
+    pthread_mutex_lock(&hasher->lock);
+    hasher->segs[seg].ptr = ptr;
+    hasher->segs[seg].avail = avail;
+    hasher->segs[seg].done = done;
+    pthread_cond_signal(&hasher->progress);
+    pthread_mutex_unlock(&hasher->lock);
+}
+
+static void stream_hasher_stop(StreamHasher *hasher) {
+    pthread_join(hasher->thread, NULL);
+    pthread_mutex_destroy(&hasher->lock);
+    pthread_cond_destroy(&hasher->progress);
+    free(hasher->segs);
+    hasher->segs = NULL;
+}
+
+// Wait for every segment to be hashed and store the digest
+int stream_hasher_finish(StreamHasher *hasher) {
+    stream_hasher_stop(hasher);
+    unsigned int len = 0;
+    int ok = EVP_DigestFinal_ex(hasher->md, hasher->digest, &len) == 1 && len == 32;
+    EVP_MD_CTX_free(hasher->md);
+    hasher->md = NULL;
+    return ok ? 0 : -1;
+}
+
+void stream_hasher_cancel(StreamHasher *hasher) {
+    pthread_mutex_lock(&hasher->lock);
+    hasher->cancelled = 1;
+    pthread_cond_signal(&hasher->progress);
+    pthread_mutex_unlock(&hasher->lock);
+    stream_hasher_stop(hasher);
+    EVP_MD_CTX_free(hasher->md);
+    hasher->md = NULL;
+}
+
+static int same_filter_chain(const EncoderConfig *a, const EncoderConfig *b) {
+    return a->preset_level == b->preset_level && a->ultra == b->ultra && a->dict_size == b->dict_size &&
+           a->preset_dict == b->preset_dict;
+}
+
+// Encode one xz stream with a context. The stream is re-initialised without
+// lzma_end(), so with an unchanged filter chain liblzma keeps the dictionary
+// and hash tables it already has. The context stays initialised afterwards.
+// With a hasher, output is released to segment seg every HASH_WINDOW bytes.
+lzma_ret encoder_context_encode(EncoderContext *ctx, const EncoderConfig *cfg, const uint8_t *in, size_t in_size,
+                                uint8_t *out, size_t out_size, size_t *out_pos, StreamHasher *hasher, size_t seg) {
+    lzma_options_lzma opt;
+    lzma_filter filters[2];
+    if (build_encoder_filters(cfg, &opt, filters) != 0) {
+        return LZMA_OPTIONS_ERROR;
+    }
+    
+    // A preset dictionary cannot be described in .xz headers, so that stream is raw
+    int reuse = ctx->ready && same_filter_chain(&ctx->cfg, cfg);
+    lzma_ret ret = cfg->preset_dict ? lzma_raw_encoder(&ctx->strm, filters) :
+                   lzma_stream_encoder(&ctx->strm, filters, LZMA_CHECK_CRC64);
+    if (ret != LZMA_OK) {
+        lzma_end(&ctx->strm);
+        ctx->ready = 0;
+        return ret;
+    }
+    ctx->ready = 1;
+    ctx->cfg = *cfg;
+    
+    if (reuse) {
+        ctx->reused_inits++;
+    } else {
+        ctx->fresh_inits++;
+    }
+    
+    ctx->strm.next_in = in;
+    ctx->strm.avail_in = in_size;
+    ctx->strm.next_out = out;
+    size_t written = 0;
+    do {
+        size_t window = out_size - written;
+        if (hasher && window > HASH_WINDOW) window = HASH_WINDOW;
+        ctx->strm.avail_out = window;
+        ret = lzma_code(&ctx->strm, LZMA_FINISH);
+        written += window - ctx->strm.avail_out;
+        stream_hasher_update(hasher, seg, out, written, ret == LZMA_STREAM_END);
+    } while (ret == LZMA_OK && written < out_size);
+    *out_pos = written;
+    
+    if (ret == LZMA_OK) ret = LZMA_BUF_ERROR;   // output did not fit
+    return ret == LZMA_STREAM_END ? LZMA_OK : ret;
+}
+
+typedef struct {
+    const EncoderConfig *cfg;
+    const uint8_t *data;
+    const size_t *bounds;       // nblocks + 1 input offsets
+    uint8_t *out;
+    size_t *out_offsets;        // slot start for each block in out
+    size_t *out_sizes;
+    lzma_ret *results;
+    StreamHasher *hasher;
+} BlockEncodeJob;
+
+// Compress one block as an independent xz stream into its reserved slot
+static void block_encode_task(void *ctx, size_t index, int worker) {
+    BlockEncodeJob *job = ctx;
+    size_t start = job->bounds[index];
+    size_t len = job->bounds[index + 1] - start;
+    
+    size_t out_pos = 0;
+    job->results[index] = encoder_context_encode(&encoder_pool.contexts[worker], job->cfg, job->data + start, len,
+                                                 job->out + job->out_offsets[index],
+                                                 lzma_stream_buffer_bound(len), &out_pos, job->hasher, index);
+    job->out_sizes[index] = out_pos;
+}
+
+// Compress the blocks [bounds[i], bounds[i + 1]) on the worker pool, at most
+// cfg->threads at a time. The streams are concatenated in order, which the
+// decoder reads back with LZMA_CONCATENATED; block_sizes (if given) receives
+// each stream's length. The hasher follows the blocks in order straight from
+// their slots.
+static uint8_t* compress_blocks_parallel(const uint8_t *data, const size_t *bounds, size_t nblocks,
+                                         size_t *block_sizes, size_t *compressed_size,
+                                         const EncoderConfig *cfg, StreamHasher *hasher, lzma_ret *status) {
+    BlockEncodeJob job = { cfg, data, bounds, NULL, NULL, NULL, NULL, NULL };
+    job.out_offsets = malloc(sizeof(size_t) * nblocks);
+    job.out_sizes = calloc(nblocks, sizeof(size_t));
+    job.results = malloc(sizeof(lzma_ret) * nblocks);
+    
+    size_t total_bound = 0;
+    for (size_t i = 0; i < nblocks && job.out_offsets; i++) {
+        job.out_offsets[i] = total_bound;
+        total_bound += lzma_stream_buffer_bound(bounds[i + 1] - bounds[i]);
+    }
+    job.out = (job.out_offsets && job.out_sizes && job.results) ? malloc(total_bound) : NULL;
+    
+    *status = LZMA_MEM_ERROR;
+    if (job.out && hasher && stream_hasher_start(hasher, nblocks) == 0) {
+        job.hasher = hasher;
+    } else if (hasher) {
+        free(job.out);
+        job.out = NULL;
+    }
+    if (job.out) {
+        pool_run(get_worker_pool(), nblocks, cfg->threads, block_encode_task, &job);
+        
+        *status = LZMA_OK;
+        for (size_t i = 0; i < nblocks; i++) {
+            if (job.results[i] != LZMA_OK) {
+                *status = job.results[i];
+                break;
+            }
+        }
+        if (job.hasher) {
+            if (*status == LZMA_OK) {
+                if (stream_hasher_finish(hasher) != 0) *status = LZMA_PROG_ERROR;
+            } else {
+                stream_hasher_cancel(hasher);
+            }
+        }
+        
+        // Compact the slots into one contiguous stream sequence
+        size_t pos = 0;
+        for (size_t i = 0; i < nblocks && *status == LZMA_OK; i++) {
+            memmove(job.out + pos, job.out + job.out_offsets[i], job.out_sizes[i]);
+            pos += job.out_sizes[i];
+            if (block_sizes) block_sizes[i] = job.out_sizes[i];
+        }
+        *compressed_size = pos;
+    }
+    
+    free(job.out_offsets);
+    free(job.out_sizes);
+    free(job.results);
+    if (*status != LZMA_OK) {
+        free(job.out);
+        return NULL;
+    }
+    return job.out;
+}
+
+// LZMA Ultra compression. If the encoder or the output buffer cannot be
+// allocated, the dictionary is halved and the attempt repeated. With more
+// than one thread the input is encoded as independent blocks in parallel.
+// Encoders come from the per-worker context pool and stay allocated for the
+// next archive of the process. With a hasher, the SHA-256 of the output is
+// computed on a separate thread while it is being produced.
+uint8_t* compress_lzma_ultra(const uint8_t *data, size_t size, size_t *compressed_size, EncoderConfig *cfg,
+                             StreamHasher *hasher) {
+    if (encoder_contexts_reserve(get_worker_pool()->nthreads) != 0) {
+        fprintf(stderr, "Out of memory allocating encoder contexts\n");
+        return NULL;
+    }
+    
+    for (;;) {
+        int rsyncable = cfg->rsync_avg && !cfg->preset_dict;
+        if (rsyncable || (cfg->threads > 1 && cfg->block_size > 0 && size > cfg->block_size && !cfg->preset_dict)) {
+            // Rsyncable: cut where the content says, so an edit only changes
+            // the streams around it and the cuts after it line up again
+            size_t nblocks = rsyncable ? size / (cfg->rsync_avg / 4) + 1
+                                       : (size + cfg->block_size - 1) / cfg->block_size;
+            size_t *bounds = malloc(sizeof(size_t) * (nblocks + 1));
+            if (!bounds) {
+                fprintf(stderr, "Out of memory planning %zu blocks\n", nblocks);
+                return NULL;
+            }
+            if (rsyncable) {
+                gear_table_init();
+                size_t pos = 0;
+                nblocks = 0;
+                do {
+                    bounds[nblocks++] = pos;
+                    pos += cdc_next_boundary(data + pos, size - pos, cfg->rsync_avg);
+                } while (pos < size);
+            } else {
+                for (size_t i = 0; i < nblocks; i++) bounds[i] = i * cfg->block_size;
+            }
+            bounds[nblocks] = size;
+            
+            lzma_ret ret;
+            uint8_t *out = compress_blocks_parallel(data, bounds, nblocks, NULL, compressed_size, cfg, hasher, &ret);
+            free(bounds);
+            if (out) {
+                cfg->streams = nblocks;
+                return out;
+            }
+            if (ret != LZMA_MEM_ERROR) {
+                fprintf(stderr, "LZMA compression failed: %d\n", ret);
+                return NULL;
+            }
+            encoder_contexts_release();
+            if (rsyncable && cfg->threads <= 1) {
+                // The cuts are fixed by the content, only the dictionary can give
+                if (cfg->dict_size / 2 < DICT_AUTO_FLOOR) {
+                    fprintf(stderr, "Out of memory even with a %u KB dictionary\n", cfg->dict_size / 1024);
+                    return NULL;
+                }
+                cfg->dict_size /= 2;
+                printf("  Encoder allocation failed, retrying with %u MB dictionary...\n",
+                       cfg->dict_size / (1024 * 1024));
+                continue;
+            }
+            if (cfg->threads > 2) {
+                cfg->threads /= 2;
+            } else {
+                cfg->threads = 1;
+                cfg->block_size = 0;
+            }
+            printf("  Encoder allocation failed, retrying with %u thread%s...\n",
+                   cfg->threads, cfg->threads == 1 ? "" : "s");
+            continue;
+        }
+        
+        // Allocate output buffer
+        size_t out_size = lzma_stream_buffer_bound(size);
+        uint8_t *out_buf = malloc(out_size);
+        
+        lzma_ret ret = LZMA_MEM_ERROR;
+        if (out_buf && hasher && stream_hasher_start(hasher, 1) != 0) {
+            free(out_buf);
+            out_buf = NULL;
+        }
+        if (out_buf) {
+            ret = encoder_context_encode(&encoder_pool.contexts[0], cfg, data, size, out_buf, out_size,
+                                         compressed_size, hasher, 0);
+            if (hasher && ret == LZMA_OK && stream_hasher_finish(hasher) != 0) {
+                ret = LZMA_PROG_ERROR;
+            } else if (hasher && ret != LZMA_OK) {
+                stream_hasher_cancel(hasher);
+            }
+        }
+        if (ret == LZMA_OK) {
+            cfg->streams = 1;
+            return out_buf;
+        }
+        free(out_buf);
+        
+        if (ret == LZMA_MEM_ERROR) {
+            encoder_contexts_release();
+            if (cfg->dict_size / 2 < DICT_AUTO_FLOOR) {
+                fprintf(stderr, "Out of memory even with a %u KB dictionary\n", cfg->dict_size / 1024);
+                return NULL;
+            }
+            cfg->dict_size /= 2;
+            printf("  Encoder allocation failed, retrying with %u MB dictionary...\n",
+                   cfg->dict_size / (1024 * 1024));
+            continue;
+        }
+        fprintf(stderr, "LZMA compression failed: %d\n", ret);
+        return NULL;
+    }
+}
+
+// Compress record-aligned archive blocks as independent xz streams and fill
+// in comp_size and comp_offset of every block. On allocation failure the
+// thread count and then the dictionary are stepped down.
+uint8_t* compress_archive_blocks(const uint8_t *data, ArchiveBlock *blocks, uint32_t nblocks,
+                                 size_t *compressed_size, EncoderConfig *cfg) {
+    size_t *bounds = malloc(sizeof(size_t) * (nblocks + 1));
+    size_t *sizes = malloc(sizeof(size_t) * nblocks);
+    if (!bounds || !sizes || encoder_contexts_reserve(get_worker_pool()->nthreads) != 0) {
+        fprintf(stderr, "Out of memory planning %u blocks\n", nblocks);
+        free(bounds);
+        free(sizes);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < nblocks; i++) bounds[i] = blocks[i].raw_offset;
+    bounds[nblocks] = blocks[nblocks - 1].raw_offset + blocks[nblocks - 1].raw_size;
+    
+    uint8_t *out = NULL;
+    for (;;) {
+        lzma_ret ret;
+        out = compress_blocks_parallel(data, bounds, nblocks, sizes, compressed_size, cfg, NULL, &ret);
+        if (out) break;
+        if (ret != LZMA_MEM_ERROR) {
+            fprintf(stderr, "LZMA compression failed: %d\n", ret);
+            break;
+        }
+        encoder_contexts_release();
+        if (cfg->threads > 1) {
+            cfg->threads /= 2;
+            printf("  Encoder allocation failed, retrying with %u thread%s...\n",
+                   cfg->threads, cfg->threads == 1 ? "" : "s");
+        } else if (cfg->dict_size / 2 >= DICT_AUTO_FLOOR) {
+            cfg->dict_size /= 2;
+            printf("  Encoder allocation failed, retrying with %u MB dictionary...\n",
+                   cfg->dict_size / (1024 * 1024));
+        } else {
+            fprintf(stderr, "Out of memory even with a %u KB dictionary\n", cfg->dict_size / 1024);
+            break;
+        }
+    }
+    
+    size_t pos = 0;
+    for (uint32_t i = 0; out && i < nblocks; i++) {
+        blocks[i].comp_size = sizes[i];
+        blocks[i].comp_offset = pos;
+        pos += sizes[i];
+    }
+    free(bounds);
+    free(sizes);
+    return out;
+}
+
+void block_descriptor(const ArchiveBlock *block, uint8_t out[BLOCK_DESC_SIZE]) {
+    write_uint32_be(out, block->raw_size);
+    write_uint32_be(out + 4, block->comp_size);
+    write_uint32_be(out + 8, block->first_record);
+    write_uint32_be(out + 12, block->first_chunk);
+    write_uint32_be(out + 16, block->crc);
+}
+
+// Merkle leaf: SHA-256(0x00 || descriptor || stream), so the table entry is
+// covered along with the data
+void block_leaf_hash(ArchiveBlock *block, const uint8_t *stream) {
+    uint8_t prefix[1 + BLOCK_DESC_SIZE] = { 0x00 };
+    block_descriptor(block, prefix + 1);
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    unsigned int len = 0;
+    if (!md) {
+        memset(block->leaf, 0, 32);
+        return;
+    }
+    EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+    EVP_DigestUpdate(md, prefix, sizeof(prefix));
+    EVP_DigestUpdate(md, stream, block->comp_size);
+    EVP_DigestFinal_ex(md, block->leaf, &len);
+    EVP_MD_CTX_free(md);
+}
+
+// Root over the block leaves: interior nodes are SHA-256(0x01 || left ||
+// right), and an odd node at the end of a level moves up unchanged
+void merkle_root(const ArchiveBlock *blocks, uint32_t nblocks, uint8_t root[32]) {
+    uint8_t (*level)[32] = malloc(32 * (size_t)(nblocks ? nblocks : 1));
+    if (!level) {
+        memset(root, 0, 32);
+        return;
+    }
+    for (uint32_t i = 0; i < nblocks; i++) memcpy(level[i], blocks[i].leaf, 32);
+    
+    size_t n = nblocks;
+    while (n > 1) {
+        size_t next = 0;
+        for (size_t i = 0; i < n; i += 2) {
+            if (i + 1 == n) {
+                memmove(level[next++], level[i], 32);
+                continue;
+            }
+            uint8_t node[65];
+            node[0] = 0x01;
+            memcpy(node + 1, level[i], 32);
+            memcpy(node + 33, level[i + 1], 32);
+            EVP_Digest(node, sizeof(node), level[next++], NULL, EVP_sha256(), NULL);
+        }
+        n = next;
+    }
+    if (n) {
+        memcpy(root, level[0], 32);
+    } else {
+        memset(root, 0, 32);
+    }
+    free(level);
+}
+
+// Write big-endian integers
+void write_uint16_be(uint8_t *buf, uint16_t val) {
+    buf[0] = (val >> 8) & 0xFF;
+    buf[1] = val & 0xFF;
+}
+
+void write_uint32_be(uint8_t *buf, uint32_t val) {
+    buf[0] = (val >> 24) & 0xFF;
+    buf[1] = (val >> 16) & 0xFF;
+    buf[2] = (val >> 8) & 0xFF;
+    buf[3] = val & 0xFF;
+}
+
+void write_uint64_be(uint8_t *buf, uint64_t val) {
+    write_uint32_be(buf, (uint32_t)(val >> 32));
+    write_uint32_be(buf + 4, (uint32_t)val);
+}
+
+uint16_t read_uint16_be(const uint8_t *buf) {
+    return ((uint16_t)buf[0] << 8) | buf[1];
+}
+
+uint32_t read_uint32_be(const uint8_t *buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+           ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+uint64_t read_uint64_be(const uint8_t *buf) {
+    return ((uint64_t)read_uint32_be(buf) << 32) | read_uint32_be(buf + 4);
+}
+
+typedef struct {
+    ArchiveBlock *blocks;
+    const uint8_t *streams;
+} BlockSealJob;
+
+// CRC32 and Merkle leaf of one compressed block; runs on the worker pool
+static void block_seal_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    BlockSealJob *job = ctx;
+    ArchiveBlock *block = &job->blocks[index];
+    const uint8_t *stream = job->streams + block->comp_offset;
+    block->crc = lzma_crc32(stream, block->comp_size, 0);
+    block_leaf_hash(block, stream);
+}
+
+// Start a new archive block at payload offset `at` unless the current one is
+// still empty
+static int archive_block_cut(ArchiveBlock **blocks, uint32_t *nblocks, size_t at,
+                             uint32_t first_record, uint32_t first_chunk) {
+    if (*nblocks > 0) {
+        ArchiveBlock *last = &(*blocks)[*nblocks - 1];
+        if (at == last->raw_offset) return 0;
+        last->raw_size = at - last->raw_offset;
+    }
+    if (*nblocks >= MAX_BLOCKS) return -1;
+    ArchiveBlock *grown = realloc(*blocks, sizeof(ArchiveBlock) * (*nblocks + 1));
+    if (!grown) return -1;
+    *blocks = grown;
+    memset(&grown[*nblocks], 0, sizeof(ArchiveBlock));
+    grown[*nblocks].raw_offset = at;
+    grown[*nblocks].first_record = first_record;
+    grown[*nblocks].first_chunk = first_chunk;
+    (*nblocks)++;
+    return 0;
+}
+
+// Create archive
+static int create_archive_in(const char *input_path, const char *output_file, const char *preset, int checksum,
+                             const CreateOptions *opts, ChunkRepo *repo, DecodedArchive *reference);
+
+static int compare_file_entries(const void *a, const void *b) {
+    return strcmp(((const FileEntry *)a)->path, ((const FileEntry *)b)->path);
+}
+
+// With --repo the repository stays locked from the dedup lookups until the
+// archive is registered, so a concurrent gc cannot drop chunks in between.
+// A --ref-archive reference is decoded before anything else, so the memory
+// plan can count it.
+int create_archive(const char *input_path, const char *output_file, const char *preset, int checksum,
+                   const CreateOptions *opts) {
+    if (!opts->repo) {
+        DecodedArchive reference = {0};
+        if (opts->ref_archive) {
+            if (opts->block_target || opts->lrm) {
+                fprintf(stderr, "--ref-archive encodes one primed stream and cannot be combined with --blocks or --lrm\n");
+                return -1;
+            }
+            printf("Loading reference %s...\n", opts->ref_archive);
+            if (decode_archive(opts->ref_archive, &reference) != 0 || reference.damaged_blocks) {
+                fprintf(stderr, "Cannot use reference archive: %s\n", opts->ref_archive);
+                decoded_archive_free(&reference);
+                return -1;
+            }
+        }
+        int result = create_archive_in(input_path, output_file, preset, checksum, opts, NULL,
+                                       opts->ref_archive ? &reference : NULL);
+        decoded_archive_free(&reference);
+        return result;
+    }
+    if (opts->delta || opts->block_target || opts->lrm || opts->incremental_from || opts->ref_archive) {
+        fprintf(stderr, "--repo cannot be combined with --delta, --blocks, --lrm, --incremental-from or --ref-archive\n");
+        return -1;
+    }
+    if (mkdir(opts->repo, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create chunk repository %s: %s\n", opts->repo, strerror(errno));
+        return -1;
+    }
+    int lock_fd = repo_lock(opts->repo, 1);
+    if (lock_fd < 0) return -1;
+    ChunkRepo repo;
+    int result = -1;
+    if (repo_open(opts->repo, 1, &repo) == 0) {
+        result = create_archive_in(input_path, output_file, preset, checksum, opts, &repo, NULL);
+        repo_close(&repo);
+    }
+    close(lock_fd);
+    return result;
+}
+
+// Members stored as anything but their content or a duplicate reference
+static int member_needs_v3(const FileEntry *file) {
+    return !file->is_duplicate && (file->is_delta || file->chunk_refs || file->repo_refs || file->jpeg ||
+                                   file->precomp || file->log_filter || file->columnar);
+}
+
+// Lowest version that can read an archive with this method, flags and
+// layout. Archives without the newer features keep version 2, so the
+// Python implementation and older builds can still open them.
+static uint8_t archive_version(uint8_t method, uint8_t flags, size_t streams, int new_records) {
+    int plain = method == COMP_LZMA_ULTRA && !(flags & ~FLAGS_PLAIN) && streams <= 1 && !new_records;
+    return plain ? KUNDA_VERSION_PLAIN : KUNDA_VERSION;
+}
+
+static int create_archive_in(const char *input_path, const char *output_file, const char *preset, int checksum,
+                             const CreateOptions *opts, ChunkRepo *repo, DecodedArchive *reference) {
+    time_t start_time = time(NULL);
+    EncoderConfig encoder = {0};
+    int encoder_resolved = 0;
+    set_filter_limits(SIZE_MAX, 0, SIZE_MAX);
+    
+    if (opts->mem_limit) {
+        printf("Phase 0: Memory planning (limit %.0f MB)...\n", opts->mem_limit / (1024.0 * 1024.0));
+        size_t est_files = 0, est_bytes = 0, est_largest = 0;
+        if (estimate_input(input_path, &est_files, &est_bytes, &est_largest) != 0) {
+            fprintf(stderr, "Cannot access: %s\n", input_path);
+            return -1;
+        }
+        if (resolve_encoder_config(preset, est_bytes, opts->fixed_dict, &encoder) != 0) {
+            return -1;
+        }
+        encoder_resolved = 1;
+        
+        uint32_t requested_dict = encoder.dict_size;
+        size_t reference_bytes = reference ? reference->payload_size : 0;
+        MemoryPlan plan;
+        int fits = plan_memory(opts->mem_limit, est_files, est_bytes, est_largest, reference_bytes, opts, &encoder, &plan) == 0;
+        if (fits && reference) {
+            // Grow the dictionary over the reference only into what the plan left over
+            encoder.preset_dict = reference->payload;
+            encoder.preset_dict_size = reference->payload_size;
+            size_reference_dict(&encoder, est_bytes, opts->mem_limit - (plan.total - plan.encoder));
+            requested_dict = encoder.dict_size;
+            fits = plan_memory(opts->mem_limit, est_files, est_bytes, est_largest, reference_bytes, opts, &encoder, &plan) == 0;
+        }
+        if (!fits) {
+            fprintf(stderr, "Memory limit too small: %zu files / %.2f MB need at least %.0f MB before compression\n",
+                    est_files, est_bytes / (1024.0 * 1024.0),
+                    (plan.scan + plan.payload + plan.lrm + plan.output + plan.reference + plan.dedup) / (1024.0 * 1024.0));
+            return -1;
+        }
+        
+        printf("  Input: %zu files, %.2f MB\n", est_files, est_bytes / (1024.0 * 1024.0));
+        printf("  Scan buffers: %.0f MB, payload: %.0f MB, long-range: %.0f MB\n",
+               plan.scan / (1024.0 * 1024.0), plan.payload / (1024.0 * 1024.0), plan.lrm / (1024.0 * 1024.0));
+        if (plan.reference) printf("  Reference payload: %.0f MB\n", plan.reference / (1024.0 * 1024.0));
+        if (plan.dedup) printf("  Dedup patches and tables: %.0f MB\n", plan.dedup / (1024.0 * 1024.0));
+        if (opts->jpeg || opts->precomp || opts->log_filter || opts->columnar) {
+            printf("  Member filters: %.0f MB (%d worker%s, %.0f MB each), kept bodies: %.0f MB\n",
+                   plan.filters / (1024.0 * 1024.0), plan.filter_workers, plan.filter_workers == 1 ? "" : "s",
+                   plan.filter_worker / (1024.0 * 1024.0), plan.filter_bodies / (1024.0 * 1024.0));
+            set_filter_limits(plan.filter_worker, plan.filter_workers, plan.filter_bodies);
+        }
+        printf("  Encoder: %.0f MB (%u thread%s), output: %.0f MB\n", plan.encoder / (1024.0 * 1024.0),
+               encoder.threads, encoder.threads == 1 ? "" : "s", plan.output / (1024.0 * 1024.0));
+        printf("  Planned peak: %.0f MB of %.0f MB\n", plan.total / (1024.0 * 1024.0),
+               opts->mem_limit / (1024.0 * 1024.0));
+        if (encoder.dict_size != requested_dict) {
+            printf("  Dictionary stepped down: %u MB -> %u MB to fit the limit\n",
+                   requested_dict / (1024 * 1024), encoder.dict_size / (1024 * 1024));
+        }
+        printf("\n");
+    }
+    
+    if (opts->block_target && opts->lrm) {
+        fprintf(stderr, "--lrm cannot be combined with --blocks (matches would cross block boundaries)\n");
+        return -1;
+    }
+    if ((opts->precomp || opts->jpeg || opts->log_filter || opts->columnar) &&
+        (opts->delta || opts->cdc_avg || opts->repo)) {
+        fprintf(stderr, "--precomp, --jpeg, --log-filter and --columnar cannot be combined with --delta, --cdc or --repo\n");
+        return -1;
+    }
+    if (opts->rsync_avg && (opts->block_target || opts->ref_archive)) {
+        fprintf(stderr, "--rsyncable picks its own stream boundaries and cannot be combined with --blocks or --ref-archive\n");
+        return -1;
+    }
+    
+    // Incremental runs compare the scan against the base archive's sidecar
+    FileStateTable base_state = {0};
+    uint32_t chain_depth = 0;
+    if (opts->incremental_from) {
+        if (load_file_state(opts->incremental_from, &base_state) != 0) return -1;
+        // extract follows at most MAX_CHAIN_DEPTH bases; refuse an archive it could not read
+        chain_depth = base_state.chain_depth + 1;
+        if (chain_depth > MAX_CHAIN_DEPTH) {
+            fprintf(stderr, "%s already has %u base archives below it and extract follows at most %d. "
+                    "Run compact on it, then create the incremental archive from the result.\n",
+                    opts->incremental_from, base_state.chain_depth, MAX_CHAIN_DEPTH);
+            file_state_free(&base_state);
+            return -1;
+        }
+    }
+    file_state_hashing = opts->file_state || opts->incremental_from || opts->scan_cache;
+    time_t scan_start = time(NULL);
+    
+    printf("Phase 1: Scanning and analyzing files...\n");
+    
+    Archive *archive = archive_create();
+    if (!archive) {
+        fprintf(stderr, "Failed to create archive structure\n");
+        file_state_free(&base_state);
+        return -1;
+    }
+    
+    // Check if input is a file or directory
+    struct stat input_st;
+    if (stat(input_path, &input_st) != 0) {
+        fprintf(stderr, "Cannot access: %s\n", input_path);
+        archive_free(archive);
+        file_state_free(&base_state);
+        return -1;
+    }
+    
+    if (S_ISREG(input_st.st_mode)) {
+        // Single file
+        printf("Compressing single file: %s\n", input_path);
+        
+        FILE *f = fopen(input_path, "rb");
+        if (!f) {
+            fprintf(stderr, "Cannot open file: %s\n", input_path);
+            archive_free(archive);
+            file_state_free(&base_state);
+            return -1;
+        }
+        
+        fseek(f, 0, SEEK_END);
+        long file_size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        
+        uint8_t *content = malloc(file_size);
+        if (!content) {
+            fclose(f);
+            archive_free(archive);
+            file_state_free(&base_state);
+            return -1;
+        }
+        
+        fread(content, 1, file_size, f);
+        fclose(f);
+        
+        // Get just the filename (no path)
+        const char *filename = strrchr(input_path, '/');
+        if (filename) {
+            filename++; // Skip the '/'
+        } else {
+            filename = input_path;
+        }
+        
+        archive_add_file(archive, filename, content, file_size);
+        compute_digest(file_digest_algo, content, file_size, archive->files[0].digest);
+        archive->files[0].mtime_sec = STAT_MTIME(input_st).tv_sec;
+        archive->files[0].mtime_nsec = STAT_MTIME(input_st).tv_nsec;
+        archive->files[0].inode = input_st.st_ino;
+        file_state_hash(&archive->files[0]);
+        
+        double size_mb = file_size / (1024.0 * 1024.0);
+        FileType type = detect_file_type(content, file_size);
+        const char *type_str = "binary";
+        if (type == FILE_TYPE_TEXT) type_str = "text";
+        else if (type == FILE_TYPE_COMPRESSED) type_str = "compressed";
+        
+        printf("  %s (%.2f MB, %s)\n", filename, size_mb, type_str);
+        
+    } else if (S_ISDIR(input_st.st_mode)) {
+        // Directory
+        if (scan_directory(input_path, input_path, archive) != 0) {
+            archive_free(archive);
+            file_state_free(&base_state);
+            return -1;
+        }
+        if (opts->incremental_from) {
+            size_t scanned = archive->count, unchanged_bytes = 0;
+            size_t unchanged = split_unchanged_files(archive, &base_state, &unchanged_bytes);
+            printf("  Incremental: %zu of %zu files unchanged since %s (%.2f MB not read)\n",
+                   unchanged, scanned, opts->incremental_from, unchanged_bytes / (1024.0 * 1024.0));
+        }
+        if (opts->scan_cache) {
+            ScanCache cache;
+            size_t cached_bytes = 0;
+            scan_cache_open(opts->scan_cache, &cache);
+            size_t cached = scan_cache_apply(archive, &cache, &cached_bytes);
+            scan_cache_close(&cache);
+            printf("  Scan cache: %zu of %zu files unchanged (%.2f MB not re-analysed)\n", cached, archive->count,
+                   cached_bytes / (1024.0 * 1024.0));
+        }
+        load_archive_files(archive);
+        if (opts->rsync_avg && !opts->cluster) {
+            // Path order, so the payload layout does not depend on readdir order
+            qsort(archive->files, archive->count, sizeof(FileEntry), compare_file_entries);
+        }
+    } else {
+        fprintf(stderr, "Input must be a regular file or directory: %s\n", input_path);
+        archive_free(archive);
+        file_state_free(&base_state);
+        return -1;
+    }
+    
+    time_t scan_time = time(NULL) - start_time;
+    
+    // Calculate statistics
+    size_t total_size = 0;
+    int text_files = 0, binary_files = 0, compressed_files = 0;
+    
+    for (size_t i = 0; i < archive->count; i++) {
+        total_size += archive->files[i].size;
+        switch (archive->files[i].type) {
+            case FILE_TYPE_TEXT: text_files++; break;
+            case FILE_TYPE_BINARY: binary_files++; break;
+            case FILE_TYPE_COMPRESSED: compressed_files++; break;
+            default: break;
+        }
+    }
+    
+    printf("\n✓ Analysis complete (%lds)\n", scan_time);
+    printf("  Files: %zu (%d text, %d binary, %d pre-compressed)\n",
+           archive->count, text_files, binary_files, compressed_files);
+    if (archive->base_count) {
+        printf("  Unchanged: %zu (stored as references to the base archive)\n", archive->base_count);
+    }
+    printf("  Total size: %.2f MB\n", total_size / (1024.0 * 1024.0));
+    
+    JpegStats jpeg_stats = {0};
+    PrecompStats precomp_stats = {0};
+    LogFilterStats log_stats = {0};
+    ColumnarStats columnar_stats = {0};
+    if (opts->jpeg || opts->precomp || opts->log_filter || opts->columnar) {
+        printf("\nPhase 1a: Recompression...\n");
+        if (opts->jpeg) jpeg_files(archive, &jpeg_stats);
+        if (opts->precomp) precomp_files(archive, &precomp_stats);
+        if (opts->columnar) columnar_files(archive, &columnar_stats);
+        if (opts->log_filter) log_filter_files(archive, &log_stats);
+        size_t over_limit = atomic_load(&filter_over_limit);
+        if (over_limit) {
+            printf("  %zu file%s stored as is to stay within the memory limit\n", over_limit, over_limit == 1 ? "" : "s");
+        }
+    }
+    
+    ClusterStats cluster_stats = {0};
+    if (opts->cluster) {
+        printf("\nPhase 1b: Similarity clustering...\n");
+        cluster_files(archive, &cluster_stats);
+    }
+    
+    DeltaStats delta_stats = {0};
+    if (opts->delta) {
+        printf("\nPhase 1c: Near-duplicate delta encoding...\n");
+        delta_encode_files(archive, &delta_stats);
+    }
+    
+    ChunkStats chunk_stats = {0};
+    if (opts->cdc_avg && !repo) {
+        printf("\nPhase 1d: Content-defined chunking...\n");
+        chunk_files(archive, opts->cdc_avg, &chunk_stats);
+    }
+    
+    RepoStats repo_stats = {0};
+    if (repo) {
+        printf("\nPhase 1e: Chunk repository %s...\n", repo->dir);
+        if (repo_store_files(repo, archive, opts->cdc_avg ? opts->cdc_avg : CDC_DEFAULT_AVG, preset,
+                             &repo_stats) != 0) {
+            archive_free(archive);
+            file_state_free(&base_state);
+            return -1;
+        }
+        printf("  %zu chunks, %zu new (%.2f MB), %lu index lookups (%lu Bloom false positives), %.0f ms\n",
+               repo_stats.total_chunks, repo_stats.new_chunks, repo_stats.new_bytes / (1024.0 * 1024.0),
+               (unsigned long)repo_stats.index_probes, (unsigned long)repo_stats.bloom_false_positives,
+               repo_stats.chunk_ms);
+        if (repo_stats.new_chunks) {
+            printf("  Pack %08u: %.2f MB\n", repo->next_pack - 1, repo_stats.pack_bytes / (1024.0 * 1024.0));
+        }
+    }
+    
+    // Sketches are in place by now, so the cache covers everything it can skip
+    if (opts->scan_cache && S_ISDIR(input_st.st_mode) && scan_cache_write(opts->scan_cache, archive, scan_start) != 0) {
+        fprintf(stderr, "Warning: cannot write scan cache %s\n", opts->scan_cache);
+    }
+    
+    // Compress paths
+    printf("\nPhase 2: Path compression...\n");
+    compress_paths(archive);
+    
+    // Create binary format
+    printf("\nPhase 3: Creating binary format...\n");
+    
+    size_t binary_capacity = 2 + 4;
+    for (size_t i = 0; i < archive->prefix_count; i++) {
+        binary_capacity += 2 + strlen(archive->prefixes[i].prefix);
+    }
+    for (size_t i = 0; i < archive->count; i++) {
+        FileEntry *file = &archive->files[i];
+        binary_capacity += 2 + strlen(file->path) + 4;
+        if (file->is_duplicate) {
+            binary_capacity += 2 + strlen(file->duplicate_of);
+        } else if (file->is_delta) {
+            binary_capacity += 2 + strlen(archive->files[file->delta_base].path) + 8 + file->patch_size;
+        } else if (file->chunk_refs) {
+            // Upper bound: every reference introduces a new chunk
+            binary_capacity += 8 + file->chunk_count * 8 + file->size;
+        } else if (file->repo_refs) {
+            binary_capacity += 8 + file->repo_nrefs * REPO_REF_SIZE;
+        } else if (file->jpeg) {
+            binary_capacity += 8 + file->jpeg_size;
+        } else if (file->precomp) {
+            binary_capacity += 8 + file->precomp_size;
+        } else if (file->log_filter) {
+            binary_capacity += 8 + file->log_filter_size;
+        } else if (file->columnar) {
+            binary_capacity += 8 + file->columnar_size;
+        } else {
+            binary_capacity += file->size;
+        }
+    }
+    for (size_t i = 0; i < archive->base_count; i++) {
+        binary_capacity += 2 + strlen(archive->base_members[i].path) + 4;
+    }
+    size_t record_count = archive->count + archive->base_count;
+    size_t digest_len = digest_length(file_digest_algo);
+    if (digest_len) {
+        binary_capacity += 2 + record_count * digest_len;
+    }
+    int chained = opts->file_state || opts->incremental_from || repo;
+    if (chained) {
+        binary_capacity += 2 * ARCHIVE_ID_LEN + 2 + (opts->incremental_from ? strlen(opts->incremental_from) : 0);
+        binary_capacity += repo ? 2 + strlen(repo->dir) : 0;
+    }
+    uint8_t *binary_data = malloc(binary_capacity);
+    if (!binary_data) {
+        fprintf(stderr, "Cannot allocate %.2f MB for the binary format (try --mem-limit)\n",
+                binary_capacity / (1024.0 * 1024.0));
+        archive_free(archive);
+        file_state_free(&base_state);
+        return -1;
+    }
+    
+    size_t offset = 0;
+    
+    // Write prefixes
+    write_uint16_be(binary_data + offset, archive->prefix_count);
+    offset += 2;
+    
+    for (size_t i = 0; i < archive->prefix_count; i++) {
+        size_t prefix_len = strlen(archive->prefixes[i].prefix);
+        write_uint16_be(binary_data + offset, prefix_len);
+        offset += 2;
+        memcpy(binary_data + offset, archive->prefixes[i].prefix, prefix_len);
+        offset += prefix_len;
+    }
+    
+    // Write files
+    write_uint32_be(binary_data + offset, record_count);
+    offset += 4;
+    uint32_t chunks_written = 0;
+    
+    // With --blocks, the prefix table is block 0 and every later block starts
+    // on a record boundary, so intact blocks can be parsed on their own
+    ArchiveBlock *blocks = NULL;
+    uint32_t nblocks = 0;
+    int block_error = opts->block_target && archive_block_cut(&blocks, &nblocks, 0, 0, 0) != 0;
+    
+    for (size_t i = 0; i < archive->count && !block_error; i++) {
+        FileEntry *file = &archive->files[i];
+        if (opts->block_target && (i == 0 || offset - blocks[nblocks - 1].raw_offset >= opts->block_target)) {
+            block_error = archive_block_cut(&blocks, &nblocks, offset, i, chunks_written) != 0;
+        }
+        
+        size_t path_len = strlen(file->path);
+        write_uint16_be(binary_data + offset, path_len);
+        offset += 2;
+        memcpy(binary_data + offset, file->path, path_len);
+        offset += path_len;
+        
+        if (file->is_duplicate) {
+            write_uint32_be(binary_data + offset, RECORD_DUPLICATE);
+            offset += 4;
+            size_t dup_len = strlen(file->duplicate_of);
+            write_uint16_be(binary_data + offset, dup_len);
+            offset += 2;
+            memcpy(binary_data + offset, file->duplicate_of, dup_len);
+            offset += dup_len;
+        } else if (file->is_delta) {
+            // Delta: base path, target size, patch
+            write_uint32_be(binary_data + offset, RECORD_DELTA);
+            offset += 4;
+            const char *base_path = archive->files[file->delta_base].path;
+            size_t base_len = strlen(base_path);
+            write_uint16_be(binary_data + offset, base_len);
+            offset += 2;
+            memcpy(binary_data + offset, base_path, base_len);
+            offset += base_len;
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->patch_size);
+            offset += 4;
+            memcpy(binary_data + offset, file->patch, file->patch_size);
+            offset += file->patch_size;
+        } else if (file->chunk_refs) {
+            // Chunk list: total size, reference count, then per reference
+            // either an existing chunk id or CHUNK_NEW + length + bytes
+            write_uint32_be(binary_data + offset, RECORD_CHUNKED);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->chunk_count);
+            offset += 4;
+            for (size_t c = 0; c < file->chunk_count; c++) {
+                uint32_t id = file->chunk_refs[c];
+                if (id == chunks_written) {
+                    const Chunk *chunk = &archive->chunks[id];
+                    write_uint32_be(binary_data + offset, CHUNK_NEW);
+                    offset += 4;
+                    write_uint32_be(binary_data + offset, chunk->len);
+                    offset += 4;
+                    memcpy(binary_data + offset, chunk->data, chunk->len);
+                    offset += chunk->len;
+                    chunks_written++;
+                } else {
+                    write_uint32_be(binary_data + offset, id);
+                    offset += 4;
+                }
+            }
+        } else if (file->repo_refs) {
+            // Repository chunks: total size, reference count, then per
+            // reference the chunk's SHA-256 and length
+            write_uint32_be(binary_data + offset, RECORD_REPO);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->repo_nrefs);
+            offset += 4;
+            memcpy(binary_data + offset, file->repo_refs, file->repo_nrefs * REPO_REF_SIZE);
+            offset += file->repo_nrefs * REPO_REF_SIZE;
+        } else if (file->jpeg) {
+            // Re-coded JPEG: original size, body length, body
+            write_uint32_be(binary_data + offset, RECORD_JPEG);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->jpeg_size);
+            offset += 4;
+            memcpy(binary_data + offset, file->jpeg, file->jpeg_size);
+            offset += file->jpeg_size;
+        } else if (file->precomp) {
+            // Deflate segments: original size, segment bytes length, segments
+            write_uint32_be(binary_data + offset, RECORD_PRECOMP);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->precomp_size);
+            offset += 4;
+            memcpy(binary_data + offset, file->precomp, file->precomp_size);
+            offset += file->precomp_size;
+        } else if (file->log_filter) {
+            // Filtered text: original size, body length, body
+            write_uint32_be(binary_data + offset, RECORD_LOG);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->log_filter_size);
+            offset += 4;
+            memcpy(binary_data + offset, file->log_filter, file->log_filter_size);
+            offset += file->log_filter_size;
+        } else if (file->columnar) {
+            // Columnar table: original size, body length, body
+            write_uint32_be(binary_data + offset, RECORD_COLUMNAR);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            write_uint32_be(binary_data + offset, file->columnar_size);
+            offset += 4;
+            memcpy(binary_data + offset, file->columnar, file->columnar_size);
+            offset += file->columnar_size;
+        } else {
+            write_uint32_be(binary_data + offset, file->size);
+            offset += 4;
+            memcpy(binary_data + offset, file->content, file->size);
+            offset += file->size;
+        }
+    }
+    
+    // Unchanged members: just the path, the base archive has the content
+    for (size_t i = 0; i < archive->base_count && !block_error; i++) {
+        if (opts->block_target && (archive->count + i == 0 ||
+                                   offset - blocks[nblocks - 1].raw_offset >= opts->block_target)) {
+            block_error = archive_block_cut(&blocks, &nblocks, offset, archive->count + i, chunks_written) != 0;
+        }
+        size_t path_len = strlen(archive->base_members[i].path);
+        write_uint16_be(binary_data + offset, path_len);
+        offset += 2;
+        memcpy(binary_data + offset, archive->base_members[i].path, path_len);
+        offset += path_len;
+        write_uint32_be(binary_data + offset, RECORD_BASE);
+        offset += 4;
+    }
+    
+    // Digest table: algorithm, digest length, then one digest per record.
+    // Unchanged members are verified by the base archive and get zeros here.
+    uint8_t flags = FLAG_PATH_COMPRESSED;
+    if (opts->block_target && !block_error) {
+        block_error = archive_block_cut(&blocks, &nblocks, offset, record_count, chunks_written) != 0;
+    }
+    if (digest_len) {
+        binary_data[offset++] = (uint8_t)file_digest_algo;
+        binary_data[offset++] = (uint8_t)digest_len;
+        for (size_t i = 0; i < archive->count; i++) {
+            memcpy(binary_data + offset, archive->files[i].digest, digest_len);
+            offset += digest_len;
+        }
+        memset(binary_data + offset, 0, archive->base_count * digest_len);
+        offset += archive->base_count * digest_len;
+        flags |= FLAG_FILE_DIGESTS;
+    }
+    
+    // Chain trailer: this archive's id, then the base's id and path
+    uint8_t archive_id[ARCHIVE_ID_LEN];
+    if (chained) {
+        new_archive_id(archive_id, output_file);
+        memcpy(binary_data + offset, archive_id, ARCHIVE_ID_LEN);
+        offset += ARCHIVE_ID_LEN;
+        if (opts->incremental_from) {
+            memcpy(binary_data + offset, base_state.archive_id, ARCHIVE_ID_LEN);
+        } else {
+            memset(binary_data + offset, 0, ARCHIVE_ID_LEN);
+        }
+        offset += ARCHIVE_ID_LEN;
+        size_t base_len = opts->incremental_from ? strlen(opts->incremental_from) : 0;
+        write_uint16_be(binary_data + offset, base_len);
+        offset += 2;
+        memcpy(binary_data + offset, opts->incremental_from ? opts->incremental_from : "", base_len);
+        offset += base_len;
+        if (repo) {
+            // Absolute, so the archive can be read from any directory
+            size_t repo_len = strlen(repo->dir);
+            write_uint16_be(binary_data + offset, repo_len);
+            offset += 2;
+            memcpy(binary_data + offset, repo->dir, repo_len);
+            offset += repo_len;
+        }
+        flags |= FLAG_CHAINED;
+    }
+    file_state_free(&base_state);
+    
+    size_t original_size = offset;
+    if (opts->block_target && !block_error) {
+        // Close the last block (digest table, or the final records)
+        blocks[nblocks - 1].raw_size = original_size - blocks[nblocks - 1].raw_offset;
+        if (blocks[nblocks - 1].raw_size == 0) nblocks--;
+    }
+    if (block_error) {
+        fprintf(stderr, "Cannot build the block table (more than %d blocks or out of memory)\n", MAX_BLOCKS);
+        free(blocks);
+        free(binary_data);
+        archive_free(archive);
+        return -1;
+    }
+    // The header stores the payload size as 32 bits
+    if (original_size > UINT32_MAX) {
+        fprintf(stderr, "Payload is larger than 4 GB (%.2f GB); split the input or use --repo\n",
+                original_size / (1024.0 * 1024.0 * 1024.0));
+        free(blocks);
+        free(binary_data);
+        archive_free(archive);
+        return -1;
+    }
+    printf("✓ Binary format: %.2f MB\n", original_size / (1024.0 * 1024.0));
+    if (opts->block_target) {
+        flags |= FLAG_BLOCKED;
+        printf("  %u blocks of ~%.1f MB, record-aligned\n", nblocks, opts->block_target / (1024.0 * 1024.0));
+    }
+    
+    // Long-range matching: LZMA then sees the residue instead of the payload
+    const uint8_t *lzma_input = binary_data;
+    size_t lzma_input_size = original_size;
+    uint8_t *lrm_data = NULL;
+    LrmStats lrm_stats = {0};
+    
+    if (opts->lrm) {
+        printf("\nPhase 3b: Long-range matching...\n");
+        size_t lrm_size;
+        lrm_data = lrm_encode(binary_data, original_size, &lrm_size, &lrm_stats);
+        if (lrm_data) {
+            printf("  %zu matches, %.2f MB referenced (index every %zu bytes, %.0f ms)\n",
+                   lrm_stats.matches, lrm_stats.matched_bytes / (1024.0 * 1024.0),
+                   lrm_stats.block, lrm_stats.encode_ms);
+        }
+        if (lrm_data && lrm_stats.matches > 0) {
+            lzma_input = lrm_data;
+            lzma_input_size = lrm_size;
+            flags |= FLAG_LONG_RANGE;
+        } else {
+            free(lrm_data);
+            lrm_data = NULL;
+        }
+    }
+    
+    // Compress
+    printf("\nPhase 4: Ultra compression (preset: %s)...\n", preset);
+    time_t compress_start = time(NULL);
+    
+    // The reference was decoded up front and sits in the dictionary ahead of the payload
+    uint8_t reference_sha[32];
+    if (reference) SHA256(reference->payload, reference->payload_size, reference_sha);
+    
+    if (!encoder_resolved && resolve_encoder_config(preset, (reference ? reference->payload_size : 0) + lzma_input_size,
+                                                    opts->fixed_dict, &encoder) != 0) {
+        free(blocks);
+        free(lrm_data);
+        free(binary_data);
+        archive_free(archive);
+        return -1;
+    }
+    if (reference) {
+        encoder.preset_dict = reference->payload;
+        encoder.preset_dict_size = reference->payload_size;
+        // Under --mem-limit the plan already sized it
+        if (!opts->mem_limit) {
+            MemoryInfo mem;
+            get_memory_info(&mem);
+            size_reference_dict(&encoder, lzma_input_size, (size_t)(mem.usable * DICT_MEM_FRACTION));
+        }
+    }
+    if (blocks) {
+        // No block needs a dictionary larger than itself
+        size_t largest = 0;
+        for (uint32_t i = 0; i < nblocks; i++) {
+            if (blocks[i].raw_size > largest) largest = blocks[i].raw_size;
+        }
+        uint32_t dict = DICT_AUTO_FLOOR;
+        while (dict < largest && dict < encoder.dict_size) dict *= 2;
+        if (dict < encoder.dict_size) encoder.dict_size = dict;
+        // The blocks are separate streams anyway, so they always use the workers
+        if (!opts->mem_limit) fit_encoder_threads(&encoder, nblocks, largest);
+        if (encoder.threads > nblocks) encoder.threads = nblocks;
+    }
+    if (opts->rsync_avg) {
+        encoder.rsync_avg = opts->rsync_avg;
+        size_rsyncable_dict(&encoder);
+        // Below the smallest dictionary, every stream restarts the model
+        // before it has filled even that (measured: +9% size at 64K, +3% at
+        // 256K, +1% at 1M)
+        if (opts->rsync_avg < DICT_AUTO_FLOOR) {
+            fprintf(stderr, "Warning: --rsyncable cuts every ~%zu KB, below the %zu KB minimum dictionary; "
+                    "expect a noticeably larger archive\n", opts->rsync_avg / 1024, DICT_AUTO_FLOOR / 1024);
+        }
+        if (!opts->mem_limit) {
+            fit_encoder_threads(&encoder, lzma_input_size / opts->rsync_avg + 1, opts->rsync_avg * 8);
+        }
+    }
+    print_encoder_config(&encoder);
+    
+    // The payload digest runs on its own thread alongside the encoder; the
+    // archive checksum is fed from the encoder output as it is written
+    StreamHasher content_hasher, archive_hasher;
+    int content_hashing = opts->content_digest && stream_hasher_start(&content_hasher, 1) == 0;
+    if (opts->content_digest && !content_hashing) {
+        fprintf(stderr, "Cannot start content digest thread\n");
+        free(blocks);
+        free(lrm_data);
+        free(binary_data);
+        archive_free(archive);
+        return -1;
+    }
+    if (content_hashing) {
+        stream_hasher_update(&content_hasher, 0, binary_data, original_size, 1);
+    }
+    
+    size_t compressed_size;
+    struct rusage usage_before, usage_after;
+    getrusage(RUSAGE_SELF, &usage_before);
+    double encode_start = now_ms();
+    uint8_t *compressed_data;
+    if (blocks) {
+        // The Merkle root takes the place of the whole-archive checksum
+        checksum = 0;
+        compressed_data = compress_archive_blocks(lzma_input, blocks, nblocks, &compressed_size, &encoder);
+    } else {
+        compressed_data = compress_lzma_ultra(lzma_input, lzma_input_size, &compressed_size, &encoder,
+                                              checksum ? &archive_hasher : NULL);
+    }
+    if (reference) decoded_archive_free(reference);
+    encoder.preset_dict = NULL;
+    double encode_ms = now_ms() - encode_start;
+    getrusage(RUSAGE_SELF, &usage_after);
+    if (content_hashing && (stream_hasher_finish(&content_hasher) != 0 || !compressed_data)) {
+        free(compressed_data);
+        compressed_data = NULL;
+    }
+    hugepage_stats.minor_faults = usage_after.ru_minflt - usage_before.ru_minflt;
+    hugepage_stats.anon_huge_kb = read_anon_huge_kb();
+    
+    // The long-range residue and incompressible data can grow past the limit too
+    if (compressed_data && (lzma_input_size > UINT32_MAX || compressed_size > UINT32_MAX)) {
+        fprintf(stderr, "Compressed archive is larger than 4 GB; split the input\n");
+        free(compressed_data);
+        compressed_data = NULL;
+    }
+    if (!compressed_data) {
+        free(blocks);
+        free(lrm_data);
+        free(binary_data);
+        archive_free(archive);
+        return -1;
+    }
+    
+    time_t compress_time = time(NULL) - compress_start;
+    double compression_ratio = (double)compressed_size / original_size * 100.0;
+    
+    printf("✓ Compressed in %lds\n", compress_time);
+    printf("  Size: %.2f MB (%.1f%%)\n", compressed_size / (1024.0 * 1024.0), compression_ratio);
+    
+    // Checksums were computed while compressing
+    if (checksum) {
+        printf("  SHA-256 (archive):  streamed, %.0f ms of hashing overlapped with %.0f ms of encoding\n",
+               archive_hasher.hash_ms, encode_ms);
+        flags |= FLAG_CHECKSUMMED;
+    }
+    if (content_hashing) {
+        printf("  SHA-256 (content):  streamed, %.0f ms of hashing overlapped\n", content_hasher.hash_ms);
+        flags |= FLAG_CONTENT_DIGEST;
+    }
+    uint8_t root[32];
+    if (blocks) {
+        double seal_start = now_ms();
+        BlockSealJob seal = { blocks, compressed_data };
+        pool_run(get_worker_pool(), nblocks, 0, block_seal_task, &seal);
+        merkle_root(blocks, nblocks, root);
+        printf("  Block CRC32 + Merkle root: %u blocks, %.0f ms\n", nblocks, now_ms() - seal_start);
+    }
+    
+    // Build archive
+    printf("\nPhase 5: Writing archive...\n");
+    
+    FILE *out = fopen(output_file, "wb");
+    if (!out) {
+        fprintf(stderr, "Cannot create output file: %s\n", output_file);
+        free(blocks);
+        free(compressed_data);
+        free(lrm_data);
+        free(binary_data);
+        archive_free(archive);
+        return -1;
+    }
+    
+    // Write header
+    uint8_t method = opts->ref_archive ? COMP_LZMA_REF : COMP_LZMA_ULTRA;
+    int new_records = 0;
+    for (size_t i = 0; i < archive->count && !new_records; i++) new_records = member_needs_v3(&archive->files[i]);
+    fwrite(KUNDA_MAGIC, 1, 8, out);
+    fputc(archive_version(method, flags, blocks ? nblocks : encoder.streams, new_records), out);
+    fputc(method, out);
+    fputc(flags, out);
+    
+    uint8_t size_buf[4];
+    write_uint32_be(size_buf, lzma_input_size);
+    fwrite(size_buf, 1, 4, out);
+    write_uint32_be(size_buf, compressed_size);
+    fwrite(size_buf, 1, 4, out);
+    
+    if (checksum) {
+        fwrite(archive_hasher.digest, 1, 32, out);
+    }
+    if (content_hashing) {
+        fwrite(content_hasher.digest, 1, 32, out);
+    }
+    if (opts->ref_archive) {
+        // Reference payload digest, dictionary size, reference path
+        size_t ref_len = strlen(opts->ref_archive);
+        fwrite(reference_sha, 1, 32, out);
+        write_uint32_be(size_buf, encoder.dict_size);
+        fwrite(size_buf, 1, 4, out);
+        write_uint16_be(size_buf, ref_len);
+        fwrite(size_buf, 1, 2, out);
+        fwrite(opts->ref_archive, 1, ref_len, out);
+    }
+    if (blocks) {
+        // Merkle root, block count, record count, then the block table
+        fwrite(root, 1, 32, out);
+        write_uint32_be(size_buf, nblocks);
+        fwrite(size_buf, 1, 4, out);
+        write_uint32_be(size_buf, record_count);
+        fwrite(size_buf, 1, 4, out);
+        for (uint32_t i = 0; i < nblocks; i++) {
+            uint8_t desc[BLOCK_DESC_SIZE];
+            block_descriptor(&blocks[i], desc);
+            fwrite(desc, 1, BLOCK_DESC_SIZE, out);
+        }
+    }
+    
+    fwrite(compressed_data, 1, compressed_size, out);
+    fclose(out);
+    
+    // An unregistered archive would lose its chunks to the next gc, so it
+    // is not kept
+    if (repo && repo_register(repo, archive_id, output_file) != 0) {
+        fprintf(stderr, "Cannot register %s in %s; archive removed\n", output_file, repo->dir);
+        remove(output_file);
+        free(blocks);
+        free(compressed_data);
+        free(lrm_data);
         free(binary_data);
         archive_free(archive);
         return -1;
     }
+    int write_state = opts->file_state || opts->incremental_from;
+    if (write_state && write_file_state(output_file, archive_id, chain_depth, archive) != 0) {
+        fprintf(stderr, "Cannot write file state: %s.state\n", output_file);
+    }
+    
+    // Get final size
+    struct stat st;
+    stat(output_file, &st);
+    size_t archive_size = st.st_size;
+    
+    time_t total_time = time(NULL) - start_time;
+    size_t overhead = archive_size - compressed_size;
+    
+    printf("\n✓ SUCCESS: %s\n", output_file);
+    printf("============================================================\n");
+    printf("  Files:              %zu\n", archive->count);
+    printf("  Original size:      %.2f MB\n", original_size / (1024.0 * 1024.0));
+    printf("  Archive size:       %.2f MB\n", archive_size / (1024.0 * 1024.0));
+    printf("  Compression ratio:  %.2f%%\n", (double)archive_size / original_size * 100.0);
+    printf("  Overhead:           %zu bytes\n", overhead);
+    printf("  Total time:         %lds\n", total_time);
+    print_parallelism();
+    print_hugepage_stats();
+    if (opts->cluster) {
+        printf("  Clustering:         %zu clusters, %.0f ms sketching\n",
+               cluster_stats.clusters, cluster_stats.sketch_ms);
+        if (cluster_stats.clusters > 0) {
+            printf("  Cluster gain (est): %.2f%% -> %.2f%% (fast probe, %.0f ms)\n",
+                   cluster_stats.probe_ratio_before, cluster_stats.probe_ratio_after,
+                   cluster_stats.probe_ms);
+        }
+    }
+    
+    if (opts->delta) {
+        printf("  Delta members:      %zu (%.2f MB stored as %.2f MB of patches)\n",
+               delta_stats.delta_files, delta_stats.target_bytes / (1024.0 * 1024.0),
+               delta_stats.patch_bytes / (1024.0 * 1024.0));
+    }
+    if (opts->cdc_avg) {
+        printf("  Chunk dedup:        %.2fx (%zu of %zu chunks unique)\n",
+               chunk_stats.unique_bytes ? (double)chunk_stats.input_bytes / chunk_stats.unique_bytes : 1.0,
+               chunk_stats.unique_chunks, chunk_stats.total_chunks);
+        printf("  Chunker throughput: %.0f MB/s\n", chunk_stats.chunk_ms > 0 ?
+               chunk_stats.input_bytes / (1024.0 * 1024.0) / (chunk_stats.chunk_ms / 1000.0) : 0.0);
+    }
+    if (opts->jpeg) {
+        printf("  JPEG re-coding:     %zu of %zu files, %.2f MB -> %.2f MB (%.1f ms CPU/MB)\n",
+               jpeg_stats.recoded, jpeg_stats.candidates, jpeg_stats.original_bytes / (1024.0 * 1024.0),
+               jpeg_stats.coded_bytes / (1024.0 * 1024.0), jpeg_stats.original_bytes ?
+               jpeg_stats.cpu_ms / (jpeg_stats.original_bytes / (1024.0 * 1024.0)) : 0.0);
+    }
+    if (opts->precomp) {
+        printf("  Deflate streams:    %zu of %zu re-created (%.2f MB stored as %.2f MB inflated, %.1f ms CPU/MB)\n",
+               precomp_stats.recreated, precomp_stats.streams, precomp_stats.deflated_bytes / (1024.0 * 1024.0),
+               precomp_stats.inflated_bytes / (1024.0 * 1024.0), precomp_stats.input_bytes ?
+               precomp_stats.cpu_ms / (precomp_stats.input_bytes / (1024.0 * 1024.0)) : 0.0);
+    }
+    if (opts->log_filter) {
+        printf("  Log filter:         %zu of %zu files, %.2f MB -> %.2f MB template + %.2f MB values\n",
+               log_stats.filtered, log_stats.candidates, log_stats.original_bytes / (1024.0 * 1024.0),
+               log_stats.template_bytes / (1024.0 * 1024.0), log_stats.value_bytes / (1024.0 * 1024.0));
+    }
+    if (opts->columnar) {
+        printf("  Columnar tables:    %zu of %zu files, %.2f MB in %zu columns\n", columnar_stats.converted,
+               columnar_stats.candidates, columnar_stats.original_bytes / (1024.0 * 1024.0), columnar_stats.columns);
+    }
+    if (repo) {
+        printf("  Repository dedup:   %.2f MB new of %.2f MB (%zu of %zu chunks new)\n",
+               repo_stats.new_bytes / (1024.0 * 1024.0), repo_stats.input_bytes / (1024.0 * 1024.0),
+               repo_stats.new_chunks, repo_stats.total_chunks);
+    }
+    if (flags & FLAG_LONG_RANGE) {
+        printf("  Long-range matches: %zu (%.2f MB removed before LZMA)\n",
+               lrm_stats.matches, lrm_stats.matched_bytes / (1024.0 * 1024.0));
+    }
+    if (archive->base_count) {
+        printf("  Unchanged (base):   %zu files referenced from %s\n", archive->base_count, opts->incremental_from);
+    }
+    if (write_state) {
+        printf("  File state:         %s.state\n", output_file);
+    }
+    if (blocks) {
+        printf("  Verifiable blocks:  %u (Merkle root %02x%02x%02x%02x%02x%02x%02x%02x...)\n", nblocks,
+               root[0], root[1], root[2], root[3], root[4], root[5], root[6], root[7]);
+    }
+    
+    double rar_estimated = original_size * 0.067;
+    double difference_mb = archive_size / (1024.0 * 1024.0) - rar_estimated / (1024.0 * 1024.0);
+    if (archive_size < rar_estimated) {
+        printf("  vs RAR (est):       %.2f MB SMALLER! 🎉\n", -difference_mb);
+    } else {
+        printf("  vs RAR (est):       %.2f MB larger\n", difference_mb);
+    }
+    printf("============================================================\n");
+    
+    free(blocks);
+    free(compressed_data);
+    free(lrm_data);
+    free(binary_data);
+    archive_free(archive);
+    
+    return 0;
+}
+
+// Create one archive per line of list_file ("input" or "input<TAB>output",
+// output defaulting to input.kun). All archives share the encoder contexts,
+// and the automatic ultra dictionary is sized once for the largest input so
+// that every archive re-initialises the encoders with the same filter chain.
+int batch_create(const char *list_file, const char *preset, const CreateOptions *opts) {
+    FILE *list = fopen(list_file, "r");
+    if (!list) {
+        fprintf(stderr, "Cannot open batch list: %s\n", list_file);
+        return -1;
+    }
+    
+    size_t capacity = 64, count = 0;
+    char (*inputs)[MAX_PATH_LEN] = malloc(sizeof(*inputs) * capacity);
+    char (*outputs)[MAX_PATH_LEN] = malloc(sizeof(*outputs) * capacity);
+    char line[MAX_PATH_LEN * 2];
+    
+    while (inputs && outputs && fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        
+        if (count >= capacity) {
+            capacity *= 2;
+            void *new_inputs = realloc(inputs, sizeof(*inputs) * capacity);
+            if (new_inputs) inputs = new_inputs;
+            void *new_outputs = realloc(outputs, sizeof(*outputs) * capacity);
+            if (new_outputs) outputs = new_outputs;
+            if (!new_inputs || !new_outputs) {
+                fprintf(stderr, "Out of memory reading batch list\n");
+                count = 0;
+                break;
+            }
+        }
+        
+        char *tab = strchr(line, '\t');
+        if (tab) *tab = '\0';
+        const char *output = tab && tab[1] ? tab + 1 : NULL;
+        if (strlen(line) > MAX_PATH_LEN - 5 || (output && strlen(output) >= MAX_PATH_LEN)) {
+            fprintf(stderr, "  Skipping over-long path in batch list: %.64s...\n", line);
+            continue;
+        }
+        memcpy(inputs[count], line, strlen(line) + 1);
+        if (output) {
+            memcpy(outputs[count], output, strlen(output) + 1);
+        } else {
+            snprintf(outputs[count], MAX_PATH_LEN, "%.*s.kun", MAX_PATH_LEN - 5, line);
+        }
+        count++;
+    }
+    fclose(list);
+    
+    if (count == 0) {
+        fprintf(stderr, "Batch list is empty: %s\n", list_file);
+        free(inputs);
+        free(outputs);
+        return -1;
+    }
+    
+    if (opts->incremental_from || opts->scan_cache) {
+        fprintf(stderr, "%s cannot be used in batch mode\n",
+                opts->incremental_from ? "--incremental-from takes a single base and" : "--scan-cache is per tree and");
+        free(inputs);
+        free(outputs);
+        return -1;
+    }
+    
+    CreateOptions batch_opts = *opts;
+    if (strcmp(preset, "ultra") == 0 && !opts->mem_limit) {
+        size_t largest = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t files = 0, bytes = 0, largest_file = 0;
+            if (estimate_input(inputs[i], &files, &bytes, &largest_file) == 0 && bytes > largest) largest = bytes;
+        }
+        printf("Batch dictionary for %zu archives (largest input %.2f MB):\n", count, largest / (1024.0 * 1024.0));
+        batch_opts.fixed_dict = get_optimal_dict_size(largest);
+        if (batch_opts.fixed_dict >= 1024 * 1024) {
+            printf("  - Dictionary: %u MB\n\n", batch_opts.fixed_dict / (1024 * 1024));
+        } else {
+            printf("  - Dictionary: %u KB\n\n", batch_opts.fixed_dict / 1024);
+        }
+    }
+    
+    double start = now_ms();
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        printf("━━━ [%zu/%zu] %s -> %s ━━━\n", i + 1, count, inputs[i], outputs[i]);
+        if (create_archive(inputs[i], outputs[i], preset, 1, &batch_opts) != 0) {
+            fprintf(stderr, "  Failed: %s\n", inputs[i]);
+            failed++;
+        }
+        printf("\n");
+    }
+    
+    printf("✓ Batch complete: %zu of %zu archives created in %.1fs\n", count - failed, count,
+           (now_ms() - start) / 1000.0);
+    print_encoder_context_stats();
+    
+    free(inputs);
+    free(outputs);
+    return failed ? -1 : 0;
+}
+
+// Scan and load a file or directory for a benchmark
+static Archive *load_input_archive(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Cannot access: %s\n", path);
+        return NULL;
+    }
+    
+    Archive *archive = archive_create();
+    if (!archive) return NULL;
+    if (S_ISDIR(st.st_mode)) {
+        if (scan_directory(path, path, archive) != 0) {
+            archive_free(archive);
+            return NULL;
+        }
+    } else if (archive_add_file(archive, path, NULL, st.st_size) == 0) {
+        archive->files[0].source = strdup(path);
+    }
+    pool_run(get_worker_pool(), archive->count, 0, load_file_task, archive);
+    return archive;
+}
+
+// Read a file, or every file of a directory concatenated, into one buffer
+// (benchmark input)
+uint8_t* load_input_bytes(const char *path, size_t *size) {
+    Archive *archive = load_input_archive(path);
+    if (!archive) return NULL;
+    
+    size_t total = 0;
+    for (size_t i = 0; i < archive->count; i++) {
+        if (archive->files[i].content) total += archive->files[i].size;
+    }
+    uint8_t *data = malloc(total ? total : 1);
+    if (data) {
+        size_t pos = 0;
+        for (size_t i = 0; i < archive->count; i++) {
+            if (!archive->files[i].content) continue;
+            memcpy(data + pos, archive->files[i].content, archive->files[i].size);
+            pos += archive->files[i].size;
+        }
+        *size = total;
+    }
+    archive_free(archive);
+    return data;
+}
+
+// Compress the same input block-parallel with each NUMA placement and
+// report the best of three runs per mode. Workers and encoder contexts are
+// rebuilt for every mode so pinning and first-touch placement start fresh.
+int bench_numa(const char *input, const char *preset) {
+    size_t size = 0;
+    uint8_t *data = load_input_bytes(input, &size);
+    if (!data) return -1;
+    
+    static const NumaMode modes[] = { NUMA_OFF, NUMA_INTERLEAVE, NUMA_LOCAL };
+    static const char *mode_names[] = { "off", "local", "interleave" };
+    
+    printf("NUMA placement benchmark: %.2f MB, preset %s\n", size / (1024.0 * 1024.0), preset);
+    EncoderConfig base_cfg;
+    if (resolve_encoder_config(preset, size, 0, &base_cfg) != 0) {
+        free(data);
+        return -1;
+    }
+    
+    int result = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        encoder_contexts_free();
+        pool_destroy(shared_pool);
+        shared_pool = NULL;
+        numa_mode = modes[m];
+        WorkerPool *pool = get_worker_pool();
+        
+        // Split into at least one block per worker so every node gets work
+        EncoderConfig cfg = base_cfg;
+        if (pool->nthreads > 1) {
+            cfg.threads = pool->nthreads;
+            if (cfg.block_size == 0 || size / cfg.block_size < (size_t)pool->nthreads) {
+                cfg.block_size = size / pool->nthreads + 1;
+                if (cfg.block_size < BLOCK_SIZE_MIN) cfg.block_size = BLOCK_SIZE_MIN;
+            }
+        }
+        
+        double best = 0;
+        size_t compressed_size = 0;
+        for (int run = 0; run < 3; run++) {
+            EncoderConfig run_cfg = cfg;
+            double start = now_ms();
+            uint8_t *out = compress_lzma_ultra(data, size, &compressed_size, &run_cfg, NULL);
+            double elapsed = now_ms() - start;
+            if (!out) {
+                result = -1;
+                break;
+            }
+            free(out);
+            if (run == 0 || elapsed < best) best = elapsed;
+        }
+        if (result != 0) break;
+        
+        printf("  %-11s %8.0f ms  %7.2f MB/s  %.2f MB  (%d worker%s, %d node%s%s)\n", mode_names[numa_mode], best,
+               best > 0 ? size / (1024.0 * 1024.0) / (best / 1000.0) : 0.0, compressed_size / (1024.0 * 1024.0),
+               pool->nthreads, pool->nthreads == 1 ? "" : "s", numa_topology.nodes, numa_topology.nodes == 1 ? "" : "s",
+               pool->pinned ? ", pinned" : "");
+    }
+    if (numa_topology.nodes < 2) {
+        printf("  Single NUMA node: placement modes are expected to match\n");
+    }
+    
+    free(data);
+    return result;
+}
+
+// Compress an input as it is and with --precomp, and time both directions of
+// the deflate recompression
+int bench_precomp(const char *input, const char *preset) {
+    Archive *archive = load_input_archive(input);
+    if (!archive) return -1;
+    
+    PrecompStats stats;
+    printf("Deflate recompression benchmark: %zu files, preset %s\n", archive->count, preset);
+    precomp_files(archive, &stats);
+    
+    // Both payloads are the file contents back to back; with --precomp the
+    // re-created files contribute their segments instead
+    size_t plain_size = 0, precomp_size = 0;
+    for (size_t i = 0; i < archive->count; i++) {
+        const FileEntry *file = &archive->files[i];
+        if (!file->content) continue;
+        plain_size += file->size;
+        precomp_size += file->precomp ? file->precomp_size : file->size;
+    }
+    uint8_t *plain = malloc(plain_size ? plain_size : 1);
+    uint8_t *precomp = malloc(precomp_size ? precomp_size : 1);
+    uint8_t *check = malloc(plain_size ? plain_size : 1);
+    int result = plain && precomp && check ? 0 : -1;
+    size_t plain_pos = 0, precomp_pos = 0;
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    for (size_t i = 0; i < archive->count && result == 0; i++) {
+        const FileEntry *file = &archive->files[i];
+        if (!file->content) continue;
+        memcpy(plain + plain_pos, file->content, file->size);
+        if (file->precomp) {
+            memcpy(precomp + precomp_pos, file->precomp, file->precomp_size);
+            precomp_pos += file->precomp_size;
+            if (precomp_rebuild(file->precomp, file->precomp_size, check, file->size) != 0 ||
+                memcmp(check, file->content, file->size) != 0) {
+                fprintf(stderr, "Rebuild mismatch: %s\n", file->path);
+                result = -1;
+            }
+        } else {
+            memcpy(precomp + precomp_pos, file->content, file->size);
+            precomp_pos += file->size;
+        }
+        plain_pos += file->size;
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    double rebuild_ms = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000.0 + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e6;
+    archive_free(archive);
+    free(check);
+    
+    size_t sizes[2] = {0, 0};
+    double times[2] = {0, 0};
+    for (int mode = 0; mode < 2 && result == 0; mode++) {
+        EncoderConfig cfg;
+        size_t in_size = mode ? precomp_size : plain_size;
+        if (resolve_encoder_config(preset, in_size, 0, &cfg) != 0) {
+            result = -1;
+            break;
+        }
+        double start = now_ms();
+        uint8_t *out = compress_lzma_ultra(mode ? precomp : plain, in_size, &sizes[mode], &cfg, NULL);
+        times[mode] = now_ms() - start;
+        if (!out) result = -1;
+        free(out);
+    }
+    free(plain);
+    free(precomp);
+    if (result != 0) return result;
+    
+    double input_mb = plain_size / (1024.0 * 1024.0);
+    printf("  plain        %8.2f MB -> %8.2f MB  (%6.0f ms)\n", input_mb, sizes[0] / (1024.0 * 1024.0), times[0]);
+    printf("  --precomp    %8.2f MB -> %8.2f MB  (%6.0f ms)\n", precomp_size / (1024.0 * 1024.0),
+           sizes[1] / (1024.0 * 1024.0), times[1]);
+    printf("  Gain: %.2f%% smaller archive\n", sizes[0] ? 100.0 - sizes[1] * 100.0 / sizes[0] : 0.0);
+    printf("  CPU per input MB: %.1f ms to analyse, %.1f ms to re-create on extract\n",
+           input_mb > 0 ? stats.cpu_ms / input_mb : 0.0, input_mb > 0 ? rebuild_ms / input_mb : 0.0);
+    return 0;
+}
+
+// Compress an input as it is and with --log-filter, and measure the filter's
+// throughput in both directions
+int bench_log_filter(const char *input, const char *preset) {
+    Archive *archive = load_input_archive(input);
+    if (!archive) return -1;
+    
+    LogFilterStats stats;
+    printf("Log filter benchmark: %zu files, preset %s\n", archive->count, preset);
+    log_filter_files(archive, &stats);
+    
+    // Both payloads are the file contents back to back; with --log-filter
+    // the filtered files contribute their bodies instead
+    size_t plain_size = 0, filtered_size = 0;
+    for (size_t i = 0; i < archive->count; i++) {
+        const FileEntry *file = &archive->files[i];
+        if (!file->content) continue;
+        plain_size += file->size;
+        filtered_size += file->log_filter ? file->log_filter_size : file->size;
+    }
+    uint8_t *plain = malloc(plain_size ? plain_size : 1);
+    uint8_t *filtered = malloc(filtered_size ? filtered_size : 1);
+    uint8_t *check = malloc(plain_size ? plain_size : 1);
+    int result = plain && filtered && check ? 0 : -1;
+    size_t plain_pos = 0, filtered_pos = 0;
+    double decode_ms = 0;
+    for (size_t i = 0; i < archive->count && result == 0; i++) {
+        const FileEntry *file = &archive->files[i];
+        if (!file->content) continue;
+        memcpy(plain + plain_pos, file->content, file->size);
+        if (file->log_filter) {
+            memcpy(filtered + filtered_pos, file->log_filter, file->log_filter_size);
+            filtered_pos += file->log_filter_size;
+            double start = now_ms();
+            if (log_filter_decode(file->log_filter, file->log_filter_size, check, file->size) != 0 ||
+                memcmp(check, file->content, file->size) != 0) {
+                fprintf(stderr, "Rebuild mismatch: %s\n", file->path);
+                result = -1;
+            }
+            decode_ms += now_ms() - start;
+        } else {
+            memcpy(filtered + filtered_pos, file->content, file->size);
+            filtered_pos += file->size;
+        }
+        plain_pos += file->size;
+    }
+    archive_free(archive);
+    free(check);
+    
+    size_t sizes[2] = {0, 0};
+    double times[2] = {0, 0};
+    for (int mode = 0; mode < 2 && result == 0; mode++) {
+        EncoderConfig cfg;
+        size_t in_size = mode ? filtered_size : plain_size;
+        if (resolve_encoder_config(preset, in_size, 0, &cfg) != 0) {
+            result = -1;
+            break;
+        }
+        double start = now_ms();
+        uint8_t *out = compress_lzma_ultra(mode ? filtered : plain, in_size, &sizes[mode], &cfg, NULL);
+        times[mode] = now_ms() - start;
+        if (!out) result = -1;
+        free(out);
+    }
+    free(plain);
+    free(filtered);
+    if (result != 0) return result;
+    
+    double input_mb = plain_size / (1024.0 * 1024.0);
+    printf("  plain        %8.2f MB -> %8.2f MB  (%6.0f ms)\n", input_mb, sizes[0] / (1024.0 * 1024.0), times[0]);
+    printf("  --log-filter %8.2f MB -> %8.2f MB  (%6.0f ms)\n", filtered_size / (1024.0 * 1024.0),
+           sizes[1] / (1024.0 * 1024.0), times[1]);
+    printf("  Gain: %.2f%% smaller archive\n", sizes[0] ? 100.0 - sizes[1] * 100.0 / sizes[0] : 0.0);
+    printf("  Filter throughput per core: %.0f MB/s to probe and split the candidates, %.0f MB/s to re-create\n",
+           stats.cpu_ms > 0 ? stats.candidate_bytes / (1024.0 * 1024.0) / (stats.cpu_ms / 1000.0) : 0.0,
+           decode_ms > 0 ? stats.original_bytes / (1024.0 * 1024.0) / (decode_ms / 1000.0) : 0.0);
+    return 0;
+}
+
+// Compress an input as it is and with --columnar, and report the ratio and
+// throughput of both paths
+int bench_columnar(const char *input, const char *preset) {
+    Archive *archive = load_input_archive(input);
+    if (!archive) return -1;
+    
+    ColumnarStats stats;
+    printf("Columnar benchmark: %zu files, preset %s\n", archive->count, preset);
+    columnar_files(archive, &stats);
+    
+    // Both payloads are the file contents back to back; with --columnar the
+    // converted files contribute their bodies instead
+    size_t plain_size = 0, columnar_size = 0;
+    for (size_t i = 0; i < archive->count; i++) {
+        const FileEntry *file = &archive->files[i];
+        if (!file->content) continue;
+        plain_size += file->size;
+        columnar_size += file->columnar ? file->columnar_size : file->size;
+    }
+    uint8_t *plain = malloc(plain_size ? plain_size : 1);
+    uint8_t *columnar = malloc(columnar_size ? columnar_size : 1);
+    uint8_t *check = malloc(plain_size ? plain_size : 1);
+    int result = plain && columnar && check ? 0 : -1;
+    size_t plain_pos = 0, columnar_pos = 0;
+    double decode_ms = 0;
+    for (size_t i = 0; i < archive->count && result == 0; i++) {
+        const FileEntry *file = &archive->files[i];
+        if (!file->content) continue;
+        memcpy(plain + plain_pos, file->content, file->size);
+        if (file->columnar) {
+            memcpy(columnar + columnar_pos, file->columnar, file->columnar_size);
+            columnar_pos += file->columnar_size;
+            double start = now_ms();
+            if (columnar_decode(file->columnar, file->columnar_size, check, file->size) != 0 ||
+                memcmp(check, file->content, file->size) != 0) {
+                fprintf(stderr, "Rebuild mismatch: %s\n", file->path);
+                result = -1;
+            }
+            decode_ms += now_ms() - start;
+        } else {
+            memcpy(columnar + columnar_pos, file->content, file->size);
+            columnar_pos += file->size;
+        }
+        plain_pos += file->size;
+    }
+    archive_free(archive);
+    free(check);
+    
+    size_t sizes[2] = {0, 0};
+    double times[2] = {0, 0};
+    for (int mode = 0; mode < 2 && result == 0; mode++) {
+        EncoderConfig cfg;
+        size_t in_size = mode ? columnar_size : plain_size;
+        if (resolve_encoder_config(preset, in_size, 0, &cfg) != 0) {
+            result = -1;
+            break;
+        }
+        double start = now_ms();
+        uint8_t *out = compress_lzma_ultra(mode ? columnar : plain, in_size, &sizes[mode], &cfg, NULL);
+        times[mode] = now_ms() - start;
+        if (!out) result = -1;
+        free(out);
+    }
+    free(plain);
+    free(columnar);
+    if (result != 0) return result;
+    
+    // The columnar path pays for the split as well as for LZMA
+    double input_mb = plain_size / (1024.0 * 1024.0);
+    double columnar_ms = times[1] + stats.wall_ms;
+    printf("  plain        %8.2f MB -> %8.2f MB  ratio %5.2f  (%6.0f ms, %6.1f MB/s)\n", input_mb,
+           sizes[0] / (1024.0 * 1024.0), sizes[0] ? (double)plain_size / sizes[0] : 0.0, times[0],
+           times[0] > 0 ? input_mb / (times[0] / 1000.0) : 0.0);
+    printf("  --columnar   %8.2f MB -> %8.2f MB  ratio %5.2f  (%6.0f ms, %6.1f MB/s)\n", input_mb,
+           sizes[1] / (1024.0 * 1024.0), sizes[1] ? (double)plain_size / sizes[1] : 0.0, columnar_ms,
+           columnar_ms > 0 ? input_mb / (columnar_ms / 1000.0) : 0.0);
+    printf("  Gain: %.2f%% smaller archive\n", sizes[0] ? 100.0 - sizes[1] * 100.0 / sizes[0] : 0.0);
+    printf("  Re-interleaving: %.0f MB/s per core\n",
+           decode_ms > 0 ? stats.original_bytes / (1024.0 * 1024.0) / (decode_ms / 1000.0) : 0.0);
+    return 0;
+}
+
+// Bytes rsync would send to turn old_data into new_data: new_data is scanned
+// with rsync's rolling checksum for the blocks of old_data, and whatever no
+// block covers goes as literals. Matches are confirmed with memcmp in place
+// of the strong checksum.
+static size_t rsync_literal_bytes(const uint8_t *old_data, size_t old_size, const uint8_t *new_data,
+                                  size_t new_size, size_t *matched) {
+    const size_t bs = RSYNC_BENCH_BLOCK;
+    size_t nblocks = old_size / bs;
+    size_t table_size = 1024;
+    while (table_size < nblocks * 2) table_size *= 2;
+    uint32_t *table = calloc(table_size, sizeof(uint32_t));    // block index + 1, 0 = empty
+    uint32_t *keys = malloc(sizeof(uint32_t) * (nblocks ? nblocks : 1));
+    *matched = 0;
+    if (!table || !keys) {
+        free(table);
+        free(keys);
+        return new_size;
+    }
+    
+    for (size_t k = 0; k < nblocks; k++) {
+        uint32_t a = 0, b = 0;
+        for (size_t i = 0; i < bs; i++) {
+            a += old_data[k * bs + i];
+            b += (uint32_t)(bs - i) * old_data[k * bs + i];
+        }
+        keys[k] = (b << 16) | (a & 0xFFFF);
+        size_t slot = mix64(keys[k]) & (table_size - 1);
+        while (table[slot]) slot = (slot + 1) & (table_size - 1);
+        table[slot] = k + 1;
+    }
+    
+    size_t literals = 0, pos = 0;
+    uint32_t a = 0, b = 0;
+    int fresh = 1;
+    while (pos + bs <= new_size) {
+        if (fresh) {
+            a = b = 0;
+            for (size_t i = 0; i < bs; i++) {
+                a += new_data[pos + i];
+                b += (uint32_t)(bs - i) * new_data[pos + i];
+            }
+            fresh = 0;
+        }
+        uint32_t key = (b << 16) | (a & 0xFFFF);
+        size_t slot = mix64(key) & (table_size - 1);
+        int hit = 0;
+        for (; table[slot] && !hit; slot = (slot + 1) & (table_size - 1)) {
+            size_t k = table[slot] - 1;
+            hit = keys[k] == key && memcmp(old_data + k * bs, new_data + pos, bs) == 0;
+        }
+        if (hit) {
+            (*matched)++;
+            pos += bs;
+            fresh = 1;
+            continue;
+        }
+        // Roll one byte forward
+        if (pos + bs < new_size) {
+            a = a - new_data[pos] + new_data[pos + bs];
+            b = b - (uint32_t)bs * new_data[pos] + a;
+        }
+        literals++;
+        pos++;
+    }
+    literals += new_size - pos;
+    free(table);
+    free(keys);
+    return literals;
+}
+
+// Compress an input and a lightly edited copy of it (a 64-byte insert at one
+// third, a 64-byte overwrite at two thirds) with and without --rsyncable, and
+// compare the ratio and what rsync would transfer between the two archives
+int bench_rsync(const char *input, const char *preset, size_t avg) {
+    size_t size = 0;
+    uint8_t *data = load_input_bytes(input, &size);
+    if (!data) return -1;
+    uint8_t *edited = malloc(size + 64);
+    if (!edited || size < 1024) {
+        fprintf(stderr, size < 1024 ? "Input too small for the rsync benchmark\n" : "Out of memory\n");
+        free(data);
+        free(edited);
+        return -1;
+    }
+    size_t insert_at = size / 3, overwrite_at = size / 3 * 2;
+    memcpy(edited, data, insert_at);
+    memset(edited + insert_at, 'I', 64);
+    memcpy(edited + insert_at + 64, data + insert_at, size - insert_at);
+    memset(edited + overwrite_at + 64, 'O', 64);
+    
+    printf("Rsyncable benchmark: %.2f MB, preset %s, cuts every ~%zu KB, rsync block %d bytes\n",
+           size / (1024.0 * 1024.0), preset, avg / 1024, RSYNC_BENCH_BLOCK);
+    EncoderConfig base_cfg;
+    if (resolve_encoder_config(preset, size + 64, 0, &base_cfg) != 0) {
+        free(data);
+        free(edited);
+        return -1;
+    }
+    
+    int result = 0;
+    size_t plain_size = 0;
+    for (int rsyncable = 0; rsyncable <= 1 && result == 0; rsyncable++) {
+        EncoderConfig cfg = base_cfg;
+        if (rsyncable) {
+            cfg.rsync_avg = avg;
+            size_rsyncable_dict(&cfg);
+        }
+        EncoderConfig old_cfg = cfg, new_cfg = cfg;
+        size_t old_size, new_size;
+        double start = now_ms();
+        uint8_t *old_out = compress_lzma_ultra(data, size, &old_size, &old_cfg, NULL);
+        double elapsed = now_ms() - start;
+        uint8_t *new_out = old_out ? compress_lzma_ultra(edited, size + 64, &new_size, &new_cfg, NULL) : NULL;
+        if (!new_out) {
+            free(old_out);
+            result = -1;
+            break;
+        }
+        
+        // rsync sends a signature per block of the old file, a token per
+        // matched block and the literals
+        size_t matched;
+        size_t literals = rsync_literal_bytes(old_out, old_size, new_out, new_size, &matched);
+        size_t transfer = literals + matched * 4 + old_size / RSYNC_BENCH_BLOCK * 20;
+        if (!rsyncable) plain_size = old_size;
+        printf("  %-10s %8.2f MB (%5.2f%%%s)  %6.0f ms  delta transfer %8.2f MB (%5.1f%% of the archive)\n",
+               rsyncable ? "rsyncable" : "plain", old_size / (1024.0 * 1024.0), old_size * 100.0 / size,
+               rsyncable ? "" : ", baseline", elapsed, transfer / (1024.0 * 1024.0), transfer * 100.0 / new_size);
+        if (rsyncable) {
+            printf("  Ratio cost: %+.2f%% archive size\n", (old_size * 100.0 / plain_size) - 100.0);
+        }
+        free(old_out);
+        free(new_out);
+    }
+    free(data);
+    free(edited);
+    return result;
+}
+
+// Create every missing parent directory of file_path
+int make_parent_dirs(const char *file_path) {
+    char dir_path[MAX_PATH_LEN];
+    strncpy(dir_path, file_path, MAX_PATH_LEN - 1);
+    dir_path[MAX_PATH_LEN - 1] = '\0';
+    
+    for (char *p = dir_path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(dir_path, 0755) != 0 && errno != EEXIST) {
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+// A member name may only name a place below the output directory: it must
+// be relative and have no ".." component
+int member_path_safe(const char *path) {
+    if (!path[0] || path[0] == '/') return 0;
+    for (const char *p = path; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p += len;
+        while (*p == '/') p++;
+    }
+    return 1;
+}
+
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (; *path; path++) {
+        h ^= (uint8_t)*path;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Open-addressing path -> entry index lookup used while extracting
+static size_t path_index_find(const size_t *slots, size_t table_size, const ExtractEntry *entries,
+                              const char *path) {
+    size_t slot = hash_path(path) & (table_size - 1);
+    while (slots[slot] != SIZE_MAX) {
+        if (strcmp(entries[slots[slot]].path, path) == 0) return slots[slot];
+        slot = (slot + 1) & (table_size - 1);
+    }
+    return SIZE_MAX;
+}
+
+static void path_index_insert(size_t *slots, size_t table_size, const ExtractEntry *entries, size_t idx) {
+    size_t slot = hash_path(entries[idx].path) & (table_size - 1);
+    while (slots[slot] != SIZE_MAX) {
+        if (strcmp(entries[slots[slot]].path, entries[idx].path) == 0) break;
+        slot = (slot + 1) & (table_size - 1);
+    }
+    slots[slot] = idx;
+}
+
+// Load <archive_file>.state, written next to every archive created with
+// --file-state or --incremental-from
+int load_file_state(const char *archive_file, FileStateTable *table) {
+    memset(table, 0, sizeof(*table));
+    char state_path[MAX_PATH_LEN];
+    if ((size_t)snprintf(state_path, sizeof(state_path), "%s.state", archive_file) >= sizeof(state_path)) {
+        fprintf(stderr, "Path too long: %s\n", archive_file);
+        return -1;
+    }
+    FILE *f = fopen(state_path, "rb");
+    if (!f) {
+        fprintf(stderr, "No file state for %s (create the base with --file-state)\n", archive_file);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    size_t size = file_size > 0 ? (size_t)file_size : 0;
+    uint8_t *data = malloc(size ? size : 1);
+    if (!data || fread(data, 1, size, f) != size) {
+        fprintf(stderr, "Cannot read file state: %s\n", state_path);
+        fclose(f);
+        free(data);
+        return -1;
+    }
+    fclose(f);
+    
+    // Version 1 had no chain depth; its archives count as full ones
+    uint32_t version = size >= 12 ? read_uint32_be(data + 8) : 0;
+    size_t header = 8 + 4 + ARCHIVE_ID_LEN + (version >= 2 ? 4 : 0) + 4;
+    if (size < header || memcmp(data, STATE_MAGIC, 8) != 0 || version < 1 || version > STATE_VERSION) {
+        fprintf(stderr, "Invalid file state: %s\n", state_path);
+        free(data);
+        return -1;
+    }
+    memcpy(table->archive_id, data + 12, ARCHIVE_ID_LEN);
+    table->chain_depth = version >= 2 ? read_uint32_be(data + 12 + ARCHIVE_ID_LEN) : 0;
+    uint32_t count = read_uint32_be(data + header - 4);
+    
+    // Each entry is at least a path length and 44 bytes of fields
+    size_t slot_count = 1;
+    while (slot_count < (size_t)count * 2) slot_count <<= 1;
+    table->entries = count <= (size - header) / 46 ? calloc(count ? count : 1, sizeof(FileState)) : NULL;
+    table->slots = malloc(sizeof(size_t) * slot_count);
+    table->slot_count = slot_count;
+    if (!table->entries || !table->slots) {
+        fprintf(stderr, "Invalid file state: %s\n", state_path);
+        free(data);
+        file_state_free(table);
+        return -1;
+    }
+    for (size_t i = 0; i < slot_count; i++) table->slots[i] = SIZE_MAX;
+    
+    size_t offset = header;
+    for (uint32_t i = 0; i < count; i++) {
+        if (offset + 2 > size) break;
+        uint16_t path_len = read_uint16_be(data + offset);
+        offset += 2;
+        if (path_len >= MAX_PATH_LEN || offset + path_len + 44 > size) break;
+        
+        FileState *entry = &table->entries[i];
+        entry->path = strndup((const char *)data + offset, path_len);
+        if (!entry->path) break;
+        offset += path_len;
+        entry->size = read_uint64_be(data + offset);
+        entry->mtime_sec = (int64_t)read_uint64_be(data + offset + 8);
+        entry->mtime_nsec = read_uint32_be(data + offset + 16);
+        entry->inode = read_uint64_be(data + offset + 20);
+        memcpy(entry->hash, data + offset + 28, 16);
+        offset += 44;
+        table->count = i + 1;
+        
+        size_t slot = hash_path(entry->path) & (slot_count - 1);
+        while (table->slots[slot] != SIZE_MAX) slot = (slot + 1) & (slot_count - 1);
+        table->slots[slot] = i;
+    }
+    free(data);
+    
+    if (table->count != count) {
+        fprintf(stderr, "File state is truncated: %s\n", state_path);
+        file_state_free(table);
+        return -1;
+    }
+    return 0;
+}
+
+void file_state_free(FileStateTable *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        free(table->entries[i].path);
+    }
+    free(table->entries);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+static const FileState *file_state_find(const FileStateTable *table, const char *path) {
+    if (!table->slots) return NULL;
+    size_t slot = hash_path(path) & (table->slot_count - 1);
+    while (table->slots[slot] != SIZE_MAX) {
+        const FileState *entry = &table->entries[table->slots[slot]];
+        if (strcmp(entry->path, path) == 0) return entry;
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+    return NULL;
+}
+
+// Move every scanned file whose size, mtime and inode match the base state
+// into archive->base_members, before anything is read. Returns the number of
+// unchanged files.
+size_t split_unchanged_files(Archive *archive, const FileStateTable *state, size_t *unchanged_bytes) {
+    size_t kept = 0, unchanged = 0;
+    FileState *base = malloc(sizeof(FileState) * (archive->count ? archive->count : 1));
+    if (!base) return 0;
+    
+    for (size_t i = 0; i < archive->count; i++) {
+        FileEntry *file = &archive->files[i];
+        const FileState *prev = file_state_find(state, file->path);
+        char *path = prev ? strdup(file->path) : NULL;
+        if (path && prev->size == file->size && prev->mtime_sec == file->mtime_sec &&
+            prev->mtime_nsec == file->mtime_nsec && prev->inode == file->inode) {
+            base[unchanged] = *prev;
+            base[unchanged].path = path;
+            unchanged++;
+            *unchanged_bytes += file->size;
+            free(file->source);
+            continue;
+        }
+        free(path);
+        if (kept != i) archive->files[kept] = *file;
+        kept++;
+    }
+    archive->count = kept;
+    archive->base_members = base;
+    archive->base_count = unchanged;
+    return unchanged;
+}
+
+static void write_state_header(FILE *out, const uint8_t id[ARCHIVE_ID_LEN], uint32_t chain_depth, uint32_t count) {
+    uint8_t buf[8];
+    fwrite(STATE_MAGIC, 1, 8, out);
+    write_uint32_be(buf, STATE_VERSION);
+    fwrite(buf, 1, 4, out);
+    fwrite(id, 1, ARCHIVE_ID_LEN, out);
+    write_uint32_be(buf, chain_depth);
+    write_uint32_be(buf + 4, count);
+    fwrite(buf, 1, 8, out);
+}
+
+static void write_state_entry(FILE *out, const FileState *entry) {
+    uint8_t buf[44];
+    size_t path_len = strlen(entry->path);
+    write_uint16_be(buf, path_len);
+    fwrite(buf, 1, 2, out);
+    fwrite(entry->path, 1, path_len, out);
+    write_uint64_be(buf, entry->size);
+    write_uint64_be(buf + 8, (uint64_t)entry->mtime_sec);
+    write_uint32_be(buf + 16, entry->mtime_nsec);
+    write_uint64_be(buf + 20, entry->inode);
+    memcpy(buf + 28, entry->hash, 16);
+    fwrite(buf, 1, 44, out);
+}
+
+// Write <archive_file>.state: magic, version, archive id, chain depth, entry
+// count, then per file its path, size, mtime, inode and fast128 content hash
+int write_file_state(const char *archive_file, const uint8_t id[ARCHIVE_ID_LEN], uint32_t chain_depth,
+                     const Archive *archive) {
+    char state_path[MAX_PATH_LEN];
+    if ((size_t)snprintf(state_path, sizeof(state_path), "%s.state", archive_file) >= sizeof(state_path)) {
+        return -1;
+    }
+    FILE *out = fopen(state_path, "wb");
+    if (!out) return -1;
+    
+    write_state_header(out, id, chain_depth, archive->count + archive->base_count);
+    for (size_t i = 0; i < archive->count + archive->base_count; i++) {
+        FileState entry;
+        if (i < archive->count) {
+            const FileEntry *file = &archive->files[i];
+            entry.path = (char *)file->path;
+            entry.size = file->size;
+            entry.mtime_sec = file->mtime_sec;
+            entry.mtime_nsec = file->mtime_nsec;
+            entry.inode = file->inode;
+            memcpy(entry.hash, file->state_hash, 16);
+        } else {
+            entry = archive->base_members[i - archive->count];
+        }
+        write_state_entry(out, &entry);
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+// Random id that ties an incremental archive to the exact base it was made from
+void new_archive_id(uint8_t id[ARCHIVE_ID_LEN], const char *output_file) {
+#if defined(__linux__)
+    if (getrandom(id, ARCHIVE_ID_LEN, 0) == ARCHIVE_ID_LEN) return;
+#elif defined(__APPLE__)
+    arc4random_buf(id, ARCHIVE_ID_LEN);
+    return;
+#else
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (f) {
+        size_t got = fread(id, 1, ARCHIVE_ID_LEN, f);
+        fclose(f);
+        if (got == ARCHIVE_ID_LEN) return;
+    }
+#endif
+    
+    struct {
+        struct timespec ts;
+        pid_t pid;
+        uint64_t path;
+    } seed;
+    memset(&seed, 0, sizeof(seed));
+    clock_gettime(CLOCK_REALTIME, &seed.ts);
+    seed.pid = getpid();
+    seed.path = hash_path(output_file);
+    fast128((const uint8_t *)&seed, sizeof(seed), id);
+}
+
+// Map a scan cache. A missing, stale-format or damaged cache is simply empty:
+// every file is analysed and the cache is rewritten.
+void scan_cache_open(const char *path, ScanCache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < SCAN_CACHE_HEADER) {
+        close(fd);
+        return;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    
+    uint32_t count = read_uint32_be(map + 12);
+    if (memcmp(map, SCAN_CACHE_MAGIC, 8) != 0 || read_uint32_be(map + 8) != SCAN_CACHE_VERSION ||
+        count > (st.st_size - SCAN_CACHE_HEADER) / SCAN_ENTRY_SIZE) {
+        fprintf(stderr, "Ignoring invalid scan cache: %s\n", path);
+        munmap(map, st.st_size);
+        return;
+    }
+    cache->map = map;
+    cache->size = st.st_size;
+    cache->count = count;
+    cache->written_at = (int64_t)read_uint64_be(map + 16);
+}
+
+void scan_cache_close(ScanCache *cache) {
+    if (cache->map) munmap(cache->map, cache->size);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Binary search for path; returns the entry or NULL
+static const uint8_t *scan_cache_find(const ScanCache *cache, const char *path) {
+    size_t path_len = strlen(path);
+    uint32_t lo = 0, hi = cache->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *entry = cache->map + SCAN_CACHE_HEADER + (size_t)mid * SCAN_ENTRY_SIZE;
+        uint32_t off = read_uint32_be(entry);
+        uint16_t len = read_uint16_be(entry + 4);
+        if (off > cache->size || len > cache->size - off) return NULL;
+        int c = memcmp(cache->map + off, path, len < path_len ? len : path_len);
+        if (c == 0) c = (len > path_len) - (len < path_len);
+        if (c == 0) return entry;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+// Mark every scanned file whose dev, inode, size, mtime and ctime match its
+// cache entry as cached and copy the type, content hash, file digest (when
+// the algorithm matches) and sketch. As with git's index, an entry modified
+// in the same second the cache was written may have changed unseen, so it
+// is re-analysed.
+size_t scan_cache_apply(Archive *archive, const ScanCache *cache, size_t *cached_bytes) {
+    size_t hits = 0;
+    for (size_t i = 0; cache->count && i < archive->count; i++) {
+        FileEntry *file = &archive->files[i];
+        const uint8_t *entry = scan_cache_find(cache, file->path);
+        if (!entry || read_uint64_be(entry + 12) != file->dev || read_uint64_be(entry + 20) != file->inode ||
+            read_uint64_be(entry + 28) != file->size || (int64_t)read_uint64_be(entry + 36) != file->mtime_sec ||
+            read_uint32_be(entry + 44) != file->mtime_nsec || (int64_t)read_uint64_be(entry + 48) != file->ctime_sec ||
+            read_uint32_be(entry + 56) != file->ctime_nsec || file->mtime_sec >= cache->written_at ||
+            file->ctime_sec >= cache->written_at) {
+            continue;
+        }
+        
+        file->type = (FileType)entry[6];
+        memcpy(file->state_hash, entry + 60, 16);
+        file->digest_cached = file_digest_algo == DIGEST_NONE || entry[8] == file_digest_algo;
+        if (entry[8] == file_digest_algo) memcpy(file->digest, entry + 76, 32);
+        if (entry[7] & SCAN_HAS_SKETCH) {
+            for (int k = 0; k < MINHASH_K; k++) file->sketch[k] = read_uint32_be(entry + 108 + k * 4);
+            file->has_sketch = 1;
+        }
+        file->scan_cached = 1;
+        *cached_bytes += file->size;
+        hits++;
+    }
+    return hits;
+}
+
+static int compare_file_paths(const void *a, const void *b) {
+    return strcmp((*(const FileEntry * const *)a)->path, (*(const FileEntry * const *)b)->path);
+}
+
+// Rewrite the cache from this run's files: write beside it, then rename
+int scan_cache_write(const char *path, const Archive *archive, int64_t scan_start) {
+    char tmp_path[MAX_PATH_LEN];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path)) return -1;
+    const FileEntry **order = malloc(sizeof(FileEntry *) * (archive->count ? archive->count : 1));
+    if (!order) return -1;
+    for (size_t i = 0; i < archive->count; i++) order[i] = &archive->files[i];
+    qsort(order, archive->count, sizeof(FileEntry *), compare_file_paths);
+    
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        free(order);
+        return -1;
+    }
+    uint8_t buf[SCAN_ENTRY_SIZE];
+    memcpy(buf, SCAN_CACHE_MAGIC, 8);
+    write_uint32_be(buf + 8, SCAN_CACHE_VERSION);
+    write_uint32_be(buf + 12, archive->count);
+    write_uint64_be(buf + 16, (uint64_t)scan_start);
+    int ok = fwrite(buf, 1, SCAN_CACHE_HEADER, out) == SCAN_CACHE_HEADER;
+    
+    size_t path_offset = SCAN_CACHE_HEADER + archive->count * SCAN_ENTRY_SIZE;
+    for (size_t i = 0; ok && i < archive->count; i++) {
+        const FileEntry *file = order[i];
+        memset(buf, 0, sizeof(buf));
+        size_t path_len = strlen(file->path);
+        write_uint32_be(buf, path_offset);
+        write_uint16_be(buf + 4, path_len);
+        path_offset += path_len;
+        buf[6] = (uint8_t)file->type;
+        buf[7] = file->has_sketch ? SCAN_HAS_SKETCH : 0;
+        buf[8] = (uint8_t)file_digest_algo;
+        write_uint64_be(buf + 12, file->dev);
+        write_uint64_be(buf + 20, file->inode);
+        write_uint64_be(buf + 28, file->size);
+        write_uint64_be(buf + 36, (uint64_t)file->mtime_sec);
+        write_uint32_be(buf + 44, file->mtime_nsec);
+        write_uint64_be(buf + 48, (uint64_t)file->ctime_sec);
+        write_uint32_be(buf + 56, file->ctime_nsec);
+        memcpy(buf + 60, file->state_hash, 16);
+        memcpy(buf + 76, file->digest, 32);
+        for (int k = 0; file->has_sketch && k < MINHASH_K; k++) write_uint32_be(buf + 108 + k * 4, file->sketch[k]);
+        ok = fwrite(buf, 1, SCAN_ENTRY_SIZE, out) == SCAN_ENTRY_SIZE;
+    }
+    for (size_t i = 0; ok && i < archive->count; i++) {
+        size_t path_len = strlen(order[i]->path);
+        ok = fwrite(order[i]->path, 1, path_len, out) == path_len;
+    }
+    free(order);
+    ok &= fclose(out) == 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Find an archive recorded by path inside another one (a base or a
+// reference). Chains are usually kept in one directory, so a file of that
+// name next to archive_file wins over the recorded path.
+static void locate_related_archive(const char *archive_file, const char *recorded, char *out, size_t out_len) {
+    const char *dir_end = strrchr(archive_file, '/');
+    const char *name = strrchr(recorded, '/');
+    name = name ? name + 1 : recorded;
+    int len = snprintf(out, out_len, "%.*s%s", dir_end ? (int)(dir_end - archive_file + 1) : 0, archive_file, name);
+    struct stat st;
+    if (len < 0 || (size_t)len >= out_len || stat(out, &st) != 0) {
+        snprintf(out, out_len, "%s", recorded);
+    }
+}
+
+// Fill the RECORD_BASE members of table from its base archive. The base is
+// looked for next to archive_file first, then at the path recorded at create
+// time; its own base members are resolved the same way, down the chain.
+int resolve_base_members(const char *archive_file, MemberTable *table, int depth) {
+    uint32_t needed = 0;
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (table->entries[i].from_base) needed++;
+    }
+    if (needed == 0) return 0;
+    if (!table->base_path) {
+        fprintf(stderr, "  %u members refer to a base archive that is not recorded\n", needed);
+        return -1;
+    }
+    if (depth >= MAX_CHAIN_DEPTH) {
+        fprintf(stderr, "  Archive chain is deeper than %d archives\n", MAX_CHAIN_DEPTH);
+        return -1;
+    }
+    
+    char base_file[MAX_PATH_LEN];
+    locate_related_archive(archive_file, table->base_path, base_file, sizeof(base_file));
+    
+    printf("Resolving %u unchanged member%s from base %s...\n", needed, needed == 1 ? "" : "s", base_file);
+    struct LoadedArchive *base = calloc(1, sizeof(struct LoadedArchive));
+    if (!base) return -1;
+    if (decode_archive(base_file, &base->decoded) != 0) {
+        fprintf(stderr, "  Cannot read base archive: %s\n", base_file);
+        free(base);
+        return -1;
+    }
+    table->base = base;
+    
+    int failed = parse_members(&base->decoded, &base->table) != 0;
+    failed |= resolve_repo_members(&base->table) != 0;
+    verify_member_digests(&base->table);
+    if (!base->table.chained || memcmp(base->table.archive_id, table->base_id, ARCHIVE_ID_LEN) != 0) {
+        fprintf(stderr, "  %s is not the archive this one was built on\n", base_file);
+        return -1;
+    }
+    failed |= resolve_base_members(base_file, &base->table, depth + 1) != 0;
+    failed |= load_appended_segments(base_file, &base->decoded, &base->table) != 0;
+    
+    for (uint32_t i = 0; i < table->count; i++) {
+        ExtractEntry *entry = &table->entries[i];
+        if (!entry->from_base) continue;
+        const ExtractEntry *found = find_member(&base->table, entry->path);
+        if (found && found->ok) {
+            entry->data = found->data;
+            entry->size = found->size;
+            entry->ok = 1;
+        } else {
+            fprintf(stderr, "  Missing in base archive: %s\n", entry->path);
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+// Extract archive
+typedef struct {
+    ExtractEntry *entries;
+    const char *output_directory;
+    atomic_size_t failed;       // members that could not be written
+} ExtractWriteJob;
+
+// Write one resolved member; runs on the worker pool
+static void extract_write_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    ExtractWriteJob *job = ctx;
+    ExtractEntry *entry = &job->entries[index];
+    if (!entry->ok) return;
+    
+    if (!member_path_safe(entry->path)) {
+        fprintf(stderr, "  Unsafe member name: %s\n", entry->path);
+        atomic_fetch_add(&job->failed, 1);
+        return;
+    }
+    char full_path[MAX_PATH_LEN];
+    int len = snprintf(full_path, sizeof(full_path), "%s/%s", job->output_directory, entry->path);
+    if (len < 0 || (size_t)len >= sizeof(full_path)) {
+        fprintf(stderr, "  Path too long: %s/%s\n", job->output_directory, entry->path);
+        atomic_fetch_add(&job->failed, 1);
+        return;
+    }
+    make_parent_dirs(full_path);
+    
+    FILE *out = fopen(full_path, "wb");
+    int ok = out != NULL;
+    if (out) {
+        if (entry->size > 0) ok = fwrite(entry->data, 1, entry->size, out) == entry->size;
+        ok &= fclose(out) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "  Cannot write: %s\n", full_path);
+        atomic_fetch_add(&job->failed, 1);
+    }
+}
+
+typedef struct {
+    ArchiveBlock *blocks;
+    const uint8_t *streams;
+    uint8_t *payload;
+} BlockDecodeJob;
+
+// Check and decode one block into its place in the payload. A block whose
+// CRC does not match or whose stream does not decode is marked damaged and
+// left zero-filled.
+static void block_decode_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    BlockDecodeJob *job = ctx;
+    ArchiveBlock *block = &job->blocks[index];
+    const uint8_t *stream = job->streams + block->comp_offset;
+    block_leaf_hash(block, stream);
+    
+    block->damaged = lzma_crc32(stream, block->comp_size, 0) != block->crc;
+    if (!block->damaged) {
+        uint64_t memlimit = UINT64_MAX;
+        size_t in_pos = 0, out_pos = 0;
+        lzma_ret ret = lzma_stream_buffer_decode(&memlimit, 0, &huge_allocator, stream, &in_pos, block->comp_size,
+                                                 job->payload + block->raw_offset, &out_pos, block->raw_size);
+        block->damaged = ret != LZMA_OK || in_pos != block->comp_size || out_pos != block->raw_size;
+    }
+    if (block->damaged) {
+        memset(job->payload + block->raw_offset, 0, block->raw_size);
+    }
+}
+
+// Decode a FLAG_BLOCKED archive whose fixed header has been read. All blocks
+// are checked and decoded in parallel. Damaged blocks are reported and
+// skipped; the decode only fails if the block table itself cannot be
+// trusted (the Merkle root does not match although every block checks out).
+static int decode_blocked(FILE *f, size_t original_size, uint32_t compressed_size, const uint8_t *stored_content,
+                          DecodedArchive *out) {
+    uint8_t head[40];
+    if (fread(head, 1, sizeof(head), f) != sizeof(head)) {
+        fprintf(stderr, "Archive header is truncated\n");
+        return -1;
+    }
+    uint32_t nblocks = read_uint32_be(head + 32);
+    out->nrecords = read_uint32_be(head + 36);
+    if (nblocks == 0 || nblocks > MAX_BLOCKS) {
+        fprintf(stderr, "Corrupt archive: bad block count %u\n", nblocks);
+        return -1;
+    }
+    
+    ArchiveBlock *blocks = calloc(nblocks, sizeof(ArchiveBlock));
+    uint8_t *table = malloc((size_t)nblocks * BLOCK_DESC_SIZE);
+    if (!blocks || !table || fread(table, 1, (size_t)nblocks * BLOCK_DESC_SIZE, f) != (size_t)nblocks * BLOCK_DESC_SIZE) {
+        fprintf(stderr, blocks && table ? "Archive header is truncated\n" : "Out of memory reading the block table\n");
+        free(blocks);
+        free(table);
+        return -1;
+    }
+    size_t raw_total = 0, comp_total = 0;
+    for (uint32_t i = 0; i < nblocks; i++) {
+        const uint8_t *desc = table + (size_t)i * BLOCK_DESC_SIZE;
+        blocks[i].raw_size = read_uint32_be(desc);
+        blocks[i].comp_size = read_uint32_be(desc + 4);
+        blocks[i].first_record = read_uint32_be(desc + 8);
+        blocks[i].first_chunk = read_uint32_be(desc + 12);
+        blocks[i].crc = read_uint32_be(desc + 16);
+        blocks[i].raw_offset = raw_total;
+        blocks[i].comp_offset = comp_total;
+        raw_total += blocks[i].raw_size;
+        comp_total += blocks[i].comp_size;
+    }
+    free(table);
+    out->end_offset = (size_t)ftell(f) + compressed_size;
+    if (raw_total != original_size || comp_total != compressed_size) {
+        fprintf(stderr, "Corrupt archive: block table does not match the header sizes\n");
+        free(blocks);
+        return -1;
+    }
+    
+    // A truncated file only damages the blocks past the end
+    uint8_t *streams = malloc(compressed_size ? compressed_size : 1);
+    uint8_t *payload = malloc(original_size ? original_size : 1);
+    if (!streams || !payload) {
+        fprintf(stderr, "Out of memory decoding %.2f MB\n", original_size / (1024.0 * 1024.0));
+        free(streams);
+        free(payload);
+        free(blocks);
+        return -1;
+    }
+    size_t got = fread(streams, 1, compressed_size, f);
+    if (got < compressed_size) {
+        fprintf(stderr, "Archive is truncated: %zu of %u compressed bytes missing\n", compressed_size - got, compressed_size);
+        memset(streams + got, 0, compressed_size - got);
+    }
+    
+    BlockDecodeJob job = { blocks, streams, payload };
+    pool_run(get_worker_pool(), nblocks, 0, block_decode_task, &job);
+    free(streams);
+    
+    uint8_t root[32];
+    merkle_root(blocks, nblocks, root);
+    for (uint32_t i = 0; i < nblocks; i++) {
+        if (blocks[i].damaged) {
+            fprintf(stderr, "  Block %u damaged (payload bytes %zu-%zu)\n", i, blocks[i].raw_offset,
+                    blocks[i].raw_offset + blocks[i].raw_size);
+            out->damaged_blocks++;
+        }
+    }
+    out->merkle_verified = memcmp(root, head, 32) == 0;
+    if (!out->merkle_verified && out->damaged_blocks == 0) {
+        fprintf(stderr, "Merkle root mismatch: the block table or root is corrupt\n");
+        free(payload);
+        free(blocks);
+        return -1;
+    }
+    
+    // The content digest covers the whole payload, so it needs every block
+    if (stored_content && out->damaged_blocks == 0) {
+        uint8_t digest[32];
+        EVP_Digest(payload, original_size, digest, NULL, EVP_sha256(), NULL);
+        if (memcmp(digest, stored_content, 32) != 0) {
+            fprintf(stderr, "Content digest mismatch: decoded payload is corrupt\n");
+            free(payload);
+            free(blocks);
+            return -1;
+        }
+        out->content_verified = 1;
+    }
+    
+    out->payload = payload;
+    out->payload_size = original_size;
+    out->blocks = blocks;
+    out->nblocks = nblocks;
+    return 0;
+}
+
+// Decode a reference archive's payload and check it is the one recorded
+static int load_reference_payload(const char *archive_file, const char *recorded, const uint8_t sha[32],
+                                  DecodedArchive *ref, int depth);
+static int decode_archive_depth(const char *archive_file, DecodedArchive *out, int depth);
+
+int decode_archive(const char *archive_file, DecodedArchive *out) {
+    return decode_archive_depth(archive_file, out, 0);
+}
+
+static int load_reference_payload(const char *archive_file, const char *recorded, const uint8_t sha[32],
+                                  DecodedArchive *ref, int depth) {
+    if (depth >= MAX_CHAIN_DEPTH) {
+        fprintf(stderr, "Reference chain is deeper than %d archives\n", MAX_CHAIN_DEPTH);
+        return -1;
+    }
+    char ref_file[MAX_PATH_LEN];
+    locate_related_archive(archive_file, recorded, ref_file, sizeof(ref_file));
+    if (decode_archive_depth(ref_file, ref, depth + 1) != 0) {
+        fprintf(stderr, "Cannot read reference archive: %s\n", ref_file);
+        return -1;
+    }
+    uint8_t digest[32];
+    SHA256(ref->payload, ref->payload_size, digest);
+    if (ref->damaged_blocks || memcmp(digest, sha, 32) != 0) {
+        fprintf(stderr, "%s is not the reference this archive was compressed against\n", ref_file);
+        decoded_archive_free(ref);
+        return -1;
+    }
+    return 0;
+}
+
+// Refuse what this build cannot decode instead of misreading it: a newer
+// version, a method other than LZMA, encryption, or a reference archive in
+// block form (create never writes one)
+static int check_archive_header(const uint8_t *header) {
+    uint8_t version = header[8], method = header[9], flags = header[10];
+    if (version == 0 || version > KUNDA_VERSION) {
+        fprintf(stderr, "Unsupported archive version %u (this build reads up to version %u)\n", version,
+                KUNDA_VERSION);
+        return -1;
+    }
+    if (method != COMP_LZMA && method != COMP_LZMA_ULTRA && method != COMP_LZMA_REF) {
+        fprintf(stderr, "Unsupported compression method %u\n", method);
+        return -1;
+    }
+    if (flags & FLAG_ENCRYPTED) {
+        fprintf(stderr, "Encrypted archives are not supported\n");
+        return -1;
+    }
+    if (method == COMP_LZMA_REF && (flags & FLAG_BLOCKED)) {
+        fprintf(stderr, "Reference archives cannot be block-structured\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Read and decode an archive. The compressed data is streamed from the file
+// into the decoder in DECODE_WINDOW pieces and each piece is hashed on the
+// way in, so the FLAG_CHECKSUMMED digest is verified without a second pass.
+// The content digest is taken over the decoded payload the same way (after
+// long-range decoding when that is used). Any mismatch fails the decode,
+// except in block-structured archives, where damage is confined to blocks.
+static int decode_archive_depth(const char *archive_file, DecodedArchive *out, int depth) {
+    memset(out, 0, sizeof(*out));
+    double start = now_ms();
+    
+    FILE *f = fopen(archive_file, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open archive: %s\n", archive_file);
+        return -1;
+    }
+    
+    // Parse header
+    uint8_t header[19];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, KUNDA_MAGIC, 8) != 0) {
+        fprintf(stderr, "Invalid Kunda archive\n");
+        fclose(f);
+        return -1;
+    }
+    
+    if (check_archive_header(header) != 0) {
+        fclose(f);
+        return -1;
+    }
+    uint8_t flags = header[10];
+    size_t original_size = read_uint32_be(header + 11);
+    uint32_t compressed_size = read_uint32_be(header + 15);
+    
+    uint8_t stored_checksum[32], stored_content[32];
+    if (((flags & FLAG_CHECKSUMMED) && fread(stored_checksum, 1, 32, f) != 32) ||
+        ((flags & FLAG_CONTENT_DIGEST) && fread(stored_content, 1, 32, f) != 32)) {
+        fprintf(stderr, "Archive header is truncated\n");
+        fclose(f);
+        return -1;
+    }
+    
+    // Reference block: payload SHA-256, dictionary size, recorded path
+    DecodedArchive reference = {0};
+    uint32_t ref_dict = 0;
+    if (header[9] == COMP_LZMA_REF) {
+        uint8_t block[38];
+        char ref_path[MAX_PATH_LEN];
+        uint16_t len = 0;
+        int ok = fread(block, 1, sizeof(block), f) == sizeof(block) && (len = read_uint16_be(block + 36)) < MAX_PATH_LEN &&
+                 fread(ref_path, 1, len, f) == len;
+        if (!ok) {
+            fprintf(stderr, "Archive header is truncated\n");
+            fclose(f);
+            return -1;
+        }
+        ref_path[len] = '\0';
+        ref_dict = read_uint32_be(block + 32);
+        if (load_reference_payload(archive_file, ref_path, block, &reference, depth) != 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+    
+    if (flags & FLAG_BLOCKED) {
+        int ret = decode_blocked(f, original_size, compressed_size,
+                                 (flags & FLAG_CONTENT_DIGEST) ? stored_content : NULL, out);
+        fclose(f);
+        out->flags = flags;
+        out->compressed_size = compressed_size;
+        out->decode_ms = now_ms() - start;
+        return ret;
+    }
+    
+    size_t end_offset = (size_t)ftell(f) + compressed_size;
+    uint8_t *decompressed = malloc(original_size ? original_size : 1);
+    uint8_t *window = malloc(DECODE_WINDOW);
+    EVP_MD_CTX *archive_md = (flags & FLAG_CHECKSUMMED) ? EVP_MD_CTX_new() : NULL;
+    EVP_MD_CTX *content_md = (flags & FLAG_CONTENT_DIGEST) ? EVP_MD_CTX_new() : NULL;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    strm.allocator = &huge_allocator;
+    lzma_ret ret = LZMA_MEM_ERROR;
+    
+    lzma_options_lzma ref_opt;
+    lzma_filter ref_filters[2];
+    if (decompressed && window && (!(flags & FLAG_CHECKSUMMED) || archive_md) &&
+        (!(flags & FLAG_CONTENT_DIGEST) || content_md)) {
+        if (reference.payload) {
+            memset(&ref_opt, 0, sizeof(ref_opt));
+            ref_opt.dict_size = ref_dict;
+            ref_opt.preset_dict = reference.payload;
+            ref_opt.preset_dict_size = reference.payload_size;
+            ref_filters[0].id = LZMA_FILTER_LZMA2;
+            ref_filters[0].options = &ref_opt;
+            ref_filters[1].id = LZMA_VLI_UNKNOWN;
+            ret = lzma_raw_decoder(&strm, ref_filters);
+        } else {
+            ret = lzma_auto_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+        }
+    }
+    if (archive_md) EVP_DigestInit_ex(archive_md, EVP_sha256(), NULL);
+    if (content_md) EVP_DigestInit_ex(content_md, EVP_sha256(), NULL);
+    int stream_content = content_md && !(flags & FLAG_LONG_RANGE);
+    
+    strm.next_out = decompressed;
+    strm.avail_out = original_size;
+    size_t remaining = compressed_size;
+    int truncated = 0;
+    
+    while (ret == LZMA_OK) {
+        if (strm.avail_in == 0 && remaining > 0) {
+            size_t n = remaining < DECODE_WINDOW ? remaining : DECODE_WINDOW;
+            size_t got = fread(window, 1, n, f);
+            remaining -= got;
+            if (got != n) {
+                truncated = 1;
+                break;
+            }
+            if (archive_md) EVP_DigestUpdate(archive_md, window, n);
+            strm.next_in = window;
+            strm.avail_in = n;
+        }
+        
+        uint8_t *produced = strm.next_out;
+        ret = lzma_code(&strm, remaining == 0 ? LZMA_FINISH : LZMA_RUN);
+        if (stream_content) EVP_DigestUpdate(content_md, produced, strm.next_out - produced);
+    }
+    size_t decoded_size = original_size - strm.avail_out;
+    lzma_end(&strm);
+    fclose(f);
+    free(window);
+    decoded_archive_free(&reference);
+    
+    int failed = 0;
+    if (truncated) {
+        fprintf(stderr, "Archive is truncated: %zu of %u compressed bytes missing\n", remaining, compressed_size);
+        failed = 1;
+    } else if (ret != LZMA_STREAM_END || decoded_size != original_size) {
+        fprintf(stderr, "Decompression failed: %d%s\n", ret,
+                ret == LZMA_DATA_ERROR || ret == LZMA_FORMAT_ERROR ? " (compressed data is corrupt)" : "");
+        failed = 1;
+    }
+    
+    if (!failed && archive_md) {
+        uint8_t digest[32];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(archive_md, digest, &len);
+        if (len != 32 || memcmp(digest, stored_checksum, 32) != 0) {
+            fprintf(stderr, "Checksum mismatch: compressed data is corrupt\n");
+            failed = 1;
+        } else {
+            out->checksum_verified = 1;
+        }
+    }
+    EVP_MD_CTX_free(archive_md);
+    
+    if (!failed && (flags & FLAG_LONG_RANGE)) {
+        size_t payload_size;
+        uint8_t *payload = lrm_decode(decompressed, original_size, &payload_size);
+        free(decompressed);
+        decompressed = payload;
+        if (!payload) {
+            fprintf(stderr, "Long-range match stream is corrupt\n");
+            failed = 1;
+        } else {
+            original_size = payload_size;
+            if (content_md) EVP_DigestUpdate(content_md, payload, payload_size);
+        }
+    }
+    
+    if (!failed && content_md) {
+        uint8_t digest[32];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(content_md, digest, &len);
+        if (len != 32 || memcmp(digest, stored_content, 32) != 0) {
+            fprintf(stderr, "Content digest mismatch: decoded payload is corrupt\n");
+            failed = 1;
+        } else {
+            out->content_verified = 1;
+        }
+    }
+    EVP_MD_CTX_free(content_md);
+    
+    if (failed) {
+        free(decompressed);
+        return -1;
+    }
+    
+    out->flags = flags;
+    out->compressed_size = compressed_size;
+    out->payload = decompressed;
+    out->payload_size = original_size;
+    out->end_offset = end_offset;
+    out->decode_ms = now_ms() - start;
+    return 0;
+}
+
+// Re-create one JPEG member from its re-coded body; runs on the worker pool
+static void jpeg_rebuild_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    MemberTable *table = ctx;
+    ExtractEntry *entry = &table->entries[index];
+    if (!entry->jpeg_body || entry->ok) return;
+    
+    uint8_t *rebuilt = malloc(entry->size ? entry->size : 1);
+    if (!rebuilt || jpeg_rebuild(entry->jpeg_body, entry->jpeg_body_size, rebuilt, entry->size) != 0) {
+        fprintf(stderr, "  Cannot rebuild JPEG member: %s\n", entry->path);
+        free(rebuilt);
+        return;
+    }
+    entry->owned = rebuilt;
+    entry->data = rebuilt;
+    entry->ok = 1;
+}
+
+// Parse the member records of a decoded payload into a table. Duplicates,
+// deltas and chunk lists are resolved here; plain members point into the
+// payload. Returns -1 if the records are truncated, with the members parsed
+// so far still in the table. In block-structured archives, parsing resumes
+// at the next intact block after damage; members of damaged blocks stay in
+// the table with no path and ok unset.
+int parse_members(const DecodedArchive *decoded, MemberTable *table) {
+    memset(table, 0, sizeof(*table));
+    const uint8_t *payload = decoded->payload;
+    size_t payload_size = decoded->payload_size;
+    const ArchiveBlock *blocks = decoded->blocks;
+    size_t offset = 0;
+    
+    // Read prefixes
+    if (payload_size < 2) {
+        fprintf(stderr, "Corrupt archive: payload too short\n");
+        return -1;
+    }
+    int prefixes_lost = blocks && blocks[0].damaged;
+    if (prefixes_lost) {
+        fprintf(stderr, "  Path prefixes lost with block 0: prefixed members keep their compressed names\n");
+    }
+    uint16_t num_prefixes = prefixes_lost ? 0 : read_uint16_be(payload + offset);
+    offset += 2;
+    
+    char **prefixes = calloc(num_prefixes ? num_prefixes : 1, sizeof(char*));
+    table->prefixes = prefixes;
+    if (!prefixes) return -1;
+    for (uint16_t i = 0; i < num_prefixes; i++) {
+        if (offset + 2 > payload_size) break;
+        uint16_t prefix_len = read_uint16_be(payload + offset);
+        offset += 2;
+        if (offset + prefix_len > payload_size) break;
+        
+        prefixes[i] = malloc(prefix_len + 1);
+        if (!prefixes[i]) break;
+        memcpy(prefixes[i], payload + offset, prefix_len);
+        prefixes[i][prefix_len] = '\0';
+        offset += prefix_len;
+        table->num_prefixes = i + 1;
+    }
+    
+    // Read files
+    if (table->num_prefixes != num_prefixes || offset + 4 > payload_size) {
+        fprintf(stderr, "Corrupt archive: truncated prefix table\n");
+        return -1;
+    }
+    uint32_t num_files = prefixes_lost ? decoded->nrecords : read_uint32_be(payload + offset);
+    offset += 4;
+    if (blocks && num_files != decoded->nrecords) {
+        fprintf(stderr, "Corrupt archive: %u records, block table says %u\n", num_files, decoded->nrecords);
+        return -1;
+    }
+    
+    // Records are resolved first (duplicates and deltas refer to earlier
+    // members by path) and written out afterwards
+    if (num_files > (payload_size - offset) / 6) {
+        fprintf(stderr, "Corrupt archive: %u records cannot fit in the payload\n", num_files);
+        return -1;
+    }
+    ExtractEntry *entries = calloc(num_files ? num_files : 1, sizeof(ExtractEntry));
+    size_t index_size = 1;
+    while (index_size < (size_t)num_files * 2) index_size <<= 1;
+    size_t *path_index = malloc(sizeof(size_t) * index_size);
+    table->entries = entries;
+    table->path_index = path_index;
+    table->index_size = index_size;
+    table->declared = num_files;
+    if (!entries || !path_index) {
+        return -1;
+    }
+    for (size_t i = 0; i < index_size; i++) path_index[i] = SIZE_MAX;
+    
+    int corrupt = 0;
+    uint32_t parsed = 0;
+    Chunk *chunks = NULL;       // chunk id -> bytes inside the payload
+    size_t chunk_count = 0;
+    size_t chunk_capacity = 0;
+    uint32_t blk = 0;           // block holding record i (FLAG_BLOCKED)
+    
+    for (uint32_t i = 0; i < num_files; i++) {
+        int entered = 0;
+        while (blocks && blk + 1 < decoded->nblocks && blocks[blk + 1].first_record == i) {
+            blk++;
+            entered = 1;
+        }
+        if (entered) {
+            // Records of damaged blocks are lost; resume at the next intact one
+            uint32_t next = blk;
+            while (next < decoded->nblocks && blocks[next].damaged) next++;
+            uint32_t resume = next < decoded->nblocks ? blocks[next].first_record : num_files;
+            if (next != blk) {
+                size_t first_chunk = next < decoded->nblocks ? blocks[next].first_chunk : chunk_count;
+                if (resume < i || resume > num_files || first_chunk < chunk_count ||
+                    first_chunk - chunk_count > payload_size) {
+                    corrupt = 1;
+                    break;
+                }
+                if (next - blk > 1) {
+                    fprintf(stderr, "  Blocks %u-%u damaged: members %u-%u lost\n", blk, next - 1, i + 1, resume);
+                } else {
+                    fprintf(stderr, "  Block %u damaged: members %u-%u lost\n", blk, i + 1, resume);
+                }
+                
+                // Chunks first stored in the lost blocks can no longer be referenced
+                if (first_chunk > chunk_capacity) {
+                    Chunk *new_chunks = realloc(chunks, sizeof(Chunk) * first_chunk);
+                    if (!new_chunks) { corrupt = 1; break; }
+                    chunks = new_chunks;
+                    chunk_capacity = first_chunk;
+                }
+                for (; chunk_count < first_chunk; chunk_count++) {
+                    chunks[chunk_count].data = NULL;
+                    chunks[chunk_count].len = UINT32_MAX;
+                }
+                blk = next;
+                i = resume;
+                parsed = resume;
+                if (i >= num_files) break;
+            }
+            offset = blocks[blk].raw_offset;
+        }
+        
+        if (offset + 2 > payload_size) { corrupt = 1; break; }
+        uint16_t path_len = read_uint16_be(payload + offset);
+        offset += 2;
+        if (path_len >= MAX_PATH_LEN || offset + path_len + 4 > payload_size) { corrupt = 1; break; }
+        
+        char path[MAX_PATH_LEN];
+        memcpy(path, payload + offset, path_len);
+        path[path_len] = '\0';
+        offset += path_len;
+        
+        // Expand compressed path
+        char expanded_path[MAX_PATH_LEN];
+        if (path[0] == '$') {
+            char *end = strchr(path + 1, '$');
+            int prefix_idx = end ? atoi(path + 1) : -1;
+            if (prefix_idx >= 0 && prefix_idx < num_prefixes) {
+                snprintf(expanded_path, MAX_PATH_LEN, "%s%s", prefixes[prefix_idx], end + 1);
+            } else {
+                strcpy(expanded_path, path);
+            }
+        } else {
+            strcpy(expanded_path, path);
+        }
+        
+        ExtractEntry *entry = &entries[i];
+        entry->path = strdup(expanded_path);
+        parsed = i + 1;
+        
+        uint32_t content_len = read_uint32_be(payload + offset);
+        offset += 4;
+        
+        if (content_len == RECORD_DUPLICATE || content_len == RECORD_DELTA) {
+            if (offset + 2 > payload_size) { corrupt = 1; break; }
+            uint16_t ref_len = read_uint16_be(payload + offset);
+            offset += 2;
+            if (ref_len >= MAX_PATH_LEN || offset + ref_len > payload_size) { corrupt = 1; break; }
+            char ref_path[MAX_PATH_LEN];
+            memcpy(ref_path, payload + offset, ref_len);
+            ref_path[ref_len] = '\0';
+            offset += ref_len;
+            
+            size_t ref = path_index_find(path_index, index_size, entries, ref_path);
+            
+            if (content_len == RECORD_DUPLICATE) {
+                if (ref != SIZE_MAX && entries[ref].ok) {
+                    entry->data = entries[ref].data;
+                    entry->size = entries[ref].size;
+                    entry->ok = 1;
+                } else if (ref != SIZE_MAX && entries[ref].jpeg_body) {
+                    // Rebuilt on its own; duplicate JPEGs are rare
+                    entry->jpeg_body = entries[ref].jpeg_body;
+                    entry->jpeg_body_size = entries[ref].jpeg_body_size;
+                    entry->size = entries[ref].size;
+                } else {
+                    fprintf(stderr, "  Missing original for duplicate: %s\n", expanded_path);
+                }
+            } else {
+                if (offset + 8 > payload_size) { corrupt = 1; break; }
+                uint32_t target_size = read_uint32_be(payload + offset);
+                uint32_t patch_size = read_uint32_be(payload + offset + 4);
+                offset += 8;
+                if (offset + patch_size > payload_size) { corrupt = 1; break; }
+                
+                uint8_t *rebuilt = malloc(target_size ? target_size : 1);
+                if (ref == SIZE_MAX || !entries[ref].ok || !rebuilt ||
+                    delta_apply(entries[ref].data, entries[ref].size, payload + offset, patch_size,
+                                rebuilt, target_size) != 0) {
+                    fprintf(stderr, "  Cannot rebuild delta member: %s\n", expanded_path);
+                    free(rebuilt);
+                } else {
+                    entry->owned = rebuilt;
+                    entry->data = rebuilt;
+                    entry->size = target_size;
+                    entry->ok = 1;
+                }
+                offset += patch_size;
+            }
+        } else if (content_len == RECORD_BASE) {
+            // Resolved later from the base archive (resolve_base_members)
+            entry->from_base = 1;
+        } else if (content_len == RECORD_CHUNKED) {
+            if (offset + 8 > payload_size) { corrupt = 1; break; }
+            uint32_t total = read_uint32_be(payload + offset);
+            uint32_t nrefs = read_uint32_be(payload + offset + 4);
+            offset += 8;
+            
+            uint8_t *rebuilt = malloc(total ? total : 1);
+            size_t filled = 0;
+            int bad = !rebuilt;
+            
+            for (uint32_t c = 0; c < nrefs && !corrupt; c++) {
+                if (offset + 4 > payload_size) { corrupt = 1; break; }
+                uint32_t id = read_uint32_be(payload + offset);
+                offset += 4;
+                
+                if (id == CHUNK_NEW) {
+                    if (offset + 4 > payload_size) { corrupt = 1; break; }
+                    uint32_t len = read_uint32_be(payload + offset);
+                    offset += 4;
+                    if (offset + len > payload_size) { corrupt = 1; break; }
+                    if (chunk_count >= chunk_capacity) {
+                        size_t new_capacity = chunk_capacity ? chunk_capacity * 2 : 4096;
+                        Chunk *new_chunks = realloc(chunks, sizeof(Chunk) * new_capacity);
+                        if (!new_chunks) { corrupt = 1; break; }
+                        chunks = new_chunks;
+                        chunk_capacity = new_capacity;
+                    }
+                    id = chunk_count++;
+                    chunks[id].data = payload + offset;
+                    chunks[id].len = len;
+                    offset += len;
+                } else if (id >= chunk_count) {
+                    bad = 1;
+                    continue;
+                }
+                
+                if (!bad && chunks[id].data && chunks[id].len <= total - filled) {
+                    memcpy(rebuilt + filled, chunks[id].data, chunks[id].len);
+                    filled += chunks[id].len;
+                } else {
+                    bad = 1;
+                }
+            }
+            if (corrupt) {
+                free(rebuilt);
+                break;
+            }
+            
+            if (bad || filled != total) {
+                fprintf(stderr, "  Cannot reassemble chunked member: %s\n", expanded_path);
+                free(rebuilt);
+            } else {
+                entry->owned = rebuilt;
+                entry->data = rebuilt;
+                entry->size = total;
+                entry->ok = 1;
+            }
+        } else if (content_len == RECORD_PRECOMP) {
+            if (offset + 8 > payload_size) { corrupt = 1; break; }
+            uint32_t original = read_uint32_be(payload + offset);
+            uint32_t body_size = read_uint32_be(payload + offset + 4);
+            offset += 8;
+            if (body_size > payload_size - offset) { corrupt = 1; break; }
+            
+            uint8_t *rebuilt = malloc(original ? original : 1);
+            if (!rebuilt || precomp_rebuild(payload + offset, body_size, rebuilt, original) != 0) {
+                fprintf(stderr, "  Cannot re-create deflate streams of: %s\n", expanded_path);
+                free(rebuilt);
+            } else {
+                entry->owned = rebuilt;
+                entry->data = rebuilt;
+                entry->size = original;
+                entry->ok = 1;
+            }
+            offset += body_size;
+        } else if (content_len == RECORD_LOG) {
+            if (offset + 8 > payload_size) { corrupt = 1; break; }
+            uint32_t original = read_uint32_be(payload + offset);
+            uint32_t body_size = read_uint32_be(payload + offset + 4);
+            offset += 8;
+            if (body_size > payload_size - offset) { corrupt = 1; break; }
+            
+            uint8_t *rebuilt = malloc(original ? original : 1);
+            if (!rebuilt || log_filter_decode(payload + offset, body_size, rebuilt, original) != 0) {
+                fprintf(stderr, "  Cannot re-create filtered log member: %s\n", expanded_path);
+                free(rebuilt);
+            } else {
+                entry->owned = rebuilt;
+                entry->data = rebuilt;
+                entry->size = original;
+                entry->ok = 1;
+            }
+            offset += body_size;
+        } else if (content_len == RECORD_COLUMNAR) {
+            if (offset + 8 > payload_size) { corrupt = 1; break; }
+            uint32_t original = read_uint32_be(payload + offset);
+            uint32_t body_size = read_uint32_be(payload + offset + 4);
+            offset += 8;
+            if (body_size > payload_size - offset) { corrupt = 1; break; }
+            
+            uint8_t *rebuilt = malloc(original ? original : 1);
+            if (!rebuilt || columnar_decode(payload + offset, body_size, rebuilt, original) != 0) {
+                fprintf(stderr, "  Cannot re-interleave columnar member: %s\n", expanded_path);
+                free(rebuilt);
+            } else {
+                entry->owned = rebuilt;
+                entry->data = rebuilt;
+                entry->size = original;
+                entry->ok = 1;
+            }
+            offset += body_size;
+        } else if (content_len == RECORD_JPEG) {
+            if (offset + 8 > payload_size) { corrupt = 1; break; }
+            entry->size = read_uint32_be(payload + offset);
+            entry->jpeg_body_size = read_uint32_be(payload + offset + 4);
+            offset += 8;
+            if (entry->jpeg_body_size > payload_size - offset) { corrupt = 1; break; }
+            entry->jpeg_body = payload + offset;
+            offset += entry->jpeg_body_size;
+        } else if (content_len == RECORD_REPO) {
+            // Resolved later from the chunk repository (resolve_repo_members)
+            if (offset + 8 > payload_size) { corrupt = 1; break; }
+            entry->size = read_uint32_be(payload + offset);
+            entry->repo_nrefs = read_uint32_be(payload + offset + 4);
+            offset += 8;
+            if (entry->repo_nrefs > (payload_size - offset) / REPO_REF_SIZE) { corrupt = 1; break; }
+            entry->repo_refs = payload + offset;
+            entry->from_repo = 1;
+            offset += (size_t)entry->repo_nrefs * REPO_REF_SIZE;
+        } else {
+            if (offset + content_len > payload_size) { corrupt = 1; break; }
+            entry->data = payload + offset;
+            entry->size = content_len;
+            entry->ok = 1;
+            offset += content_len;
+        }
+        
+        path_index_insert(path_index, index_size, entries, i);
+    }
+    
+    table->count = parsed;
+    table->chunks = chunks;
+    if (corrupt) {
+        fprintf(stderr, "Corrupt archive: truncated record %u\n", parsed);
+        return -1;
+    }
+    pool_run(get_worker_pool(), parsed, 0, jpeg_rebuild_task, table);
+    
+    // Digest table and chain trailer after the last record (their own block
+    // when blocked)
+    if ((decoded->flags & (FLAG_FILE_DIGESTS | FLAG_CHAINED)) && blocks) {
+        if (blocks[decoded->nblocks - 1].damaged) {
+            fprintf(stderr, "  Per-file digests and base reference lost with block %u\n", decoded->nblocks - 1);
+            return 0;
+        }
+        offset = blocks[decoded->nblocks - 1].raw_offset;
+    }
+    if (decoded->flags & FLAG_FILE_DIGESTS) {
+        if (offset + 2 > payload_size || digest_length(payload[offset]) == 0 ||
+            payload[offset + 1] != digest_length(payload[offset]) ||
+            offset + 2 + (size_t)num_files * payload[offset + 1] > payload_size) {
+            fprintf(stderr, "Corrupt archive: bad digest table\n");
+            return -1;
+        }
+        table->digest_algo = payload[offset];
+        table->digests = payload + offset + 2;
+        offset += 2 + (size_t)num_files * payload[offset + 1];
+    }
+    if (decoded->flags & FLAG_CHAINED) {
+        uint16_t base_len = offset + 2 * ARCHIVE_ID_LEN + 2 <= payload_size ?
+                            read_uint16_be(payload + offset + 2 * ARCHIVE_ID_LEN) : 0;
+        if (offset + 2 * ARCHIVE_ID_LEN + 2 + base_len > payload_size || base_len >= MAX_PATH_LEN) {
+            fprintf(stderr, "Corrupt archive: bad chain trailer\n");
+            return -1;
+        }
+        table->chained = 1;
+        memcpy(table->archive_id, payload + offset, ARCHIVE_ID_LEN);
+        memcpy(table->base_id, payload + offset + ARCHIVE_ID_LEN, ARCHIVE_ID_LEN);
+        if (base_len) {
+            table->base_path = strndup((const char *)payload + offset + 2 * ARCHIVE_ID_LEN + 2, base_len);
+        }
+        // Optional: chunk repository path
+        offset += 2 * ARCHIVE_ID_LEN + 2 + base_len;
+        if (offset + 2 <= payload_size) {
+            uint16_t repo_len = read_uint16_be(payload + offset);
+            if (offset + 2 + repo_len > payload_size || repo_len == 0 || repo_len >= MAX_PATH_LEN) {
+                fprintf(stderr, "Corrupt archive: bad chain trailer\n");
+                return -1;
+            }
+            table->repo_path = strndup((const char *)payload + offset + 2, repo_len);
+        }
+    }
+    return 0;
+}
+
+static void verify_digest_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    MemberTable *table = ctx;
+    ExtractEntry *entry = &table->entries[index];
+    if (!entry->ok) return;
+    
+    size_t len = digest_length(table->digest_algo);
+    uint8_t digest[32];
+    compute_digest(table->digest_algo, entry->data, entry->size, digest);
+    if (memcmp(digest, table->digests + index * len, len) != 0) {
+        entry->digest_failed = 1;
+        entry->ok = 0;
+    }
+}
+
+// Check every resolved member against the digest table in parallel.
+// Mismatching members are reported by path and marked unusable. Returns the
+// number of corrupted members.
+uint32_t verify_member_digests(MemberTable *table) {
+    if (table->digest_algo == DIGEST_NONE) return 0;
+    pool_run(get_worker_pool(), table->count, 0, verify_digest_task, table);
+    
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (table->entries[i].digest_failed) {
+            fprintf(stderr, "  Corrupted member (%s mismatch): %s\n",
+                    table->digest_algo == DIGEST_SHA256 ? "SHA-256" : "fast128", table->entries[i].path);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+void decoded_archive_free(DecodedArchive *decoded) {
+    free(decoded->payload);
+    free(decoded->blocks);
+    memset(decoded, 0, sizeof(*decoded));
+}
+
+void member_table_free(MemberTable *table) {
+    for (uint32_t i = 0; i < table->count; i++) {
+        free(table->entries[i].path);
+        free(table->entries[i].owned);
+    }
+    free(table->entries);
+    free(table->path_index);
+    free(table->chunks);
+    for (uint16_t i = 0; i < table->num_prefixes; i++) {
+        free(table->prefixes[i]);
+    }
+    free(table->prefixes);
+    free(table->base_path);
+    free(table->repo_path);
+    if (table->base) {
+        member_table_free(&table->base->table);
+        decoded_archive_free(&table->base->decoded);
+        free(table->base);
+    }
+    for (uint32_t s = 0; s < table->nsegments; s++) {
+        member_table_free(&table->segments[s].table);
+        decoded_archive_free(&table->segments[s].decoded);
+    }
+    free(table->segments);
+    memset(table, 0, sizeof(*table));
+}
+
+// Header, block table and compressed data of the main archive end here;
+// appended segments and their index follow
+int read_archive_extent(FILE *f, size_t *end) {
+    uint8_t header[19];
+    if (fseeko(f, 0, SEEK_SET) != 0 || fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, KUNDA_MAGIC, 8) != 0 || check_archive_header(header) != 0) {
+        return -1;
+    }
+    uint8_t flags = header[10];
+    size_t header_len = sizeof(header) + ((flags & FLAG_CHECKSUMMED) ? 32 : 0) + ((flags & FLAG_CONTENT_DIGEST) ? 32 : 0);
+    if (flags & FLAG_BLOCKED) {
+        uint8_t count[4];
+        if (fseeko(f, header_len + 32, SEEK_SET) != 0 || fread(count, 1, 4, f) != 4) return -1;
+        header_len += 40 + (size_t)read_uint32_be(count) * BLOCK_DESC_SIZE;
+    }
+    if (header[9] == COMP_LZMA_REF) {
+        uint8_t block[38];
+        if (fseeko(f, header_len, SEEK_SET) != 0 || fread(block, 1, sizeof(block), f) != sizeof(block)) return -1;
+        header_len += sizeof(block) + read_uint16_be(block + 36);
+    }
+    *end = header_len + read_uint32_be(header + 15);
+    return 0;
+}
+
+// Parse the index whose footer ends at footer_end. Errors are printed only
+// with report set.
+static int parse_segment_index(FILE *f, size_t main_end, uint64_t footer_end, SegmentIndex *index, int report) {
+    uint8_t footer[INDEX_FOOTER_SIZE];
+    if (footer_end < main_end + 16 + INDEX_FOOTER_SIZE ||
+        fseeko(f, footer_end - INDEX_FOOTER_SIZE, SEEK_SET) != 0 ||
+        fread(footer, 1, INDEX_FOOTER_SIZE, f) != INDEX_FOOTER_SIZE ||
+        memcmp(footer + 12, INDEX_END_MAGIC, 8) != 0) {
+        if (report) fprintf(stderr, "Data after the archive is not a segment index\n");
+        return -1;
+    }
+    uint64_t index_offset = read_uint64_be(footer + 4);
+    if (index_offset < main_end || index_offset + 16 > footer_end - INDEX_FOOTER_SIZE) {
+        if (report) fprintf(stderr, "Corrupt segment index: bad offset\n");
+        return -1;
+    }
+    
+    size_t len = (size_t)(footer_end - INDEX_FOOTER_SIZE - index_offset);
+    uint8_t *buf = malloc(len);
+    if (!buf || fseeko(f, index_offset, SEEK_SET) != 0 || fread(buf, 1, len, f) != len ||
+        lzma_crc32(buf, len, 0) != read_uint32_be(footer) || memcmp(buf, INDEX_MAGIC, 8) != 0 ||
+        read_uint32_be(buf + 8) != INDEX_VERSION) {
+        if (report) fprintf(stderr, "Corrupt segment index\n");
+        free(buf);
+        return -1;
+    }
+    uint32_t count = read_uint32_be(buf + 12);
+    if (count > MAX_SEGMENTS || len != 16 + (size_t)count * INDEX_ENTRY_SIZE) {
+        if (report) fprintf(stderr, "Corrupt segment index: %u segments do not fit\n", count);
+        free(buf);
+        return -1;
+    }
+    
+    index->segments = calloc(count ? count : 1, sizeof(SegmentInfo));
+    if (!index->segments) {
+        free(buf);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *e = buf + 16 + (size_t)i * INDEX_ENTRY_SIZE;
+        SegmentInfo *seg = &index->segments[i];
+        seg->offset = read_uint64_be(e);
+        seg->comp_size = read_uint32_be(e + 8);
+        seg->raw_size = read_uint32_be(e + 12);
+        seg->records = read_uint32_be(e + 16);
+        seg->flags = e[20];
+        memcpy(seg->sha, e + 21, 32);
+        if (seg->offset < main_end || seg->offset + seg->comp_size > index_offset) {
+            if (report) fprintf(stderr, "Corrupt segment index: segment %u is out of range\n", i + 1);
+            free(buf);
+            free(index->segments);
+            index->segments = NULL;
+            return -1;
+        }
+    }
+    free(buf);
+    index->count = count;
+    index->index_offset = index_offset;
+    index->end = footer_end;
+    return 0;
+}
+
+// Read the segment index, if the file continues past the main archive data.
+// index->count is 0 and index->index_offset and index->end are main_end when
+// there is none.
+//
+// An append that was interrupted leaves a partial segment or index after the
+// last complete footer (append_segment never overwrites it). Such a tail is
+// skipped with a warning: the footer is searched backwards, and the next
+// append overwrites the tail.
+int read_segment_index(FILE *f, size_t main_end, SegmentIndex *index) {
+    memset(index, 0, sizeof(*index));
+    index->index_offset = main_end;
+    index->end = main_end;
+    if (fseeko(f, 0, SEEK_END) != 0) return -1;
+    off_t file_size = ftello(f);
+    if (file_size <= (off_t)main_end) return 0;
+    if (parse_segment_index(f, main_end, file_size, index, 0) == 0) return 0;
+    
+    // Scan backwards for an earlier end magic, one window at a time; windows
+    // overlap so a magic across a window boundary is seen
+    uint8_t *window = malloc(INDEX_SCAN_WINDOW + 8);
+    if (!window) return -1;
+    uint64_t hi = file_size;
+    while (hi > main_end) {
+        uint64_t lo = hi - main_end > INDEX_SCAN_WINDOW ? hi - INDEX_SCAN_WINDOW : main_end;
+        size_t len = (size_t)(hi - lo) + (hi < (uint64_t)file_size ? 7 : 0);
+        if (fseeko(f, lo, SEEK_SET) != 0 || fread(window, 1, len, f) != len) break;
+        for (size_t i = len >= 8 ? len - 8 + 1 : 0; i-- > 0;) {
+            if (memcmp(window + i, INDEX_END_MAGIC, 8) != 0 || lo + i + 8 >= (uint64_t)file_size) continue;
+            if (parse_segment_index(f, main_end, lo + i + 8, index, 0) == 0) {
+                fprintf(stderr, "Warning: ignoring %llu bytes after the segment index (interrupted append?)\n",
+                        (unsigned long long)(file_size - index->end));
+                free(window);
+                return 0;
+            }
+        }
+        hi = lo;
+    }
+    free(window);
+    
+    // A footer is at the end but damaged: report what is wrong with it
+    uint8_t magic[8];
+    if (fseeko(f, file_size - 8, SEEK_SET) == 0 && fread(magic, 1, 8, f) == 8 &&
+        memcmp(magic, INDEX_END_MAGIC, 8) == 0) {
+        parse_segment_index(f, main_end, file_size, index, 1);
+        return -1;
+    }
+    fprintf(stderr, "Warning: ignoring %llu bytes after the archive that hold no segment index (interrupted append?)\n",
+            (unsigned long long)(file_size - main_end));
+    return 0;
+}
+
+// Write the index at index->index_offset, followed by the footer (CRC32 of
+// the index, its offset, end magic). *end receives the new file size.
+int write_segment_index(FILE *f, const SegmentIndex *index, size_t *end) {
+    size_t len = 16 + (size_t)index->count * INDEX_ENTRY_SIZE;
+    uint8_t *buf = malloc(len + INDEX_FOOTER_SIZE);
+    if (!buf) return -1;
+    
+    memcpy(buf, INDEX_MAGIC, 8);
+    write_uint32_be(buf + 8, INDEX_VERSION);
+    write_uint32_be(buf + 12, index->count);
+    for (uint32_t i = 0; i < index->count; i++) {
+        uint8_t *e = buf + 16 + (size_t)i * INDEX_ENTRY_SIZE;
+        const SegmentInfo *seg = &index->segments[i];
+        write_uint64_be(e, seg->offset);
+        write_uint32_be(e + 8, seg->comp_size);
+        write_uint32_be(e + 12, seg->raw_size);
+        write_uint32_be(e + 16, seg->records);
+        e[20] = seg->flags;
+        memcpy(e + 21, seg->sha, 32);
+    }
+    write_uint32_be(buf + len, lzma_crc32(buf, len, 0));
+    write_uint64_be(buf + len + 4, index->index_offset);
+    memcpy(buf + len + 12, INDEX_END_MAGIC, 8);
+    
+    int ok = fseeko(f, index->index_offset, SEEK_SET) == 0 && fwrite(buf, 1, len + INDEX_FOOTER_SIZE, f) == len + INDEX_FOOTER_SIZE;
+    free(buf);
+    *end = index->index_offset + len + INDEX_FOOTER_SIZE;
+    return ok ? 0 : -1;
+}
+
+// Decode a whole buffer of one or more concatenated xz streams
+static int decode_xz_buffer(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    strm.allocator = &huge_allocator;
+    if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) return -1;
+    strm.next_in = in;
+    strm.avail_in = in_size;
+    strm.next_out = out;
+    strm.avail_out = out_size;
+    lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+    size_t produced = out_size - strm.avail_out;
+    lzma_end(&strm);
+    return ret == LZMA_STREAM_END && produced == out_size ? 0 : -1;
+}
+
+// Decode the segments appended after the main archive data (if any) into
+// table->segments and mark every member that a later segment replaces as
+// shadowed. Returns -1 if the index or a segment is damaged.
+int load_appended_segments(const char *archive_file, const DecodedArchive *main, MemberTable *table) {
+    FILE *f = fopen(archive_file, "rb");
+    if (!f) return -1;
+    SegmentIndex index;
+    int failed = read_segment_index(f, main->end_offset, &index) != 0;
+    if (failed || index.count == 0) {
+        fclose(f);
+        free(index.segments);
+        return failed ? -1 : 0;
+    }
+    
+    table->segments = calloc(index.count, sizeof(struct LoadedArchive));
+    if (!table->segments) {
+        fclose(f);
+        free(index.segments);
+        return -1;
+    }
+    table->nsegments = index.count;
+    
+    uint32_t members = 0;
+    for (uint32_t i = 0; i < index.count; i++) {
+        const SegmentInfo *seg = &index.segments[i];
+        struct LoadedArchive *loaded = &table->segments[i];
+        uint8_t *stream = malloc(seg->comp_size ? seg->comp_size : 1);
+        uint8_t *payload = malloc(seg->raw_size ? seg->raw_size : 1);
+        uint8_t sha[32];
+        
+        int ok = stream && payload && fseeko(f, seg->offset, SEEK_SET) == 0 &&
+                 fread(stream, 1, seg->comp_size, f) == seg->comp_size;
+        if (ok) {
+            EVP_Digest(stream, seg->comp_size, sha, NULL, EVP_sha256(), NULL);
+            ok = memcmp(sha, seg->sha, 32) == 0 && decode_xz_buffer(stream, seg->comp_size, payload, seg->raw_size) == 0;
+        }
+        free(stream);
+        if (!ok) {
+            fprintf(stderr, "  Appended segment %u is damaged\n", i + 1);
+            free(payload);
+            failed = 1;
+            continue;
+        }
+        
+        loaded->decoded.flags = seg->flags;
+        loaded->decoded.compressed_size = seg->comp_size;
+        loaded->decoded.payload = payload;
+        loaded->decoded.payload_size = seg->raw_size;
+        loaded->decoded.checksum_verified = 1;
+        if (parse_members(&loaded->decoded, &loaded->table) != 0 || loaded->table.count != seg->records) {
+            failed = 1;
+        }
+        verify_member_digests(&loaded->table);
+        members += loaded->table.count;
+    }
+    fclose(f);
+    free(index.segments);
+    
+    // Newest wins: a member is shadowed by any later segment with its path
+    uint32_t shadowed = 0;
+    for (uint32_t s = 0; s <= table->nsegments; s++) {
+        MemberTable *older = s == 0 ? table : &table->segments[s - 1].table;
+        for (uint32_t i = 0; i < older->count; i++) {
+            ExtractEntry *entry = &older->entries[i];
+            if (!entry->path) continue;
+            for (uint32_t n = s; n < table->nsegments; n++) {
+                const MemberTable *newer = &table->segments[n].table;
+                if (newer->path_index &&
+                    path_index_find(newer->path_index, newer->index_size, newer->entries, entry->path) != SIZE_MAX) {
+                    entry->shadowed = 1;
+                    entry->ok = 0;
+                    shadowed++;
+                    break;
+                }
+            }
+        }
+    }
+    printf("Appended segments: %u (%u members, %u older version%s shadowed)\n", table->nsegments, members,
+           shadowed, shadowed == 1 ? "" : "s");
+    return failed ? -1 : 0;
+}
+
+// Latest version of a member: appended segments newest first, then the main
+// archive
+const ExtractEntry *find_member(const MemberTable *table, const char *path) {
+    for (uint32_t s = table->nsegments; s-- > 0;) {
+        const MemberTable *seg = &table->segments[s].table;
+        if (!seg->path_index) continue;
+        size_t ref = path_index_find(seg->path_index, seg->index_size, seg->entries, path);
+        if (ref != SIZE_MAX) return &seg->entries[ref];
+    }
+    if (!table->path_index) return NULL;
+    size_t ref = path_index_find(table->path_index, table->index_size, table->entries, path);
+    return ref != SIZE_MAX ? &table->entries[ref] : NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Chunk repository (--repo=DIR)
+//
+// DIR/index    KUNREPOI, version, next pack id, entry count, then fixed-size
+//              entries sorted by SHA-256 (mapped and binary-searched)
+// DIR/bloom    KUNBLOOM, version, hash count, bit count, bits
+// DIR/archives one "<archive id hex>\t<absolute path>" line per archive
+// DIR/packs/pack-NNNNNNNN.kpk  KUNDAPAK, version, raw size, compressed
+//              size, then one xz stream of chunks back to back
+// DIR/lock     flock(): exclusive for create and gc, shared for reading
+// ---------------------------------------------------------------------------
+
+static uint64_t bloom_probe(const uint8_t sha[32], int k, uint64_t mask) {
+    uint64_t h1, h2;
+    memcpy(&h1, sha, 8);
+    memcpy(&h2, sha + 8, 8);
+    return (h1 + (uint64_t)k * (h2 | 1)) & mask;
+}
+
+static void bloom_add(uint64_t *bits, uint64_t nbits, const uint8_t sha[32]) {
+    for (int k = 0; k < BLOOM_HASHES; k++) {
+        uint64_t bit = bloom_probe(sha, k, nbits - 1);
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static int bloom_maybe(const ChunkRepo *repo, const uint8_t sha[32]) {
+    for (int k = 0; k < BLOOM_HASHES; k++) {
+        uint64_t bit = bloom_probe(sha, k, repo->bloom_bits - 1);
+        if (!(repo->bloom[bit / 64] & (1ULL << (bit % 64)))) return 0;
+    }
+    return 1;
+}
+
+static void repo_file_path(const ChunkRepo *repo, const char *name, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s/%s", repo->dir, name);
+}
+
+static void repo_pack_path(const ChunkRepo *repo, uint32_t pack, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s/packs/pack-%08u.kpk", repo->dir, pack);
+}
+
+static const uint8_t *repo_entry(const ChunkRepo *repo, uint64_t i) {
+    return repo->index_map + REPO_INDEX_HEADER + i * REPO_ENTRY_SIZE;
+}
+
+// Size the filter for the index (at least BLOOM_BITS_PER_CHUNK bits per
+// chunk) and fill it from every entry
+static int repo_build_bloom(ChunkRepo *repo, uint64_t expected) {
+    uint64_t nbits = 1 << 20;
+    while (nbits < expected * BLOOM_BITS_PER_CHUNK) nbits <<= 1;
+    uint64_t *bits = calloc(nbits / 64, sizeof(uint64_t));
+    if (!bits) return -1;
+    for (uint64_t i = 0; i < repo->count; i++) bloom_add(bits, nbits, repo_entry(repo, i));
+    free(repo->bloom);
+    repo->bloom = bits;
+    repo->bloom_bits = nbits;
+    return 0;
+}
+
+static int repo_map_index(ChunkRepo *repo) {
+    char path[MAX_PATH_LEN];
+    repo_file_path(repo, "index", path, sizeof(path));
+    repo->count = 0;
+    repo->next_pack = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < REPO_INDEX_HEADER) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    uint64_t count = read_uint64_be(map + 16);
+    if (memcmp(map, REPO_INDEX_MAGIC, 8) != 0 || read_uint32_be(map + 8) != REPO_VERSION ||
+        count != (uint64_t)(st.st_size - REPO_INDEX_HEADER) / REPO_ENTRY_SIZE) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    repo->index_map = map;
+    repo->index_size = st.st_size;
+    repo->count = count;
+    repo->next_pack = read_uint32_be(map + 12);
+    return 0;
+}
+
+// Take the repository lock: exclusive to change the repository, shared to read it
+int repo_lock(const char *dir, int exclusive) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    int fd = open(path, exclusive ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+        fprintf(stderr, "Cannot lock chunk repository %s: %s\n", dir, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Open (with create, make) a repository: map its index and load its Bloom
+// filter, rebuilding the filter if it is missing or too small for the index
+int repo_open(const char *dir, int create, ChunkRepo *repo) {
+    memset(repo, 0, sizeof(*repo));
+    char packs[MAX_PATH_LEN];
+    if (create) {
+        snprintf(packs, sizeof(packs), "%s/packs", dir);
+        if ((mkdir(dir, 0755) != 0 && errno != EEXIST) || (mkdir(packs, 0755) != 0 && errno != EEXIST)) {
+            fprintf(stderr, "Cannot create chunk repository %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+    }
+    char resolved[MAX_PATH_LEN];
+    if (!realpath(dir, resolved) || strlen(resolved) >= sizeof(repo->dir)) {
+        fprintf(stderr, "Chunk repository not found: %s\n", dir);
+        return -1;
+    }
+    memcpy(repo->dir, resolved, strlen(resolved) + 1);
+    char path[MAX_PATH_LEN];
+    if (create) {
+        // The archive list exists from the start, so gc can tell a lost list
+        // from a repository nothing was registered in yet
+        repo_file_path(repo, "archives", path, sizeof(path));
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Cannot create chunk repository %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+        close(fd);
+    }
+    if (repo_map_index(repo) != 0) {
+        fprintf(stderr, "Chunk repository index is damaged: %s/index\n", repo->dir);
+        return -1;
+    }
     
-    // Write header
-    fwrite(KUNDA_MAGIC, 1, 8, out);
-    fputc(KUNDA_VERSION, out);
-    fputc(COMP_LZMA_ULTRA, out);
-    fputc(flags, out);
+    repo_file_path(repo, "bloom", path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    uint8_t header[24];
+    if (f && fread(header, 1, sizeof(header), f) == sizeof(header) && memcmp(header, REPO_BLOOM_MAGIC, 8) == 0 &&
+        read_uint32_be(header + 8) == REPO_VERSION && read_uint32_be(header + 12) == BLOOM_HASHES) {
+        uint64_t nbits = read_uint64_be(header + 16);
+        if (nbits >= (1 << 20) && (nbits & (nbits - 1)) == 0 && nbits >= repo->count * BLOOM_BITS_PER_CHUNK) {
+            repo->bloom = malloc(nbits / 8);
+            if (repo->bloom && fread(repo->bloom, 1, nbits / 8, f) == nbits / 8) {
+                repo->bloom_bits = nbits;
+            } else {
+                free(repo->bloom);
+                repo->bloom = NULL;
+            }
+        }
+    }
+    if (f) fclose(f);
+    if (!repo->bloom && repo_build_bloom(repo, repo->count) != 0) {
+        repo_close(repo);
+        return -1;
+    }
+    return 0;
+}
+
+void repo_close(ChunkRepo *repo) {
+    if (repo->index_map) munmap(repo->index_map, repo->index_size);
+    free(repo->bloom);
+    memset(repo, 0, sizeof(*repo));
+}
+
+// Find a chunk: the Bloom filter answers most "new chunk" queries without
+// touching the index
+static const uint8_t *repo_lookup(ChunkRepo *repo, const uint8_t sha[32]) {
+    if (!bloom_maybe(repo, sha)) return NULL;
+    repo->index_probes++;
+    uint64_t lo = 0, hi = repo->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const uint8_t *entry = repo_entry(repo, mid);
+        int c = memcmp(entry, sha, 32);
+        if (c == 0) return entry;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    repo->bloom_false_positives++;
+    return NULL;
+}
+
+static int compare_repo_entries(const void *a, const void *b) {
+    return memcmp(a, b, 32);
+}
+
+// fsync the directory holding path, so a rename into it survives a crash.
+// Filesystems that cannot sync a directory (EINVAL) need not.
+static int sync_parent_dir(const char *path) {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        slash[slash == dir] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return -1;
+    int ok = fsync(fd) == 0 || errno == EINVAL;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Flush, fsync and close the temp file at tmp_path, then rename it over
+// path and fsync the directory. The temp file is removed on failure.
+static int write_all_and_sync(FILE *f, const char *tmp_path, const char *path) {
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok &= fclose(f) == 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return sync_parent_dir(path);
+}
+
+// Replace the index with the entries of the mapped index that keep[] allows
+// (all when keep is NULL) merged with added (count_added entries, sorted),
+// then rebuild or extend the Bloom filter and write it
+static int repo_write_index(ChunkRepo *repo, const uint8_t *keep, const uint8_t *added, size_t count_added) {
+    char path[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN];
+    repo_file_path(repo, "index", path, sizeof(path));
+    repo_file_path(repo, "index.tmp", tmp_path, sizeof(tmp_path));
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) return -1;
     
-    uint8_t size_buf[4];
-    write_uint32_be(size_buf, original_size);
-    fwrite(size_buf, 1, 4, out);
-    write_uint32_be(size_buf, compressed_size);
-    fwrite(size_buf, 1, 4, out);
+    uint64_t kept = 0;
+    for (uint64_t i = 0; i < repo->count; i++) kept += !keep || keep[i];
+    uint8_t header[REPO_INDEX_HEADER];
+    memcpy(header, REPO_INDEX_MAGIC, 8);
+    write_uint32_be(header + 8, REPO_VERSION);
+    write_uint32_be(header + 12, repo->next_pack);
+    write_uint64_be(header + 16, kept + count_added);
+    int ok = fwrite(header, 1, sizeof(header), out) == sizeof(header);
     
-    if (checksum) {
-        fwrite(sha256_hash, 1, 32, out);
+    uint64_t i = 0;
+    size_t j = 0;
+    while (ok && (i < repo->count || j < count_added)) {
+        if (i < repo->count && keep && !keep[i]) {
+            i++;
+            continue;
+        }
+        const uint8_t *next;
+        if (j >= count_added || (i < repo->count && memcmp(repo_entry(repo, i), added + j * REPO_ENTRY_SIZE, 32) < 0)) {
+            next = repo_entry(repo, i++);
+        } else {
+            next = added + (j++) * REPO_ENTRY_SIZE;
+        }
+        ok = fwrite(next, 1, REPO_ENTRY_SIZE, out) == REPO_ENTRY_SIZE;
     }
+    if (!ok) {
+        fclose(out);
+        remove(tmp_path);
+        return -1;
+    }
+    if (write_all_and_sync(out, tmp_path, path) != 0) return -1;
     
-    fwrite(compressed_data, 1, compressed_size, out);
-    fclose(out);
+    if (repo->index_map) munmap(repo->index_map, repo->index_size);
+    repo->index_map = NULL;
+    if (repo_map_index(repo) != 0) return -1;
     
-    // Get final size
-    struct stat st;
-    stat(output_file, &st);
-    size_t archive_size = st.st_size;
+    // Entries only ever leave the filter on a rebuild
+    if (keep || repo->bloom_bits < repo->count * BLOOM_BITS_PER_CHUNK) {
+        if (repo_build_bloom(repo, repo->count * 2) != 0) return -1;
+    } else {
+        for (size_t k = 0; k < count_added; k++) bloom_add(repo->bloom, repo->bloom_bits, added + k * REPO_ENTRY_SIZE);
+    }
+    repo_file_path(repo, "bloom", path, sizeof(path));
+    repo_file_path(repo, "bloom.tmp", tmp_path, sizeof(tmp_path));
+    out = fopen(tmp_path, "wb");
+    if (!out) return -1;
+    memcpy(header, REPO_BLOOM_MAGIC, 8);
+    write_uint32_be(header + 8, REPO_VERSION);
+    write_uint32_be(header + 12, BLOOM_HASHES);
+    write_uint64_be(header + 16, repo->bloom_bits);
+    ok = fwrite(header, 1, 24, out) == 24 &&
+         fwrite(repo->bloom, 1, repo->bloom_bits / 8, out) == repo->bloom_bits / 8;
+    if (!ok) {
+        fclose(out);
+        remove(tmp_path);
+        return -1;
+    }
+    return write_all_and_sync(out, tmp_path, path);
+}
+
+// Compress raw (the concatenated chunks of one pack) and write it as pack id
+static int repo_write_pack(const ChunkRepo *repo, uint32_t id, const uint8_t *raw, size_t raw_size,
+                           const char *preset, size_t *pack_bytes) {
+    EncoderConfig cfg;
+    if (resolve_encoder_config(preset, raw_size, 0, &cfg) != 0) return -1;
+    size_t compressed_size;
+    uint8_t *compressed = compress_lzma_ultra(raw, raw_size, &compressed_size, &cfg, NULL);
+    if (!compressed) return -1;
+    
+    char path[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN];
+    repo_pack_path(repo, id, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s/packs/pack.tmp", repo->dir);
+    FILE *out = fopen(tmp_path, "wb");
+    uint8_t header[REPO_PACK_HEADER];
+    memcpy(header, REPO_PACK_MAGIC, 8);
+    write_uint32_be(header + 8, REPO_VERSION);
+    write_uint64_be(header + 12, raw_size);
+    write_uint64_be(header + 20, compressed_size);
+    int ok = out && fwrite(header, 1, sizeof(header), out) == sizeof(header) &&
+             fwrite(compressed, 1, compressed_size, out) == compressed_size;
+    free(compressed);
+    if (!ok) {
+        if (out) fclose(out);
+        remove(tmp_path);
+        return -1;
+    }
+    *pack_bytes = sizeof(header) + compressed_size;
+    return write_all_and_sync(out, tmp_path, path);
+}
+
+// Read and decode a whole pack
+static uint8_t *repo_read_pack(const ChunkRepo *repo, uint32_t id, size_t *raw_size) {
+    char path[MAX_PATH_LEN];
+    repo_pack_path(repo, id, path, sizeof(path));
+    size_t file_size;
+    uint8_t *file = load_input_bytes(path, &file_size);
+    if (!file) return NULL;
+    uint8_t *raw = NULL;
+    if (file_size >= REPO_PACK_HEADER && memcmp(file, REPO_PACK_MAGIC, 8) == 0 &&
+        read_uint32_be(file + 8) == REPO_VERSION &&
+        read_uint64_be(file + 20) == file_size - REPO_PACK_HEADER) {
+        *raw_size = read_uint64_be(file + 12);
+        raw = malloc(*raw_size ? *raw_size : 1);
+        if (raw && decode_xz_buffer(file + REPO_PACK_HEADER, file_size - REPO_PACK_HEADER, raw, *raw_size) != 0) {
+            free(raw);
+            raw = NULL;
+        }
+    }
+    free(file);
+    if (!raw) fprintf(stderr, "  Chunk pack is damaged or missing: %s\n", path);
+    return raw;
+}
+
+typedef struct {
+    Archive *archive;
+    size_t avg;
+} RepoCutJob;
+
+// Cut one file into content-defined chunks and name each by its SHA-256
+static void repo_cut_task(void *ctx, size_t index, int worker) {
+    (void)worker;
+    RepoCutJob *job = ctx;
+    FileEntry *file = &job->archive->files[index];
+    size_t capacity = file->size / (job->avg / 4) + 2;
+    file->repo_refs = malloc(capacity * REPO_REF_SIZE);
+    if (!file->repo_refs) return;
+    
+    size_t pos = 0;
+    while (pos < file->size) {
+        size_t len = cdc_next_boundary(file->content + pos, file->size - pos, job->avg);
+        uint8_t *ref = file->repo_refs + file->repo_nrefs * REPO_REF_SIZE;
+        SHA256(file->content + pos, len, ref);
+        write_uint32_be(ref + 32, len);
+        file->repo_nrefs++;
+        pos += len;
+    }
+}
+
+// Store the content of every file in the repository: each file becomes a
+// list of chunk references, and the chunks the repository does not have yet
+// go into one new pack. The index and Bloom filter are updated before this
+// returns, so the archive written afterwards only refers to stored chunks.
+int repo_store_files(ChunkRepo *repo, Archive *archive, size_t avg, const char *preset, RepoStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    double start = now_ms();
+    gear_table_init();
+    RepoCutJob job = { archive, avg };
+    pool_run(get_worker_pool(), archive->count, 0, repo_cut_task, &job);
+    
+    size_t pack_capacity = 1 << 20, new_capacity = 1024, set_size = 1 << 12;
+    uint8_t *pack = malloc(pack_capacity);
+    uint8_t *added = malloc(new_capacity * REPO_ENTRY_SIZE);
+    size_t *set = malloc(sizeof(size_t) * set_size);
+    size_t pack_size = 0, nadded = 0;
+    int failed = !pack || !added || !set;
+    for (size_t i = 0; set && i < set_size; i++) set[i] = SIZE_MAX;
+    
+    for (size_t f = 0; f < archive->count && !failed; f++) {
+        FileEntry *file = &archive->files[f];
+        if (!file->repo_refs) {
+            failed = 1;
+            break;
+        }
+        size_t pos = 0;
+        for (size_t c = 0; c < file->repo_nrefs && !failed; c++) {
+            const uint8_t *ref = file->repo_refs + c * REPO_REF_SIZE;
+            uint32_t len = read_uint32_be(ref + 32);
+            const uint8_t *data = file->content + pos;
+            pos += len;
+            stats->total_chunks++;
+            stats->input_bytes += len;
+            
+            // Already added by this run?
+            uint64_t h;
+            memcpy(&h, ref, 8);
+            size_t slot = h & (set_size - 1);
+            while (set[slot] != SIZE_MAX && memcmp(added + set[slot] * REPO_ENTRY_SIZE, ref, 32) != 0) {
+                slot = (slot + 1) & (set_size - 1);
+            }
+            if (set[slot] != SIZE_MAX || repo_lookup(repo, ref)) continue;
+            
+            if (pack_size + len > pack_capacity || nadded == new_capacity) {
+                while (pack_size + len > pack_capacity) pack_capacity *= 2;
+                if (nadded == new_capacity) new_capacity *= 2;
+                uint8_t *new_pack = realloc(pack, pack_capacity);
+                if (new_pack) pack = new_pack;
+                uint8_t *new_added = realloc(added, new_capacity * REPO_ENTRY_SIZE);
+                if (new_added) added = new_added;
+                if (!new_pack || !new_added) {
+                    failed = 1;
+                    break;
+                }
+            }
+            uint8_t *entry = added + nadded * REPO_ENTRY_SIZE;
+            memcpy(entry, ref, 32);
+            write_uint32_be(entry + 32, repo->next_pack);
+            write_uint64_be(entry + 36, pack_size);
+            write_uint32_be(entry + 44, len);
+            memcpy(pack + pack_size, data, len);
+            pack_size += len;
+            set[slot] = nadded++;
+            
+            // Keep the set at most half full
+            if (nadded * 2 > set_size) {
+                size_t *grown = malloc(sizeof(size_t) * set_size * 2);
+                if (!grown) {
+                    failed = 1;
+                    break;
+                }
+                set_size *= 2;
+                for (size_t i = 0; i < set_size; i++) grown[i] = SIZE_MAX;
+                for (size_t k = 0; k < nadded; k++) {
+                    uint64_t hk;
+                    memcpy(&hk, added + k * REPO_ENTRY_SIZE, 8);
+                    size_t s2 = hk & (set_size - 1);
+                    while (grown[s2] != SIZE_MAX) s2 = (s2 + 1) & (set_size - 1);
+                    grown[s2] = k;
+                }
+                free(set);
+                set = grown;
+            }
+        }
+    }
+    free(set);
+    stats->new_chunks = nadded;
+    stats->new_bytes = pack_size;
+    stats->index_probes = repo->index_probes;
+    stats->bloom_false_positives = repo->bloom_false_positives;
+    stats->chunk_ms = now_ms() - start;
+    
+    if (!failed && nadded) {
+        qsort(added, nadded, REPO_ENTRY_SIZE, compare_repo_entries);
+        failed = repo_write_pack(repo, repo->next_pack, pack, pack_size, preset, &stats->pack_bytes) != 0;
+        if (!failed) {
+            repo->next_pack++;
+            failed = repo_write_index(repo, NULL, added, nadded) != 0;
+        }
+    }
+    free(pack);
+    free(added);
+    if (failed) fprintf(stderr, "Cannot store chunks in the repository %s\n", repo->dir);
+    return failed ? -1 : 0;
+}
+
+// Record an archive in the repository's list, so gc knows its chunks are live
+int repo_register(const ChunkRepo *repo, const uint8_t id[ARCHIVE_ID_LEN], const char *archive_file) {
+    char path[MAX_PATH_LEN], archive_path[MAX_PATH_LEN];
+    repo_file_path(repo, "archives", path, sizeof(path));
+    if (!realpath(archive_file, archive_path)) return -1;
+    FILE *f = fopen(path, "a");
+    if (!f) return -1;
+    for (int i = 0; i < ARCHIVE_ID_LEN; i++) fprintf(f, "%02x", id[i]);
+    fprintf(f, "\t%s\n", archive_path);
+    // Appended in place, so a failed sync must never remove the list
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok &= fclose(f) == 0;
+    return ok ? 0 : -1;
+}
+
+typedef struct {
+    uint32_t pack;
+    uint64_t offset;            // in the decoded pack
+    uint32_t len;
+    uint32_t entry;
+    size_t dest;                // in the member's content
+    const uint8_t *sha;
+} RepoFetch;
+
+static int compare_repo_fetches(const void *a, const void *b) {
+    const RepoFetch *x = a, *y = b;
+    if (x->pack != y->pack) return x->pack < y->pack ? -1 : 1;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Rebuild the RECORD_REPO members of table from the repository recorded in
+// the archive. Each pack is decoded once; every chunk is checked against its
+// SHA-256 as it is copied. Members with a missing or damaged chunk stay
+// unreadable. Returns -1 if any member could not be rebuilt.
+int resolve_repo_members(MemberTable *table) {
+    size_t nfetch = 0;
+    uint32_t needed = 0;
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (table->entries[i].from_repo) {
+            needed++;
+            nfetch += table->entries[i].repo_nrefs;
+        }
+    }
+    if (needed == 0) return 0;
+    if (!table->repo_path) {
+        fprintf(stderr, "  %u members refer to a chunk repository that is not recorded\n", needed);
+        return -1;
+    }
+    
+    int lock_fd = repo_lock(table->repo_path, 0);
+    ChunkRepo repo;
+    if (lock_fd < 0 || repo_open(table->repo_path, 0, &repo) != 0) {
+        if (lock_fd >= 0) close(lock_fd);
+        return -1;
+    }
+    printf("Resolving %u member%s from chunk repository %s...\n", needed, needed == 1 ? "" : "s", repo.dir);
+    
+    RepoFetch *fetches = malloc(sizeof(RepoFetch) * (nfetch ? nfetch : 1));
+    uint8_t *bad = calloc(table->count, 1);
+    size_t n = 0;
+    for (uint32_t i = 0; fetches && bad && i < table->count; i++) {
+        ExtractEntry *entry = &table->entries[i];
+        if (!entry->from_repo) continue;
+        entry->owned = malloc(entry->size ? entry->size : 1);
+        bad[i] = !entry->owned;
+        size_t dest = 0;
+        for (uint32_t c = 0; c < entry->repo_nrefs && !bad[i]; c++) {
+            const uint8_t *ref = entry->repo_refs + (size_t)c * REPO_REF_SIZE;
+            uint32_t len = read_uint32_be(ref + 32);
+            const uint8_t *found = repo_lookup(&repo, ref);
+            if (!found || read_uint32_be(found + 44) != len || len > entry->size - dest) {
+                bad[i] = 1;
+                break;
+            }
+            fetches[n++] = (RepoFetch){ read_uint32_be(found + 32), read_uint64_be(found + 36), len, i, dest, ref };
+            dest += len;
+        }
+        if (dest != entry->size) bad[i] = 1;
+    }
+    
+    if (fetches && bad) {
+        qsort(fetches, n, sizeof(RepoFetch), compare_repo_fetches);
+        for (size_t k = 0; k < n;) {
+            size_t raw_size = 0;
+            uint32_t pack_id = fetches[k].pack;
+            uint8_t *raw = repo_read_pack(&repo, pack_id, &raw_size);
+            for (; k < n && fetches[k].pack == pack_id; k++) {
+                const RepoFetch *fetch = &fetches[k];
+                if (bad[fetch->entry]) continue;
+                uint8_t digest[32];
+                if (!raw || fetch->offset + fetch->len > raw_size ||
+                    (SHA256(raw + fetch->offset, fetch->len, digest), memcmp(digest, fetch->sha, 32) != 0)) {
+                    bad[fetch->entry] = 1;
+                    continue;
+                }
+                memcpy(table->entries[fetch->entry].owned + fetch->dest, raw + fetch->offset, fetch->len);
+            }
+            free(raw);
+        }
+    }
+    
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < table->count; i++) {
+        ExtractEntry *entry = &table->entries[i];
+        if (!entry->from_repo) continue;
+        if (!fetches || !bad || bad[i]) {
+            fprintf(stderr, "  Cannot rebuild member from the repository: %s\n", entry->path);
+            failed++;
+        } else {
+            entry->data = entry->owned;
+            entry->ok = 1;
+        }
+    }
+    free(fetches);
+    free(bad);
+    repo_close(&repo);
+    close(lock_fd);
+    return failed ? -1 : 0;
+}
+
+static int compare_shas(const void *a, const void *b) {
+    return memcmp(a, b, 32);
+}
+
+// Drop the chunks no registered archive refers to any more. Archives whose
+// file is gone (or now holds a different archive) are unregistered first.
+// Packs without a live chunk are deleted and packs that are mostly dead are
+// rewritten with their live chunks only.
+int repo_gc(const char *dir, const char *preset) {
+    printf("Collecting garbage in chunk repository %s...\n", dir);
+    int lock_fd = repo_lock(dir, 1);
+    ChunkRepo repo;
+    if (lock_fd < 0 || repo_open(dir, 0, &repo) != 0) {
+        if (lock_fd >= 0) close(lock_fd);
+        return -1;
+    }
+    
+    // Live archives and every chunk they refer to
+    char list_path[MAX_PATH_LEN];
+    repo_file_path(&repo, "archives", list_path, sizeof(list_path));
+    // Without the list every chunk would look dead: only an empty repository
+    // may have none
+    FILE *list = fopen(list_path, "r");
+    if (!list && (errno != ENOENT || repo.count > 0)) {
+        fprintf(stderr, "  Cannot read %s (%s), not collecting\n", list_path,
+                errno == ENOENT ? "missing, but the index is not empty" : strerror(errno));
+        repo_close(&repo);
+        close(lock_fd);
+        return -1;
+    }
+    char **kept_lines = NULL;
+    size_t live_archives = 0, dropped_archives = 0, nlive = 0, live_capacity = 0;
+    uint8_t *live = NULL;
+    int failed = 0;
+    char line[MAX_PATH_LEN + 64];
+    while (list && !failed && fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *tab = strchr(line, '\t');
+        if (!tab || tab - line != 2 * ARCHIVE_ID_LEN) continue;
+        uint8_t id[ARCHIVE_ID_LEN];
+        for (int i = 0; i < ARCHIVE_ID_LEN; i++) sscanf(line + 2 * i, "%2hhx", &id[i]);
+        
+        struct stat st;
+        if (stat(tab + 1, &st) != 0) {
+            dropped_archives++;
+            continue;
+        }
+        // An archive that exists but cannot be read keeps everything alive
+        DecodedArchive decoded;
+        MemberTable table;
+        if (decode_archive(tab + 1, &decoded) != 0) {
+            fprintf(stderr, "  Cannot read %s, not collecting\n", tab + 1);
+            failed = 1;
+            break;
+        }
+        if (parse_members(&decoded, &table) != 0) {
+            fprintf(stderr, "  Cannot read %s, not collecting\n", tab + 1);
+            member_table_free(&table);
+            decoded_archive_free(&decoded);
+            failed = 1;
+            break;
+        }
+        if (!table.chained || memcmp(table.archive_id, id, ARCHIVE_ID_LEN) != 0) {
+            dropped_archives++;
+        } else {
+            for (uint32_t i = 0; !failed && i < table.count; i++) {
+                const ExtractEntry *entry = &table.entries[i];
+                if (!entry->from_repo) continue;
+                if (nlive + entry->repo_nrefs > live_capacity) {
+                    live_capacity = (nlive + entry->repo_nrefs) * 2;
+                    uint8_t *grown = realloc(live, live_capacity * 32);
+                    if (!grown) {
+                        failed = 1;
+                        break;
+                    }
+                    live = grown;
+                }
+                for (uint32_t c = 0; c < entry->repo_nrefs; c++) {
+                    memcpy(live + (nlive++) * 32, entry->repo_refs + (size_t)c * REPO_REF_SIZE, 32);
+                }
+            }
+            char **grown = realloc(kept_lines, sizeof(char *) * (live_archives + 1));
+            if (grown) {
+                kept_lines = grown;
+                *tab = '\t';
+                kept_lines[live_archives++] = strdup(line);
+            } else {
+                failed = 1;
+            }
+        }
+        member_table_free(&table);
+        decoded_archive_free(&decoded);
+    }
+    if (list && ferror(list)) {
+        fprintf(stderr, "  Cannot read %s, not collecting\n", list_path);
+        failed = 1;
+    }
+    if (list) fclose(list);
+    if (live) qsort(live, nlive, 32, compare_shas);
+    
+    // Live bytes per pack decide what happens to it
+    uint32_t npacks = repo.next_pack;
+    uint64_t *pack_live = calloc(npacks ? npacks : 1, sizeof(uint64_t));
+    uint8_t *drop = calloc(npacks ? npacks : 1, 1);
+    uint8_t *keep = calloc(repo.count ? repo.count : 1, 1);
+    uint64_t live_chunks = 0, dead_chunks = 0;
+    failed |= !pack_live || !drop || !keep;
+    for (uint64_t i = 0; !failed && i < repo.count; i++) {
+        const uint8_t *entry = repo_entry(&repo, i);
+        uint32_t pack_id = read_uint32_be(entry + 32);
+        keep[i] = live && pack_id < npacks && bsearch(entry, live, nlive, 32, compare_shas) != NULL;
+        if (keep[i]) {
+            pack_live[pack_id] += read_uint32_be(entry + 44);
+            live_chunks++;
+        } else {
+            dead_chunks++;
+        }
+    }
+    free(live);
+    
+    // Move the live chunks of mostly-dead packs into one new pack
+    uint32_t deleted = 0, repacked = 0;
+    size_t freed = 0, written = 0, nmoved = 0, moved_size = 0;
+    uint8_t *moved = NULL, *repack = NULL;
+    for (uint32_t p = 0; !failed && p < npacks; p++) {
+        char path[MAX_PATH_LEN];
+        uint8_t header[REPO_PACK_HEADER];
+        struct stat st;
+        repo_pack_path(&repo, p, path, sizeof(path));
+        FILE *pf = fopen(path, "rb");
+        if (!pf) continue;
+        int have_header = fread(header, 1, sizeof(header), pf) == sizeof(header) && fstat(fileno(pf), &st) == 0;
+        fclose(pf);
+        if (!have_header) continue;
+        if (pack_live[p] > 0 && pack_live[p] >= read_uint64_be(header + 12) * REPO_GC_REPACK) continue;
+        
+        if (pack_live[p] > 0) {
+            size_t raw_size;
+            uint8_t *raw = repo_read_pack(&repo, p, &raw_size);
+            if (!raw) {
+                failed = 1;
+                break;
+            }
+            for (uint64_t i = 0; i < repo.count && !failed; i++) {
+                const uint8_t *entry = repo_entry(&repo, i);
+                if (!keep[i] || read_uint32_be(entry + 32) != p) continue;
+                uint64_t offset = read_uint64_be(entry + 36);
+                uint32_t len = read_uint32_be(entry + 44);
+                uint8_t *grown_data = realloc(repack, moved_size + len + 1);
+                if (grown_data) repack = grown_data;
+                uint8_t *grown_moved = realloc(moved, (nmoved + 1) * REPO_ENTRY_SIZE);
+                if (grown_moved) moved = grown_moved;
+                if (!grown_data || !grown_moved || offset + len > raw_size) {
+                    failed = 1;
+                    break;
+                }
+                memcpy(repack + moved_size, raw + offset, len);
+                uint8_t *m = moved + nmoved * REPO_ENTRY_SIZE;
+                memcpy(m, entry, 32);
+                write_uint32_be(m + 32, npacks);
+                write_uint64_be(m + 36, moved_size);
+                write_uint32_be(m + 44, len);
+                moved_size += len;
+                nmoved++;
+                keep[i] = 0;
+            }
+            free(raw);
+            repacked++;
+        } else {
+            deleted++;
+        }
+        drop[p] = 1;
+        freed += st.st_size;
+    }
+    
+    // New pack and index first, so a crash only leaves unreferenced packs
+    if (!failed && nmoved) {
+        qsort(moved, nmoved, REPO_ENTRY_SIZE, compare_repo_entries);
+        failed = repo_write_pack(&repo, npacks, repack, moved_size, preset, &written) != 0;
+        if (!failed) repo.next_pack = npacks + 1;
+    }
+    if (!failed) failed = repo_write_index(&repo, keep, moved, nmoved) != 0;
+    for (uint32_t p = 0; !failed && p < npacks; p++) {
+        if (!drop[p]) continue;
+        char path[MAX_PATH_LEN];
+        repo_pack_path(&repo, p, path, sizeof(path));
+        unlink(path);
+    }
+    if (!failed) {
+        char tmp_path[MAX_PATH_LEN];
+        repo_file_path(&repo, "archives.tmp", tmp_path, sizeof(tmp_path));
+        FILE *out = fopen(tmp_path, "w");
+        for (size_t i = 0; out && i < live_archives; i++) fprintf(out, "%s\n", kept_lines[i]);
+        failed = !out || write_all_and_sync(out, tmp_path, list_path) != 0;
+    }
+    for (size_t i = 0; i < live_archives; i++) free(kept_lines[i]);
+    free(kept_lines);
+    free(moved);
+    free(repack);
+    free(pack_live);
+    free(drop);
+    free(keep);
+    repo_close(&repo);
+    close(lock_fd);
+    
+    if (failed) {
+        fprintf(stderr, "Garbage collection failed, nothing was deleted\n");
+        return -1;
+    }
+    printf("\n✓ %zu archive%s live, %zu unregistered\n", live_archives, live_archives == 1 ? "" : "s",
+           dropped_archives);
+    printf("  Chunks: %lu live, %lu dropped\n", (unsigned long)live_chunks, (unsigned long)dead_chunks);
+    printf("  Packs: %u deleted, %u repacked, %.2f MB freed\n", deleted, repacked,
+           ((double)freed - (double)written) / (1024.0 * 1024.0));
+    return 0;
+}
+
+// Count members over the main table and its segments: readable ones, and
+// ones that could not be resolved (shadowed members are neither)
+static void count_members(const MemberTable *table, uint32_t *live, uint32_t *unreadable) {
+    *live = 0;
+    *unreadable = 0;
+    for (uint32_t s = 0; s <= table->nsegments; s++) {
+        const MemberTable *t = s == 0 ? table : &table->segments[s - 1].table;
+        for (uint32_t i = 0; i < t->count; i++) {
+            if (t->entries[i].ok) {
+                (*live)++;
+            } else if (!t->entries[i].shadowed) {
+                (*unreadable)++;
+            }
+        }
+        *unreadable += t->declared - t->count;
+    }
+}
+
+int extract_archive(const char *archive_file, const char *output_directory) {
+    printf("Extracting Kunda Ultra archive...\n");
+    time_t start_time = time(NULL);
+    
+    DecodedArchive decoded;
+    if (decode_archive(archive_file, &decoded) != 0) {
+        return -1;
+    }
+    printf("Decompressed %.2f MB%s\n", decoded.compressed_size / (1024.0 * 1024.0),
+           decoded.checksum_verified ? " (SHA-256 verified)" : "");
+    if (decoded.blocks) {
+        if (decoded.damaged_blocks) {
+            printf("Blocks: %u of %u damaged, recovering members from the intact blocks\n",
+                   decoded.damaged_blocks, decoded.nblocks);
+        } else {
+            printf("Blocks: %u verified (CRC32, Merkle root)\n", decoded.nblocks);
+        }
+    }
+    
+    MemberTable table;
+    int corrupt = parse_members(&decoded, &table) != 0 || decoded.damaged_blocks > 0;
+    corrupt |= resolve_repo_members(&table) != 0;
+    uint32_t damaged = verify_member_digests(&table);
+    corrupt |= resolve_base_members(archive_file, &table, 0) != 0;
+    corrupt |= load_appended_segments(archive_file, &decoded, &table) != 0;
+    if (table.digest_algo != DIGEST_NONE) {
+        uint32_t verified = 0;
+        for (uint32_t i = 0; i < table.count; i++) {
+            if (table.entries[i].ok) verified++;
+        }
+        printf("Per-file digests: %u of %u members verified\n", verified, table.count);
+    }
+    corrupt |= damaged > 0;
+    uint32_t live, unreadable;
+    count_members(&table, &live, &unreadable);
+    printf("Extracting %u files...\n", live + unreadable);
+    
+    // Create output directory
+    mkdir(output_directory, 0755);
+    
+    ExtractWriteJob write_job = { table.entries, output_directory, 0 };
+    pool_run(get_worker_pool(), table.count, 0, extract_write_task, &write_job);
+    size_t write_failed = atomic_load(&write_job.failed);
+    for (uint32_t s = 0; s < table.nsegments; s++) {
+        ExtractWriteJob segment_job = { table.segments[s].table.entries, output_directory, 0 };
+        pool_run(get_worker_pool(), table.segments[s].table.count, 0, extract_write_task, &segment_job);
+        write_failed += atomic_load(&segment_job.failed);
+    }
+    
+    member_table_free(&table);
+    decoded_archive_free(&decoded);
+    
+    if (write_failed) {
+        fprintf(stderr, "%zu member%s could not be written\n", write_failed, write_failed == 1 ? "" : "s");
+    }
+    if (corrupt || write_failed) return -1;
     
     time_t total_time = time(NULL) - start_time;
-    size_t overhead = archive_size - compressed_size;
+    printf("\n✓ Extracted in %lds to: %s\n", total_time, output_directory);
+    
+    return 0;
+}
+
+// Decode and verify archives without writing anything: checksums, content
+// digest and every member record. Meant for integrity sweeps.
+int test_archives(int count, char **archive_files) {
+    int failures = 0;
+    size_t total_compressed = 0, total_payload = 0;
+    double start = now_ms();
+    
+    for (int i = 0; i < count; i++) {
+        DecodedArchive decoded;
+        if (decode_archive(archive_files[i], &decoded) != 0) {
+            printf("✗ %s: FAILED\n", archive_files[i]);
+            failures++;
+            continue;
+        }
+        
+        MemberTable table;
+        int bad = parse_members(&decoded, &table) != 0 || decoded.damaged_blocks > 0;
+        bad |= resolve_repo_members(&table) != 0;
+        verify_member_digests(&table);
+        bad |= resolve_base_members(archive_files[i], &table, 0) != 0;
+        bad |= load_appended_segments(archive_files[i], &decoded, &table) != 0;
+        uint32_t live, unreadable;
+        count_members(&table, &live, &unreadable);
+        bad |= unreadable > 0;
+        
+        double mb = decoded.payload_size / (1024.0 * 1024.0);
+        if (bad) {
+            printf("✗ %s: FAILED (%u of %u members unreadable", archive_files[i], unreadable, live + unreadable);
+            if (decoded.damaged_blocks) {
+                printf(", %u of %u blocks damaged", decoded.damaged_blocks, decoded.nblocks);
+            }
+            printf(")\n");
+            failures++;
+        } else {
+            printf("✓ %s: OK (%u member%s, %.2f MB, %s%s%s, %.0f MB/s)\n", archive_files[i], live,
+                   live == 1 ? "" : "s", mb,
+                   decoded.merkle_verified ? "Merkle root verified" :
+                   decoded.checksum_verified ? "SHA-256 verified" : "no checksum",
+                   decoded.content_verified ? ", content digest verified" : "",
+                   table.digest_algo != DIGEST_NONE ? ", per-file digests verified" : "",
+                   decoded.decode_ms > 0 ? mb / (decoded.decode_ms / 1000.0) : 0.0);
+        }
+        total_compressed += decoded.compressed_size;
+        total_payload += decoded.payload_size;
+        
+        member_table_free(&table);
+        decoded_archive_free(&decoded);
+    }
+    
+    double elapsed = (now_ms() - start) / 1000.0;
+    printf("\nTested %d archive%s: %d failed, %.2f MB compressed -> %.2f MB in %.2fs (%.0f MB/s)\n",
+           count, count == 1 ? "" : "s", failures, total_compressed / (1024.0 * 1024.0),
+           total_payload / (1024.0 * 1024.0), elapsed,
+           elapsed > 0 ? total_payload / (1024.0 * 1024.0) / elapsed : 0.0);
+    return failures ? -1 : 0;
+}
+
+// Plain member records (no prefixes, no dedup), the per-file digest table
+// when file_digest_algo is set, and a chain trailer that keeps archive_id if
+// one is given. Used for appended segments and compacted archives.
+uint8_t *serialize_plain_members(const Archive *archive, const uint8_t *archive_id, size_t *size, uint8_t *flags) {
+    size_t digest_len = digest_length(file_digest_algo);
+    size_t capacity = 2 + 4;
+    for (size_t i = 0; i < archive->count; i++) {
+        capacity += 2 + strlen(archive->files[i].path) + 4 + archive->files[i].size;
+    }
+    if (digest_len) capacity += 2 + archive->count * digest_len;
+    if (archive_id) capacity += 2 * ARCHIVE_ID_LEN + 2;
+    
+    uint8_t *payload = malloc(capacity);
+    if (!payload) return NULL;
+    size_t offset = 0;
+    write_uint16_be(payload, 0);
+    write_uint32_be(payload + 2, archive->count);
+    offset = 6;
+    
+    for (size_t i = 0; i < archive->count; i++) {
+        const FileEntry *file = &archive->files[i];
+        size_t path_len = strlen(file->path);
+        write_uint16_be(payload + offset, path_len);
+        offset += 2;
+        memcpy(payload + offset, file->path, path_len);
+        offset += path_len;
+        write_uint32_be(payload + offset, file->size);
+        offset += 4;
+        memcpy(payload + offset, file->content, file->size);
+        offset += file->size;
+    }
+    
+    *flags = FLAG_PATH_COMPRESSED;
+    if (digest_len) {
+        payload[offset++] = (uint8_t)file_digest_algo;
+        payload[offset++] = (uint8_t)digest_len;
+        for (size_t i = 0; i < archive->count; i++) {
+            memcpy(payload + offset, archive->files[i].digest, digest_len);
+            offset += digest_len;
+        }
+        *flags |= FLAG_FILE_DIGESTS;
+    }
+    if (archive_id) {
+        memcpy(payload + offset, archive_id, ARCHIVE_ID_LEN);
+        memset(payload + offset + ARCHIVE_ID_LEN, 0, ARCHIVE_ID_LEN);
+        write_uint16_be(payload + offset + 2 * ARCHIVE_ID_LEN, 0);
+        offset += 2 * ARCHIVE_ID_LEN + 2;
+        *flags |= FLAG_CHAINED;
+    }
+    *size = offset;
+    return payload;
+}
+
+// Compress a payload with the preset's encoder, streaming SHA-256 of the
+// output into sha and the number of xz streams into streams (if given). A non-zero
+// fixed_dict was resolved and printed once by the caller, so the
+// configuration is not printed again.
+static uint8_t *compress_payload(const uint8_t *payload, size_t size, const char *preset, uint32_t fixed_dict,
+                                 size_t *compressed_size, uint8_t sha[32], size_t *streams) {
+    EncoderConfig cfg;
+    if (resolve_encoder_config(preset, size, fixed_dict, &cfg) != 0) return NULL;
+    if (!fixed_dict) print_encoder_config(&cfg);
+    StreamHasher hasher;
+    uint8_t *compressed = compress_lzma_ultra(payload, size, compressed_size, &cfg, &hasher);
+    if (compressed) memcpy(sha, hasher.digest, 32);
+    if (streams) *streams = cfg.streams;
+    return compressed;
+}
+
+static int compare_entry_paths(const void *a, const void *b) {
+    const FileEntry *x = *(const FileEntry * const *)a, *y = *(const FileEntry * const *)b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : (x > y) - (x < y);
+}
+
+// A segment holds each name once: when a path is named twice (directly and
+// through its directory) the one given last wins
+static void drop_repeated_paths(Archive *archive) {
+    FileEntry **order = malloc(sizeof(FileEntry *) * archive->count);
+    if (!order) return;
+    for (size_t i = 0; i < archive->count; i++) order[i] = &archive->files[i];
+    qsort(order, archive->count, sizeof(FileEntry *), compare_entry_paths);
+    for (size_t i = 0; i + 1 < archive->count; i++) {
+        if (strcmp(order[i]->path, order[i + 1]->path) == 0) order[i]->path[0] = '\0';
+    }
+    free(order);
     
-    printf("\n✓ SUCCESS: %s\n", output_file);
-    printf("============================================================\n");
-    printf("  Files:              %zu\n", archive->count);
-    printf("  Original size:      %.2f MB\n", original_size / (1024.0 * 1024.0));
-    printf("  Archive size:       %.2f MB\n", archive_size / (1024.0 * 1024.0));
-    printf("  Compression ratio:  %.2f%%\n", (double)archive_size / original_size * 100.0);
-    printf("  Overhead:           %zu bytes\n", overhead);
-    printf("  Total time:         %lds\n", total_time);
+    size_t kept = 0;
+    for (size_t i = 0; i < archive->count; i++) {
+        if (archive->files[i].path[0]) {
+            archive->files[kept++] = archive->files[i];
+        } else {
+            free(archive->files[i].source);
+        }
+    }
+    archive->count = kept;
+}
+
+// Add files or directories to an existing archive as a new, independently
+// compressed segment, then rewrite the trailing index. Member names are the
+// paths as given (relative, without a leading "./"), and a member shadows any
+// older member with the same name. Nothing already in the archive is
+// recompressed.
+int append_archive(const char *archive_file, int npaths, char **paths, const char *preset) {
+    printf("Appending to %s...\n", archive_file);
+    double start = now_ms();
     
-    double rar_estimated = original_size * 0.067;
-    double difference_mb = archive_size / (1024.0 * 1024.0) - rar_estimated / (1024.0 * 1024.0);
-    if (archive_size < rar_estimated) {
-        printf("  vs RAR (est):       %.2f MB SMALLER! 🎉\n", -difference_mb);
-    } else {
-        printf("  vs RAR (est):       %.2f MB larger\n", difference_mb);
+    Archive *archive = archive_create();
+    for (int i = 0; archive && i < npaths; i++) {
+        struct stat st;
+        const char *name = paths[i];
+        while (strncmp(name, "./", 2) == 0) name += 2;
+        while (*name == '/') name++;
+        if (stat(paths[i], &st) != 0) {
+            fprintf(stderr, "Cannot access: %s\n", paths[i]);
+        } else if (*name && strcmp(name, ".") != 0 && !member_path_safe(name)) {
+            fprintf(stderr, "Member names must stay below the archive root: %s\n", paths[i]);
+        } else if (S_ISDIR(st.st_mode)) {
+            size_t first = archive->count;
+            scan_directory(paths[i], "", archive);
+            for (size_t j = first; j < archive->count; j++) {
+                char *path = archive->files[j].path;
+                char *rel = path;
+                while (strncmp(rel, "./", 2) == 0) rel += 2;
+                while (*rel == '/') rel++;
+                memmove(path, rel, strlen(rel) + 1);
+            }
+        } else if (S_ISREG(st.st_mode) && archive_add_file(archive, name, NULL, st.st_size) == 0) {
+            archive->files[archive->count - 1].source = strdup(paths[i]);
+        }
+    }
+    if (archive) {
+        drop_repeated_paths(archive);
+        load_archive_files(archive);
+    }
+    if (!archive || archive->count == 0) {
+        fprintf(stderr, "Nothing to append\n");
+        archive_free(archive);
+        return -1;
     }
-    printf("============================================================\n");
     
-    free(compressed_data);
-    free(binary_data);
+    int result = append_segment(archive_file, archive, preset, 0, start);
     archive_free(archive);
-    
-    return 0;
+    return result;
 }
 
-// Extract archive
-int extract_archive(const char *archive_file, const char *output_directory) {
-    printf("Extracting Kunda Ultra archive...\n");
-    time_t start_time = time(NULL);
-    
-    FILE *f = fopen(archive_file, "rb");
+// Write the loaded files of archive as one new segment of archive_file and
+// rewrite the index after it. The archive is fsync'ed before this returns 0.
+// Returns SEGMENTS_FULL without writing anything when the index is full.
+// fixed_dict is passed on to compress_payload (0 = size it per segment).
+int append_segment(const char *archive_file, const Archive *archive, const char *preset, uint32_t fixed_dict,
+                   double start) {
+    FILE *f = fopen(archive_file, "r+b");
     if (!f) {
         fprintf(stderr, "Cannot open archive: %s\n", archive_file);
         return -1;
     }
-    
-    // Read entire file
-    fseek(f, 0, SEEK_END);
-    long file_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    uint8_t *archive_data = malloc(file_size);
-    if (!archive_data) {
+    size_t main_end;
+    SegmentIndex index;
+    if (read_archive_extent(f, &main_end) != 0) {
+        fprintf(stderr, "Invalid Kunda archive\n");
         fclose(f);
         return -1;
     }
+    if (read_segment_index(f, main_end, &index) != 0) {
+        fclose(f);
+        return -1;
+    }
+    if (index.count >= MAX_SEGMENTS) {
+        fprintf(stderr, "Archive already has %d segments (run compact)\n", MAX_SEGMENTS);
+        free(index.segments);
+        fclose(f);
+        return SEGMENTS_FULL;
+    }
     
-    fread(archive_data, 1, file_size, f);
-    fclose(f);
-    
-    // Parse header
-    size_t offset = 0;
+    size_t size, compressed_size = 0;
+    SegmentInfo seg = {0};
+    uint8_t *payload = serialize_plain_members(archive, NULL, &size, &seg.flags);
+    uint8_t *compressed = NULL;
+    if (payload && size > UINT32_MAX) {
+        fprintf(stderr, "Segment is larger than 4 GB; append in smaller parts\n");
+    } else if (payload) {
+        compressed = compress_payload(payload, size, preset, fixed_dict, &compressed_size, seg.sha, NULL);
+    }
+    free(payload);
     
-    if (memcmp(archive_data + offset, KUNDA_MAGIC, 8) != 0) {
-        fprintf(stderr, "Invalid Kunda archive\n");
-        free(archive_data);
+    SegmentInfo *segments = compressed ? realloc(index.segments, sizeof(SegmentInfo) * (index.count + 1)) : NULL;
+    if (!segments) {
+        free(compressed);
+        free(index.segments);
+        fclose(f);
         return -1;
     }
-    offset += 8;
-    
-    // Skip version and method (not used in decompression, but part of format)
-    offset += 1; // version
-    offset += 1; // method
-    uint8_t flags = archive_data[offset++];
+    index.segments = segments;
     
-    uint32_t original_size = read_uint32_be(archive_data + offset);
-    offset += 4;
+    // The new segment goes after the old footer, followed by the new index.
+    // Until the new footer is on disk the old one stays the last complete
+    // footer, so a crash or a full disk leaves every earlier segment
+    // readable. The old index stays behind as dead space; compact drops it.
+    seg.offset = index.end;
+    seg.comp_size = compressed_size;
+    seg.raw_size = size;
+    seg.records = archive->count;
+    index.segments[index.count++] = seg;
+    index.index_offset = seg.offset + compressed_size;
     
-    uint32_t compressed_size = read_uint32_be(archive_data + offset);
-    offset += 4;
+    size_t end = 0;
+    int ok = fseeko(f, seg.offset, SEEK_SET) == 0 && fwrite(compressed, 1, compressed_size, f) == compressed_size &&
+             write_segment_index(f, &index, &end) == 0 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    // Only now drop a tail left by an interrupted append; on failure cut
+    // back to the old footer so the partial segment does not linger
+    if (ok) {
+        ok = ftruncate(fileno(f), end) == 0 && fsync(fileno(f)) == 0;
+        // A version 2 reader would decode the main archive and silently miss
+        // the segments, so the header now asks for a segment-aware reader
+        int version = ok && fseeko(f, 8, SEEK_SET) == 0 ? fgetc(f) : KUNDA_VERSION;
+        if (ok && version < KUNDA_VERSION) {
+            ok = fseeko(f, 8, SEEK_SET) == 0 && fputc(KUNDA_VERSION, f) != EOF && fflush(f) == 0 &&
+                 fsync(fileno(f)) == 0;
+        }
+    } else {
+        int saved = errno;
+        if (ftruncate(fileno(f), seg.offset) == 0) fsync(fileno(f));
+        errno = saved;
+    }
+    ok &= fclose(f) == 0;
+    if (!ok) {
+        fprintf(stderr, "Cannot write to %s: %s\n", archive_file, strerror(errno));
+    } else {
+        printf("\n✓ Appended %zu member%s as segment %u: %.2f MB -> %.2f MB in %.0f ms\n", archive->count,
+               archive->count == 1 ? "" : "s", index.count, size / (1024.0 * 1024.0),
+               compressed_size / (1024.0 * 1024.0), now_ms() - start);
+    }
+    free(compressed);
+    free(index.segments);
+    return ok ? 0 : -1;
+}
+
+// watch is built on inotify, so it is only available on Linux
+#ifdef __linux__
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_SLOTS (WATCH_MAX_PENDING * 2)
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void watch_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+// Queue rel (a file relative to the watched root). A file already queued
+// keeps its first event time, so the latency covers its oldest change.
+static void watch_queue(WatchState *w, const char *rel) {
+    char full[MAX_PATH_LEN];
+    struct stat st;
+    snprintf(full, sizeof(full), "%s/%s", w->root, rel);
+    if (stat(full, &st) != 0 || !S_ISREG(st.st_mode)) return;
+    if (st.st_dev == w->archive_dev && st.st_ino == w->archive_ino) return;
     
-    if (flags & FLAG_CHECKSUMMED) {
-        offset += 32; // Skip checksum
+    size_t slot = hash_path(rel) & (WATCH_SLOTS - 1);
+    while (w->slots[slot] != SIZE_MAX) {
+        PendingFile *p = &w->pending[w->slots[slot]];
+        if (strcmp(p->path, rel) == 0) {
+            w->pending_bytes += st.st_size - p->size;
+            p->size = st.st_size;
+            return;
+        }
+        slot = (slot + 1) & (WATCH_SLOTS - 1);
+    }
+    char *path = strdup(rel);
+    if (!path) return;
+    w->slots[slot] = w->npending;
+    w->pending[w->npending++] = (PendingFile){path, st.st_size, now_ms()};
+    w->pending_bytes += st.st_size;
+}
+
+static int watch_flush(WatchState *w);
+
+// Watch rel and every directory below it. With queue_files set, files found
+// on the way are queued too: they may have been written before the watch
+// existed.
+static void watch_add_tree(WatchState *w, const char *rel, int queue_files) {
+    char full[MAX_PATH_LEN];
+    snprintf(full, sizeof(full), "%s%s%s", w->root, rel[0] ? "/" : "", rel);
+    int wd = inotify_add_watch(w->fd, full, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "Cannot watch %s: %s\n", full, strerror(errno));
+        return;
+    }
+    if (wd >= w->dir_capacity) {
+        int capacity = w->dir_capacity ? w->dir_capacity : 64;
+        while (capacity <= wd) capacity *= 2;
+        char **dirs = realloc(w->dirs, sizeof(char *) * capacity);
+        if (!dirs) return;
+        memset(dirs + w->dir_capacity, 0, sizeof(char *) * (capacity - w->dir_capacity));
+        w->dirs = dirs;
+        w->dir_capacity = capacity;
     }
+    free(w->dirs[wd]);
+    w->dirs[wd] = strdup(rel);
     
-    // Decompress
-    printf("Decompressing %.2f MB...\n", compressed_size / (1024.0 * 1024.0));
+    DIR *dir = opendir(full);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[MAX_PATH_LEN], child_full[MAX_PATH_LEN];
+        if ((size_t)snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name) >= sizeof(child) ||
+            (size_t)snprintf(child_full, sizeof(child_full), "%s/%s", w->root, child) >= sizeof(child_full)) {
+            continue;
+        }
+        struct stat st;
+        if (stat(child_full, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            watch_add_tree(w, child, queue_files);
+        } else if (queue_files) {
+            // A full queue goes out as a batch, as in the event loop, so a
+            // rescan of a large tree misses nothing
+            if (w->npending >= WATCH_MAX_PENDING) watch_flush(w);
+            watch_queue(w, child);
+        }
+    }
+    closedir(dir);
+}
+
+// Append everything queued as one segment, then record how long each file
+// waited between its first event and the fsync that made it durable
+static int watch_flush(WatchState *w) {
+    if (w->npending == 0) return 0;
+    double start = now_ms();
+    Archive *archive = archive_create();
+    for (size_t i = 0; archive && i < w->npending; i++) {
+        char full[MAX_PATH_LEN];
+        struct stat st;
+        snprintf(full, sizeof(full), "%s/%s", w->root, w->pending[i].path);
+        if (member_path_safe(w->pending[i].path) && stat(full, &st) == 0 && S_ISREG(st.st_mode) &&
+            archive_add_file(archive, w->pending[i].path, NULL, st.st_size) == 0) {
+            archive->files[archive->count - 1].source = strdup(full);
+        }
+    }
     
-    uint8_t *decompressed = malloc(original_size);
-    if (!decompressed) {
-        free(archive_data);
-        return -1;
+    int result = -1;
+    if (archive) {
+        load_archive_files(archive);
+        result = archive->count ? append_segment(w->archive_file, archive, w->preset, w->fixed_dict, start) : 0;
+        if (result == SEGMENTS_FULL) {
+            printf("Segment index is full, compacting first...\n");
+            result = compact_archive(w->archive_file, NULL, w->preset);
+            // compact renames a new file into place: keep excluding the archive by its new inode
+            struct stat st;
+            if (stat(w->archive_file, &st) == 0) {
+                w->archive_dev = st.st_dev;
+                w->archive_ino = st.st_ino;
+            }
+            if (result == 0) result = append_segment(w->archive_file, archive, w->preset, w->fixed_dict, start);
+        }
     }
     
-    lzma_stream strm = LZMA_STREAM_INIT;
-    lzma_ret ret = lzma_auto_decoder(&strm, UINT64_MAX, 0);
+    if (result == 0 && archive && archive->count) {
+        double durable = now_ms(), batch_max = 0;
+        for (size_t i = 0; i < w->npending; i++) {
+            double latency = durable - w->pending[i].event_ms;
+            w->latency_sum += latency;
+            if (latency > batch_max) batch_max = latency;
+        }
+        if (batch_max > w->latency_max) w->latency_max = batch_max;
+        w->batches++;
+        w->files += w->npending;
+        printf("  Event-to-durable: %.0f ms max this batch, %.0f ms mean overall\n", batch_max,
+               w->latency_sum / w->files);
+    }
+    archive_free(archive);
     
-    if (ret != LZMA_OK) {
-        free(decompressed);
-        free(archive_data);
+    // A failed batch is dropped rather than retried forever; its files are
+    // queued again on their next change
+    for (size_t i = 0; i < w->npending; i++) free(w->pending[i].path);
+    for (size_t i = 0; i < WATCH_SLOTS; i++) w->slots[i] = SIZE_MAX;
+    w->npending = 0;
+    w->pending_bytes = 0;
+    return result;
+}
+
+// Keep archive_file up to date with directory: changed files are collected
+// with inotify and appended as one segment per batch, after interval_ms from
+// the first change or as soon as max_batch bytes or WATCH_MAX_PENDING files
+// are queued. The archive is created first if it does not exist. Runs until
+// SIGINT or SIGTERM, then flushes what is queued.
+int watch_directory(const char *directory, const char *archive_file, const char *preset, double interval_ms,
+                    size_t max_batch) {
+    struct stat st;
+    if (stat(directory, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a directory: %s\n", directory);
         return -1;
     }
     
-    strm.next_in = archive_data + offset;
-    strm.avail_in = compressed_size;
-    strm.next_out = decompressed;
-    strm.avail_out = original_size;
-    
-    ret = lzma_code(&strm, LZMA_FINISH);
-    lzma_end(&strm);
-    
-    if (ret != LZMA_STREAM_END) {
-        fprintf(stderr, "Decompression failed: %d\n", ret);
-        free(decompressed);
-        free(archive_data);
+    WatchState w = {0};
+    w.root = directory;
+    w.archive_file = archive_file;
+    w.preset = preset;
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    w.pending = malloc(sizeof(PendingFile) * WATCH_MAX_PENDING);
+    w.slots = malloc(sizeof(size_t) * WATCH_SLOTS);
+    if (w.fd < 0 || !w.pending || !w.slots) {
+        fprintf(stderr, "Cannot start watching: %s\n", strerror(errno));
+        if (w.fd >= 0) close(w.fd);
+        free(w.pending);
+        free(w.slots);
         return -1;
     }
+    for (size_t i = 0; i < WATCH_SLOTS; i++) w.slots[i] = SIZE_MAX;
     
-    free(archive_data);
-    
-    // Parse decompressed data
-    offset = 0;
-    
-    // Read prefixes
-    uint16_t num_prefixes = read_uint16_be(decompressed + offset);
-    offset += 2;
-    
-    char **prefixes = malloc(sizeof(char*) * num_prefixes);
-    for (uint16_t i = 0; i < num_prefixes; i++) {
-        uint16_t prefix_len = read_uint16_be(decompressed + offset);
-        offset += 2;
-        
-        prefixes[i] = malloc(prefix_len + 1);
-        memcpy(prefixes[i], decompressed + offset, prefix_len);
-        prefixes[i][prefix_len] = '\0';
-        offset += prefix_len;
+    // Watches go in before the initial archive, so nothing written meanwhile is missed
+    watch_add_tree(&w, "", 0);
+    int result = 0;
+    if (stat(archive_file, &st) != 0) {
+        CreateOptions opts = {0};
+        result = create_archive(directory, archive_file, preset, 1, &opts);
+        stat(archive_file, &st);
     }
+    w.archive_dev = st.st_dev;
+    w.archive_ino = st.st_ino;
     
-    // Read files
-    uint32_t num_files = read_uint32_be(decompressed + offset);
-    offset += 4;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
     
-    printf("Extracting %u files...\n", num_files);
+    printf("\nWatching %s -> %s (batch every %.1fs or %.0f MB, Ctrl-C to stop)\n", directory, archive_file,
+           interval_ms / 1000.0, max_batch / (1024.0 * 1024.0));
     
-    // Create output directory
-    mkdir(output_directory, 0755);
+    // One dictionary for the whole run, sized for a full batch, so every
+    // batch is encoded alike and the encoder is announced once
+    EncoderConfig encoder;
+    if (result == 0 && resolve_encoder_config(preset, max_batch, 0, &encoder) != 0) result = -1;
+    if (result == 0) {
+        encoder.threads = 1;
+        w.fixed_dict = encoder.dict_size;
+        print_encoder_config(&encoder);
+    }
     
-    for (uint32_t i = 0; i < num_files; i++) {
-        uint16_t path_len = read_uint16_be(decompressed + offset);
-        offset += 2;
-        
-        char path[MAX_PATH_LEN];
-        memcpy(path, decompressed + offset, path_len);
-        path[path_len] = '\0';
-        offset += path_len;
-        
-        // Expand compressed path
-        char expanded_path[MAX_PATH_LEN];
-        if (path[0] == '$') {
-            char *end = strchr(path + 1, '$');
-            if (end) {
-                int prefix_idx = atoi(path + 1);
-                snprintf(expanded_path, MAX_PATH_LEN, "%s%s", prefixes[prefix_idx], end + 1);
-            } else {
-                strcpy(expanded_path, path);
-            }
-        } else {
-            strcpy(expanded_path, path);
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (result == 0 && !watch_stop) {
+        int timeout = -1;
+        if (w.npending) {
+            double wait = w.pending[0].event_ms + interval_ms - now_ms();
+            timeout = wait > 0 ? (int)wait + 1 : 0;
+        }
+        struct pollfd pfd = {w.fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            result = -1;
+            break;
         }
         
-        uint32_t content_len = read_uint32_be(decompressed + offset);
-        offset += 4;
-        
-        if (content_len == 0xFFFFFFFF) {
-            // Duplicate - skip for now
-            uint16_t dup_len = read_uint16_be(decompressed + offset);
-            offset += 2 + dup_len;
-        } else {
-            // Write file
-            char full_path[MAX_PATH_LEN];
-            snprintf(full_path, MAX_PATH_LEN, "%s/%s", output_directory, expanded_path);
-            
-            // Create parent directories
-            char *last_slash = strrchr(full_path, '/');
-            if (last_slash) {
-                *last_slash = '\0';
+        ssize_t len;
+        while (ready > 0 && (len = read(w.fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // Events were lost: requeue the whole tree
+                    fprintf(stderr, "Event queue overflowed, rescanning %s\n", directory);
+                    watch_add_tree(&w, "", 1);
+                    continue;
+                }
+                if (ev->wd < 0 || ev->wd >= w.dir_capacity || !w.dirs[ev->wd]) continue;
+                if (ev->mask & IN_IGNORED) {
+                    free(w.dirs[ev->wd]);
+                    w.dirs[ev->wd] = NULL;
+                    continue;
+                }
+                if (!ev->len) continue;
                 
-                char dir_path[MAX_PATH_LEN] = "";
-                char *token = strtok(full_path, "/");
-                while (token) {
-                    strcat(dir_path, token);
-                    mkdir(dir_path, 0755);
-                    strcat(dir_path, "/");
-                    token = strtok(NULL, "/");
+                char rel[MAX_PATH_LEN];
+                const char *dir = w.dirs[ev->wd];
+                snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] ? "/" : "", ev->name);
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) watch_add_tree(&w, rel, 1);
+                } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    if (w.npending >= WATCH_MAX_PENDING) watch_flush(&w);
+                    watch_queue(&w, rel);
                 }
-                *last_slash = '/';
-            }
-            
-            FILE *out = fopen(full_path, "wb");
-            if (out) {
-                fwrite(decompressed + offset, 1, content_len, out);
-                fclose(out);
             }
-            
-            offset += content_len;
+        }
+        
+        if (w.npending &&
+            (w.pending_bytes >= max_batch || now_ms() >= w.pending[0].event_ms + interval_ms)) {
+            watch_flush(&w);
         }
     }
+    if (result == 0) result = watch_flush(&w);
     
-    // Free prefixes
-    for (uint16_t i = 0; i < num_prefixes; i++) {
-        free(prefixes[i]);
+    printf("\n✓ Stopped watching: %zu batch%s, %zu file%s appended", w.batches, w.batches == 1 ? "" : "es", w.files,
+           w.files == 1 ? "" : "s");
+    if (w.files) {
+        printf(", event-to-durable %.0f ms mean, %.0f ms max", w.latency_sum / w.files, w.latency_max);
     }
-    free(prefixes);
-    free(decompressed);
+    printf("\n");
     
-    time_t total_time = time(NULL) - start_time;
-    printf("\n✓ Extracted in %lds to: %s\n", total_time, output_directory);
+    for (int i = 0; i < w.dir_capacity; i++) free(w.dirs[i]);
+    free(w.dirs);
+    free(w.pending);
+    free(w.slots);
+    close(w.fd);
+    return result;
+}
+#else
+int watch_directory(const char *directory, const char *archive_file, const char *preset, double interval_ms,
+                    size_t max_batch) {
+    (void)directory;
+    (void)archive_file;
+    (void)preset;
+    (void)interval_ms;
+    (void)max_batch;
+    fprintf(stderr, "watch is not supported on this platform\n");
+    return -1;
+}
+#endif
+
+// Give target_file the state sidecar of archive_file with a chain depth of
+// 0, for a compacted archive that no longer has a base. An archive without
+// a state file is left without one.
+static int copy_file_state_full(const char *archive_file, const char *target_file) {
+    char state_path[MAX_PATH_LEN], target_path[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN];
+    if ((size_t)snprintf(state_path, sizeof(state_path), "%s.state", archive_file) >= sizeof(state_path) ||
+        (size_t)snprintf(target_path, sizeof(target_path), "%s.state", target_file) >= sizeof(target_path) ||
+        (size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.state.tmp", target_file) >= sizeof(tmp_path)) {
+        return -1;
+    }
+    if (access(state_path, F_OK) != 0) return 0;
+    FileStateTable state;
+    if (load_file_state(archive_file, &state) != 0) return -1;
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        file_state_free(&state);
+        return -1;
+    }
+    write_state_header(out, state.archive_id, 0, state.count);
+    for (size_t i = 0; i < state.count; i++) write_state_entry(out, &state.entries[i]);
+    file_state_free(&state);
+    return write_all_and_sync(out, tmp_path, target_path);
+}
+
+// Rewrite an archive with only the latest version of every member. Base
+// members and appended segments are folded in, and the result is a plain
+// checksummed archive that keeps the archive id, so a .state sidecar and
+// later incremental archives still match it.
+int compact_archive(const char *archive_file, const char *output_file, const char *preset) {
+    printf("Compacting %s...\n", archive_file);
+    struct stat before;
+    if (stat(archive_file, &before) != 0) {
+        fprintf(stderr, "Cannot access: %s\n", archive_file);
+        return -1;
+    }
+    
+    DecodedArchive decoded;
+    if (decode_archive(archive_file, &decoded) != 0) return -1;
+    MemberTable table;
+    int damaged = parse_members(&decoded, &table) != 0 || decoded.damaged_blocks > 0;
+    damaged |= resolve_repo_members(&table) != 0;
+    damaged |= verify_member_digests(&table) > 0;
+    damaged |= resolve_base_members(archive_file, &table, 0) != 0;
+    damaged |= load_appended_segments(archive_file, &decoded, &table) != 0;
+    
+    uint32_t live, unreadable;
+    count_members(&table, &live, &unreadable);
+    Archive *archive = damaged || unreadable ? NULL : archive_create();
+    if (!archive) {
+        fprintf(stderr, "%s\n", damaged || unreadable ? "Archive is damaged, not compacting (see test)" : "Out of memory");
+        member_table_free(&table);
+        decoded_archive_free(&decoded);
+        return -1;
+    }
+    
+    // Member contents are borrowed from the decoded tables
+    int algo = DIGEST_NONE;
+    uint32_t shadowed = 0;
+    for (uint32_t s = 0; s <= table.nsegments; s++) {
+        const MemberTable *t = s == 0 ? &table : &table.segments[s - 1].table;
+        if (algo == DIGEST_NONE) algo = t->digest_algo;
+        for (uint32_t i = 0; i < t->count; i++) {
+            const ExtractEntry *entry = &t->entries[i];
+            if (entry->shadowed) shadowed++;
+            if (entry->ok) archive_add_file(archive, entry->path, entry->data, entry->size);
+        }
+    }
+    file_digest_algo = algo;
+    for (size_t i = 0; i < archive->count; i++) {
+        compute_digest(algo, archive->files[i].content, archive->files[i].size, archive->files[i].digest);
+    }
+    
+    size_t size, compressed_size = 0;
+    uint8_t flags = 0, sha[32];
+    size_t streams = 1;
+    uint8_t *payload = serialize_plain_members(archive, table.chained ? table.archive_id : NULL, &size, &flags);
+    uint8_t *compressed = NULL;
+    if (payload && size > UINT32_MAX) {
+        fprintf(stderr, "Compacted payload is larger than 4 GB\n");
+    } else if (payload) {
+        compressed = compress_payload(payload, size, preset, 0, &compressed_size, sha, &streams);
+    }
+    free(payload);
+    size_t files = archive->count;
+    for (size_t i = 0; i < archive->count; i++) archive->files[i].content = NULL;
+    archive_free(archive);
+    member_table_free(&table);
+    decoded_archive_free(&decoded);
+    if (!compressed) return -1;
+    
+    // In place: write beside the archive, then rename over it
+    char tmp_path[MAX_PATH_LEN];
+    const char *target = output_file ? output_file : archive_file;
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.compact", target) >= sizeof(tmp_path)) {
+        free(compressed);
+        return -1;
+    }
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Cannot create output file: %s\n", tmp_path);
+        free(compressed);
+        return -1;
+    }
+    uint8_t header[19];
+    memcpy(header, KUNDA_MAGIC, 8);
+    header[8] = archive_version(COMP_LZMA_ULTRA, flags | FLAG_CHECKSUMMED, streams, 0);
+    header[9] = COMP_LZMA_ULTRA;
+    header[10] = flags | FLAG_CHECKSUMMED;
+    write_uint32_be(header + 11, size);
+    write_uint32_be(header + 15, compressed_size);
+    int ok = fwrite(header, 1, sizeof(header), out) == sizeof(header) && fwrite(sha, 1, 32, out) == 32 &&
+             fwrite(compressed, 1, compressed_size, out) == compressed_size;
+    free(compressed);
+    if (!ok) {
+        fprintf(stderr, "Cannot write %s: %s\n", tmp_path, strerror(errno));
+        fclose(out);
+        remove(tmp_path);
+        return -1;
+    }
+    // The rename replaces the only copy of every member, so the new file
+    // must be on disk first
+    if (write_all_and_sync(out, tmp_path, target) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", target, strerror(errno));
+        return -1;
+    }
+    // Incremental archives made from the result start a new chain
+    if (copy_file_state_full(archive_file, target) != 0) {
+        fprintf(stderr, "Cannot write file state: %s.state\n", target);
+    }
     
+    struct stat after;
+    stat(target, &after);
+    printf("\n✓ Compacted to %s: %zu members, %u shadowed version%s dropped, %.2f MB -> %.2f MB\n", target, files,
+           shadowed, shadowed == 1 ? "" : "s", before.st_size / (1024.0 * 1024.0), after.st_size / (1024.0 * 1024.0));
     return 0;
 }
 
@@ -878,8 +10863,19 @@ void print_usage(void) {
     printf("  • Maximum search depth (273)\n");
     printf("  • BT4 match finder\n");
     printf("\n📝 Usage:\n");
-    printf("  Create: ./kunda_zip create <file|dir> [output.kun] [preset]\n");
-    printf("  Extract: ./kunda_zip extract <archive.kun> [output_dir]\n");
+    printf("  Create: ./kunda_zip create <file|dir> [output.kun] [preset] [options]\n");
+    printf("  Extract: ./kunda_zip extract <archive.kun> [output_dir] [--threads=N]\n");
+    printf("  Test:    ./kunda_zip test <archive.kun>...\n");
+    printf("  Append:  ./kunda_zip append <archive.kun> <file|dir>... [--preset=NAME]\n");
+    printf("  Compact: ./kunda_zip compact <archive.kun> [output.kun] [--preset=NAME]\n");
+    printf("  Watch:   ./kunda_zip watch <dir> <archive.kun> [--interval=SECONDS] [--max-batch=SIZE] [--preset=NAME]\n");
+    printf("  Repo GC: ./kunda_zip repo-gc <repo_dir> [--preset=NAME]\n");
+    printf("  Batch:   ./kunda_zip batch <list.txt> [preset] [options]\n");
+    printf("  Bench:   ./kunda_zip bench numa <file|dir> [preset] [--threads=N]\n");
+    printf("           ./kunda_zip bench rsync <file|dir> [preset] [--rsyncable=AVG]\n");
+    printf("           ./kunda_zip bench precomp <file|dir> [preset]\n");
+    printf("           ./kunda_zip bench logs <file|dir> [preset]\n");
+    printf("           ./kunda_zip bench columnar <file|dir> [preset]\n");
     printf("\n⚙️  Presets:\n");
     printf("  ultra        - Auto-detect best dict size (safest)\n");
     printf("  ultra-128    - 128 MB dict (~512 MB RAM needed)\n");
@@ -888,12 +10884,125 @@ void print_usage(void) {
     printf("  max          - LZMA extreme (safe)\n");
     printf("  balanced     - Good balance\n");
     printf("  fast         - Quick compression\n");
+    printf("\n🔧 Create options:\n");
+    printf("  --cluster    - Group near-duplicate files (MinHash/LSH)\n");
+    printf("  --delta      - Store near-duplicates as patches against a similar file\n");
+    printf("  --cdc[=AVG]  - Chunk-level dedup, average chunk AVG bytes (default 8192)\n");
+    printf("  --lrm        - Long-range matching for repeats beyond the dictionary\n");
+    printf("  --mem-limit=SIZE - Fit the whole run into SIZE (e.g. 2G), degrading the encoder\n");
+    printf("  --threads=N  - Worker count (default: CPUs allowed by affinity and cgroup quota)\n");
+    printf("  --parallel-streams - Encode large inputs as concurrent xz streams (faster, slightly larger)\n");
+    printf("  --hugepages=MODE - 2 MB pages for encoder buffers: auto, thp, hugetlb or off\n");
+    printf("  --numa[=interleave] - Pin workers to NUMA nodes with node-local encoder memory\n");
+    printf("  --content-digest - Also store a SHA-256 of the uncompressed payload\n");
+    printf("  --file-digests[=fast|sha256] - Per-file digests, checked on extract and test\n");
+    printf("  --blocks[=SIZE] - Record-aligned blocks with CRC32 and a Merkle root (default 8M)\n");
+    printf("  --file-state - Write <archive>.state (mtime, size, inode, hash per file)\n");
+    printf("  --incremental-from=BASE - Store only files changed since BASE, reference the rest\n");
+    printf("  --precomp    - Store gzip/zip/PNG deflate streams inflated when zlib re-creates them exactly\n");
+    printf("  --jpeg       - Re-code baseline and progressive JPEGs with a context model, bit-exact on extract\n");
+    printf("  --log-filter - Split log lines into templates and delta-coded numbers and timestamps\n");
+    printf("  --columnar   - Store CSV/TSV and NDJSON members column by column\n");
+    printf("  --rsyncable[=AVG] - Restart the encoder at content-defined cuts (~AVG apart, default 1M)\n");
+    printf("  --repo=DIR - Keep chunks in a repository shared by many archives (--cdc sets the chunk size)\n");
     printf("\n💡 Examples:\n");
     printf("  ./kunda_zip create my_folder archive.kun ultra\n");
     printf("  ./kunda_zip create large_file.txt compressed.kun ultra-256\n");
     printf("  ./kunda_zip extract archive.kun extracted/\n");
 }
 
+// Parse one create/batch argument. Returns 1 if it was an option, 0 if it is
+// positional, -1 on an invalid option.
+static int parse_create_option(const char *arg, CreateOptions *opts) {
+    if (strcmp(arg, "--cluster") == 0) {
+        opts->cluster = 1;
+    } else if (strcmp(arg, "--delta") == 0) {
+        opts->delta = 1;
+    } else if (strcmp(arg, "--cdc") == 0 || strncmp(arg, "--cdc=", 6) == 0) {
+        opts->cdc_avg = arg[5] == '=' ? strtoul(arg + 6, NULL, 10) : CDC_DEFAULT_AVG;
+        if (opts->cdc_avg < CDC_MIN_AVG || opts->cdc_avg > CDC_MAX_AVG) {
+            fprintf(stderr, "Chunk size must be between %d and %d bytes\n", CDC_MIN_AVG, CDC_MAX_AVG);
+            return -1;
+        }
+    } else if (strcmp(arg, "--lrm") == 0) {
+        opts->lrm = 1;
+    } else if (strncmp(arg, "--mem-limit=", 12) == 0) {
+        opts->mem_limit = parse_size(arg + 12);
+        if (opts->mem_limit == 0) {
+            fprintf(stderr, "Invalid memory limit: %s\n", arg + 12);
+            return -1;
+        }
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+        requested_threads = atoi(arg + 10);
+        if (requested_threads < 1) {
+            fprintf(stderr, "Invalid thread count: %s\n", arg + 10);
+            return -1;
+        }
+    } else if (strcmp(arg, "--parallel-streams") == 0) {
+        parallel_streams = 1;
+    } else if (strcmp(arg, "--file-digests") == 0 || strcmp(arg, "--file-digests=fast") == 0) {
+        file_digest_algo = DIGEST_FAST128;
+    } else if (strcmp(arg, "--file-digests=sha256") == 0) {
+        file_digest_algo = DIGEST_SHA256;
+    } else if (strcmp(arg, "--blocks") == 0 || strncmp(arg, "--blocks=", 9) == 0) {
+        opts->block_target = arg[8] == '=' ? parse_size(arg + 9) : BLOCK_TARGET_DEFAULT;
+        if (opts->block_target < 64 * 1024 || opts->block_target > (size_t)1024 * 1024 * 1024) {
+            fprintf(stderr, "Block size must be between 64K and 1G\n");
+            return -1;
+        }
+    } else if (strcmp(arg, "--rsyncable") == 0 || strncmp(arg, "--rsyncable=", 12) == 0) {
+        opts->rsync_avg = arg[11] == '=' ? parse_size(arg + 12) : RSYNC_DEFAULT_AVG;
+        if (opts->rsync_avg < RSYNC_MIN_AVG || opts->rsync_avg > CDC_MAX_AVG) {
+            fprintf(stderr, "Rsyncable cut size must be between 64K and 4M\n");
+            return -1;
+        }
+    } else if (strcmp(arg, "--precomp") == 0) {
+        opts->precomp = 1;
+    } else if (strcmp(arg, "--jpeg") == 0) {
+        opts->jpeg = 1;
+    } else if (strcmp(arg, "--log-filter") == 0) {
+        opts->log_filter = 1;
+    } else if (strcmp(arg, "--columnar") == 0) {
+        opts->columnar = 1;
+    } else if (strcmp(arg, "--file-state") == 0) {
+        opts->file_state = 1;
+    } else if (strncmp(arg, "--incremental-from=", 19) == 0 && arg[19]) {
+        opts->incremental_from = arg + 19;
+    } else if (strncmp(arg, "--ref-archive=", 14) == 0 && arg[14] && strlen(arg + 14) < MAX_PATH_LEN) {
+        opts->ref_archive = arg + 14;
+    } else if (strncmp(arg, "--repo=", 7) == 0 && arg[7] && strlen(arg + 7) < MAX_PATH_LEN - 64) {
+        opts->repo = arg + 7;
+    } else if (strncmp(arg, "--scan-cache=", 13) == 0 && arg[13]) {
+        opts->scan_cache = arg + 13;
+    } else if (strcmp(arg, "--content-digest") == 0) {
+        opts->content_digest = 1;
+    } else if (strcmp(arg, "--numa") == 0 || strcmp(arg, "--numa=local") == 0) {
+        set_numa_mode(NUMA_LOCAL);
+    } else if (strcmp(arg, "--numa=interleave") == 0) {
+        set_numa_mode(NUMA_INTERLEAVE);
+    } else if (strncmp(arg, "--hugepages=", 12) == 0) {
+        const char *mode = arg + 12;
+        if (strcmp(mode, "off") == 0) {
+            hugepage_mode = HUGEPAGES_OFF;
+        } else if (strcmp(mode, "auto") == 0) {
+            hugepage_mode = HUGEPAGES_AUTO;
+        } else if (strcmp(mode, "thp") == 0) {
+            hugepage_mode = HUGEPAGES_THP;
+        } else if (strcmp(mode, "hugetlb") == 0) {
+            hugepage_mode = HUGEPAGES_HUGETLB;
+        } else {
+            fprintf(stderr, "Invalid huge page mode: %s (use auto, thp, hugetlb or off)\n", mode);
+            return -1;
+        }
+    } else if (strncmp(arg, "--", 2) == 0) {
+        fprintf(stderr, "Unknown option: %s\n", arg);
+        return -1;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         print_usage();
@@ -902,20 +11011,232 @@ int main(int argc, char *argv[]) {
     
     const char *command = argv[1];
     
-    if (strcmp(command, "create") == 0) {
-        const char *input = argc > 2 ? argv[2] : ".";
-        const char *output = argc > 3 ? argv[3] : "archive.kun";
-        const char *preset = argc > 4 ? argv[4] : "ultra";
+    if (strcmp(command, "create") == 0 || strcmp(command, "batch") == 0) {
+        CreateOptions opts = {0};
+        const char *positional[3] = {NULL, NULL, NULL};
+        int npositional = 0;
+        int batch = strcmp(command, "batch") == 0;
+        
+        for (int i = 2; i < argc; i++) {
+            int parsed = parse_create_option(argv[i], &opts);
+            if (parsed < 0) {
+                return 1;
+            } else if (parsed == 0 && npositional < (batch ? 2 : 3)) {
+                positional[npositional++] = argv[i];
+            } else if (parsed == 0) {
+                fprintf(stderr, "Unexpected argument: %s\n\n", argv[i]);
+                print_usage();
+                return 1;
+            }
+        }
+        
+        if (batch) {
+            if (!positional[0]) {
+                fprintf(stderr, "Usage: %s batch <list.txt> [preset] [options]\n", argv[0]);
+                return 1;
+            }
+            int result = batch_create(positional[0], positional[1] ? positional[1] : "ultra", &opts);
+            encoder_contexts_free();
+            pool_destroy(shared_pool);
+            return result;
+        }
+        
+        const char *input = positional[0] ? positional[0] : ".";
+        const char *output = positional[1] ? positional[1] : "archive.kun";
+        const char *preset = positional[2] ? positional[2] : "ultra";
         
-        return create_archive(input, output, preset, 1);
+        int result = create_archive(input, output, preset, 1, &opts);
+        encoder_contexts_free();
+        pool_destroy(shared_pool);
+        return result;
     } else if (strcmp(command, "extract") == 0) {
-        const char *archive = argc > 2 ? argv[2] : "archive.kun";
-        const char *output_dir = argc > 3 ? argv[3] : "extracted";
+        const char *positional[2] = {NULL, NULL};
+        int npositional = 0;
         
-        return extract_archive(archive, output_dir);
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--threads=", 10) == 0) {
+                requested_threads = atoi(argv[i] + 10);
+                if (requested_threads < 1) {
+                    fprintf(stderr, "Invalid thread count: %s\n", argv[i] + 10);
+                    return 1;
+                }
+            } else if (strncmp(argv[i], "--", 2) == 0) {
+                fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                return 1;
+            } else if (npositional < 2) {
+                positional[npositional++] = argv[i];
+            } else {
+                fprintf(stderr, "Unexpected argument: %s\n\n", argv[i]);
+                print_usage();
+                return 1;
+            }
+        }
+        
+        const char *archive = positional[0] ? positional[0] : "archive.kun";
+        const char *output_dir = positional[1] ? positional[1] : "extracted";
+        
+        int result = extract_archive(archive, output_dir);
+        pool_destroy(shared_pool);
+        return result;
+    } else if (strcmp(command, "test") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s test <archive.kun>...\n", argv[0]);
+            return 1;
+        }
+        int result = test_archives(argc - 2, argv + 2);
+        pool_destroy(shared_pool);
+        return result == 0 ? 0 : 1;
+    } else if (strcmp(command, "watch") == 0) {
+        const char *positional[2] = {NULL, NULL};
+        int npositional = 0;
+        const char *preset = "ultra";
+        double interval = WATCH_DEFAULT_INTERVAL;
+        size_t max_batch = WATCH_DEFAULT_MAX_BATCH;
+        
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--preset=", 9) == 0) {
+                preset = argv[i] + 9;
+            } else if (strncmp(argv[i], "--interval=", 11) == 0) {
+                interval = atof(argv[i] + 11);
+                if (interval <= 0) {
+                    fprintf(stderr, "Invalid interval: %s\n", argv[i] + 11);
+                    return 1;
+                }
+            } else if (strncmp(argv[i], "--max-batch=", 12) == 0) {
+                max_batch = parse_size(argv[i] + 12);
+                if (max_batch == 0) {
+                    fprintf(stderr, "Invalid batch size: %s\n", argv[i] + 12);
+                    return 1;
+                }
+            } else if (strncmp(argv[i], "--threads=", 10) == 0 || strncmp(argv[i], "--file-digests", 14) == 0) {
+                // Only the create options that set process-wide state apply here
+                CreateOptions unused = {0};
+                if (parse_create_option(argv[i], &unused) < 0) return 1;
+            } else if (strncmp(argv[i], "--", 2) == 0) {
+                fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                return 1;
+            } else {
+                if (npositional < 2) positional[npositional] = argv[i];
+                npositional++;
+            }
+        }
+        if (npositional != 2) {
+            fprintf(stderr, "Usage: %s watch <dir> <archive.kun> [--interval=SECONDS] [--max-batch=SIZE]\n", argv[0]);
+            return 1;
+        }
+        int result = watch_directory(positional[0], positional[1], preset, interval * 1000.0, max_batch);
+        encoder_contexts_free();
+        pool_destroy(shared_pool);
+        return result == 0 ? 0 : 1;
+    } else if (strcmp(command, "append") == 0 || strcmp(command, "compact") == 0) {
+        int append = strcmp(command, "append") == 0;
+        const char *preset = "ultra";
+        char **positional = malloc(sizeof(char *) * argc);
+        int npositional = 0;
+        if (!positional) return 1;
+        
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--preset=", 9) == 0) {
+                preset = argv[i] + 9;
+            } else if (strncmp(argv[i], "--threads=", 10) == 0 ||
+                       (append && strncmp(argv[i], "--file-digests", 14) == 0)) {
+                // Only the create options that set process-wide state apply here
+                CreateOptions unused = {0};
+                if (parse_create_option(argv[i], &unused) < 0) {
+                    free(positional);
+                    return 1;
+                }
+            } else if (strncmp(argv[i], "--", 2) == 0) {
+                fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                free(positional);
+                return 1;
+            } else {
+                positional[npositional++] = argv[i];
+            }
+        }
+        
+        int result;
+        if (append && npositional < 2) {
+            fprintf(stderr, "Usage: %s append <archive.kun> <file|dir>... [--preset=NAME]\n", argv[0]);
+            result = -1;
+        } else if (!append && (npositional < 1 || npositional > 2)) {
+            fprintf(stderr, "Usage: %s compact <archive.kun> [output.kun] [--preset=NAME]\n", argv[0]);
+            result = -1;
+        } else if (append) {
+            result = append_archive(positional[0], npositional - 1, positional + 1, preset);
+        } else {
+            result = compact_archive(positional[0], npositional > 1 ? positional[1] : NULL, preset);
+        }
+        free(positional);
+        encoder_contexts_free();
+        pool_destroy(shared_pool);
+        return result == 0 ? 0 : 1;
+    } else if (strcmp(command, "repo-gc") == 0) {
+        const char *preset = "ultra";
+        const char *dir = NULL;
+        int npositional = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--preset=", 9) == 0) {
+                preset = argv[i] + 9;
+            } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+                CreateOptions unused = {0};
+                if (parse_create_option(argv[i], &unused) < 0) return 1;
+            } else if (strncmp(argv[i], "--", 2) == 0) {
+                fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                return 1;
+            } else if (npositional++ == 0) {
+                dir = argv[i];
+            }
+        }
+        if (npositional != 1) {
+            fprintf(stderr, "Usage: %s repo-gc <repo_dir> [--preset=NAME]\n", argv[0]);
+            return 1;
+        }
+        int result = repo_gc(dir, preset);
+        encoder_contexts_free();
+        pool_destroy(shared_pool);
+        return result == 0 ? 0 : 1;
+    } else if (strcmp(command, "bench") == 0) {
+        const char *kind = argc > 2 ? argv[2] : "";
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s bench numa|rsync|precomp|logs|columnar <file|dir> [preset] [options]\n", argv[0]);
+            return 1;
+        }
+        
+        CreateOptions opts = {0};
+        const char *preset = NULL;
+        for (int i = 4; i < argc; i++) {
+            int parsed = parse_create_option(argv[i], &opts);
+            if (parsed < 0) return 1;
+            if (parsed == 0 && preset) {
+                fprintf(stderr, "Unexpected argument: %s\n", argv[i]);
+                return 1;
+            }
+            if (parsed == 0) preset = argv[i];
+        }
+        if (!preset) preset = "max";
+        
+        int result;
+        if (strcmp(kind, "numa") == 0) {
+            result = bench_numa(argv[3], preset);
+        } else if (strcmp(kind, "rsync") == 0) {
+            result = bench_rsync(argv[3], preset, opts.rsync_avg ? opts.rsync_avg : RSYNC_DEFAULT_AVG);
+        } else if (strcmp(kind, "precomp") == 0) {
+            result = bench_precomp(argv[3], preset);
+        } else if (strcmp(kind, "logs") == 0) {
+            result = bench_log_filter(argv[3], preset);
+        } else if (strcmp(kind, "columnar") == 0) {
+            result = bench_columnar(argv[3], preset);
+        } else {
+            fprintf(stderr, "Unknown benchmark: %s\n", kind);
+            return 1;
+        }
+        encoder_contexts_free();
+        pool_destroy(shared_pool);
+        return result == 0 ? 0 : 1;
     } else {
         fprintf(stderr, "Unknown command: %s\n", command);
-        fprintf(stderr, "Use 'create' or 'extract'\n");
+        fprintf(stderr, "Use 'create', 'extract', 'test', 'append', 'compact', 'watch', 'repo-gc', 'batch' or 'bench'\n");
         return 1;
     }
 }
\ No newline at end of file
@@ -421,12 +421,19 @@ class KundaUltra:
         
         version = archive_data[offset]
         offset += 1
+        if version > KundaUltra.VERSION:
+            # Version 3 adds record types, flags, methods and appended
+            # segments this reader does not know; use the C implementation
+            raise ValueError(f"Unsupported archive version {version} "
+                             f"(this reader supports up to {KundaUltra.VERSION}, use src/c/kunda_zip)")
         
         method_byte = archive_data[offset]
         offset += 1
         
         flags = archive_data[offset]
         offset += 1
+        if flags & ~(KundaUltra.FLAG_CHECKSUMMED | KundaUltra.FLAG_PATH_COMPRESSED):
+            raise ValueError(f"Unsupported archive flags 0x{flags:02x} (use src/c/kunda_zip)")
         
         original_size = struct.unpack('>I', archive_data[offset:offset+4])[0]
         offset += 4
@@ -452,6 +459,8 @@ class KundaUltra:
             data_bytes = bz2.decompress(compressed_data)
         elif method_byte == KundaUltra.COMP_ZLIB:
             data_bytes = zlib.decompress(compressed_data)
+        else:
+            raise ValueError(f"Unsupported compression method {method_byte}")
         
         # Parse paths
         offset = 0
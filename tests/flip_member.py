@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+"""
+Flip one bit inside a member of a plain (single-stream, checksummed)
+archive and re-seal it, for the per-file digest test.
+
+Any damage to the compressed data is caught by the archive checksum before
+per-file digests are looked at. To reach them, the payload is decoded, the
+first byte of MARKER is changed, and the payload is compressed again with
+a fresh compressed size and SHA-256. Only the member that contains MARKER
+then differs from its digest.
+
+Usage: flip_member.py INPUT OUTPUT MARKER
+"""
+
+import hashlib
+import lzma
+import struct
+import sys
+
+HEADER = 19     # magic, version, method, flags, original and compressed size
+CHECKSUM = 32
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__.strip().splitlines()[-1])
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    size = struct.unpack('>I', data[15:HEADER])[0]
+    start = HEADER + CHECKSUM
+    payload = bytearray(lzma.decompress(data[start:start + size]))
+
+    marker = sys.argv[3].encode()
+    if payload.count(marker) != 1:
+        sys.exit('marker must occur exactly once in the payload')
+    payload[payload.index(marker)] ^= 1
+
+    stream = lzma.compress(bytes(payload), format=lzma.FORMAT_XZ, check=lzma.CHECK_CRC64)
+    with open(sys.argv[2], 'wb') as f:
+        f.write(data[:15] + struct.pack('>I', len(stream)))
+        f.write(hashlib.sha256(stream).digest())
+        f.write(stream)
+        f.write(data[start + size:])
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""
+Write a small baseline grayscale JPEG for the --jpeg round-trip test.
+
+Standard library only: a plain 8x8 DCT, the example quantization table and
+the standard Huffman tables from the JPEG spec (Annex K). The image is a
+deterministic pattern, so the output is the same on every run.
+
+Usage: make_jpeg.py OUTPUT [WIDTH HEIGHT]
+"""
+
+import math
+import struct
+import sys
+
+ZIGZAG = [
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+]
+
+QUANT = [
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+]
+
+DC_COUNTS = [0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0]
+DC_SYMBOLS = list(range(12))
+AC_COUNTS = [0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d]
+AC_SYMBOLS = bytes.fromhex(
+    "01020300041105122131410613516107227114328191a1082342b1c11552d1f0"
+    "2433627282090a161718191a25262728292a3435363738393a434445464748494a"
+    "535455565758595a636465666768696a737475767778797a838485868788898a"
+    "92939495969798999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3c4c5c6c7"
+    "c8c9cad2d3d4d5d6d7d8d9dae1e2e3e4e5e6e7e8e9eaf1f2f3f4f5f6f7f8f9fa")
+
+
+def huffman_codes(counts, symbols):
+    codes, code, k = {}, 0, 0
+    for length, count in enumerate(counts, 1):
+        for _ in range(count):
+            codes[symbols[k]] = (code, length)
+            code += 1
+            k += 1
+        code <<= 1
+    return codes
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.bits = 0
+
+    def write(self, value, length):
+        for i in range(length - 1, -1, -1):
+            self.acc = (self.acc << 1) | ((value >> i) & 1)
+            self.bits += 1
+            if self.bits == 8:
+                self.out.append(self.acc)
+                if self.acc == 0xFF:
+                    self.out.append(0)
+                self.acc = 0
+                self.bits = 0
+
+    def flush(self):
+        if self.bits:
+            self.write((1 << (8 - self.bits)) - 1, 8 - self.bits)
+
+
+def magnitude(value):
+    size = abs(value).bit_length()
+    return size, (value if value >= 0 else value + (1 << size) - 1)
+
+
+def encode(width, height):
+    cos = [[math.cos((2 * x + 1) * u * math.pi / 16) for x in range(8)] for u in range(8)]
+    scale = [math.sqrt(0.5) if u == 0 else 1.0 for u in range(8)]
+    dc_codes = huffman_codes(DC_COUNTS, DC_SYMBOLS)
+    ac_codes = huffman_codes(AC_COUNTS, AC_SYMBOLS)
+
+    def pixel(x, y):
+        return int(128 + 60 * math.sin(x / 9.0) * math.cos(y / 13.0) + ((x * 7 + y * 13) % 17) - 8)
+
+    bw = BitWriter()
+    prev_dc = 0
+    for by in range(0, height, 8):
+        for bx in range(0, width, 8):
+            block = [[pixel(min(bx + x, width - 1), min(by + y, height - 1)) - 128 for x in range(8)]
+                     for y in range(8)]
+            coef = [0] * 64
+            for v in range(8):
+                for u in range(8):
+                    s = sum(block[y][x] * cos[u][x] * cos[v][y] for y in range(8) for x in range(8))
+                    coef[v * 8 + u] = int(round(s * scale[u] * scale[v] / 4 / QUANT[v * 8 + u]))
+            zz = [coef[i] for i in ZIGZAG]
+
+            size, bits = magnitude(zz[0] - prev_dc)
+            prev_dc = zz[0]
+            bw.write(*dc_codes[size])
+            bw.write(bits, size)
+            run = 0
+            for value in zz[1:]:
+                if value == 0:
+                    run += 1
+                    continue
+                while run > 15:
+                    bw.write(*ac_codes[0xF0])
+                    run -= 16
+                size, bits = magnitude(value)
+                bw.write(*ac_codes[(run << 4) | size])
+                bw.write(bits, size)
+                run = 0
+            if run:
+                bw.write(*ac_codes[0x00])
+    bw.flush()
+
+    def segment(marker, payload):
+        return struct.pack(">HH", marker, len(payload) + 2) + payload
+
+    out = bytearray(b"\xff\xd8")
+    out += segment(0xFFE0, b"JFIF\x00\x01\x01\x00\x00\x01\x00\x01\x00\x00")
+    out += segment(0xFFDB, bytes([0]) + bytes(QUANT[i] for i in ZIGZAG))
+    out += segment(0xFFC0, struct.pack(">BHHB", 8, height, width, 1) + bytes([1, 0x11, 0]))
+    out += segment(0xFFC4, bytes([0x00] + DC_COUNTS + DC_SYMBOLS))
+    out += segment(0xFFC4, bytes([0x10] + AC_COUNTS) + AC_SYMBOLS)
+    out += segment(0xFFDA, bytes([1, 1, 0x00, 0, 63, 0]))
+    out += bw.out + b"\xff\xd9"
+    return bytes(out)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (2, 4):
+        sys.exit(__doc__.strip().splitlines()[-1])
+    w, h = (int(sys.argv[2]), int(sys.argv[3])) if len(sys.argv) == 4 else (256, 192)
+    with open(sys.argv[1], "wb") as f:
+        f.write(encode(w, h))
@@ -0,0 +1,446 @@
+#!/usr/bin/env bash
+# Round-trip tests for build/kunda_zip: every create option must give an
+# archive that passes `test` and extracts to an identical tree, damaged or
+# truncated archives must be rejected, and member names or options that
+# would be unsafe or ignored must be refused.
+#
+# Usage: tests/roundtrip.sh [path/to/kunda_zip]
+
+set -u
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+KUNDA=${1:-build/kunda_zip}
+case $KUNDA in /*) ;; *) KUNDA=$PWD/$KUNDA ;; esac
+if [ ! -x "$KUNDA" ]; then
+    echo "kunda_zip not found at $KUNDA (run make first)" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/kunda-test.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+passed=0
+failed=0
+
+pass() {
+    passed=$((passed + 1))
+    printf '  ok    %s\n' "$1"
+}
+
+fail() {
+    failed=$((failed + 1))
+    printf '  FAIL  %s: %s\n' "$1" "$2"
+    if [ -f log ]; then tail -n 5 log | sed 's/^/          /'; fi
+}
+
+# ---------------------------------------------------------------------------
+# Test data: text, near-duplicates, exact duplicates, logs, tables, binary,
+# gzip, JPEG and an empty file, deterministic so failures can be reproduced.
+# The zlib gzip and the JPEGs need python3 and are skipped without it.
+
+make_input() {
+    local dir=$1
+    mkdir -p "$dir/src/sub" "$dir/logs" "$dir/tables" "$dir/bin"
+    awk 'BEGIN { for (i = 0; i < 20000; i++) printf "line %d of the source text, value %d\n", i, (i * 7919) % 1000 }' \
+        > "$dir/src/text.txt"
+    sed 's/value 5/VALUE 5/' "$dir/src/text.txt" > "$dir/src/sub/text-edited.txt"
+    cp "$dir/src/text.txt" "$dir/src/sub/text-copy.txt"
+    awk 'BEGIN { for (i = 0; i < 30000; i++)
+                     printf "2024-03-%02d %02d:%02d:%02d.%03d INFO worker-%d handled request %d in %d ms\n",
+                            1 + i % 28, i % 24, i % 60, (i * 7) % 60, i % 1000, i % 8, 100000 + i, (i * 31) % 500 }' \
+        > "$dir/logs/app.log"
+    awk 'BEGIN { print "id,customer,amount,status";
+                 for (i = 0; i < 20000; i++) printf "%d,cust-%d,%d.%02d,%s\n", i, i % 97, i % 500, i % 100,
+                                                    (i % 3 ? "paid" : "open") }' > "$dir/tables/orders.csv"
+    awk 'BEGIN { for (i = 0; i < 10000; i++)
+                     printf "{\"id\":%d,\"user\":\"u%d\",\"ok\":%s,\"ms\":%d}\n",
+                            i, i % 50, (i % 2 ? "true" : "false"), i % 700 }' \
+        > "$dir/tables/events.ndjson"
+    LC_ALL=C awk 'BEGIN { srand(42); for (i = 0; i < 65536; i++) printf "%c", int(rand() * 256) }' \
+        > "$dir/bin/random.bin"
+    gzip -9 -n -c "$dir/src/text.txt" > "$dir/bin/text.txt.gz"
+    if command -v python3 > /dev/null 2>&1; then
+        # gzip written by zlib, which --precomp can re-create
+        python3 -c 'import sys, gzip; sys.stdout.buffer.write(gzip.compress(sys.stdin.buffer.read(), 6, mtime=0))' \
+            < "$dir/logs/app.log" > "$dir/bin/app.log.gz"
+        # Baseline JPEGs for --jpeg, one with partial edge blocks
+        mkdir -p "$dir/images"
+        python3 "$TESTS/make_jpeg.py" "$dir/images/pattern.jpg"
+        python3 "$TESTS/make_jpeg.py" "$dir/images/edges.jpg" 100 60
+    fi
+    : > "$dir/empty.txt"
+}
+
+make_input input
+
+# create + test + extract + diff -r for one set of create options
+roundtrip() {
+    local name=$1
+    shift
+    rm -rf out
+    if ! "$KUNDA" create input "$name.kun" fast "$@" > log 2>&1; then
+        fail "$name" "create failed"
+    elif ! "$KUNDA" test "$name.kun" > log 2>&1; then
+        fail "$name" "test failed"
+    elif ! "$KUNDA" extract "$name.kun" out > log 2>&1; then
+        fail "$name" "extract failed"
+    elif ! diff -r input out > log 2>&1; then
+        fail "$name" "extracted tree differs"
+    else
+        pass "$name"
+    fi
+}
+
+echo "Round trips:"
+roundtrip plain
+roundtrip cluster --cluster
+roundtrip delta --delta
+roundtrip cdc --cdc=4096
+roundtrip lrm --lrm
+roundtrip precomp --precomp
+roundtrip jpeg --jpeg
+roundtrip log-filter --log-filter
+roundtrip columnar --columnar
+roundtrip filters --log-filter --columnar --precomp
+roundtrip blocks --blocks=64K
+roundtrip file-digests --file-digests
+roundtrip file-digests-sha256 --file-digests=sha256 --content-digest
+roundtrip rsyncable --rsyncable=64K
+roundtrip parallel-streams --parallel-streams --threads=2
+roundtrip mem-limit --mem-limit=512M
+roundtrip filters-mem-limit --jpeg --precomp --log-filter --columnar --mem-limit=512M
+roundtrip dedup-mem-limit --delta --cdc=4096 --mem-limit=256M
+roundtrip numa --numa --blocks=64K --threads=2
+roundtrip numa-interleave --numa=interleave --blocks=64K --threads=2
+roundtrip hugepages --hugepages=thp
+roundtrip hugepages-off --hugepages=off
+roundtrip repo --repo="$WORK/repo"
+roundtrip scan-cache --scan-cache="$WORK/scan.cache"
+roundtrip scan-cache-reuse --scan-cache="$WORK/scan.cache"
+
+# glibc fills fresh heap memory with a non-zero byte, so any FileEntry field
+# left uninitialised shows up as a wrong file type or digest
+rm -rf out
+if ! MALLOC_PERTURB_=254 MALLOC_MMAP_THRESHOLD_=1000000000 \
+     "$KUNDA" create input perturbed.kun fast --file-digests --log-filter --columnar > log 2>&1; then
+    fail perturbed-heap "create failed"
+elif grep -q ' (0 text,' log; then
+    fail perturbed-heap "text files were classified as binary"
+elif ! MALLOC_PERTURB_=254 "$KUNDA" test perturbed.kun > log 2>&1; then
+    fail perturbed-heap "test failed"
+elif ! MALLOC_PERTURB_=254 "$KUNDA" extract perturbed.kun out > log 2>&1 ||
+     ! diff -r input out > log 2>&1; then
+    fail perturbed-heap "extracted tree differs"
+else
+    pass perturbed-heap
+fi
+
+# Incremental: unchanged files are referenced from the base archive
+rm -rf out
+cp -r input base-input
+if "$KUNDA" create input base.kun fast --file-state > log 2>&1 &&
+   echo "changed after the base" >> input/src/text.txt &&
+   "$KUNDA" create input incr.kun fast --incremental-from=base.kun > log 2>&1 &&
+   "$KUNDA" extract incr.kun out > log 2>&1 && diff -r input out > log 2>&1; then
+    pass incremental
+else
+    fail incremental "incremental archive does not round-trip"
+fi
+
+# Reference archive: primed with the payload of an earlier archive
+rm -rf out
+if "$KUNDA" create input ref-new.kun fast --ref-archive=base.kun > log 2>&1 &&
+   "$KUNDA" test ref-new.kun > log 2>&1 && "$KUNDA" extract ref-new.kun out > log 2>&1 &&
+   diff -r input out > log 2>&1; then
+    pass ref-archive
+else
+    fail ref-archive "reference archive does not round-trip"
+fi
+rm -rf input
+mv base-input input
+
+# --mem-limit counts the decoded reference: 32 MB fits this input alone but
+# not together with its reference
+if ! "$KUNDA" create input ref-limit.kun fast --mem-limit=32M > log 2>&1; then
+    fail ref-mem-limit "32 MB no longer fits the input alone"
+elif "$KUNDA" create input ref-limit.kun fast --ref-archive=base.kun --mem-limit=32M > log 2>&1; then
+    fail ref-mem-limit "the reference was not counted against the limit"
+elif ! "$KUNDA" create input ref-limit.kun fast --ref-archive=base.kun --mem-limit=64M > log 2>&1 ||
+     ! grep -q 'Reference payload' log; then
+    fail ref-mem-limit "a limit that fits the reference was refused"
+else
+    pass ref-mem-limit
+fi
+
+# Append a segment, then compact it away
+rm -rf out appended expected
+mkdir appended
+printf 'appended later\n' > appended/new.txt
+cp -r input expected
+cp appended/new.txt expected/new.txt
+if "$KUNDA" create input append.kun fast > log 2>&1 &&
+   (cd appended && "$KUNDA" append ../append.kun new.txt --preset=fast) > log 2>&1 &&
+   "$KUNDA" test append.kun > log 2>&1 && "$KUNDA" extract append.kun out > log 2>&1 &&
+   diff -r expected out > log 2>&1; then
+    pass append
+else
+    fail append "appended archive does not round-trip"
+fi
+rm -rf out
+if "$KUNDA" compact append.kun compacted.kun --preset=fast > log 2>&1 &&
+   "$KUNDA" test compacted.kun > log 2>&1 && "$KUNDA" extract compacted.kun out > log 2>&1 &&
+   diff -r expected out > log 2>&1; then
+    pass compact
+else
+    fail compact "compacted archive does not round-trip"
+fi
+
+# Incremental chain: create refuses an archive that would have more bases
+# than extract follows (64), and compacting the base starts a new chain
+rm -rf chain out
+mkdir -p chain/tree
+printf 'unchanged\n' > chain/tree/kept.txt
+printf '0\n' > chain/tree/changed.txt
+"$KUNDA" create chain/tree chain/0.kun fast --file-state > log 2>&1
+n=0
+while [ $n -lt 70 ]; do
+    printf '%s\n' $((n + 1)) > chain/tree/changed.txt
+    "$KUNDA" create chain/tree chain/$((n + 1)).kun fast --incremental-from=chain/$n.kun > log 2>&1 || break
+    n=$((n + 1))
+done
+printf '%s\n' $n > chain/tree/changed.txt
+if [ $n -ne 64 ] || ! grep -q 'Run compact' log; then
+    fail chain-limit "chain stopped after $n archives"
+elif ! "$KUNDA" extract chain/64.kun out > log 2>&1 || ! diff -r chain/tree out > log 2>&1; then
+    fail chain-limit "the deepest accepted archive does not extract"
+elif ! "$KUNDA" compact chain/64.kun --preset=fast > log 2>&1 ||
+     ! printf 'after compact\n' > chain/tree/changed.txt ||
+     ! "$KUNDA" create chain/tree chain/65.kun fast --incremental-from=chain/64.kun > log 2>&1 ||
+     ! rm -rf out || ! "$KUNDA" extract chain/65.kun out > log 2>&1 || ! diff -r chain/tree out > log 2>&1; then
+    fail chain-limit "a compacted base does not start a new chain"
+else
+    pass chain-limit
+fi
+
+# Batch: one archive per list line, sharing encoder contexts
+rm -rf out out2
+printf 'input\tbatch1.kun\n# comment\n\nappended\tbatch2.kun\n' > batch.txt
+if "$KUNDA" batch batch.txt fast > log 2>&1 &&
+   "$KUNDA" extract batch1.kun out > log 2>&1 && diff -r input out > log 2>&1 &&
+   "$KUNDA" extract batch2.kun out2 > log 2>&1 && diff -r appended out2 > log 2>&1; then
+    pass batch
+else
+    fail batch "batch archives do not round-trip"
+fi
+
+# Repository GC: drop a deleted archive's chunks, keep the live one intact
+rm -rf out gc-repo
+mkdir gc-other
+cp appended/new.txt gc-other/
+if "$KUNDA" create input gc-live.kun fast --repo="$WORK/gc-repo" > log 2>&1 &&
+   "$KUNDA" create gc-other gc-dead.kun fast --repo="$WORK/gc-repo" > log 2>&1 &&
+   rm gc-dead.kun && "$KUNDA" repo-gc gc-repo --preset=fast > log 2>&1 &&
+   "$KUNDA" test gc-live.kun > log 2>&1 && "$KUNDA" extract gc-live.kun out > log 2>&1 &&
+   diff -r input out > log 2>&1; then
+    pass repo-gc
+else
+    fail repo-gc "live archive does not round-trip after repo-gc"
+fi
+
+# Watch (Linux only): files written while it runs are queued, and SIGINT
+# flushes the queue. The long interval leaves the flush to the signal.
+if [ "$(uname -s)" = Linux ]; then
+    rm -rf out watched watch.kun
+    mkdir watched
+    "$KUNDA" watch watched watch.kun --interval=60 --preset=fast > watch.log 2>&1 &
+    watcher=$!
+    for _ in $(seq 50); do
+        grep -q '^Watching' watch.log && break
+        sleep 0.2
+    done
+    cp -r input/src watched/
+    printf 'written while watching\n' > watched/late.txt
+    sleep 1
+    kill -INT "$watcher"
+    if ! wait "$watcher"; then
+        cp watch.log log
+        fail watch "watch did not stop cleanly"
+    elif ! "$KUNDA" test watch.kun > log 2>&1 || ! "$KUNDA" extract watch.kun out > log 2>&1; then
+        fail watch "watched archive is damaged"
+    elif ! diff -r watched out > log 2>&1; then
+        fail watch "watched archive differs from the directory"
+    else
+        pass watch
+    fi
+
+    # A directory moved in whole raises no event per file, so its files
+    # are queued by the rescan, and more than the queue holds must still
+    # go out: the first full queue as its own batch, the rest on SIGINT
+    rm -rf out watched watch.kun many
+    mkdir watched many
+    (cd many && seq 65600 | xargs touch)
+    "$KUNDA" watch watched watch.kun --interval=60 --preset=fast > watch.log 2>&1 &
+    watcher=$!
+    for _ in $(seq 50); do
+        [ -f watch.kun ] && break
+        sleep 0.2
+    done
+    sleep 1
+    before=$(wc -c < watch.kun)
+    mv many watched/
+    for _ in $(seq 600); do
+        [ "$(wc -c < watch.kun)" != "$before" ] && break
+        sleep 0.2
+    done
+    kill -INT "$watcher"
+    if ! wait "$watcher"; then
+        cp watch.log log
+        fail watch-full-queue "watch did not stop cleanly"
+    elif ! "$KUNDA" extract watch.kun out > log 2>&1; then
+        fail watch-full-queue "watched archive is damaged"
+    elif ! diff -r watched out > log 2>&1; then
+        fail watch-full-queue "files beyond a full queue were dropped"
+    else
+        pass watch-full-queue
+    fi
+    rm -rf out watched many
+fi
+
+# ---------------------------------------------------------------------------
+# Refused input: member names that escape the archive root and create
+# options that append, compact, watch and repo-gc would ignore
+
+echo "Refused input:"
+
+# expect_refused NAME MESSAGE COMMAND...: the command must exit non-zero
+# and say why
+expect_refused() {
+    local name=$1 message=$2
+    shift 2
+    if "$@" > log 2>&1; then
+        fail "$name" "accepted"
+    elif ! grep -q "$message" log; then
+        fail "$name" "refused without saying \"$message\""
+    else
+        pass "$name"
+    fi
+}
+
+rm -rf escape
+mkdir -p escape/inner
+printf 'outside\n' > escape/outside.txt
+cp append.kun escape/before.kun
+expect_refused append-dotdot 'below the archive root' sh -c 'cd escape/inner && "$1" append ../before.kun ../outside.txt' sh "$KUNDA"
+if ! cmp -s append.kun escape/before.kun; then
+    fail append-dotdot-unchanged "archive was modified"
+else
+    pass append-dotdot-unchanged
+fi
+# A watch that wrongly accepts the option would never return
+limit=
+command -v timeout > /dev/null 2>&1 && limit="timeout 10"
+expect_refused append-option 'Unknown option' "$KUNDA" append append.kun appended/new.txt --cluster
+expect_refused compact-option 'Unknown option' "$KUNDA" compact append.kun compact-bad.kun --blocks=64K
+expect_refused watch-option 'Unknown option' $limit "$KUNDA" watch appended watch-bad.kun --cluster
+expect_refused repo-gc-option 'Unknown option' "$KUNDA" repo-gc gc-repo --blocks=64K
+
+# A repository whose archive list is gone must not be collected as empty
+mv gc-repo/archives gc-archives
+expect_refused repo-gc-lost-list 'not collecting' "$KUNDA" repo-gc gc-repo --preset=fast
+mv gc-archives gc-repo/archives
+
+# ---------------------------------------------------------------------------
+# Damaged archives must fail test and extract, never pass silently
+
+# expect_reject NAME ARCHIVE: test and extract must both exit non-zero
+expect_reject() {
+    rm -rf out
+    if "$KUNDA" test "$2" > log 2>&1; then
+        fail "$1" "test accepted a damaged archive"
+    elif "$KUNDA" extract "$2" out > log 2>&1; then
+        fail "$1" "extract accepted a damaged archive"
+    else
+        pass "$1"
+    fi
+}
+
+# Overwrite one byte at OFFSET of FILE with BYTE (octal escape)
+poke() {
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+echo "Damaged archives:"
+size=$(wc -c < plain.kun)
+
+head -c $((size / 2)) plain.kun > truncated.kun
+expect_reject truncated truncated.kun
+
+head -c 12 plain.kun > header-only.kun
+expect_reject header-only header-only.kun
+
+cp plain.kun flipped.kun
+poke flipped.kun $((size - 100)) '\125'
+cmp -s plain.kun flipped.kun || expect_reject corrupt-data flipped.kun
+
+cp plain.kun version.kun
+poke version.kun 8 '\011'
+expect_reject future-version version.kun
+
+cp plain.kun method.kun
+poke method.kun 9 '\001'
+expect_reject unknown-method method.kun
+
+# A reference archive with FLAG_BLOCKED set, which create never writes
+cp ref-new.kun ref-blocked.kun
+flags=$(od -An -tu1 -j10 -N1 ref-new.kun)
+poke ref-blocked.kun 10 "\\$(printf '%03o' $((flags | 64)))"
+expect_reject ref-blocked ref-blocked.kun
+
+cp blocks.kun blocks-flipped.kun
+bsize=$(wc -c < blocks.kun)
+poke blocks-flipped.kun $((bsize / 2)) '\125'
+cmp -s blocks.kun blocks-flipped.kun || expect_reject corrupt-block blocks-flipped.kun
+
+# Damage to one block loses only that block's members: extract names the
+# block and the member range and still writes every other member intact
+rm -rf out
+"$KUNDA" extract blocks-flipped.kun out > log 2>&1
+range=$(sed -n 's/^  Blocks* [0-9-]* damaged: members \([0-9]*\)-\([0-9]*\) lost$/\1 \2/p' log)
+total=$(find input -type f | wc -l)
+written=$(find out -type f 2> /dev/null | wc -l)
+differs=0
+for f in $(cd out 2> /dev/null && find . -type f); do
+    cmp -s "input/$f" "out/$f" || differs=1
+done
+if cmp -s blocks.kun blocks-flipped.kun; then
+    :
+elif [ "$(echo "$range" | wc -w)" -ne 2 ]; then
+    fail corrupt-block-recovery "extract did not name the damaged block and its members"
+elif [ "$written" -eq 0 ] || [ $((total - written)) -ne $((${range#* } - ${range% *} + 1)) ]; then
+    fail corrupt-block-recovery "$written of $total members written, members $range reported lost"
+elif [ "$differs" -ne 0 ]; then
+    fail corrupt-block-recovery "a member recovered from an intact block differs"
+else
+    pass corrupt-block-recovery
+fi
+
+# Per-file digests name the damaged member. The archive checksum would
+# catch any change to the compressed data first, so the helper changes a
+# byte of logs/app.log in the payload and re-seals the archive.
+if command -v python3 > /dev/null 2>&1; then
+    if ! python3 "$TESTS/flip_member.py" file-digests.kun member-flipped.kun 'handled request 100123 ' > log 2>&1; then
+        fail corrupt-member "could not change a byte of logs/app.log"
+    elif "$KUNDA" test member-flipped.kun > log 2>&1; then
+        fail corrupt-member "test accepted a damaged member"
+    elif [ "$(grep -c 'Corrupted member' log)" -ne 1 ] ||
+         ! grep -q '^  Corrupted member (fast128 mismatch): logs/app.log$' log; then
+        fail corrupt-member "test did not name exactly the damaged member"
+    else
+        pass corrupt-member
+    fi
+fi
+
+echo
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]